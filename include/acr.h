@@ -44,6 +44,8 @@ extern "C" {
 }
 
 #include <json/json.h>
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 
 #include <string>
 #include <list>
@@ -51,6 +53,7 @@ extern "C" {
 
 #include "sas.h"
 #include "httpconnection.h"
+#include "ralfdelivery.h"
 #include "servercaps.h"
 
 typedef enum { SCSCF=0, PCSCF=1, ICSCF=2, BGCF=5, AS=6, IBCF=7 } Node;
@@ -190,7 +193,7 @@ class RalfACR : public ACR
 {
 public:
   /// Constructor.
-  RalfACR(HttpConnection* ralf,
+  RalfACR(RalfDeliveryQueue* ralf,
           SAS::TrailId trail,
           Node node_functionality,
           Initiator initiator,
@@ -319,14 +322,26 @@ private:
     Originator originator;
   };
 
-  void encode_sdp_description(Json::Value& v, const MediaDescription& media);
+  typedef rapidjson::Writer<rapidjson::StringBuffer> JSONWriter;
 
-  void encode_media_components(Json::Value& v,
+  void encode_message(JSONWriter& writer, pj_time_val timestamp);
+
+  void encode_sdp_description(JSONWriter& writer, const MediaDescription& media);
+
+  void encode_media_components(JSONWriter& writer,
                                const std::vector<std::string>& sdp,
                                SDPType sdp_type,
                                Initiator initiator_flag,
                                const std::string& initiator_party);
 
+  /// Per-thread buffer that messages are encoded into, so the buffer
+  /// memory is reused from one ACR to the next.
+  static rapidjson::StringBuffer* encode_buffer();
+  static void destroy_encode_buffer(void* buffer);
+  static void create_encode_buffer_key();
+  static pthread_once_t _encode_buffer_once;
+  static pthread_key_t _encode_buffer_key;
+
   void split_sdp(const std::string& sdp, std::vector<std::string>& lines);
 
   void store_charging_addresses(pjsip_msg* msg);
@@ -356,7 +371,7 @@ private:
 
   std::string hdr_contents(pjsip_hdr* hdr);
 
-  HttpConnection* _ralf;
+  RalfDeliveryQueue* _ralf;
   SAS::TrailId _trail;
 
   Initiator _initiator;
@@ -444,10 +459,9 @@ class RalfACRFactory : public ACRFactory
 {
 public:
   /// Constructor.
-  /// @param ralf                 HttpConnection class set up to connect to
-  ///                             Ralf cluster.
+  /// @param ralf                 Queue delivering ACRs to the Ralf cluster.
   /// @param node_functionality   Node-Functionality value to set in ACRs.
-  RalfACRFactory(HttpConnection* ralf,
+  RalfACRFactory(RalfDeliveryQueue* ralf,
                  Node node_functionality);
 
   /// Destructor.
@@ -462,7 +476,7 @@ public:
   virtual ACR* get_acr(SAS::TrailId trail, Initiator initiator, NodeRole role);
 
 private:
-  HttpConnection* _ralf;
+  RalfDeliveryQueue* _ralf;
   Node _node_functionality;
 };
 
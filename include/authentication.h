@@ -51,7 +51,10 @@ pj_status_t init_authentication(const std::string& realm_name,
                                 HSSConnection* hss_connection,
                                 ChronosConnection* chronos_connection,
                                 ACRFactory* rfacr_factory,
-                                AnalyticsLogger* analytics_logger);
+                                AnalyticsLogger* analytics_logger,
+                                int nonce_reuse_lifetime_secs,
+                                int nonce_count_maximum,
+                                int aka_av_prefetch_count);
 
 void destroy_authentication();
 
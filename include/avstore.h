@@ -38,6 +38,7 @@
 #define AVSTORE_H_
 
 #include <json/json.h>
+#include <vector>
 
 #include "store.h"
 
@@ -61,13 +62,15 @@ public:
   /// @param nonce     A reference to the nonce.
   /// @param av        A pointer to a JSONCPP Json::Value object encoding
   ///                  the Authentication Vector.
+  /// @param expiry    The lifetime of the record in seconds.
   /// @returns True if we successfully set the data in memcached,
   /// false otherwise.
   bool set_av(const std::string& impi,
               const std::string& nonce,
               const Json::Value* av,
               uint64_t cas,
-              SAS::TrailId trail);
+              SAS::TrailId trail,
+              int expiry = AV_EXPIRY);
 
   /// Retrieves the Authentication Vector for the specified private user identity
   /// and nonce.
@@ -81,7 +84,62 @@ public:
                       uint64_t& cas,
                       SAS::TrailId trail);
 
+  /// Marks the specified Authentication Vector as used, overwriting the
+  /// record read with get_av.
+  /// @param cas       The CAS returned when the AV was read.
+  /// @param reuse_lifetime  If non-zero, the nonce may be reused for this
+  ///                  many seconds, so the record lifetime is extended
+  ///                  accordingly.  If zero, the record lifetime is unchanged.
+  /// @returns True if the tombstone was recorded, false otherwise (including
+  /// if the record was modified since it was read).
+  bool tombstone_av(const std::string& impi,
+                    const std::string& nonce,
+                    Json::Value* av,
+                    uint64_t cas,
+                    SAS::TrailId trail,
+                    int reuse_lifetime = 0);
+
+  /// Holds Authentication Vectors prefetched from the HSS for use in later
+  /// challenges for the specified private and public user identities.  The
+  /// AVs are written to the store, replacing any already held, so every
+  /// node takes them from the same list in the order supplied.
+  void add_prefetched_avs(const std::string& impi,
+                          const std::string& impu,
+                          const std::vector<Json::Value*>& avs,
+                          SAS::TrailId trail);
+
+  /// Takes the next prefetched Authentication Vector for the specified
+  /// private and public user identities from the store.
+  /// @returns         A pointer to the AV, which the caller must delete, or
+  ///                  NULL if there are no unexpired prefetched AVs.
+  Json::Value* get_prefetched_av(const std::string& impi,
+                                 const std::string& impu,
+                                 SAS::TrailId trail);
+
+  /// Discards any prefetched Authentication Vectors for the specified
+  /// private and public user identities, for example because the client
+  /// has requested a resync so their sequence numbers are no longer valid.
+  void clear_prefetched_avs(const std::string& impi,
+                            const std::string& impu,
+                            SAS::TrailId trail);
+
 private:
+  /// Reads the prefetched AV list for the specified key from the store.
+  /// The list is empty if there is no record or it has expired.
+  /// @returns         The store status of the read.
+  Store::Status get_prefetched_list(const std::string& key,
+                                    Json::Value& avs,
+                                    time_t& expires,
+                                    uint64_t& cas,
+                                    SAS::TrailId trail);
+
+  /// Writes the prefetched AV list for the specified key to the store.
+  Store::Status set_prefetched_list(const std::string& key,
+                                    const Json::Value& avs,
+                                    time_t expires,
+                                    uint64_t cas,
+                                    SAS::TrailId trail);
+
   /// A pointer to the underlying data store.
   Store* _data_store;
 
@@ -90,6 +148,14 @@ private:
   /// that on authentication timeout our 30-second Chronos timer
   /// should pop before it expires.
   static const int AV_EXPIRY = 40;
+
+  /// Discard prefetched AVs after 10 minutes, so a subscriber who stops
+  /// registering doesn't hold vectors indefinitely.
+  static const int AV_PREFETCH_EXPIRY = 600;
+
+  /// Number of times to retry an update to the prefetched AV list that
+  /// hits contention from another node.
+  static const int AV_PREFETCH_MAX_ATTEMPTS = 5;
 };
 
 // Utility function - retrieves the "branch" field from the given AV
@@ -53,10 +53,12 @@ extern "C" {
 #include <utility>
 #include <vector>
 #include <list>
+#include <atomic>
 
 #include "stack.h"
 #include "pjmodule.h"
 #include "acr.h"
+#include "objectpool.h"
 
 
 /// Class implementing basic SIP proxy functionality.  Various methods in
@@ -109,6 +111,10 @@ protected:
     /// Destructor.
     virtual ~UASTsx();
 
+    /// Allocate from the per-thread object pools.
+    static void* operator new(size_t size) { return ObjectPool::alloc(size); }
+    static void operator delete(void* obj, size_t size) { ObjectPool::free(obj, size); }
+
     /// Returns the name of the underlying PJSIP transaction.
     inline const char* name() { return (_tsx != NULL) ? _tsx->obj_name : "unknown"; }
 
@@ -154,7 +160,7 @@ protected:
     void exit_context();
 
     void trying_timer_expired();
-    static void trying_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+    static void trying_timer_callback(TimerWheel::Entry* entry);
     void cancel_trying_timer();
     pj_status_t send_trying(pjsip_rx_data* rdata);
 
@@ -252,9 +258,12 @@ protected:
     bool _pending_destroy;
     int _context_count;
 
-    pj_timer_entry       _trying_timer;
+    /// The trying timer.  _trying_timer_state is TRYING_TIMER while the
+    /// timer is scheduled, and is atomically cleared by whichever of the
+    /// timer pop and the cancellation happens first, so neither needs a lock.
+    TimerWheel::Entry    _trying_timer;
     static const int     TRYING_TIMER = 1;
-    pthread_mutex_t      _trying_timer_lock;
+    std::atomic_int      _trying_timer_state;
 
     friend class UACTsx;
   };
@@ -269,6 +278,10 @@ protected:
     UACTsx(BasicProxy* proxy, UASTsx* uas_tsx, size_t index);
     virtual ~UACTsx();
 
+    /// Allocate from the per-thread object pools.
+    static void* operator new(size_t size) { return ObjectPool::alloc(size); }
+    static void operator delete(void* obj, size_t size) { ObjectPool::free(obj, size); }
+
     /// Returns the name of the underlying PJSIP transaction.
     inline const char* name() { return (_tsx != NULL) ? _tsx->obj_name : "unknown"; }
 
@@ -347,6 +360,10 @@ protected:
     std::vector<AddrInfo> _servers;
     int _current_server;
 
+    /// The time the request was sent to the current server, used to report
+    /// the server's latency when it first responds.
+    pj_time_val _send_time;
+
     /// Pointer to the associated PJSIP UAC transaction used to send a
     /// CANCEL request.  NULL if no CANCEL has been sent.
     pjsip_transaction* _cancel_tsx;
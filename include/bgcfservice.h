@@ -40,8 +40,11 @@
 #ifndef BGCFSERVICE_H__
 #define BGCFSERVICE_H__
 
-#include <map>
 #include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <functional>
 #include "updater.h"
@@ -56,10 +59,74 @@ public:
   /// Updates the bgcf routes
   void update_routes();
 
+  /// Returns the route for the longest configured suffix of the domain, or
+  /// the default route if no suffix is configured.
   std::vector<std::string> get_route(const std::string &domain, SAS::TrailId trail) const;
 
 private:
-  std::map<std::string, std::vector<std::string>> _routes;
+  struct Route
+  {
+    std::string domain;
+    std::vector<std::string> route;
+
+    /// The route as reported in SAS events, built when the route is loaded.
+    std::string route_string;
+  };
+
+  /// @class RouteTable
+  ///
+  /// Trie of routes keyed on domain labels, starting from the last label,
+  /// giving the route for the longest matching domain suffix in time
+  /// proportional to the number of labels in the domain.  Labels are
+  /// compared case-insensitively, and each node's children are kept sorted
+  /// so they can be binary searched.  The table also holds the default (*)
+  /// route.
+  class RouteTable
+  {
+  public:
+    RouteTable();
+    ~RouteTable();
+
+    /// Adds a route, taking ownership of it.  Returns false (and deletes
+    /// the route) if there is already a route for the domain.
+    bool insert(Route* route);
+
+    /// Returns the route for the longest matching suffix of the domain, or
+    /// NULL if none match.
+    const Route* longest_match(const std::string& domain) const;
+
+    const Route* default_route() const { return _default_route; }
+
+    size_t size() const { return _routes.size(); }
+
+  private:
+    typedef std::pair<std::string, uint32_t> Child;
+
+    struct Node
+    {
+      Node() : route(NULL) {}
+      std::vector<Child> children;
+      Route* route;
+    };
+
+    static int compare_label(const std::string& label, const char* str, size_t len);
+    static size_t find_child(const Node& node, const char* label, size_t len);
+
+    std::vector<Node> _nodes;
+    std::vector<Route*> _routes;
+    Route* _default_route;
+  };
+
+  /// Reads the routes from the configuration file.  Returns NULL if the
+  /// file doesn't exist or can't be parsed.
+  RouteTable* read_routes() const;
+
+  /// The current routes.  Lookups take a reference under the read lock, so
+  /// an update can swap in a new table without waiting for them, and the
+  /// old one is freed once the last lookup using it completes.
+  mutable pthread_rwlock_t _routes_lock;
+  std::shared_ptr<RouteTable> _routes;
+
   std::string _configuration;
   Updater<void, BgcfService>* _updater;
 };
@@ -53,6 +53,7 @@ extern "C" {
 #include "xdmconnection.h"
 #include "simservs.h"
 #include "aschain.h"
+#include "timerwheel.h"
 
 // forward declaration
 class UASTransaction;
@@ -112,7 +113,7 @@ public:
   private:
     bool _ringing;
     unsigned int _media_conditions;
-    pj_timer_entry _no_reply_timer;
+    TimerWheel::Entry _no_reply_timer;
 
     bool apply_privacy(pjsip_tx_data* tx_data);
     bool apply_call_diversion(unsigned int conditions, int code);
@@ -121,7 +122,7 @@ public:
     unsigned int condition_from_status(int code);
     void no_reply_timer_pop();
 
-    static void no_reply_timer_pop(pj_timer_heap_t *timer_heap, pj_timer_entry *entry);
+    static void no_reply_timer_pop(TimerWheel::Entry* entry);
   };
   friend class Terminating;
 
@@ -47,6 +47,8 @@
 #include "hssconnection.h"
 #include "regstore.h"
 #include "httpconnection.h"
+#include "httpclientpool.h"
+#include "ralfdelivery.h"
 #include "httpresolver.h"
 #include "acr.h"
 #include "enumservice.h"
@@ -57,6 +59,7 @@ struct options
   int                    pcscf_untrusted_port;
   int                    pcscf_trusted_port;
   int                    webrtc_port;
+  int                    webrtc_threads;
   std::string            upstream_proxy;
   int                    upstream_proxy_port;
   int                    upstream_proxy_connections;
@@ -79,6 +82,13 @@ struct options
   bool                   auth_enabled;
   std::string            auth_realm;
   std::string            auth_config;
+  int                    nonce_reuse_lifetime;
+  int                    nonce_count_max;
+  int                    aka_av_prefetch;
+  int                    http_client_threads;
+  int                    ralf_queue_size;
+  int                    ralf_batch_size;
+  std::string            ralf_spool_dir;
   std::string            sas_server;
   std::string            sas_system_name;
   std::string            hss_server;
@@ -121,7 +131,8 @@ extern LoadMonitor* load_monitor;
 extern HSSConnection* hss_connection;
 extern RegStore* local_reg_store;
 extern RegStore* remote_reg_store;
-extern HttpConnection* ralf_connection;
+extern HttpClient* ralf_connection;
+extern RalfDeliveryQueue* ralf_queue;
 extern HttpResolver* http_resolver;
 extern ACRFactory* scscf_acr_factory;
 extern EnumService* enum_service;
@@ -45,6 +45,7 @@ extern "C" {
 #include <map>
 #include <string>
 #include <random>
+#include <atomic>
 
 #include "statistic.h"
 
@@ -75,6 +76,9 @@ public:
 private:
   pj_status_t resolve_host(const pj_str_t* host, int port, pj_sockaddr* addr);
   pj_status_t create_connection(int hash_slot);
+  pjsip_transport* acquire_connection(int start_slot);
+  void disconnect_slot(int hash_slot);
+  int random_slot();
   void quiesce_connection(int hash_slot);
   void quiesce_connections();
   void transport_state_update(pjsip_transport* tp, pjsip_transport_state state);
@@ -104,23 +108,44 @@ private:
   volatile bool _terminated;
 
   /// Number of active connections in the hash.
-  int _active_connections;
+  std::atomic_int _active_connections;
 
   /// Structure to keep track of the connection in a slot in the hash.  tp
   /// is set as soon as the connection is started, but it is disconnected
   /// until we get a notification from PJSIP that the connection is connected.
+  ///
+  /// connected_tp is set to tp while the connection is connected, and is
+  /// read by get_connection without taking _tp_hash_lock.  get_connection
+  /// counts itself in readers while it takes a reference to the transport,
+  /// and the transport is only released once readers has dropped to zero.
   typedef struct tp_hash_slot
   {
+    tp_hash_slot() :
+      tp(NULL),
+      listener_key(NULL),
+      recycle_time(0),
+      connected_tp(NULL),
+      readers(0)
+    {
+    }
+
     pjsip_transport* tp;
     pjsip_tp_state_listener_key *listener_key;
-    pj_bool_t connected;
     int recycle_time;
+    std::atomic<pjsip_transport*> connected_tp;
+    std::atomic_int readers;
   } tp_hash_slot;
 
+  /// Protects changes to the hash and the map.  get_connection doesn't
+  /// take this lock.
   pthread_mutex_t _tp_hash_lock;
   std::vector<tp_hash_slot> _tp_hash;
   std::map<pjsip_transport*, int> _tp_map;
 
+  /// Per-thread state for picking connections at random, as rand() takes a
+  /// global lock.
+  static __thread unsigned int _seed;
+
   // Statistics
   Statistic _statistic;
   std::map<std::string, int> _host_conn_count;
@@ -61,8 +61,10 @@ public:
   static void destroy(DNSResolver* resolver);
   // Perform a NAPTR query for the specified domain, returning the results in
   // the naptr_reply structure, and logging to the trail.  The caller must
-  // call free_naptr_reply when it has finished with naptr_reply.
-  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail);
+  // call free_naptr_reply when it has finished with naptr_reply.  ttl is set
+  // to the time for which the result (successful or NXDOMAIN) may be cached,
+  // or 0 if it should not be cached.
+  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail);
   // Free a naptr_reply structure.
   virtual void free_naptr_reply(struct ares_naptr_reply* naptr_reply) const;
 
@@ -82,6 +84,8 @@ private:
                      int timeouts,
                      unsigned char* abuf,
                      int alen);
+  // Work out how long a response may be cached for.
+  static int response_ttl(const unsigned char* abuf, int alen, bool negative);
 
   // The ares data structure that controls actually making the query.
   ares_channel _channel;
@@ -99,6 +103,9 @@ private:
   // The reply data structure.  Only valid between ares_callback and
   // perform_naptr_query returning, and only if _status is ARES_SUCCESS.
   struct ares_naptr_reply* _naptr_reply;
+  // The TTL of the reply.  Only valid between ares_callback and
+  // perform_naptr_query returning.
+  int _ttl;
 
 };
 
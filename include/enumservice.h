@@ -42,12 +42,20 @@
 
 #include <list>
 #include <string>
+#include <vector>
+#include <memory>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <functional>
 #include <boost/regex.hpp>
 #include <netinet/in.h>
 #include <ares.h>
 #include "sas.h"
 #include "baseresolver.h"
 #include "dnsresolver.h"
+#include "shardedcache.h"
+#include "updater.h"
 
 /// @class EnumService
 ///
@@ -89,6 +97,11 @@ public:
 
   std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const;
 
+  /// Re-reads the configuration file, and switches lookups over to the new
+  /// number prefixes.  If the file can't be read the current prefixes are
+  /// kept.
+  void update_enum();
+
 private:
   struct NumberPrefix
   {
@@ -97,10 +110,59 @@ private:
     std::string replace;
   };
 
-  std::list<struct NumberPrefix*> _number_prefixes;
+  /// @class PrefixTrie
+  ///
+  /// Trie of number prefixes keyed on digits (and a leading +), giving the
+  /// longest matching prefix for a number in time proportional to the
+  /// length of the number rather than the number of prefixes.  Nodes are
+  /// held in a single vector and refer to their children by index.
+  class PrefixTrie
+  {
+  public:
+    PrefixTrie();
+    ~PrefixTrie();
+
+    /// Adds a prefix, taking ownership of it.  Returns false (and deletes
+    /// the prefix) if it contains characters that can't appear in a number
+    /// or duplicates an existing prefix.
+    bool insert(NumberPrefix* pfix);
+
+    /// Returns the longest prefix of the number, or NULL if none match.
+    const NumberPrefix* longest_match(const std::string& number) const;
+
+    size_t size() const { return _prefixes.size(); }
+
+  private:
+    static const int NUM_SYMBOLS = 11;
+    static int symbol(char c);
+
+    struct Node
+    {
+      Node() : prefix(NULL) { memset(children, 0, sizeof(children)); }
+      uint32_t children[NUM_SYMBOLS];
+      NumberPrefix* prefix;
+    };
+
+    std::vector<Node> _nodes;
+    std::vector<NumberPrefix*> _prefixes;
+  };
+
+  /// Reads the number prefixes from the configuration file.  Returns NULL
+  /// if the file doesn't exist or can't be parsed.
+  PrefixTrie* read_prefixes() const;
+
+  const NumberPrefix* prefix_match(const std::string& number,
+                                   std::shared_ptr<PrefixTrie>& prefixes) const;
 
-  NumberPrefix* prefix_match(const std::string& number) const;
+  std::string _configuration;
 
+  /// The current prefixes.  Lookups take a reference under the read lock,
+  /// so an update can swap in a new trie without waiting for them, and the
+  /// old one is freed once the last lookup using it completes.
+  mutable pthread_rwlock_t _number_prefixes_lock;
+  std::shared_ptr<PrefixTrie> _number_prefixes;
+
+  Updater<void, JSONEnumService>* _updater;
 };
 
 /// @class DNSEnumService
@@ -157,6 +219,21 @@ private:
   // Maximum number of DNS queries per request.
   static const int MAX_DNS_QUERIES = 5;
 
+  // Maximum number of entries in each of the caches.
+  static const int MAX_CACHE_ENTRIES = 100000;
+
+  // The rules from a NAPTR response, sorted by order and preference, or
+  // NULL if the domain doesn't exist.
+  typedef std::shared_ptr<const std::vector<Rule> > RuleList;
+
+  // Gets the rules for a domain, from the cache or by querying DNS.  Returns
+  // false if the query fails (other than with NXDOMAIN).  ttl is set to how
+  // long the rules may be cached for.
+  bool get_rules(const std::string& domain,
+                 RuleList& rules,
+                 int& ttl,
+                 SAS::TrailId trail) const;
+
   // Converts a key to an ENUM domain name.
   std::string key_to_domain(const std::string& key) const;
   // Gets a resolver (from thread-local data).
@@ -173,6 +250,12 @@ private:
   pthread_key_t _thread_local;
   // DNSResolverFactory, used for constructing DNSResolvers when required.
   const DNSResolverFactory* _resolver_factory;
+  // Cache of translations keyed by AUS, held for the lowest TTL of the
+  // records used.  Failed translations are cached as the empty string.
+  mutable ShardedCache<std::string> _result_cache;
+  // Cache of parsed NAPTR responses keyed by domain, held for the record
+  // TTL (or the negative TTL for NXDOMAIN).
+  mutable ShardedCache<RuleList> _rule_cache;
 };
 
 #endif
@@ -50,10 +50,12 @@ extern "C" {
 #include <unordered_map>
 #include <string>
 #include <atomic>
+#include <memory>
 
 #include "statistic.h"
 #include "stack.h"
 #include "quiescing_manager.h"
+#include "smallmap.h"
 
 class FlowTable;
 
@@ -94,7 +96,7 @@ public:
                                          pjsip_transport_state state,
                                          const pjsip_transport_state_info *info);
 
-  static void on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e);
+  static void on_timer_expiry(TimerWheel::Entry* e);
 
   friend class FlowTable;
 
@@ -109,6 +111,12 @@ private:
   void expiry_timer();
 
   void inc_ref();
+  bool inc_ref_if_live();
+
+  inline pthread_mutex_t* flow_lock();
+
+  size_t memory_usage() const;
+  void update_memory_usage();
 
   FlowTable* _flow_table;
   pjsip_transport* _transport;
@@ -118,37 +126,44 @@ private:
 
   /// Timer used to expire the associated registration bindings.  This is also
   /// used to expire idle UDP flows (ie. when there are no more associated
-  /// registration bindings.
-  pj_timer_entry _timer;
-
-  /// Lock used to protect accesses to the various data structures managing
-  /// the identifiers authorized on this flow.
-  pthread_mutex_t _flow_lock;
+  /// registration bindings.  _timer_expires is the wallclock time at which
+  /// it is due to pop.
+  TimerWheel::Entry _timer;
+  int _timer_expires;
 
   /// Map holding all the authenticated identifiers for this flow.  The key
   /// is a normalized address of record/public identity, the value is the
   /// full name-addr that should be used in P-Asserted-ID, the expiry
   /// time, and whether this identity can be used as a default identity.
+  /// Most flows carry a single identity, so the map holds one entry inline,
+  /// and service routes (which are shared by all the clients served by the
+  /// same S-CSCF) are interned in the FlowTable.
+  ///
+  /// The map and _default_id are protected by the flow lock, which is one of
+  /// a set of locks held by the FlowTable (see flow_lock()).
   struct AuthId
   {
     std::string name_addr;
     int expires;
     bool default_id;
-    std::string service_route;
+    std::shared_ptr<const std::string> service_route;
   };
 
-  typedef std::unordered_map<std::string, struct AuthId> auth_id_map;
+  typedef SmallMap<std::string, struct AuthId, 1> auth_id_map;
   auth_id_map _authorized_ids;
 
   /// The default identity for this flow.
   std::string _default_id;
 
-  /// Counts the references to this Flow.  This can only be updated or tested
-  /// by a thread which currently holds the FlowTable::_flow_map_lock.
-  int _refs;
+  /// Counts the references to this Flow.  Once this reaches zero the flow
+  /// is being removed, and FlowTable lookups will no longer return it.
+  std::atomic_int _refs;
+
+  /// The memory this flow has added to FlowTable::_flow_memory.
+  size_t _memory;
 
   // Counts the number of active dialogs on this flow. This can be
-  // updated or tested without FlowTable::_flow_map_lock being held.
+  // updated or tested without any FlowTable locks being held.
   std::atomic_long _dialogs;
 
   /// Timer identifiers - the timer either runs as an expiry timer (when there
@@ -188,7 +203,6 @@ public:
   void remove_flow(Flow* flow);
 
   // Functions for quiescing a Bono.
-  void check_quiescing_state();
   void quiesce();
   void unquiesce();
   bool is_quiescing();
@@ -211,40 +225,95 @@ private:
     {
     }
 
-    /// Override operator< so this can be used as a map key.
-    bool operator< (const FlowKey& other) const
+    /// Override operator== so this can be used as a hash map key.
+    bool operator== (const FlowKey& other) const
     {
-      // Compare the transport type first.
-      if (_type < other._type)
-      {
-        return true;
-      }
-      else if (_type > other._type)
-      {
-        return false;
-      }
-      else
+      return ((_type == other._type) &&
+              (pj_sockaddr_cmp(&_raddr, &other._raddr) == 0));
+    }
+
+    /// Hashes the transport type, remote IP address and port.
+    size_t hash() const
+    {
+      const unsigned char* addr =
+                   (const unsigned char*)pj_sockaddr_get_addr(&_raddr);
+      unsigned addr_len = pj_sockaddr_get_addr_len(&_raddr);
+      size_t h = (_type * 31) + pj_sockaddr_get_port(&_raddr);
+      for (unsigned ii = 0; ii < addr_len; ++ii)
       {
-        // The transport is the same, so check the remote addresses.
-        return (pj_sockaddr_cmp(&_raddr, &other._raddr) < 0);
+        h = (h * 31) + addr[ii];
       }
+      return h;
     }
 
+    struct Hash
+    {
+      size_t operator()(const FlowKey& key) const { return key.hash(); }
+    };
+
   private:
     int _type;
     pj_sockaddr _raddr;
   };
 
-  pthread_mutex_t _flow_map_lock;
-  std::map<FlowKey, Flow*> _tp2flow_map;        // map from transport addresses to flow
-  std::map<std::string, Flow*> _tk2flow_map;    // map from token to flow
+  /// The flows are split across a number of partitions, each with its own
+  /// lock, so lookups on different flows rarely contend.  A flow is held in
+  /// the address map of the partition selected by its remote address, and
+  /// in the token map of the partition selected by its token, which is
+  /// usually a different partition.  Only one partition lock is ever held
+  /// at a time.
+  static const int NUM_PARTITIONS = 64;
+
+  struct Partition
+  {
+    pthread_mutex_t lock;
+    std::unordered_map<FlowKey, Flow*, FlowKey::Hash> tp2flow_map;  // map from transport addresses to flow
+    std::unordered_map<std::string, Flow*> tk2flow_map;            // map from token to flow
+  };
+
+  Partition _partitions[NUM_PARTITIONS];
+
+  Partition* addr_partition(const FlowKey& key);
+  Partition* token_partition(const std::string& token);
 
-  // Statistics
+  /// Locks protecting the identities on each flow.  Flows share these
+  /// rather than each having its own mutex.
+  static const int NUM_FLOW_LOCKS = 256;
+  pthread_mutex_t _flow_locks[NUM_FLOW_LOCKS];
+
+  pthread_mutex_t* flow_lock(const Flow* flow)
+  {
+    return &_flow_locks[((uintptr_t)flow >> 4) % NUM_FLOW_LOCKS];
+  }
+
+  /// Returns the shared copy of the specified string, creating one if
+  /// there isn't one already.  The copy is removed from the table when the
+  /// last reference to it is released.
+  std::shared_ptr<const std::string> intern(const std::string& str);
+  void release_interned(const std::string* str);
+
+  pthread_mutex_t _intern_lock;
+  std::unordered_map<std::string, std::weak_ptr<const std::string> > _interned;
+
+  // Flow count and statistics.  The count is protected by _count_lock, which
+  // is also held when checking whether quiescing has completed.
+  // _flow_memory is the approximate memory used by all the flows, including
+  // their share of any interned strings.
   void report_flow_count();
+  void check_quiescing_state();
+  pthread_mutex_t _count_lock;
+  int _flow_count;
+  std::atomic_long _flow_memory;
   Statistic _statistic;
+  Statistic _memory_statistic;
   bool _quiescing;
   QuiescingManager* _qm;
 
 };
 
+inline pthread_mutex_t* Flow::flow_lock()
+{
+  return _flow_table->flow_lock(this);
+}
+
 #endif
@@ -43,10 +43,11 @@
 #include <curl/curl.h>
 #include <json/value.h>
 
-#include "httpconnection.h"
+#include "httpclientpool.h"
 #include "rapidxml/rapidxml.hpp"
 #include "ifchandler.h"
 #include "sas.h"
+#include "utils.h"
 #include "accumulator.h"
 #include "load_monitor.h"
 
@@ -59,9 +60,10 @@ class HSSConnection
 {
 public:
   HSSConnection(const std::string& server,
-                HttpResolver* resolver,
+                HttpClientPool* pool,
                 LoadMonitor *load_monitor,
                 LastValueCache *stats_aggregator);
+  HSSConnection(HttpClient* http, LastValueCache *stats_aggregator);
   ~HSSConnection();
 
   HTTPCode get_auth_vector(const std::string& private_user_id,
@@ -70,6 +72,19 @@ public:
                            const std::string& autn,
                            Json::Value*& object,
                            SAS::TrailId trail);
+
+  /// Retrieves a batch of authentication vectors from Homestead.  The
+  /// vectors are returned in the order they should be used (for AKA, in
+  /// sequence number order).  If Homestead returns a single vector, avs
+  /// holds just that vector.  The caller is responsible for deleting the
+  /// vectors.
+  HTTPCode get_auth_vectors(const std::string& private_user_id,
+                            const std::string& public_user_id,
+                            const std::string& auth_type,
+                            const std::string& autn,
+                            int count,
+                            std::vector<Json::Value*>& avs,
+                            SAS::TrailId trail);
   HTTPCode get_user_auth_status(const std::string& private_user_identity,
                                 const std::string& public_user_identity,
                                 const std::string& visited_network,
@@ -144,11 +159,19 @@ public:
   static const std::string STATE_NOT_REGISTERED;
 
 private:
+  std::string auth_vector_path(const std::string& private_user_id,
+                               const std::string& public_user_id,
+                               const std::string& auth_type,
+                               const std::string& autn,
+                               int count);
+  void accumulate_auth_vector_latency(Utils::StopWatch& stopWatch,
+                                      HTTPCode rc);
+
   virtual long get_json_object(const std::string& path, Json::Value*& object, SAS::TrailId trail);
   virtual long get_xml_object(const std::string& path, rapidxml::xml_document<>*& root, SAS::TrailId trail);
   virtual long put_for_xml_object(const std::string& path, std::string body, rapidxml::xml_document<>*& root, SAS::TrailId trail);
 
-  HttpConnection* _http;
+  HttpClient* _http;
   StatisticAccumulator _latency_stat;
   StatisticAccumulator _digest_latency_stat;
   StatisticAccumulator _subscription_latency_stat;
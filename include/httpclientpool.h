@@ -0,0 +1,378 @@
+/**
+ * @file httpclientpool.h  Shared event-driven HTTP client
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HTTPCLIENTPOOL_H__
+#define HTTPCLIENTPOOL_H__
+
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <functional>
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "httpconnection.h"
+#include "httpresolver.h"
+#include "load_monitor.h"
+#include "statistic.h"
+#include "sas.h"
+
+/// Shared event-driven HTTP/1.1 client.
+///
+/// Requests are run on a small pool of I/O threads, each owning an
+/// event_base and a set of persistent (keep-alive) connections to each
+/// downstream host.  Each host is served by a single I/O thread, so its
+/// connections never need locking, and requests to a host are spread
+/// across up to connections_per_host connections, with further requests
+/// queued behind them.
+///
+/// Server names are resolved on separate resolver threads (as many as there
+/// are I/O threads), so neither the caller nor the I/O threads block on DNS.  A request is tried against up
+/// to MAX_TARGETS of the resolved targets in turn, moving on to the next
+/// target if the connection fails, the request times out or the target
+/// responds with a 503.  Targets that fail at the connection level are
+/// blacklisted.
+///
+/// Results are delivered through a completion callback that runs on the
+/// I/O thread, so callers do not tie up a thread while a request is
+/// outstanding.  A blocking API is also provided for callers that need
+/// the result inline; this must not be called from a completion callback.
+class HttpClientPool
+{
+public:
+  /// Completion callback, passed the HTTP result code and response body.
+  typedef std::function<void(HTTPCode, const std::string&)> Callback;
+
+  /// Notified of each attempt to send a request to a target.  The methods
+  /// are called on the I/O threads.
+  class Listener
+  {
+  public:
+    virtual ~Listener() {}
+
+    /// A request has been sent to the specified target.
+    virtual void request_sent(const std::string& target,
+                              evhttp_cmd_type method,
+                              const std::string& path,
+                              const std::string& body,
+                              SAS::TrailId trail) = 0;
+
+    /// The specified target responded to a request.
+    virtual void response_received(const std::string& target,
+                                   const std::string& path,
+                                   HTTPCode rc,
+                                   const std::string& body,
+                                   unsigned long latency_us,
+                                   SAS::TrailId trail) = 0;
+
+    /// A request to the specified target failed without a response.
+    virtual void request_failed(const std::string& target,
+                                const std::string& path,
+                                SAS::TrailId trail) = 0;
+  };
+
+  /// Constructor.
+  /// @param resolver             Resolver used to find the targets for a
+  ///                             server name.
+  /// @param num_threads          The number of I/O threads, and of resolver
+  ///                             threads.
+  /// @param connections_per_host The maximum number of connections from
+  ///                             each I/O thread to each host.
+  /// @param timeout_secs         Request timeout.
+  HttpClientPool(HttpResolver* resolver,
+                 int num_threads,
+                 int connections_per_host,
+                 int timeout_secs);
+
+  /// Destructor.  Stops the resolver and I/O threads, and fails every
+  /// request that hasn't completed.
+  ~HttpClientPool();
+
+  /// Sends a request asynchronously.
+  /// @param server               The server, as host[:port].
+  /// @param method               The HTTP method.
+  /// @param path                 The request path.
+  /// @param headers              Additional headers.
+  /// @param body                 The request body (may be empty).
+  /// @param callback             Called on completion with the result.
+  /// @param listener             Notified of each attempt (may be NULL).
+  void send_request(const std::string& server,
+                    evhttp_cmd_type method,
+                    const std::string& path,
+                    const std::map<std::string, std::string>& headers,
+                    const std::string& body,
+                    Callback callback,
+                    SAS::TrailId trail,
+                    Listener* listener = NULL);
+
+  /// Sends a request and waits for the result.
+  HTTPCode send_request(const std::string& server,
+                        evhttp_cmd_type method,
+                        const std::string& path,
+                        const std::map<std::string, std::string>& headers,
+                        const std::string& body,
+                        std::string& response,
+                        SAS::TrailId trail,
+                        Listener* listener = NULL);
+
+private:
+  class IoThread;
+
+  /// A request waiting to be sent or awaiting its response.
+  struct Request
+  {
+    std::string server;
+    std::string host;
+    int port;
+    evhttp_cmd_type method;
+    std::string path;
+    std::map<std::string, std::string> headers;
+    std::string body;
+    Callback callback;
+    SAS::TrailId trail;
+    Listener* listener;
+
+    /// The resolved targets, and the one currently being tried.
+    std::vector<AddrInfo> targets;
+    size_t current;
+    std::string address;
+    int target_port;
+
+    /// The I/O thread sending the request, and when it was sent.
+    IoThread* thread;
+    struct timespec send_time;
+  };
+
+  /// Persistent connections from one I/O thread to one host.
+  struct HostConnections
+  {
+    std::vector<evhttp_connection*> connections;
+    size_t next;
+  };
+
+  /// An I/O thread, with its event loop and connections.
+  class IoThread
+  {
+  public:
+    IoThread(HttpClientPool* pool);
+
+    /// Destructor.  Fails any requests that are queued or awaiting a
+    /// response.  The thread must have been stopped first.
+    ~IoThread();
+
+    /// Queues a request to be sent from this thread.  May be called from
+    /// any thread.
+    void enqueue(Request* req);
+
+    /// Stops the event loop and waits for the thread to exit.
+    void stop();
+
+  private:
+    static void* thread_func(void* arg);
+    static void on_wakeup(evutil_socket_t fd, short events, void* arg);
+    static void on_tick(evutil_socket_t fd, short events, void* arg);
+    static void on_response(evhttp_request* rsp, void* arg);
+
+    void send(Request* req);
+    evhttp_connection* get_connection(const Request* req);
+
+    HttpClientPool* _pool;
+    event_base* _base;
+    event* _wakeup;
+    event* _tick;
+    pthread_t _thread;
+    bool _stopped;
+
+    pthread_mutex_t _lock;
+    std::deque<Request*> _queue;
+    bool _stopping;
+
+    /// Requests awaiting a response.  libevent doesn't call the callbacks
+    /// of requests on a connection that is freed, so these are failed
+    /// explicitly when the thread is destroyed.  Only accessed on this
+    /// thread.
+    std::set<Request*> _in_flight;
+
+    /// Connections indexed by address:port.  Only accessed on this thread.
+    std::map<std::string, HostConnections> _hosts;
+  };
+
+  static void* resolver_thread(void* arg);
+  void resolve_requests();
+
+  /// Sends a request to its current target, from the I/O thread that owns
+  /// connections to that target.
+  void dispatch(Request* req);
+
+  /// Handles a failed attempt to send a request, moving on to the next
+  /// target if there is one.  Returns true if the request has been retried.
+  bool retry(Request* req);
+
+  /// Completes a request and frees it.
+  static void complete(Request* req, HTTPCode rc, const std::string& body);
+
+  /// Selects the I/O thread that owns connections to the specified target.
+  IoThread* thread_for(const std::string& address, int port);
+
+  /// The maximum number of targets each request is tried against.
+  static const int MAX_TARGETS = 2;
+
+  /// How long targets that fail at the connection level are blacklisted.
+  static const int BLACKLIST_DURATION = 30;
+
+  HttpResolver* _resolver;
+  int _connections_per_host;
+  int _timeout_secs;
+  std::vector<IoThread*> _threads;
+
+  /// Requests waiting to be resolved, protected by _resolve_lock.
+  /// _resolve_cond is signalled when requests are added or the resolver
+  /// threads should exit.
+  pthread_mutex_t _resolve_lock;
+  pthread_cond_t _resolve_cond;
+  std::deque<Request*> _resolve_queue;
+  bool _terminating;
+  std::vector<pthread_t> _resolve_threads;
+};
+
+/// Client for a single server, sending requests over a shared
+/// HttpClientPool.
+///
+/// The client reports the targets that are currently responding in the
+/// specified statistic, feeds the latency of each response and any
+/// overload responses or timeouts into the load monitor, and logs each
+/// request and response to SAS.
+class HttpClient : public HttpClientPool::Listener
+{
+public:
+  /// Constructor.
+  /// @param pool                 The shared HTTP client pool.
+  /// @param server               The server, as host[:port].
+  /// @param stat_name            Statistic listing the connected targets.
+  /// @param load_monitor         Load monitor to feed back to (may be NULL).
+  /// @param stats_aggregator     LVC used to report statistics.
+  HttpClient(HttpClientPool* pool,
+             const std::string& server,
+             const std::string& stat_name,
+             LoadMonitor* load_monitor,
+             LastValueCache* stats_aggregator);
+
+  virtual ~HttpClient();
+
+  /// Sends a POST asynchronously.
+  virtual void send_post(const std::string& path,
+                         const std::map<std::string, std::string>& headers,
+                         const std::string& body,
+                         HttpClientPool::Callback callback,
+                         SAS::TrailId trail);
+
+  /// Sends a POST and waits for the result.
+  HTTPCode send_post(const std::string& path,
+                     const std::map<std::string, std::string>& headers,
+                     const std::string& body,
+                     std::string& response,
+                     SAS::TrailId trail);
+
+  /// Sends a GET and waits for the result.
+  HTTPCode send_get(const std::string& path,
+                    std::string& response,
+                    SAS::TrailId trail);
+
+  /// Sends a PUT and waits for the result.
+  HTTPCode send_put(const std::string& path,
+                    const std::map<std::string, std::string>& headers,
+                    const std::string& body,
+                    std::string& response,
+                    SAS::TrailId trail);
+
+  const std::string& server() const { return _server; }
+
+  virtual void request_sent(const std::string& target,
+                            evhttp_cmd_type method,
+                            const std::string& path,
+                            const std::string& body,
+                            SAS::TrailId trail);
+  virtual void response_received(const std::string& target,
+                                 const std::string& path,
+                                 HTTPCode rc,
+                                 const std::string& body,
+                                 unsigned long latency_us,
+                                 SAS::TrailId trail);
+  virtual void request_failed(const std::string& target,
+                              const std::string& path,
+                              SAS::TrailId trail);
+
+protected:
+  /// Sends a request over the pool and waits for the result.
+  virtual HTTPCode send_and_wait(evhttp_cmd_type method,
+                                 const std::string& path,
+                                 const std::map<std::string, std::string>& headers,
+                                 const std::string& body,
+                                 std::string& response,
+                                 SAS::TrailId trail);
+
+private:
+  /// Sends a request and waits for the result, logging it if it fails.  All
+  /// the blocking methods send through this.
+  HTTPCode send_request(evhttp_cmd_type method,
+                        const std::string& path,
+                        const std::map<std::string, std::string>& headers,
+                        const std::string& body,
+                        std::string& response,
+                        SAS::TrailId trail);
+
+  /// Adds or removes a target from the connected targets, reporting the
+  /// statistic if it changes.
+  void update_connected(const std::string& target, bool connected);
+
+  static const char* method_str(evhttp_cmd_type method);
+
+  HttpClientPool* _pool;
+  std::string _server;
+  LoadMonitor* _load_monitor;
+
+  /// The targets that responded to their last request, protected by
+  /// _connected_lock.
+  pthread_mutex_t _connected_lock;
+  std::set<std::string> _connected;
+  Statistic _statistic;
+};
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * @file nexthoptable.h  Declaration of next hop target set table class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef NEXTHOPTABLE_H__
+#define NEXTHOPTABLE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+
+#include "sipresolver.h"
+#include "sas.h"
+
+/// Caches the targets of next hop destinations across requests, and orders
+/// them by the health of each target.
+///
+/// The targets of a destination are found from the SIP resolver along with
+/// their SRV priorities and weights.  Targets with the best priority have
+/// their SRV weight as their base weight, and all targets are used as
+/// fallbacks in order of priority and weight.  A target set is built when a
+/// destination is first used, and is rebuilt on a background thread once
+/// the DNS records it came from expire.  Requests carry on using the current
+/// set meanwhile, and for up to GRACE_MS after it expires if the rebuild
+/// fails, so after the first request picking the targets for a destination
+/// never waits for the resolver.  Destinations that don't fit in the table
+/// are resolved directly.
+///
+/// The latency and error rate of each target are tracked from the responses
+/// it sends, and the first target for a request is picked in proportion to
+/// its base weight scaled by its health, so load moves away from slow or
+/// failing targets.  Targets that have timed out or failed at the transport
+/// level are not used until their blacklist period has passed.
+class NextHopTable
+{
+public:
+  /// Constructor.
+  /// @param resolver             The SIP resolver.
+  /// @param num_threads          The number of threads used for rebuilds.
+  NextHopTable(SIPResolver* resolver, int num_threads = DEFAULT_THREADS);
+  ~NextHopTable();
+
+  /// Resolves a destination to the targets to try, in order.
+  void resolve(const std::string& name,
+               int af,
+               int port,
+               int transport,
+               int retries,
+               std::vector<AddrInfo>& targets,
+               SAS::TrailId trail = 0);
+
+  /// Records that a target responded to a request, taking the specified
+  /// time to do so.
+  void report_response(const AddrInfo& target, int latency_ms);
+
+  /// Records that a target failed to handle a request.  Soft failures (such
+  /// as 503 responses) reduce the health of the target, while hard failures
+  /// (timeouts and transport errors) also blacklist it for the specified
+  /// time.
+  void report_failure(const AddrInfo& target, bool hard, int blacklist_secs);
+
+  static const int DEFAULT_THREADS = 2;
+
+private:
+  /// The health of a target, shared by all the target sets it belongs to.
+  /// The latency and error rate are exponentially weighted moving averages.
+  struct Health
+  {
+    Health();
+    std::atomic_int latency_us;
+    std::atomic_int error_rate;
+    std::atomic<uint64_t> blacklisted_until_ms;
+  };
+
+  struct Target
+  {
+    AddrInfo ai;
+    double base_weight;
+    std::shared_ptr<Health> health;
+  };
+
+  /// The targets of a destination, in fallback order.  expires_ms is when
+  /// the DNS records the set was built from expire.
+  struct TargetSet
+  {
+    std::vector<Target> targets;
+    uint64_t expires_ms;
+    std::atomic<uint64_t> rebuild_ms;
+    std::atomic_bool rebuilding;
+  };
+
+  typedef std::shared_ptr<TargetSet> TargetSetPtr;
+
+  /// A rebuild of a target set.
+  struct Job
+  {
+    std::string key;
+    std::string name;
+    int af;
+    int port;
+    int transport;
+  };
+
+  /// Builds the target set for a destination from its weighted targets, and
+  /// holds it in the table.  Returns NULL, leaving the table unchanged, if
+  /// the destination has no targets.
+  TargetSetPtr build(const std::string& name,
+                     int af,
+                     int port,
+                     int transport,
+                     SAS::TrailId trail);
+
+  /// Queues a rebuild of a target set on the background threads.
+  void queue_rebuild(const std::string& key,
+                     const std::string& name,
+                     int af,
+                     int port,
+                     int transport);
+
+  /// Handles a failed rebuild.  The current target set is kept, and the
+  /// rebuild retried shortly, until its grace period has run out.
+  void rebuild_failed(const std::string& key);
+
+  static void* rebuild_thread(void* p);
+  void run_rebuilds();
+
+  /// Picks up to the specified number of targets from a target set.
+  void pick(const TargetSet& set,
+            int retries,
+            std::vector<AddrInfo>& targets);
+
+  /// Returns the weight of a target given its current health, or zero if
+  /// it is blacklisted.
+  static double weight(const Target& target, uint64_t now);
+
+  /// Returns whether a target's error rate is low enough for it to be used
+  /// ahead of the fallback targets.
+  static bool healthy(const Target& target);
+
+  /// Finds the health of a target, or NULL if the target isn't in any
+  /// target set.
+  std::shared_ptr<Health> find_health(const AddrInfo& target);
+
+  /// Adds a sample to a moving average.
+  static void update_average(std::atomic_int& average, int sample);
+
+  static std::string destination_key(const std::string& name,
+                                     int af,
+                                     int port,
+                                     int transport);
+  static std::string target_key(const AddrInfo& target);
+  static uint64_t now_ms();
+
+  /// The maximum number of targets in a set.
+  static const int MAX_TARGETS = 32;
+
+  /// Target sets are rebuilt when their DNS records expire, but no more
+  /// often than this.
+  static const int MIN_REBUILD_INTERVAL_MS = 1000;
+
+  /// How long to wait after a failed rebuild before retrying it.
+  static const int REBUILD_RETRY_MS = 1000;
+
+  /// How long after its records expire a target set may be used while it
+  /// can't be rebuilt.
+  static const int GRACE_MS = 30000;
+
+  /// The maximum number of destinations held.  Further destinations are
+  /// resolved directly by the resolver.
+  static const size_t MAX_DESTINATIONS = 10000;
+
+  /// Scaling of error rates, which are held in parts per ERROR_SCALE.
+  static const int ERROR_SCALE = 1000;
+
+  /// Targets with at least this error rate are only used as a fallback once
+  /// the healthy targets have been tried.
+  static const int UNHEALTHY_ERROR_RATE = ERROR_SCALE / 2;
+
+  /// The latency at which a target's weight is halved, and the latency
+  /// assumed for targets that haven't responded yet.
+  static const int REFERENCE_LATENCY_US = 100000;
+  static const int INITIAL_LATENCY_US = 10000;
+
+  /// Each new sample contributes 1/AVERAGE_WEIGHT of a moving average.
+  static const int AVERAGE_WEIGHT = 8;
+
+  /// Every target keeps at least this fraction of its base weight unless it
+  /// is blacklisted, so a target that has recovered is soon noticed.  This is
+  /// also the proportion of requests used to probe unhealthy targets when
+  /// they would otherwise have been picked first.
+  static const double MIN_HEALTH;
+
+  SIPResolver* _resolver;
+
+  /// The target sets by destination, and the health of their targets by
+  /// address, port and transport, protected by _lock.  Target sets are
+  /// replaced when they are rebuilt, so readers only need the lock while
+  /// they take a reference to a set.
+  pthread_rwlock_t _lock;
+  std::unordered_map<std::string, TargetSetPtr> _sets;
+  std::unordered_map<std::string, std::shared_ptr<Health> > _health;
+
+  /// The queued rebuilds, protected by _jobs_lock.  _cond is signalled when
+  /// jobs are queued or the threads should exit.
+  pthread_mutex_t _jobs_lock;
+  pthread_cond_t _cond;
+  std::deque<Job> _jobs;
+  bool _terminating;
+
+  std::vector<pthread_t> _threads;
+};
+
+#endif
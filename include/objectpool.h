@@ -0,0 +1,146 @@
+/**
+ * @file objectpool.h  Per-thread pools of free objects
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef OBJECTPOOL_H__
+#define OBJECTPOOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "statistic.h"
+#include "zmq_lvc.h"
+
+/// Allocator for objects that are created and destroyed at a high rate,
+/// such as the per-transaction proxy objects.  Freed objects are kept on
+/// per-thread free lists, one for each size of object, and reused for
+/// later allocations of the same size on that thread, so the common case
+/// takes no locks and never reaches the global allocator.
+///
+/// Classes use the pool by declaring class-specific operator new and
+/// operator delete which call alloc and free.  These are inherited by
+/// derived classes, which are pooled separately by size.
+///
+/// Counts of allocations are kept per thread, and published every few
+/// seconds in the "object_pool" statistic once enable_stats has been
+/// called.
+class ObjectPool
+{
+public:
+  /// Allocates an object of the specified size.
+  static void* alloc(size_t size);
+
+  /// Frees an object allocated by alloc.  size must be the size passed to
+  /// alloc.
+  static void free(void* obj, size_t size);
+
+  /// Pool statistics, totalled across all threads.
+  struct Stats
+  {
+    /// Number of objects allocated.
+    unsigned long allocated;
+
+    /// Number of allocations satisfied from a free list.
+    unsigned long reused;
+
+    /// Number of objects returned to the global allocator, either because
+    /// they were too big to pool or their free list was full.
+    unsigned long released;
+  };
+
+  static void get_stats(Stats& stats);
+
+  /// Starts or stops publishing statistics.
+  static void enable_stats(LastValueCache* stats_aggregator);
+  static void disable_stats();
+
+  /// How often statistics are published.
+  static const int STATS_INTERVAL_MS = 5000;
+
+  /// Object sizes are rounded up to a multiple of this.
+  static const size_t GRANULARITY = 16;
+
+  /// Larger objects are allocated directly from the global allocator.
+  static const size_t MAX_OBJECT_SIZE = 2048;
+
+  /// Maximum number of free objects of each size kept by each thread.
+  static const int MAX_FREE_PER_THREAD = 256;
+
+private:
+  static const size_t NUM_SIZES = MAX_OBJECT_SIZE / GRANULARITY;
+
+  /// A free object is linked into its free list through its first word.
+  struct FreeObject
+  {
+    FreeObject* next;
+  };
+
+  static __thread FreeObject* _free_list[NUM_SIZES];
+  static __thread int _num_free[NUM_SIZES];
+
+  /// Statistics for one thread.  Only the owning thread writes to them, so
+  /// they are updated without atomic read-modify-write operations.  They
+  /// are linked into a list when the thread first uses the pool, and never
+  /// freed, so the totals still include threads that have exited.
+  struct ThreadStats
+  {
+    std::atomic_ulong allocated;
+    std::atomic_ulong reused;
+    std::atomic_ulong released;
+    ThreadStats* next;
+  };
+
+  /// Returns the statistics for the calling thread.
+  static ThreadStats& thread_stats();
+
+  /// Increments a counter owned by the calling thread.
+  static void count(std::atomic_ulong& counter);
+
+  static __thread ThreadStats* _thread_stats;
+  static std::atomic<ThreadStats*> _all_stats;
+
+  static void* stats_thread(void* p);
+  static void report_stats();
+
+  /// The statistic, and the thread that publishes it, protected by
+  /// _stats_lock.  _stats_cond is signalled when the thread should exit.
+  static pthread_mutex_t _stats_lock;
+  static pthread_cond_t _stats_cond;
+  static Statistic* _statistic;
+  static pthread_t _stats_thread;
+};
+
+#endif
@@ -143,6 +143,9 @@ pjsip_tx_data* clone_msg(pjsip_endpoint* endpt,
 pjsip_tx_data* clone_msg(pjsip_endpoint* endpt,
                          pjsip_tx_data* tdata);
 
+pjsip_tx_data* shallow_clone_msg(pjsip_endpoint* endpt,
+                                 pjsip_tx_data* tdata);
+
 pj_status_t create_response(pjsip_endpoint *endpt,
       		            const pjsip_rx_data *rdata,
       		            int st_code,
@@ -184,6 +187,10 @@ void resolve_next_hop(pjsip_tx_data* tdata,
 
 void blacklist_server(AddrInfo& server);
 
+void report_server_latency(const AddrInfo& server, const pj_time_val& send_time);
+
+void report_server_overload(const AddrInfo& server);
+
 void set_dest_info(pjsip_tx_data* tdata, const AddrInfo& ai);
 
 void generate_new_branch_id(pjsip_tx_data* tdata);
@@ -0,0 +1,189 @@
+/**
+ * @file ralfdelivery.h  Background delivery of ACRs to Ralf
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef RALFDELIVERY_H__
+#define RALFDELIVERY_H__
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+#include "httpclientpool.h"
+#include "statistic.h"
+#include "sas.h"
+
+/// Delivers ACRs to Ralf from a background thread, so SIP processing never
+/// waits on the CDF (even for DNS resolution of the Ralf cluster).
+///
+/// ACRs are held on a bounded in-memory queue.  The delivery thread keeps up
+/// to a fixed number of them awaiting a response over the shared keep-alive
+/// HTTP client, where the requests to each Ralf node are spread across that
+/// node's persistent connections, and sends the next ACR as soon as a
+/// response arrives.  If the queue is full, ACRs are handed to the delivery
+/// thread to write to a spool file (if a spool directory is configured) and
+/// are delivered once the queue has drained, or are dropped otherwise, so
+/// senders never wait on the disk.  The spool persists across restarts, and
+/// corrupt records in it are skipped.
+///
+/// Queue depth, spool depth, the number of ACRs awaiting a response and
+/// counts of dropped and failed ACRs are reported in the "ralf_delivery"
+/// statistic.
+class RalfDeliveryQueue
+{
+public:
+  /// Constructor.
+  /// @param ralf                 HttpClient set up to connect to the Ralf
+  ///                             cluster.
+  /// @param max_queue_size       The maximum number of ACRs held in memory.
+  /// @param max_in_flight        The maximum number of ACRs awaiting a
+  ///                             response at once.
+  /// @param spool_dir            Directory for the overflow spool file, or
+  ///                             empty to drop ACRs when the queue is full.
+  /// @param stats_aggregator     LVC used to report statistics.
+  RalfDeliveryQueue(HttpClient* ralf,
+                    int max_queue_size,
+                    int max_in_flight,
+                    const std::string& spool_dir,
+                    LastValueCache* stats_aggregator);
+
+  /// Destructor.  Carries on delivering queued ACRs for up to
+  /// DRAIN_TIMEOUT_MS.  ACRs still on the queue after that are spooled if
+  /// there is a spool, and dropped otherwise, and ACRs still awaiting a
+  /// response are counted as dropped.
+  ~RalfDeliveryQueue();
+
+  /// Queues an ACR for delivery.  This never blocks on the network or the
+  /// disk.
+  void send(const std::string& path,
+            const std::string& body,
+            SAS::TrailId trail);
+
+private:
+  struct QueuedACR
+  {
+    std::string path;
+    std::string body;
+    SAS::TrailId trail;
+  };
+
+  /// State shared with the callbacks for requests awaiting a response, so
+  /// responses that arrive after the queue has stopped don't touch it.
+  struct Responses
+  {
+    Responses(RalfDeliveryQueue* queue);
+    ~Responses();
+
+    /// Protects queue, which is cleared when the queue stops.
+    pthread_mutex_t lock;
+    RalfDeliveryQueue* queue;
+  };
+
+  enum ReadResult
+  {
+    READ_OK,
+    READ_EOF,
+    READ_CORRUPT
+  };
+
+  /// Stops the delivery thread, giving it up to the specified time to
+  /// deliver what is on the queue.
+  void stop(int timeout_ms);
+
+  static void* delivery_thread(void* p);
+  void deliver();
+  void send_acrs(const std::vector<QueuedACR>& acrs);
+  void on_response(HTTPCode rc);
+  void spool_overflow(const std::deque<QueuedACR>& overflow);
+  void report_stats();
+  static uint64_t now_ms();
+
+  void open_spool(const std::string& spool_dir);
+  static ReadResult read_acr(FILE* file, QueuedACR& acr);
+  static bool next_acr(FILE* file, QueuedACR& acr);
+  bool spool(const QueuedACR& acr);
+  void unspool(int max_acrs, std::vector<QueuedACR>& acrs);
+
+  HttpClient* _ralf;
+  size_t _max_queue_size;
+  size_t _max_in_flight;
+
+  /// How long the destructor waits for queued ACRs to be delivered.
+  static const int DRAIN_TIMEOUT_MS = 5000;
+
+  /// The queue, protected by _lock.  _cond is signalled when ACRs are added,
+  /// a response arrives or the delivery thread should exit.
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  std::deque<QueuedACR> _queue;
+  bool _terminating;
+  bool _stopped;
+  uint64_t _drain_deadline_ms;
+  pthread_t _thread;
+
+  /// ACRs that didn't fit on the queue, waiting for the delivery thread to
+  /// spool them, protected by _lock.  _overflow_pending also counts ACRs the
+  /// delivery thread has taken off _overflow but not yet spooled.  While it
+  /// or _spooled is non-zero, new ACRs go behind them so ACRs are delivered
+  /// in order.
+  std::deque<QueuedACR> _overflow;
+  size_t _overflow_pending;
+
+  /// The number of ACRs awaiting a response, protected by _lock.
+  size_t _in_flight;
+  std::shared_ptr<Responses> _responses;
+
+  /// The spool file, protected by _spool_lock, and only touched by the
+  /// delivery thread once it is running.  ACRs are appended to the end of
+  /// the file and read from _spool_offset, and the file is truncated once
+  /// everything in it has been read.  Lock ordering is _lock before
+  /// _spool_lock.
+  pthread_mutex_t _spool_lock;
+  FILE* _spool;
+  long _spool_offset;
+  std::atomic_int _spooled;
+
+  std::atomic_ulong _dropped;
+  std::atomic_ulong _failed;
+  Statistic _statistic;
+};
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file regexcache.h  Process-wide cache of compiled regular expressions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef REGEXCACHE_H__
+#define REGEXCACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <boost/regex.hpp>
+
+#include "shardedcache.h"
+#include "statistic.h"
+#include "zmq_lvc.h"
+
+/// Cache of compiled regular expressions keyed by pattern, shared by
+/// everything that compiles regular expressions from configuration or
+/// signaling (ENUM rules and iFC service point triggers).  A small set of
+/// patterns is typically used over and over, so this saves compiling the
+/// same expression on every request.
+///
+/// The cache is bounded, and thread-safe.  Compiled expressions are
+/// immutable, so can be used concurrently by any number of threads.  Hit
+/// and miss counts are published in the "regex_cache" statistic once
+/// enable_stats has been called.
+class RegexCache
+{
+public:
+  typedef std::shared_ptr<const boost::regex> Regex;
+
+  /// The maximum number of patterns held by the process-wide cache.
+  static const int MAX_PATTERNS = 10000;
+
+  RegexCache(size_t max_patterns);
+  ~RegexCache();
+
+  /// Returns the process-wide cache.
+  static RegexCache* instance();
+
+  /// Returns the compiled form of the pattern, or NULL if the pattern isn't
+  /// a valid regular expression.
+  Regex get(const std::string& pattern);
+
+  /// Starts or stops publishing statistics.
+  void enable_stats(LastValueCache* stats_aggregator);
+  void disable_stats();
+
+  uint64_t hits() const { return _hits.load(); }
+  uint64_t misses() const { return _misses.load(); }
+
+private:
+  void report_stats();
+
+  static void create_instance();
+  static pthread_once_t _instance_once;
+  static RegexCache* _instance;
+
+  /// The cache never expires entries, so entries are added with this TTL.
+  static const int NO_EXPIRY = 0x7fffffff;
+
+  /// Statistics are reported on every miss, and after this many hits.
+  static const int STATS_HIT_INTERVAL = 1000;
+
+  ShardedCache<Regex> _cache;
+  std::atomic_ullong _hits;
+  std::atomic_ullong _misses;
+
+  pthread_mutex_t _stats_lock;
+  Statistic* _statistic;
+};
+
+#endif
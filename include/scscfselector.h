@@ -39,8 +39,11 @@
 
 #include <string>
 #include <vector>
-#include <map>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
 #include <functional>
+#include <boost/dynamic_bitset.hpp>
 #include "updater.h"
 #include "sas.h"
 
@@ -58,17 +61,51 @@ public:
                         const std::vector<int> &optional,
                         const std::vector<std::string> &rejects,
                         SAS::TrailId trail);
+
 private:
+  /// A set of capabilities, indexed by capability ID.  Every set built from
+  /// a configuration is sized to the number of distinct capabilities in it.
+  typedef boost::dynamic_bitset<> Capabilities;
+
   typedef struct scscf
   {
     std::string server;
     int priority;
     int weight;
-    std::vector<int> capabilities;
+
+    /// The capabilities as a bitset, indexed by capability ID.
+    Capabilities capabilities;
   } scscf_t;
 
+  /// The configured S-CSCFs, along with the table mapping each capability
+  /// they have to its (bit) ID.
+  struct Config
+  {
+    std::vector<scscf_t> scscfs;
+    std::unordered_map<int, int> capability_ids;
+
+    /// Sizes the set for this configuration and sets the bits for the
+    /// requested capabilities.  Returns false if any of them isn't a
+    /// capability of any configured S-CSCF.
+    bool capability_set(const std::vector<int>& capabilities,
+                        Capabilities& set) const;
+  };
+
+  /// Reads the S-CSCFs from the configuration file.  Returns NULL if the
+  /// file doesn't exist or can't be parsed.
+  Config* read_scscfs() const;
+
+  static std::string capabilities_str(const std::vector<int>& capabilities);
+  static std::string rejects_str(const std::vector<std::string>& rejects);
+
   std::string _configuration;
-  std::vector<scscf> _scscfs;
+
+  /// The current configuration.  Selections take a reference under the read
+  /// lock, so an update can swap in new configuration without waiting for
+  /// them.
+  pthread_rwlock_t _config_lock;
+  std::shared_ptr<Config> _config;
+
   Updater<void, SCSCFSelector>* _updater;
 };
 
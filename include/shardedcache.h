@@ -0,0 +1,219 @@
+/**
+ * @file shardedcache.h  Sharded cache of values with a time to live.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef SHARDEDCACHE_H__
+#define SHARDEDCACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include <functional>
+
+/// Thread-safe cache of values keyed by string, where each value expires
+/// after its own time to live (typically the TTL of the DNS records it was
+/// built from).
+///
+/// Entries are spread across a number of independently locked shards, so
+/// threads looking up different keys rarely contend.  Each shard holds at
+/// most max_size / num_shards entries.  When a shard is full, expired
+/// entries are purged from it, and if it is still full an arbitrary entry
+/// is evicted.  V must be cheap to copy.
+template <typename V>
+class ShardedCache
+{
+public:
+  ShardedCache(size_t max_size, int num_shards = 16) :
+    _num_shards(num_shards),
+    _max_shard_size((max_size + num_shards - 1) / num_shards)
+  {
+    _shards = new Shard[_num_shards];
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_init(&_shards[ii].lock, NULL);
+    }
+  }
+
+  ~ShardedCache()
+  {
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_destroy(&_shards[ii].lock);
+    }
+    delete[] _shards;
+  }
+
+  /// Looks up a key, returning true and the value if it is present and has
+  /// not expired.
+  bool get(const std::string& key, V& value)
+  {
+    int ttl;
+    return get(key, value, ttl);
+  }
+
+  /// Looks up a key, also returning the remaining time to live of the value.
+  bool get(const std::string& key, V& value, int& ttl)
+  {
+    Shard& shard = shard_for(key);
+    bool found = false;
+    time_t now = current_time();
+
+    pthread_mutex_lock(&shard.lock);
+    typename Map::iterator i = shard.map.find(key);
+    if (i != shard.map.end())
+    {
+      if (i->second.expires > now)
+      {
+        value = i->second.value;
+        ttl = i->second.expires - now;
+        found = true;
+      }
+      else
+      {
+        shard.map.erase(i);
+      }
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    return found;
+  }
+
+  /// Adds or replaces the value for a key, which expires after ttl seconds.
+  /// Values with a TTL of zero or less are not cached.
+  void put(const std::string& key, const V& value, int ttl)
+  {
+    if (ttl <= 0)
+    {
+      return;
+    }
+
+    Shard& shard = shard_for(key);
+    time_t now = current_time();
+
+    pthread_mutex_lock(&shard.lock);
+    if ((shard.map.size() >= _max_shard_size) &&
+        (shard.map.find(key) == shard.map.end()))
+    {
+      make_space(shard, now);
+    }
+
+    Entry& entry = shard.map[key];
+    entry.value = value;
+    entry.expires = now + ttl;
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Removes all entries.
+  void clear()
+  {
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_lock(&_shards[ii].lock);
+      _shards[ii].map.clear();
+      pthread_mutex_unlock(&_shards[ii].lock);
+    }
+  }
+
+  /// Returns the number of entries, including any that have expired but
+  /// not yet been removed.
+  size_t size()
+  {
+    size_t size = 0;
+    for (int ii = 0; ii < _num_shards; ++ii)
+    {
+      pthread_mutex_lock(&_shards[ii].lock);
+      size += _shards[ii].map.size();
+      pthread_mutex_unlock(&_shards[ii].lock);
+    }
+    return size;
+  }
+
+private:
+  struct Entry
+  {
+    V value;
+    time_t expires;
+  };
+
+  typedef std::unordered_map<std::string, Entry> Map;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    Map map;
+  };
+
+  Shard& shard_for(const std::string& key)
+  {
+    return _shards[std::hash<std::string>()(key) % _num_shards];
+  }
+
+  /// Purges expired entries from a full shard, then evicts an entry if
+  /// that didn't free any space.  Called with the shard lock held.
+  void make_space(Shard& shard, time_t now)
+  {
+    for (typename Map::iterator i = shard.map.begin(); i != shard.map.end(); )
+    {
+      if (i->second.expires <= now)
+      {
+        i = shard.map.erase(i);
+      }
+      else
+      {
+        ++i;
+      }
+    }
+
+    if (shard.map.size() >= _max_shard_size)
+    {
+      shard.map.erase(shard.map.begin());
+    }
+  }
+
+  static time_t current_time()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+  }
+
+  int _num_shards;
+  size_t _max_shard_size;
+  Shard* _shards;
+};
+
+#endif
@@ -37,15 +37,49 @@
 #ifndef SIPRESOLVER_H__
 #define SIPRESOLVER_H__
 
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
 #include "baseresolver.h"
 #include "sas.h"
 
+/// Resolves SIP URIs to targets following RFC3263.
+///
+/// Each resolution of a domain name is held for the TTL of the DNS records
+/// it used.  While those records are cached by the DnsCachedResolver, names
+/// are resolved afresh (so SRV and A record load balancing and blacklisting
+/// apply to every request).  From shortly before they expire the held
+/// resolution is used instead, and the name is re-resolved on a background
+/// thread.  The held resolution can be used for up to grace_secs after it
+/// expires while this refresh is in progress, so once a name has been
+/// resolved requests for it never wait for DNS.  Only names that have been
+/// used since they were last refreshed are refreshed again.
+///
+/// Resolving is synchronous, because SIP routing (PJUtils::resolve_next_hop
+/// and the proxies' target processing) picks targets inline.  Requests only
+/// wait for DNS when a name is first used (or has gone unused for longer
+/// than its TTL and grace period), and for names with a TTL below
+/// MIN_HOLD_TTL_SECS when their records drop out of the DnsCachedResolver's
+/// cache.
 class SIPResolver : public BaseResolver
 {
 public:
-  SIPResolver(DnsCachedResolver* dns_client);
+  /// Constructor.
+  /// @param dns_client           The DNS resolver.
+  /// @param num_threads          The number of threads used for refreshes.
+  /// @param grace_secs           How long after it expires a resolution may
+  ///                             be used while it is being refreshed.
+  SIPResolver(DnsCachedResolver* dns_client,
+              int num_threads = DEFAULT_THREADS,
+              int grace_secs = DEFAULT_GRACE_SECS);
   ~SIPResolver();
 
+  /// Resolves a name, blocking if it has to wait for DNS (see above for when
+  /// this happens).
   void resolve(const std::string& name,
                int af,
                int port,
@@ -54,7 +88,185 @@ public:
                std::vector<AddrInfo>& targets,
                SAS::TrailId trail = 0);
 
+  /// A target of a name, with the priority and weight of the SRV record it
+  /// was found through.  The weight of a record is shared between the
+  /// addresses of its target.  Targets of names that don't use SRV have
+  /// priority zero and share a weight of one.
+  struct WeightedTarget
+  {
+    AddrInfo ai;
+    int priority;
+    double weight;
+  };
+
+  /// Resolves a name to all of its targets along with their SRV priorities
+  /// and weights, rather than picking an order for them.  Held resolutions
+  /// and the blacklist aren't used, so this is for callers that keep their
+  /// own view of the targets' health and refresh it themselves.  ttl is set
+  /// to the lowest TTL of the records used, or INT_MAX if the name is an IP
+  /// address.
+  void resolve_weighted(const std::string& name,
+                        int af,
+                        int port,
+                        int transport,
+                        std::vector<WeightedTarget>& targets,
+                        int& ttl,
+                        SAS::TrailId trail = 0);
+
+  /// Blacklists a target, and removes it from any held resolutions.
+  void blacklist(const AddrInfo& ai, int ttl);
+
   std::string get_transport_str(int transport);
+
+  static const int DEFAULT_THREADS = 2;
+  static const int DEFAULT_GRACE_SECS = 30;
+
+private:
+  /// A resolution, held so it can be used while it is being refreshed.  The
+  /// resolution key doesn't include the number of retries, so the targets
+  /// are the full list (up to MAX_HELD_TARGETS) and each use takes as many
+  /// as it needs.
+  struct Resolution
+  {
+    std::string name;
+    int af;
+    int port;
+    int transport;
+    std::vector<AddrInfo> targets;
+    uint64_t expires_ms;
+    uint64_t next_refresh_ms;
+    bool used;
+    bool refreshing;
+  };
+
+  /// A set of held resolutions, protected by its own lock so resolutions
+  /// of different names rarely contend.
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, Resolution> resolutions;
+  };
+
+  /// A refresh of a held resolution.
+  struct Job
+  {
+    std::string key;
+    std::string name;
+    int af;
+    int port;
+    int transport;
+  };
+
+  /// Resolves a name by querying the DNS caches, returning the TTL of the
+  /// records used (or zero if the result shouldn't be held).
+  void do_resolve(const std::string& name,
+                  int af,
+                  int port,
+                  int transport,
+                  int retries,
+                  std::vector<AddrInfo>& targets,
+                  int& ttl,
+                  SAS::TrailId trail);
+
+  /// Works out how to resolve a name that isn't an IP address, following
+  /// RFC3263.  On return either srv_name is the SRV record to look up, or it
+  /// is empty and a_name is the name to look up A/AAAA records for.  The
+  /// transport is updated, and ttl lowered to the TTL of any records used.
+  void select_lookup(const std::string& name,
+                     int port,
+                     int& transport,
+                     std::string& srv_name,
+                     std::string& a_name,
+                     int& ttl,
+                     SAS::TrailId trail);
+
+  /// Adds the addresses of a name to a list of weighted targets, lowering
+  /// ttl to the TTL of the records used.
+  void add_weighted_targets(const std::string& a_name,
+                            int af,
+                            int port,
+                            int transport,
+                            int priority,
+                            double weight,
+                            std::vector<WeightedTarget>& targets,
+                            int& ttl);
+
+  static std::string resolution_key(const std::string& name,
+                                    int af,
+                                    int port,
+                                    int transport);
+  Shard& shard_for(const std::string& key);
+  static uint64_t now_ms();
+  static bool same_target(const AddrInfo& lhs, const AddrInfo& rhs);
+
+  /// Resolves a name if that can be done without waiting for DNS.  Returns
+  /// false if the name needs to be resolved from scratch.
+  bool resolve_without_waiting(const std::string& key,
+                               const std::string& name,
+                               int af,
+                               int port,
+                               int transport,
+                               int retries,
+                               std::vector<AddrInfo>& targets,
+                               SAS::TrailId trail);
+
+  /// Holds (or updates) the resolution of a name.
+  void hold_resolution(const std::string& key,
+                       const std::string& name,
+                       int af,
+                       int port,
+                       int transport,
+                       const std::vector<AddrInfo>& targets,
+                       int ttl);
+
+  /// Queues a refresh of a held resolution.  Must be called with the lock of
+  /// the resolution's shard held.
+  void queue_refresh(const std::string& key,
+                     Resolution& resolution,
+                     uint64_t now);
+
+  static void* resolver_thread(void* p);
+  void run_jobs();
+  static void* refresh_thread(void* p);
+  void run_refreshes();
+
+  /// Resolutions are only held for names with at least this TTL.
+  static const int MIN_HOLD_TTL_SECS = 5;
+
+  /// Held resolutions are used instead of resolving afresh from this long
+  /// before they expire.
+  static const int REFRESH_AHEAD_MS = 1000;
+
+  /// How long to wait after a failed refresh before retrying it.
+  static const int REFRESH_RETRY_MS = 1000;
+
+  /// How often held resolutions are checked for refreshing and expiry.
+  static const int REFRESH_INTERVAL_MS = 500;
+
+  /// The maximum number of resolutions held in each shard.
+  static const size_t MAX_RESOLUTIONS_PER_SHARD = 1000;
+
+  /// The number of targets resolved for a held resolution.
+  static const int MAX_HELD_TARGETS = 32;
+
+  /// The number of shards of held resolutions.
+  static const int NUM_SHARDS = 16;
+
+  uint64_t _grace_ms;
+
+  Shard _shards[NUM_SHARDS];
+
+  /// The queued refreshes, protected by _jobs_lock.  _cond is signalled when
+  /// jobs are queued or the threads should exit.  The lock of a shard may be
+  /// held when taking _jobs_lock, but not the other way round.
+  pthread_mutex_t _jobs_lock;
+  pthread_cond_t _cond;
+  pthread_cond_t _refresh_cond;
+  std::deque<Job> _jobs;
+  bool _terminating;
+
+  std::vector<pthread_t> _threads;
+  pthread_t _refresh_thread;
 };
 
 #endif
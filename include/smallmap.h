@@ -0,0 +1,179 @@
+/**
+ * @file smallmap.h  Small flat map with inline storage
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SMALLMAP_H__
+#define SMALLMAP_H__
+
+#include <utility>
+#include <algorithm>
+
+/// Flat map for small numbers of entries, such as the per-fork state of a
+/// transaction.  Up to N entries are held inline, so a map that never grows
+/// beyond this makes no allocations.  Lookups are a linear scan, which is
+/// faster than a tree or hash lookup at these sizes.
+///
+/// Entries are unordered.  Inserting an entry may invalidate iterators,
+/// and erasing an entry moves the last entry into its place, so also
+/// invalidates iterators to the last entry.  K and V must be cheap to copy.
+template <typename K, typename V, size_t N>
+class SmallMap
+{
+public:
+  typedef std::pair<K, V> value_type;
+  typedef value_type* iterator;
+  typedef const value_type* const_iterator;
+
+  SmallMap() :
+    _data(_inline),
+    _size(0),
+    _capacity(N)
+  {
+  }
+
+  ~SmallMap()
+  {
+    if (_data != _inline)
+    {
+      delete[] _data;
+    }
+  }
+
+  iterator begin() { return _data; }
+  iterator end() { return _data + _size; }
+  const_iterator begin() const { return _data; }
+  const_iterator end() const { return _data + _size; }
+
+  bool empty() const { return (_size == 0); }
+  size_t size() const { return _size; }
+
+  /// Returns true if the entries have outgrown the inline storage and are
+  /// held in a heap buffer.
+  bool on_heap() const { return (_data != _inline); }
+  size_t capacity() const { return _capacity; }
+
+  iterator find(const K& key)
+  {
+    iterator i = begin();
+    while ((i != end()) && (!(i->first == key)))
+    {
+      ++i;
+    }
+    return i;
+  }
+
+  const_iterator find(const K& key) const
+  {
+    const_iterator i = begin();
+    while ((i != end()) && (!(i->first == key)))
+    {
+      ++i;
+    }
+    return i;
+  }
+
+  /// Returns the value for the key, adding a default value if the key is
+  /// not already present.
+  V& operator[](const K& key)
+  {
+    iterator i = find(key);
+    if (i == end())
+    {
+      if (_size == _capacity)
+      {
+        grow();
+      }
+      i = end();
+      i->first = key;
+      i->second = V();
+      ++_size;
+    }
+    return i->second;
+  }
+
+  void erase(iterator i)
+  {
+    --_size;
+    if (i != end())
+    {
+      *i = _data[_size];
+    }
+
+    // Reset the vacated slot so it doesn't hold on to any resources.
+    _data[_size] = value_type();
+  }
+
+  size_t erase(const K& key)
+  {
+    iterator i = find(key);
+    if (i == end())
+    {
+      return 0;
+    }
+    erase(i);
+    return 1;
+  }
+
+  void clear()
+  {
+    _size = 0;
+  }
+
+private:
+  // Not copyable.
+  SmallMap(const SmallMap&);
+  SmallMap& operator=(const SmallMap&);
+
+  /// Moves the entries to a heap buffer with twice the capacity.
+  void grow()
+  {
+    size_t capacity = _capacity * 2;
+    value_type* data = new value_type[capacity];
+    std::copy(_data, _data + _size, data);
+    if (_data != _inline)
+    {
+      delete[] _data;
+    }
+    _data = data;
+    _capacity = capacity;
+  }
+
+  value_type _inline[N];
+  value_type* _data;
+  size_t _size;
+  size_t _capacity;
+};
+
+#endif
@@ -49,6 +49,9 @@
 
 #include "basicproxy.h"
 #include "sproutlet.h"
+#include "smallmap.h"
+#include "objectpool.h"
+#include "sproutletstats.h"
 
 
 class SproutletWrapper;
@@ -72,7 +75,7 @@ public:
   virtual ~SproutletProxy();
 
   /// Static callback for timers
-  static void on_timer_pop(pj_timer_heap_t* th, pj_timer_entry* tentry);
+  static void on_timer_pop(TimerWheel::Entry* tentry);
 
 protected:
   /// Pre-declaration
@@ -102,9 +105,20 @@ protected:
   bool is_uri_local(const pjsip_uri* uri);
   bool is_host_local(const pj_str_t* host);
 
-  /// Defintion of a timer set by an child sproutlet transaction.
+  /// Builds the dispatch tables used to find the target Sproutlet for a
+  /// request.
+  void build_dispatch_tables();
+
+  /// Extracts the possible service names from a SIP URI.  A name is only
+  /// returned if the rest of the URI refers to this proxy.
+  void possible_service_names(const pjsip_sip_uri* uri,
+                              std::list<std::string>& names);
+
+  /// Defintion of a timer set by an child sproutlet transaction.  The
+  /// TimerID is the address of this structure.
   struct SproutletTimerCallbackData
   {
+    TimerWheel::Entry entry;
     SproutletProxy* proxy;
     SproutletProxy::UASTsx* uas_tsx;
     SproutletWrapper* sproutlet_wrapper;
@@ -116,9 +130,14 @@ protected:
                       void* context,
                       TimerID& id,
                       int duration);
-  void cancel_timer(TimerID id);
+
+  /// Cancels a timer, freeing its callback data.  Returns false if the timer
+  /// is already popping on another thread, in which case the pop still
+  /// calls process_timer_pop on the transaction and frees the data.
+  bool cancel_timer(TimerID id);
   bool timer_running(TimerID id);
   void on_timer_pop(SproutletProxy::UASTsx* uas_tsx,
+                    TimerID id,
                     SproutletWrapper* sproutlet_wrapper,
                     void* context);
 
@@ -141,7 +160,8 @@ protected:
     virtual void process_cancel_request(pjsip_rx_data* rdata);
 
     /// Handle a timer pop.
-    void process_timer_pop(SproutletWrapper* tsx,
+    void process_timer_pop(TimerID id,
+                           SproutletWrapper* tsx,
                            void* context);
 
   protected:
@@ -181,16 +201,25 @@ protected:
     /// Checks to see if it is safe to destroy the UASTsx.
     void check_destroy();
 
+    /// Cancels any timers still running and marks the UASTsx for
+    /// destruction, once no timer pops that refer to it are in flight.
+    void destroy_when_timers_done();
+
+    /// Keeps a reference to a request whose contents are shared with the
+    /// copies passed to Sproutlets until this transaction is destroyed.
+    void pin_request(pjsip_tx_data* req);
+
     /// The root Sproutlet for this transaction.
     SproutletWrapper* _root;
 
     /// Templated type used to map from upstream Sproutlet/fork to the
-    /// downstream Sproutlet or UACTsx.
+    /// downstream Sproutlet or UACTsx.  Most transactions only have a few
+    /// forks, so these are small flat maps rather than trees.
     template<typename T>
     struct DMap
     {
-      typedef std::map<std::pair<SproutletWrapper*, int>, T> type;
-      typedef typename std::map<std::pair<SproutletWrapper*, int>, T>::iterator iterator;
+      typedef SmallMap<std::pair<SproutletWrapper*, int>, T, 4> type;
+      typedef typename SmallMap<std::pair<SproutletWrapper*, int>, T, 4>::iterator iterator;
     };
 
     /// Mapping from upstream Sproutlet/fork to downstream Sproutlet.
@@ -201,7 +230,7 @@ protected:
 
     /// Mapping from downstream Sproutlet or UAC transaction to upstream
     /// Sproutlet/fork.
-    typedef std::map<void*, std::pair<SproutletWrapper*, int> > UMap;
+    typedef SmallMap<void*, std::pair<SproutletWrapper*, int>, 4> UMap;
     UMap _umap;
 
     /// Queue of pending requests to be scheduled.
@@ -212,6 +241,25 @@ protected:
     } PendingRequest;
     std::queue<PendingRequest> _pending_req_q;
 
+    /// Requests pinned because their contents are shared with other requests.
+    std::list<pjsip_tx_data*> _pinned_reqs;
+
+    /// Timers set by Sproutlets on this transaction that have neither popped
+    /// nor been cancelled.  A TimerID is only dereferenced while it is in
+    /// this set, and the set is only accessed in the transaction's context,
+    /// so a timer popping on another thread can't free the callback data
+    /// under a Sproutlet that is cancelling or checking it.
+    std::unordered_set<TimerID> _timers;
+
+    /// Timers that were cancelled while popping on another thread.  Each
+    /// pop still calls process_timer_pop, so the transaction isn't destroyed
+    /// until this set is empty.
+    std::unordered_set<TimerID> _popping_timers;
+
+    /// Set once the transaction is complete, and will be destroyed as soon
+    /// as no timer pops are in flight.
+    bool _complete;
+
     /// Parent proxy object
     SproutletProxy* _sproutlet_proxy;
 
@@ -223,6 +271,19 @@ protected:
 
   std::list<Sproutlet*> _sproutlets;
 
+  /// Dispatch tables, built from the Sproutlets when the proxy is created.
+  /// _services maps each service name and alias to its Sproutlet,
+  /// _ports maps each port to its default Sproutlet and _local_hosts holds
+  /// the lower-cased root URI host and host aliases.  Where Sproutlets
+  /// clash, the first in the list wins.
+  std::unordered_map<std::string, Sproutlet*> _services;
+  std::unordered_map<int, Sproutlet*> _ports;
+  std::unordered_set<std::string> _local_hosts;
+
+  /// Per-Sproutlet statistics, or NULL if statistics are not being
+  /// published.
+  SproutletStats* _stats;
+
   static const pj_str_t STR_SERVICE;
 
   friend class UASTsx;
@@ -244,6 +305,10 @@ public:
   /// Virtual destructor.
   virtual ~SproutletWrapper();
 
+  /// Allocate from the per-thread object pools.
+  static void* operator new(size_t size) { return ObjectPool::alloc(size); }
+  static void operator delete(void* obj, size_t size) { ObjectPool::free(obj, size); }
+
   const std::string& service_name() const;
 
   /// This implementation has concrete implementations for all of the virtual
@@ -285,6 +350,7 @@ private:
   void process_actions(bool complete_after_actions);
   void aggregate_response(pjsip_tx_data* rsp);
   void tx_request(pjsip_tx_data* req, int fork_id);
+  void pass_response(pjsip_tx_data* rsp, int fork_id);
   void tx_response(pjsip_tx_data* rsp);
   void tx_cancel(int fork_id);
   int compare_sip_sc(int sc1, int sc2);
@@ -301,6 +367,10 @@ private:
   std::string _service_name;
   std::string _service_host;
 
+  /// Statistics for this Sproutlet and the method of the request, or NULL
+  /// if statistics aren't being collected.
+  SproutletStats::Counters* _stats_counters;
+
   /// Identifier for this SproutletTsx instance - currently a concatenation
   /// of the service name and the address of the object.
   std::string _id;
@@ -309,7 +379,7 @@ private:
   /// is passed to the Sproutlet.
   pjsip_tx_data* _req;
 
-  typedef std::unordered_map<const pjsip_msg*, pjsip_tx_data*> Packets;
+  typedef SmallMap<const pjsip_msg*, pjsip_tx_data*, 4> Packets;
   Packets _packets;
 
   typedef std::unordered_map<int, pjsip_tx_data*> Requests;
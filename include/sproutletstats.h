@@ -0,0 +1,157 @@
+/**
+ * @file sproutletstats.h  Per-Sproutlet statistics
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SPROUTLETSTATS_H__
+#define SPROUTLETSTATS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+
+#include "statistic.h"
+#include "zmq_lvc.h"
+
+/// Statistics for each Sproutlet, broken down by request method.  These are
+/// accumulated over a period and published as the sproutlet_stats statistic,
+/// which has the following values for each Sproutlet and method.
+///
+///  - service name
+///  - method
+///  - number of requests passed to the Sproutlet
+///  - number of responses passed to the Sproutlet
+///  - mean CPU time per request or response, in microseconds
+///  - maximum CPU time for a request or response, in microseconds
+///  - number of downstream forks
+///  - maximum forks for one request
+///  - number of timers set
+///
+/// Counters for each Sproutlet and each common method (plus one for other
+/// methods) are allocated up front, so recording a sample takes no locks
+/// and allocates nothing.  The statistic is published from a background
+/// thread at the end of each period, so it doesn't go stale when the
+/// Sproutlets are idle.
+class SproutletStats
+{
+public:
+  /// The counters for one Sproutlet and method.
+  struct Counters
+  {
+    /// Set once anything has been recorded, after which the counters are
+    /// reported in every period.
+    std::atomic_bool used;
+    std::atomic_ulong requests;
+    std::atomic_ulong responses;
+    std::atomic_ulong cpu_us;
+    std::atomic_ulong max_cpu_us;
+    std::atomic_ulong forks;
+    std::atomic_ulong max_forks;
+    std::atomic_ulong timers;
+  };
+
+  /// Constructor.
+  /// @param lvc                  LVC used to report statistics.
+  /// @param services             The service names of the Sproutlets.
+  /// @param period_us            Accumulation period, in microseconds.
+  SproutletStats(LastValueCache* lvc,
+                 const std::vector<std::string>& services,
+                 uint_fast64_t period_us = DEFAULT_PERIOD_US);
+  ~SproutletStats();
+
+  /// Returns the counters for a Sproutlet and method, or NULL if the
+  /// Sproutlet wasn't passed to the constructor.
+  Counters* get_counters(const std::string& service,
+                         const std::string& method);
+
+  /// Records that a request was passed to a Sproutlet.
+  static void record_request(Counters* counters, unsigned long cpu_us);
+
+  /// Records that a response was passed to a Sproutlet.
+  static void record_response(Counters* counters, unsigned long cpu_us);
+
+  /// Records the number of forks a Sproutlet made for a request.
+  static void record_forks(Counters* counters, int forks);
+
+  /// Records that a Sproutlet set a timer.
+  static void record_timer(Counters* counters);
+
+  /// Returns the CPU time used by the calling thread, in microseconds.
+  static unsigned long thread_cpu_us();
+
+  /// Default accumulation period, in microseconds.
+  static const uint_fast64_t DEFAULT_PERIOD_US = 5 * 1000 * 1000;
+
+private:
+  /// Methods with their own counters.  Other methods share the last entry.
+  static const char* const METHODS[];
+  static const int NUM_METHODS;
+
+  /// The counters for each method, by service name.
+  typedef std::map<std::string, std::unique_ptr<Counters[]> > StatsMap;
+
+  /// Records the CPU time for a request or response.
+  static void record_cpu(Counters* counters, unsigned long cpu_us);
+
+  /// Raises a maximum to at least the specified value.
+  static void update_max(std::atomic_ulong& max, unsigned long value);
+
+  static void* refresh_thread(void* p);
+
+  /// Publishes the statistics and starts a new period.
+  void refresh();
+
+  /// Builds the published value of the statistic, optionally resetting the
+  /// counters for a new period.
+  void build_report(std::vector<std::string>& values, bool reset = false);
+
+  /// The counters are created by the constructor, so the map isn't changed
+  /// afterwards.
+  StatsMap _stats;
+  uint_fast64_t _period_us;
+  Statistic _statistic;
+
+  /// The refresh thread, which waits on _cond for up to a period at a time.
+  /// _terminating is protected by _lock.
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminating;
+  pthread_t _thread;
+};
+
+#endif
@@ -130,6 +130,10 @@ namespace SASEvent
   const int BINDINGS_FROM_TARGETS = SPROUT_BASE + 0x0000D4;
   const int ALL_BINDINGS_FILTERED = SPROUT_BASE + 0x0000D5;
 
+  const int HTTP_CLIENT_TX_REQ = SPROUT_BASE + 0x0000E0;
+  const int HTTP_CLIENT_RX_RSP = SPROUT_BASE + 0x0000E1;
+  const int HTTP_CLIENT_REQ_ERROR = SPROUT_BASE + 0x0000E2;
+
 } //namespace SASEvent
 
 #endif
@@ -54,6 +54,8 @@ extern "C" {
 #include "quiescing_manager.h"
 #include "load_monitor.h"
 #include "sipresolver.h"
+#include "nexthoptable.h"
+#include "timerwheel.h"
 
 /* Pre-declariations */
 class LastValueCache;
@@ -62,10 +64,12 @@ class LastValueCache;
 struct stack_data_struct
 {
   SIPResolver*         sipresolver;
+  NextHopTable*        next_hops;
 
   pj_caching_pool      cp;
   pj_pool_t           *pool;
   pjsip_endpoint      *endpt;
+  TimerWheel          *timer_wheel;
   int                  pcscf_untrusted_port;
   pjsip_tpfactory     *pcscf_untrusted_tcp_factory;
   int                  pcscf_trusted_port;
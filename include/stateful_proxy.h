@@ -47,6 +47,7 @@ class UASTransaction;
 class UACTransaction;
 
 #include <list>
+#include <atomic>
 
 #include "pjutils.h"
 #include "enumservice.h"
@@ -58,6 +59,7 @@ class UACTransaction;
 #include "trustboundary.h"
 #include "sessioncase.h"
 #include "ifchandler.h"
+#include "objectpool.h"
 #include "hssconnection.h"
 #include "aschain.h"
 #include "quiescing_manager.h"
@@ -140,6 +142,10 @@ class UASTransaction
 public:
   ~UASTransaction();
 
+  /// Allocate from the per-thread object pools.
+  static void* operator new(size_t size) { return ObjectPool::alloc(size); }
+  static void operator delete(void* obj, size_t size) { ObjectPool::free(obj, size); }
+
   static pj_status_t create(pjsip_rx_data* rdata,
                             pjsip_tx_data* tdata,
                             TrustBoundary* trust,
@@ -168,7 +174,7 @@ public:
   inline const char* name() { return (_tsx != NULL) ? _tsx->obj_name : "unknown"; }
 
   void trying_timer_expired();
-  static void trying_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
+  static void trying_timer_callback(TimerWheel::Entry* entry);
 
   // Enters/exits this UASTransaction's context.  This takes a group lock,
   // single-threading any processing on this UASTransaction and associated
@@ -287,9 +293,12 @@ private:
   ACR*                 _bgcf_acr;
 
 public:
-  pj_timer_entry       _trying_timer;
+  /// The trying timer.  _trying_timer_state is TRYING_TIMER while the timer
+  /// is scheduled, and is atomically cleared by whichever of the timer pop
+  /// and the cancellation happens first.
+  TimerWheel::Entry    _trying_timer;
   static const int     TRYING_TIMER = 1;
-  pthread_mutex_t      _trying_timer_lock;
+  std::atomic_int      _trying_timer_state;
 };
 
 // This is the data that is attached to the UAC transaction
@@ -299,6 +308,10 @@ public:
   UACTransaction(UASTransaction* uas_data, int target, pjsip_transaction* tsx, pjsip_tx_data *tdata);
   ~UACTransaction();
 
+  /// Allocate from the per-thread object pools.
+  static void* operator new(size_t size) { return ObjectPool::alloc(size); }
+  static void operator delete(void* obj, size_t size) { ObjectPool::free(obj, size); }
+
   static UACTransaction* get_from_tsx(pjsip_transaction* tsx);
 
   void set_target(const struct Target& target);
@@ -311,6 +324,7 @@ public:
   inline SAS::TrailId trail() { return (_tsx != NULL) ? get_trail(_tsx) : 0; }
   inline const char* name() { return (_tsx != NULL) ? _tsx->obj_name : "unknown"; }
 
+  void cancel_liveness_timer();
   void liveness_timer_expired();
 
   static void liveness_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry);
@@ -347,12 +361,19 @@ private:
   std::vector<AddrInfo> _servers;
   int                  _current_server;
 
+  // The time the request was sent to the current server, used to report the
+  // server's latency when it first responds.
+  pj_time_val          _send_time;
+
   bool                 _pending_destroy;
   int                  _context_count;
 
   int                  _liveness_timeout;
+  /// The liveness timer, with its state managed in the same way as the
+  /// UASTransaction trying timer.
   pj_timer_entry       _liveness_timer;
   static const int LIVENESS_TIMER = 1;
+  std::atomic_int      _liveness_timer_state;
 };
 
 pj_status_t init_stateful_proxy(RegStore* registrar_store,
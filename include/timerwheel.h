@@ -0,0 +1,178 @@
+/**
+ * @file timerwheel.h  Hierarchical timer wheel
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef TIMERWHEEL_H__
+#define TIMERWHEEL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+/// Hierarchical timer wheel, used in place of the PJSIP timer heap for the
+/// very large numbers of long-lived timers sprout and bono hold (flow
+/// keepalives, transaction and Sproutlet timers).  Scheduling and cancelling
+/// a timer are O(1), and timers are spread across a number of independently
+/// locked shards so threads arming timers on different objects rarely
+/// contend.
+///
+/// The wheel has no threads of its own - it is driven by calling poll,
+/// which the PJSIP threads do each time round their event loop.  As with
+/// the PJSIP timer heap, callbacks are made without any wheel locks held,
+/// so a timer can be cancelled or rescheduled from another thread just as
+/// it pops, and the owner must cope with that.
+class TimerWheel
+{
+public:
+  struct Entry;
+
+  typedef void (*Callback)(Entry* entry);
+
+  /// A timer.  The owner allocates this and must keep it valid until it has
+  /// popped or been cancelled.  user_data, cb and id are for use by the
+  /// owner, in the same way as the equivalent fields of a pj_timer_entry.
+  struct Entry
+  {
+    Entry() :
+      user_data(NULL),
+      cb(NULL),
+      id(0),
+      _prev(NULL),
+      _next(NULL),
+      _pop_tick(0)
+    {
+    }
+
+    Entry(void* user_data, Callback cb) :
+      user_data(user_data),
+      cb(cb),
+      id(0),
+      _prev(NULL),
+      _next(NULL),
+      _pop_tick(0)
+    {
+    }
+
+    void* user_data;
+    Callback cb;
+    int id;
+
+  private:
+    friend class TimerWheel;
+
+    /// Links in the wheel slot list.  These are NULL when the timer is not
+    /// scheduled.
+    Entry* _prev;
+    Entry* _next;
+
+    /// The tick at which the timer is due to pop.
+    uint64_t _pop_tick;
+  };
+
+  TimerWheel(int num_shards = DEFAULT_SHARDS);
+  ~TimerWheel();
+
+  /// Schedules the timer to pop after the specified delay, cancelling it
+  /// first if it is already scheduled.  The delay is rounded up to a whole
+  /// number of ticks.
+  void schedule(Entry* entry, int delay_ms);
+
+  /// Cancels the timer.  Returns true if it was scheduled, or false if it
+  /// was not running (including if it is popping right now).
+  bool cancel(Entry* entry);
+
+  /// Returns true if the timer is scheduled.
+  bool running(Entry* entry);
+
+  /// Pops any timers that are due.  Shards that another thread is already
+  /// polling are skipped.  Returns the number of timers that popped.
+  int poll();
+
+  /// Resolution of the wheel.  This matches the delay the PJSIP threads use
+  /// when waiting for events.
+  static const int TICK_MS = 10;
+
+  static const int DEFAULT_SHARDS = 16;
+
+private:
+  /// The first level of the wheel has a slot for each of the next 256 ticks,
+  /// and each higher level has 64 slots, each covering a whole revolution of
+  /// the level below.  Timers due further out than the top level covers (a
+  /// little under 500 days) are clamped.
+  static const int ROOT_BITS = 8;
+  static const int ROOT_SLOTS = 1 << ROOT_BITS;
+  static const int LEVEL_BITS = 6;
+  static const int LEVEL_SLOTS = 1 << LEVEL_BITS;
+  static const int NUM_LEVELS = 4;
+  static const uint64_t MAX_TICKS =
+                            1ULL << (ROOT_BITS + NUM_LEVELS * LEVEL_BITS);
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+
+    /// Set while a thread is polling this shard.
+    std::atomic_bool polling;
+
+    /// The next tick to process.
+    uint64_t tick;
+
+    /// Slot lists.  Each slot is a circular list with a dummy head entry.
+    Entry root[ROOT_SLOTS];
+    Entry levels[NUM_LEVELS][LEVEL_SLOTS];
+
+    /// Timers popped by the current poll, with their callbacks.  Only used
+    /// by the thread that is polling the shard.
+    std::vector<std::pair<Entry*, Callback> > popped;
+  };
+
+  Shard* shard_for(Entry* entry);
+  void add(Shard* shard, Entry* entry);
+  int cascade(Shard* shard, int level, int index);
+  int poll_shard(Shard* shard, uint64_t now);
+
+  static uint64_t current_tick();
+  static void list_init(Entry* head);
+  static void list_add(Entry* head, Entry* entry);
+  static void list_remove(Entry* entry);
+
+  int _num_shards;
+  Shard* _shards;
+};
+
+#endif
@@ -171,7 +171,7 @@ ACR* ACRFactory::get_acr(SAS::TrailId trail, Initiator initiator, NodeRole role)
   return new ACR();
 }
 
-RalfACR::RalfACR(HttpConnection* ralf,
+RalfACR::RalfACR(RalfDeliveryQueue* ralf,
                  SAS::TrailId trail,
                  Node node_functionality,
                  Initiator initiator,
@@ -641,19 +641,91 @@ void RalfACR::server_capabilities(const ServerCapabilities& caps)
 
 void RalfACR::send_message(pj_time_val timestamp)
 {
-  // Encode and send the request using the Ralf HTTP connection.
+  // Encode the request and hand it to the delivery queue, which sends it in
+  // the background.
   LOG_VERBOSE("Sending %s Ralf ACR (%p)",
               ACR::node_name(_node_functionality).c_str(), this);
   std::string path = "/call-id/" + Utils::url_escape(_user_session_id);
-  std::map<std::string, std::string> headers;
-  long rc = _ralf->send_post(path,
-                             headers,
-                             get_message(timestamp),
-                             _trail);
+  _ralf->send(path, get_message(timestamp), _trail);
+}
+
+pthread_once_t RalfACR::_encode_buffer_once = PTHREAD_ONCE_INIT;
+pthread_key_t RalfACR::_encode_buffer_key;
+
+void RalfACR::create_encode_buffer_key()
+{
+  pthread_key_create(&_encode_buffer_key, &destroy_encode_buffer);
+}
+
+void RalfACR::destroy_encode_buffer(void* buffer)
+{
+  delete (rapidjson::StringBuffer*)buffer;
+}
+
+rapidjson::StringBuffer* RalfACR::encode_buffer()
+{
+  pthread_once(&_encode_buffer_once, &create_encode_buffer_key);
+
+  rapidjson::StringBuffer* buffer =
+                (rapidjson::StringBuffer*)pthread_getspecific(_encode_buffer_key);
+  if (buffer == NULL)
+  {
+    buffer = new rapidjson::StringBuffer();
+    pthread_setspecific(_encode_buffer_key, buffer);
+  }
+
+  buffer->Clear();
+  return buffer;
+}
+
+/// Helpers for writing AVPs with the streaming JSON writer.
+static inline void write_string(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                const std::string& value)
+{
+  writer.String(value.data(), (rapidjson::SizeType)value.length());
+}
+
+static inline void write_string_avp(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                    const char* name,
+                                    const std::string& value)
+{
+  writer.String(name);
+  write_string(writer, value);
+}
+
+static inline void write_int_avp(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                 const char* name,
+                                 int value)
+{
+  writer.String(name);
+  writer.Int(value);
+}
+
+static inline void write_uint_avp(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                  const char* name,
+                                  unsigned int value)
+{
+  writer.String(name);
+  writer.Uint(value);
+}
 
-  if (rc != HTTP_OK)
+/// Writes an array AVP holding the strings in a list, or nothing if the
+/// list is empty.
+static void write_string_array_avp(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                                   const char* name,
+                                   const std::list<std::string>& values)
+{
+  if (!values.empty())
   {
-    LOG_WARNING("Failed to send Ralf ACR message (%p), rc = %ld", this, rc);
+    writer.String(name);
+    writer.StartArray();
+    for (std::list<std::string>::const_iterator i = values.begin();
+         i != values.end();
+         ++i)
+    {
+      write_string(writer, *i);
+    }
+    writer.EndArray();
   }
 }
 
@@ -667,7 +739,18 @@ std::string RalfACR::get_message(pj_time_val timestamp)
     pj_gettimeofday(&timestamp);
   }
 
-  Json::Value v;
+  // Stream the message straight in to this thread's encode buffer, rather
+  // than building a document tree and then rendering it.
+  rapidjson::StringBuffer* buffer = encode_buffer();
+  JSONWriter writer(*buffer);
+  encode_message(writer, timestamp);
+
+  return std::string(buffer->GetString(), buffer->GetSize());
+}
+
+void RalfACR::encode_message(JSONWriter& writer, pj_time_val timestamp)
+{
+  writer.StartObject();
 
   // Add the peers section with charging function addresses if this is a
   // start or event message.
@@ -675,94 +758,98 @@ std::string RalfACR::get_message(pj_time_val timestamp)
       (_record_type == EVENT_RECORD))
   {
     LOG_DEBUG("Adding peers meta-data, %d ccfs, %d ecfs", _ccfs.size(), _ecfs.size());
-    Json::Value& p = v["peers"];
-    for (std::list<std::string>::const_iterator i = _ccfs.begin();
-         i != _ccfs.end();
-         ++i)
+    writer.String("peers");
+    if ((_ccfs.empty()) && (_ecfs.empty()))
     {
-      p["ccf"].append(Json::Value(*i));
+      writer.Null();
     }
-    for (std::list<std::string>::const_iterator i = _ecfs.begin();
-         i != _ecfs.end();
-         ++i)
+    else
     {
-      p["ecf"].append(Json::Value(*i));
+      writer.StartObject();
+      write_string_array_avp(writer, "ccf", _ccfs);
+      write_string_array_avp(writer, "ecf", _ecfs);
+      writer.EndObject();
     }
   }
 
   // Build the event data.
   LOG_DEBUG("Building event");
-  Json::Value& e = v["event"];
+  writer.String("event");
+  writer.StartObject();
 
   // Add top-level fields.
   LOG_DEBUG("Adding Account-Record-Type AVP %d", _record_type);
-  e["Accounting-Record-Type"] = Json::Value(_record_type);
+  write_int_avp(writer, "Accounting-Record-Type", _record_type);
   if (!_username.empty())
   {
-    e["User-Name"] = Json::Value(_username);
+    write_string_avp(writer, "User-Name", _username);
   }
   if (_interim_interval != 0)
   {
-    e["Acct-Interim-Interval"] = Json::Value(_interim_interval);
+    write_int_avp(writer, "Acct-Interim-Interval", _interim_interval);
   }
-  e["Event-Timestamp"] = Json::Value((Json::UInt)timestamp.sec);
+  write_uint_avp(writer, "Event-Timestamp", timestamp.sec);
 
   // Add Service-Information AVP group.
   LOG_DEBUG("Adding Service-Information AVP group");
-  Json::Value& si = e["Service-Information"];
+  writer.String("Service-Information");
+  writer.StartObject();
 
-  if ((_node_functionality == PCSCF) ||
-      (_node_functionality == SCSCF) ||
-      (_node_functionality == IBCF))
+  if (((_node_functionality == PCSCF) ||
+       (_node_functionality == SCSCF) ||
+       (_node_functionality == IBCF)) &&
+      (!_subscription_ids.empty()))
   {
     // Add Subscription-Id AVPs on P-CSCF/S-CSCF/IBCF ACRs (should be omitted
     // on I-CSCF and BGCF).
     LOG_DEBUG("Adding %d Subscription-Id AVPs", _subscription_ids.size());
+    writer.String("Subscription-Id");
+    writer.StartArray();
     for (std::list<SubscriptionId>::const_iterator i = _subscription_ids.begin();
          i != _subscription_ids.end();
          ++i)
     {
-      Json::Value& sub = si["Subscription-Id"].append(Json::Value());
-      sub["Subscription-Id-Type"] = Json::Value(i->type);
-      sub["Subscription-Id-Data"] = Json::Value(i->id);
+      writer.StartObject();
+      write_int_avp(writer, "Subscription-Id-Type", i->type);
+      write_string_avp(writer, "Subscription-Id-Data", i->id);
+      writer.EndObject();
     }
+    writer.EndArray();
   }
 
   // Add IMS-Information AVP group.
   LOG_DEBUG("Adding IMS-Information AVP group");
-  Json::Value& ii = si["IMS-Information"];
+  writer.String("IMS-Information");
+  writer.StartObject();
 
   // Add Event-Type AVP group.
   LOG_DEBUG("Adding Event-Type AVP group");
-  Json::Value& event_type = ii["Event-Type"];
-  event_type["SIP-Method"] = Json::Value(_method);
+  writer.String("Event-Type");
+  writer.StartObject();
+  write_string_avp(writer, "SIP-Method", _method);
   if (!_event.empty())
   {
-    event_type["Event"] = Json::Value(_event);
+    write_string_avp(writer, "Event", _event);
   }
   if (_expires != -1)
   {
-    event_type["Expires"] = Json::Value(_expires);
+    write_int_avp(writer, "Expires", _expires);
   }
+  writer.EndObject();
 
-  ii["Role-Of-Node"] = Json::Value(_node_role);
-  ii["Node-Functionality"] = Json::Value(_node_functionality);
-  ii["User-Session-Id"] = Json::Value(_user_session_id);
+  write_int_avp(writer, "Role-Of-Node", _node_role);
+  write_int_avp(writer, "Node-Functionality", _node_functionality);
+  write_string_avp(writer, "User-Session-Id", _user_session_id);
 
   // Add the Calling-Party-Address AVPs.
   LOG_DEBUG("Adding %d Calling-Party-Address AVPs", _calling_party_addresses.size());
-  for (std::list<std::string>::const_iterator i = _calling_party_addresses.begin();
-       i != _calling_party_addresses.end();
-       ++i)
-  {
-    ii["Calling-Party-Address"].append(Json::Value(*i));
-  }
+  write_string_array_avp(writer, "Calling-Party-Address", _calling_party_addresses);
 
   // Add the Called-Party-Address AVP.
   if (!_called_party_address.empty())
   {
     LOG_DEBUG("Adding Called-Party-Address AVP");
-    ii["Called-Party-Address"] = Json::Value(_called_party_address);
+    write_string_avp(writer, "Called-Party-Address", _called_party_address);
   }
 
   if (_node_functionality == SCSCF)
@@ -772,7 +859,7 @@ std::string RalfACR::get_message(pj_time_val timestamp)
     if (_requested_party_address != _called_party_address)
     {
       LOG_DEBUG("Adding Requested-Party-Address AVP");
-      ii["Requested-Party-Address"] = Json::Value(_requested_party_address);
+      write_string_avp(writer, "Requested-Party-Address", _requested_party_address);
     }
   }
 
@@ -781,59 +868,66 @@ std::string RalfACR::get_message(pj_time_val timestamp)
   {
     // Add the Called-Asserted-Identity AVPs.
     LOG_DEBUG("Adding %d Called-Asserted-Identity AVPs", _called_asserted_ids.size());
-    for (std::list<std::string>::const_iterator i = _called_asserted_ids.begin();
-         i != _called_asserted_ids.end();
-         ++i)
-    {
-      ii["Called-Asserted-Identity"].append(Json::Value(*i));
-    }
+    write_string_array_avp(writer, "Called-Asserted-Identity", _called_asserted_ids);
   }
 
   if (_node_functionality != BGCF)
   {
     // Add the Associated-URI AVPs.
     LOG_DEBUG("Adding %d Associated-URI AVPs", _associated_uris.size());
-    for (std::list<std::string>::const_iterator i = _associated_uris.begin();
-         i != _associated_uris.end();
-         ++i)
-    {
-      ii["Associated-URI"].append(Json::Value(*i));
-    }
+    write_string_array_avp(writer, "Associated-URI", _associated_uris);
   }
 
-  // Add the Time-Stamps AVP group.
+  // Add the Time-Stamps AVP group.  This is always present, even if empty.
   LOG_DEBUG("Adding Time-Stamps AVP group");
-  Json::Value& timestamps = ii["Time-Stamps"];
-  if (_req_timestamp.sec != 0)
+  writer.String("Time-Stamps");
+  if ((_req_timestamp.sec == 0) && (_rsp_timestamp.sec == 0))
   {
-    timestamps["SIP-Request-Timestamp"] = Json::Value((Json::UInt)_req_timestamp.sec);
-    timestamps["SIP-Request-Timestamp-Fraction"] = Json::Value((Json::UInt)_req_timestamp.msec);
+    writer.Null();
   }
-  if (_rsp_timestamp.sec != 0)
+  else
   {
-    timestamps["SIP-Response-Timestamp"] = Json::Value((Json::UInt)_rsp_timestamp.sec);
-    timestamps["SIP-Response-Timestamp-Fraction"] = Json::Value((Json::UInt)_rsp_timestamp.msec);
+    writer.StartObject();
+    if (_req_timestamp.sec != 0)
+    {
+      write_uint_avp(writer, "SIP-Request-Timestamp", _req_timestamp.sec);
+      write_uint_avp(writer, "SIP-Request-Timestamp-Fraction", _req_timestamp.msec);
+    }
+    if (_rsp_timestamp.sec != 0)
+    {
+      write_uint_avp(writer, "SIP-Response-Timestamp", _rsp_timestamp.sec);
+      write_uint_avp(writer, "SIP-Response-Timestamp-Fraction", _rsp_timestamp.msec);
+    }
+    writer.EndObject();
   }
 
-  if (_node_functionality == SCSCF)
+  if ((_node_functionality == SCSCF) &&
+      (!_as_information.empty()))
   {
     // Add the Application-Server-Information AVPs.
     LOG_DEBUG("Adding %d Application-Server-Information AVP groups", _as_information.size());
+    writer.String("Application-Server-Information");
+    writer.StartArray();
     for (std::list<ASInformation>::const_iterator i = _as_information.begin();
          i != _as_information.end();
          ++i)
     {
-      Json::Value& as = ii["Application-Server-Information"].append(Json::Value());
-      as["Application-Server"] = Json::Value(i->uri);
+      writer.StartObject();
+      write_string_avp(writer, "Application-Server", i->uri);
       if (!i->redirect_uri.empty())
       {
-        as["Application-Provided-Called-Party-Address"].append(Json::Value(i->redirect_uri));
+        writer.String("Application-Provided-Called-Party-Address");
+        writer.StartArray();
+        write_string(writer, i->redirect_uri);
+        writer.EndArray();
       }
       if (i->status_code != STATUS_CODE_NONE)
       {
-        as["Status-Code"] = Json::Value(i->status_code);
+        write_int_avp(writer, "Status-Code", i->status_code);
       }
+      writer.EndObject();
     }
+    writer.EndArray();
   }
 
   // Add a single Inter-Operator-Identifier AVP group.  (According to 7.2.77 of
@@ -843,50 +937,75 @@ std::string RalfACR::get_message(pj_time_val timestamp)
   if ((!_orig_ioi.empty()) || (!_term_ioi.empty()))
   {
     LOG_DEBUG("Adding Inter-Operator-Identifier AVP group");
-    Json::Value& ioi = ii["Inter-Operator-Identifier"].append(Json::Value());
+    writer.String("Inter-Operator-Identifier");
+    writer.StartArray();
+    writer.StartObject();
     if (!_orig_ioi.empty())
     {
-      ioi["Originating-IOI"] = Json::Value(_orig_ioi);
+      write_string_avp(writer, "Originating-IOI", _orig_ioi);
     }
     if (!_term_ioi.empty())
     {
-      ioi["Terminating-IOI"] = Json::Value(_term_ioi);
+      write_string_avp(writer, "Terminating-IOI", _term_ioi);
     }
+    writer.EndObject();
+    writer.EndArray();
   }
 
   // Add Transit-IOI-List AVPs.
   LOG_DEBUG("Adding %d Transit-IOI-List AVPs", _transit_iois.size());
-  for (std::list<std::string>::const_iterator i = _transit_iois.begin();
-       i != _transit_iois.end();
-       ++i)
-  {
-    ii["Transit-IOI-List"].append(Json::Value(*i));
-  }
+  write_string_array_avp(writer, "Transit-IOI-List", _transit_iois);
 
-  ii["IMS-Charging-Identifier"] = Json::Value(_icid);
+  write_string_avp(writer, "IMS-Charging-Identifier", _icid);
 
   // Add the Server-Capabilities AVP if I-CSCF.
   if (_node_functionality == ICSCF)
   {
     LOG_DEBUG("Adding Server-Capabilities AVP group");
-    Json::Value& server_caps = ii["Server-Capabilities"];
-    for (std::vector<int>::const_iterator i = _server_caps.mandatory_caps.begin();
-         i != _server_caps.mandatory_caps.end();
-         ++i)
+    writer.String("Server-Capabilities");
+    if ((_server_caps.mandatory_caps.empty()) &&
+        (_server_caps.optional_caps.empty()) &&
+        (_server_caps.scscf.empty()))
     {
-      server_caps["Mandatory-Capability"].append(Json::Value(*i));
+      writer.Null();
     }
-    for (std::vector<int>::const_iterator i = _server_caps.optional_caps.begin();
-         i != _server_caps.optional_caps.end();
-         ++i)
-    {
-      server_caps["Optional-Capability"].append(Json::Value(*i));
-    }
-    if (!_server_caps.scscf.empty())
+    else
     {
-      // Note that the Server-Name in Server-Capabilities is an array AVP
-      // according to 6.3.4/TS 29.229.
-      server_caps["Server-Name"].append(Json::Value(_server_caps.scscf));
+      writer.StartObject();
+      if (!_server_caps.mandatory_caps.empty())
+      {
+        writer.String("Mandatory-Capability");
+        writer.StartArray();
+        for (std::vector<int>::const_iterator i = _server_caps.mandatory_caps.begin();
+             i != _server_caps.mandatory_caps.end();
+             ++i)
+        {
+          writer.Int(*i);
+        }
+        writer.EndArray();
+      }
+      if (!_server_caps.optional_caps.empty())
+      {
+        writer.String("Optional-Capability");
+        writer.StartArray();
+        for (std::vector<int>::const_iterator i = _server_caps.optional_caps.begin();
+             i != _server_caps.optional_caps.end();
+             ++i)
+        {
+          writer.Int(*i);
+        }
+        writer.EndArray();
+      }
+      if (!_server_caps.scscf.empty())
+      {
+        // Note that the Server-Name in Server-Capabilities is an array AVP
+        // according to 6.3.4/TS 29.229.
+        writer.String("Server-Name");
+        writer.StartArray();
+        write_string(writer, _server_caps.scscf);
+        writer.EndArray();
+      }
+      writer.EndObject();
     }
   }
 
@@ -900,21 +1019,27 @@ std::string RalfACR::get_message(pj_time_val timestamp)
       (_node_functionality == IBCF))
   {
     // Add Early-Media-Description AVPs to Start and Event ACRs.
-    if ((_record_type == START_RECORD) ||
-        (_record_type == EVENT_RECORD))
+    if (((_record_type == START_RECORD) ||
+         (_record_type == EVENT_RECORD)) &&
+        (!_early_media.empty()))
     {
       LOG_DEBUG("Adding %d Early-Media-Description AVPs", _early_media.size());
+      writer.String("Early-Media-Description");
+      writer.StartArray();
       for (std::list<EarlyMediaDescription>::const_iterator i = _early_media.begin();
            i != _early_media.end();
            ++i)
       {
-        Json::Value& em = ii["Early-Media-Description"].append(Json::Value());
-        em["SDP-Timestamps"]["SDP-Offer-Timestamp"] =
-                                 Json::Value((Json::UInt)i->offer_timestamp.sec);
-        em["SDP-Timestamps"]["SDP-Answer-Timestamp"] =
-                                Json::Value((Json::UInt)i->answer_timestamp.sec);
-        encode_sdp_description(em, i->media);
+        writer.StartObject();
+        writer.String("SDP-Timestamps");
+        writer.StartObject();
+        write_uint_avp(writer, "SDP-Offer-Timestamp", i->offer_timestamp.sec);
+        write_uint_avp(writer, "SDP-Answer-Timestamp", i->answer_timestamp.sec);
+        writer.EndObject();
+        encode_sdp_description(writer, i->media);
+        writer.EndObject();
       }
+      writer.EndArray();
     }
 
     if ((_record_type == START_RECORD) ||
@@ -922,23 +1047,30 @@ std::string RalfACR::get_message(pj_time_val timestamp)
     {
       // Add SDP related AVPs to Start and Interim ACRs.
       LOG_DEBUG("Adding Media AVPs");
-      encode_sdp_description(ii, _media);
+      encode_sdp_description(writer, _media);
     }
 
     // Add Message-Body AVPs.
-    LOG_DEBUG("Adding %d Message-Body AVPs", _msg_bodies.size());
-    for (std::list<MessageBody>::const_iterator i = _msg_bodies.begin();
-         i != _msg_bodies.end();
-         ++i)
+    if (!_msg_bodies.empty())
     {
-      Json::Value& body = ii["Message-Body"].append(Json::Value());
-      body["Content-Type"] = Json::Value(i->type);
-      body["Content-Length"] = Json::Value(i->length);
-      if (!i->disposition.empty())
+      LOG_DEBUG("Adding %d Message-Body AVPs", _msg_bodies.size());
+      writer.String("Message-Body");
+      writer.StartArray();
+      for (std::list<MessageBody>::const_iterator i = _msg_bodies.begin();
+           i != _msg_bodies.end();
+           ++i)
       {
-        body["Content-Disposition"] = Json::Value(i->disposition);
+        writer.StartObject();
+        write_string_avp(writer, "Content-Type", i->type);
+        write_int_avp(writer, "Content-Length", i->length);
+        if (!i->disposition.empty())
+        {
+          write_string_avp(writer, "Content-Disposition", i->disposition);
+        }
+        write_int_avp(writer, "Originator", i->originator);
+        writer.EndObject();
       }
-      body["Originator"] = Json::Value(i->originator);
+      writer.EndArray();
     }
   }
 
@@ -947,7 +1079,7 @@ std::string RalfACR::get_message(pj_time_val timestamp)
   {
     // Cause code is always zero for STOP requests.
     LOG_DEBUG("Adding Cause-Code(0) AVP to ACR[Stop]");
-    ii["Cause-Code"] = Json::Value(0);
+    write_int_avp(writer, "Cause-Code", 0);
   }
   else if ((_record_type == EVENT_RECORD) &&
            (_status_code != 0))
@@ -992,65 +1124,56 @@ std::string RalfACR::get_message(pj_time_val timestamp)
     // cases we have to send a SIP response with a valid 4xx/5xx/6xx status
     // code, so we use that status code.
     LOG_DEBUG("Adding Cause-Code(%d) AVP to ACR[Interim]", cause_code);
-    ii["Cause-Code"] = Json::Value(cause_code);
+    write_int_avp(writer, "Cause-Code", cause_code);
   }
 
   // Add Reason-Header AVPs.
   LOG_DEBUG("Adding %d Reason-Header AVPs", _reasons.size());
-  for (std::list<std::string>::const_iterator i = _reasons.begin();
-       i != _reasons.end();
-       ++i)
-  {
-    ii["Reason-Header"].append(Json::Value(*i));
-  }
+  write_string_array_avp(writer, "Reason-Header", _reasons);
 
   // Add Access-Network-Information AVPs
   LOG_DEBUG("Adding %d Access-Network-Information AVPs", _access_network_info.size());
-  for (std::list<std::string>::const_iterator i = _access_network_info.begin();
-       i != _access_network_info.end();
-       ++i)
-  {
-    ii["Access-Network-Information"].append(Json::Value(*i));
-  }
+  write_string_array_avp(writer, "Access-Network-Information", _access_network_info);
 
   // Add From-Address AVP.
   LOG_DEBUG("Adding From-Address AVP");
-  ii["From-Address"] = Json::Value(_from_address);
+  write_string_avp(writer, "From-Address", _from_address);
 
   // Add IMS-Visited-Network-Identifier AVP if set.
   if (!_visited_network_id.empty())
   {
     LOG_DEBUG("Adding IMS-Visited-Network-Identifier AVP");
-    ii["IMS-Visited-Network-Identifier"] = Json::Value(_visited_network_id);
+    write_string_avp(writer, "IMS-Visited-Network-Identifier", _visited_network_id);
   }
 
   // Add Route-Header-Received and Route-Header-Transmitted AVPs if set.
   if (!_route_hdr_received.empty())
   {
     LOG_DEBUG("Adding Route-Header-Received AVP");
-    ii["Route-Header-Received"] = Json::Value(_route_hdr_received);
+    write_string_avp(writer, "Route-Header-Received", _route_hdr_received);
   }
   if (!_route_hdr_transmitted.empty())
   {
     LOG_DEBUG("Adding Route-Header-Transmitted AVP");
-    ii["Route-Header-Transmitted"] = Json::Value(_route_hdr_transmitted);
+    write_string_avp(writer, "Route-Header-Transmitted", _route_hdr_transmitted);
   }
 
   // Add the Instance-Id AVP if set.
   if (!_instance_id.empty())
   {
     LOG_DEBUG("Adding Instance-Id AVP");
-    ii["Instance-Id"] = Json::Value(_instance_id);
+    write_string_avp(writer, "Instance-Id", _instance_id);
   }
 
-  //LOG_DEBUG("Built JSON message %s", v.toStyledString().c_str());
-
-  // Render the message to a string and return it.
-  Json::FastWriter writer;
-  return writer.write(v);
+  // Close the IMS-Information, Service-Information, event and top-level
+  // objects.
+  writer.EndObject();
+  writer.EndObject();
+  writer.EndObject();
+  writer.EndObject();
 }
 
-void RalfACR::encode_sdp_description(Json::Value& v, const MediaDescription& media)
+void RalfACR::encode_sdp_description(JSONWriter& writer, const MediaDescription& media)
 {
   // Split the offer and answer in to lines.
   std::vector<std::string> offer;
@@ -1063,31 +1186,54 @@ void RalfACR::encode_sdp_description(Json::Value& v, const MediaDescription& med
   // repeating them).
   LOG_DEBUG("Adding SDP-Session-Description AVPs");
   std::vector<std::string>& session_sdp = (answer.empty()) ? offer : answer;
-  for (size_t ii = 0; ii < session_sdp.size(); ++ii)
+  if ((!session_sdp.empty()) && (session_sdp[0][0] != 'm'))
   {
-    if (session_sdp[ii][0] == 'm')
+    writer.String("SDP-Session-Description");
+    writer.StartArray();
+    for (size_t ii = 0; ii < session_sdp.size(); ++ii)
     {
-      break;
+      if (session_sdp[ii][0] == 'm')
+      {
+        break;
+      }
+      write_string(writer, session_sdp[ii]);
     }
-    v["SDP-Session-Description"].append(Json::Value(session_sdp[ii]));
-  }
-
-  // Now parse and encode the offer and answer media components.
-  LOG_DEBUG("Adding media AVPs for offer");
-  encode_media_components(v,
-                          offer,
-                          SDP_OFFER,
-                          media.offer.initiator_flag,
-                          media.offer.initiator_party);
-  LOG_DEBUG("Adding media AVPs for answer");
-  encode_media_components(v,
-                          answer,
-                          SDP_ANSWER,
-                          media.answer.initiator_flag,
-                          media.answer.initiator_party);
+    writer.EndArray();
+  }
+
+  // Now parse and encode the offer and answer media components, which all
+  // go in a single SDP-Media-Component array.
+  bool has_media = false;
+  for (size_t ii = 0; (ii < offer.size()) && (!has_media); ++ii)
+  {
+    has_media = (offer[ii][0] == 'm');
+  }
+  for (size_t ii = 0; (ii < answer.size()) && (!has_media); ++ii)
+  {
+    has_media = (answer[ii][0] == 'm');
+  }
+
+  if (has_media)
+  {
+    writer.String("SDP-Media-Component");
+    writer.StartArray();
+    LOG_DEBUG("Adding media AVPs for offer");
+    encode_media_components(writer,
+                            offer,
+                            SDP_OFFER,
+                            media.offer.initiator_flag,
+                            media.offer.initiator_party);
+    LOG_DEBUG("Adding media AVPs for answer");
+    encode_media_components(writer,
+                            answer,
+                            SDP_ANSWER,
+                            media.answer.initiator_flag,
+                            media.answer.initiator_party);
+    writer.EndArray();
+  }
 }
 
-void RalfACR::encode_media_components(Json::Value& v,
+void RalfACR::encode_media_components(JSONWriter& writer,
                                   const std::vector<std::string>& sdp,
                                   SDPType sdp_type,
                                   Initiator initiator_flag,
@@ -1098,37 +1244,49 @@ void RalfACR::encode_media_components(Json::Value& v,
     if (sdp[ii][0] == 'm')
     {
       // Generate an SDP-Media-Component AVP.
-      Json::Value& mc = v["SDP-Media-Component"].append(Json::Value());
+      writer.StartObject();
 
       // Add the SDP-Media-Name AVP.
-      mc["SDP-Media-Name"] = Json::Value(sdp[ii]);
+      write_string_avp(writer, "SDP-Media-Name", sdp[ii]);
 
       // Add SDP-Media-Description AVPs.
-      for (ii = ii + 1; (ii < sdp.size()) && (sdp[ii][0] != 'm'); ++ii)
+      if ((ii + 1 < sdp.size()) && (sdp[ii + 1][0] != 'm'))
       {
-        mc["SDP-Media-Description"].append(Json::Value(sdp[ii]));
+        writer.String("SDP-Media-Description");
+        writer.StartArray();
+        for (ii = ii + 1; (ii < sdp.size()) && (sdp[ii][0] != 'm'); ++ii)
+        {
+          write_string(writer, sdp[ii]);
+        }
+        writer.EndArray();
+      }
+      else
+      {
+        ++ii;
       }
 
       // Add the Local-GW-Inserted-Indication AVP (alway 0 - Local GW not
       // inserted).
-      mc["Local-GW-Inserted-Indication"] = Json::Value(0);
+      write_int_avp(writer, "Local-GW-Inserted-Indication", 0);
 
       // Add the IP-Realm-Default-Indication AVP (always 1 - Default IP
       // realm used).
-      mc["IP-Realm-Default-Indication"] = Json::Value(1);
+      write_int_avp(writer, "IP-Realm-Default-Indication", 1);
 
       // Add the Transcoder-Inserted-Indication AVP (always 0 - Transcode not
       // inserted).
-      mc["Transcoder-Inserted-Indication"] = Json::Value(0);
+      write_int_avp(writer, "Transcoder-Inserted-Indication", 0);
 
       // Add the Media-Initiator-Flag AVP.
-      mc["Media-Initiator-Flag"] = Json::Value(initiator_flag);
+      write_int_avp(writer, "Media-Initiator-Flag", initiator_flag);
 
       // Add the Media-Initiator-Party AVP.
-      mc["Media-Initiator-Party"] = Json::Value(initiator_party);
+      write_string_avp(writer, "Media-Initiator-Party", initiator_party);
 
       // Add the SDP-Type AVP.
-      mc["SDP-Type"] = Json::Value(sdp_type);
+      write_int_avp(writer, "SDP-Type", sdp_type);
+
+      writer.EndObject();
     }
     else
     {
@@ -1471,7 +1629,7 @@ std::string RalfACR::hdr_contents(pjsip_hdr* hdr)
 }
 
 /// RalfACRFactory Constructor.
-RalfACRFactory::RalfACRFactory(HttpConnection* ralf,
+RalfACRFactory::RalfACRFactory(RalfDeliveryQueue* ralf,
                                Node node_functionality) :
   _ralf(ralf),
   _node_functionality(node_functionality)
@@ -110,6 +110,19 @@ static AvStore* av_store;
 static AnalyticsLogger* analytics;
 
 
+// Period (in seconds) for which a validated Digest nonce may be reused by
+// the client with an increasing nonce count, and the maximum nonce count
+// accepted.  Nonce reuse is disabled if the lifetime is zero.
+static int nonce_reuse_lifetime;
+static int nonce_count_max;
+
+
+// Number of AKA vectors to request from the HSS at once.  Vectors that aren't
+// used for the current challenge are held in the AV store for subsequent
+// challenges.
+static int aka_prefetch_count;
+
+
 // PJSIP structure for control server authentication functions.
 pjsip_auth_srv auth_srv;
 
@@ -178,6 +191,58 @@ bool verify_auth_vector(Json::Value* av, const std::string& impi, SAS::TrailId t
 }
 
 
+/// Parses the nonce count from an Authorization header, returning zero if
+/// the header doesn't have a valid nc parameter with qop=auth.
+static unsigned long get_nonce_count(pjsip_authorization_hdr* auth_hdr)
+{
+  unsigned long nc = 0;
+
+  if ((pj_stricmp(&auth_hdr->credential.digest.qop, &STR_AUTH) == 0) &&
+      (auth_hdr->credential.digest.nc.slen > 0))
+  {
+    std::string nc_str = PJUtils::pj_str_to_string(&auth_hdr->credential.digest.nc);
+    nc = strtoul(nc_str.c_str(), NULL, 16);
+  }
+
+  return nc;
+}
+
+
+/// Checks whether a request may reuse a nonce that has already been
+/// validated, as permitted by RFC 2617.  The nonce count must be higher than
+/// any previously accepted for the nonce, and the nonce must still be
+/// within its reuse lifetime.
+static bool nonce_reuse_permitted(Json::Value* av,
+                                  pjsip_authorization_hdr* auth_hdr)
+{
+  if ((nonce_reuse_lifetime == 0) ||
+      (!av->isMember("digest")) ||
+      (!(*av)["nc"].isUInt()) ||
+      (!(*av)["nonce_expires"].isUInt()))
+  {
+    LOG_DEBUG("Nonce has already been used and may not be reused");
+    return false;
+  }
+
+  unsigned long nc = get_nonce_count(auth_hdr);
+  if ((nc <= (*av)["nc"].asUInt()) ||
+      ((nonce_count_max > 0) && (nc > (unsigned long)nonce_count_max)))
+  {
+    LOG_DEBUG("Nonce count %lu is not valid for a reused nonce (last %u)",
+              nc, (*av)["nc"].asUInt());
+    return false;
+  }
+
+  if ((time_t)(*av)["nonce_expires"].asUInt() <= time(NULL))
+  {
+    LOG_DEBUG("Nonce reuse lifetime has expired");
+    return false;
+  }
+
+  return true;
+}
+
+
 pj_status_t user_lookup(pj_pool_t *pool,
                         const pjsip_auth_lookup_cred_param *param,
                         pjsip_cred_info *cred_info,
@@ -294,7 +359,54 @@ void create_challenge(pjsip_authorization_hdr* auth_hdr,
 
   // Get the Authentication Vector from the HSS.
   Json::Value* av = NULL;
-  HTTPCode http_code = hss->get_auth_vector(impi, impu, auth_type, resync, av, get_trail(rdata));
+  HTTPCode http_code = HTTP_OK;
+
+  if ((auth_type == "aka") &&
+      (aka_prefetch_count > 1))
+  {
+    if (resync.empty())
+    {
+      // Use a previously prefetched vector if there is one.
+      av = av_store->get_prefetched_av(impi, impu, get_trail(rdata));
+    }
+    else
+    {
+      // The client is out of sync with the HSS, so the sequence numbers of
+      // any prefetched vectors are no longer valid.
+      av_store->clear_prefetched_avs(impi, impu, get_trail(rdata));
+    }
+
+    if (av == NULL)
+    {
+      // Fetch a batch of vectors from the HSS, use the first for this
+      // challenge and hold the rest for subsequent challenges.
+      std::vector<Json::Value*> avs;
+      http_code = hss->get_auth_vectors(impi,
+                                        impu,
+                                        auth_type,
+                                        resync,
+                                        aka_prefetch_count,
+                                        avs,
+                                        get_trail(rdata));
+      if (!avs.empty())
+      {
+        av = avs.front();
+        avs.erase(avs.begin());
+        av_store->add_prefetched_avs(impi, impu, avs, get_trail(rdata));
+
+        for (std::vector<Json::Value*>::iterator i = avs.begin();
+             i != avs.end();
+             ++i)
+        {
+          delete *i;
+        }
+      }
+    }
+  }
+  else
+  {
+    http_code = hss->get_auth_vector(impi, impu, auth_type, resync, av, get_trail(rdata));
+  }
 
   if ((av != NULL) &&
       (!verify_auth_vector(av, impi, get_trail(rdata))))
@@ -525,8 +637,21 @@ pj_bool_t authenticate_rx_request(pjsip_rx_data* rdata)
     std::string nonce = PJUtils::pj_str_to_string(&auth_hdr->credential.digest.nonce);
     uint64_t cas = 0;
 
+    // Get the AV from the store.  A reused nonce's count is checked against
+    // this record, and the new count is written with its CAS, so two
+    // requests with the same nonce count can't both be accepted.
     Json::Value* av = av_store->get_av(impi, nonce, cas, trail);
 
+    if ((av != NULL) &&
+        (av->isMember("nc")) &&
+        (!nonce_reuse_permitted(av, auth_hdr)))
+    {
+      // The nonce has already been validated and can't be reused for this
+      // request, so treat it as stale.
+      delete av;
+      av = NULL;
+    }
+
     // Request contains a response to a previous challenge, so pass it to
     // the authentication module to verify.
     LOG_DEBUG("Verify authentication information in request");
@@ -540,10 +665,40 @@ pj_bool_t authenticate_rx_request(pjsip_rx_data* rdata)
       SAS::Event event(trail, SASEvent::AUTHENTICATION_SUCCESS, 0);
       SAS::report_event(event);
 
-      (*av)["tombstone"] = Json::Value("true");
-      bool rc = av_store->set_av(impi, nonce, av, cas, trail);
+      // If nonce reuse is enabled, record the nonce count so the client
+      // can reuse this nonce for subsequent requests.  The reuse lifetime
+      // starts when the nonce is first validated.
+      int reuse_lifetime = 0;
+      unsigned long nc = get_nonce_count(auth_hdr);
+      if ((nonce_reuse_lifetime > 0) &&
+          (av->isMember("digest")) &&
+          (nc > 0))
+      {
+        time_t now = time(NULL);
+        if (!av->isMember("nonce_expires"))
+        {
+          (*av)["nonce_expires"] = Json::UInt(now + nonce_reuse_lifetime);
+        }
+        (*av)["nc"] = Json::UInt(nc);
+        reuse_lifetime = (*av)["nonce_expires"].asUInt() - now;
+      }
 
-      if (!rc)
+      bool rc = av_store->tombstone_av(impi, nonce, av, cas, trail, reuse_lifetime);
+
+      if ((!rc) && (reuse_lifetime > 0))
+      {
+        // The nonce count wasn't recorded, most likely because another
+        // request using the same nonce updated the record after we read it.
+        // Don't retry with our copy, as that could accept a replayed nonce
+        // count - treat the nonce as stale and challenge the request instead.
+        LOG_WARNING("Failed to record nonce count %lu for %s/%s, rechallenging",
+                    nc,
+                    impi.c_str(),
+                    nonce.c_str());
+        status = PJSIP_EAUTHACCNOTFOUND;
+        sc = PJSIP_SC_UNAUTHORIZED;
+      }
+      else if (!rc)
       {
         // LCOV_EXCL_START
         LOG_ERROR("Tried to tombstone AV for %s/%s after processing an authentication, but failed",
@@ -712,7 +867,10 @@ pj_status_t init_authentication(const std::string& realm_name,
                                 HSSConnection* hss_connection,
                                 ChronosConnection* chronos_connection,
                                 ACRFactory* rfacr_factory,
-                                AnalyticsLogger* analytics_logger)
+                                AnalyticsLogger* analytics_logger,
+                                int nonce_reuse_lifetime_secs,
+                                int nonce_count_maximum,
+                                int aka_av_prefetch_count)
 {
   pj_status_t status;
 
@@ -722,6 +880,9 @@ pj_status_t init_authentication(const std::string& realm_name,
   chronos = chronos_connection;
   acr_factory = rfacr_factory;
   analytics = analytics_logger;
+  nonce_reuse_lifetime = nonce_reuse_lifetime_secs;
+  nonce_count_max = nonce_count_maximum;
+  aka_prefetch_count = aka_av_prefetch_count;
 
   // Register the authentication module.  This needs to be in the stack
   // before the transaction layer.
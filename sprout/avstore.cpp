@@ -43,6 +43,259 @@
 #include "sas.h"
 #include "sproutsasevent.h"
 
+// AVs are stored in a compact binary format, so reading and writing them
+// doesn't need a JSON serialize or parse.  The format is:
+//
+//   - a version byte (AV_BINARY_VERSION), which distinguishes binary records
+//     from legacy JSON records (which always start with '{')
+//   - a flags byte (AV_FLAG_*)
+//   - if AV_FLAG_NC is set, the last accepted nonce count and the nonce
+//     expiry time, each as a 4-byte big-endian integer
+//   - the realm, qop and ha1 strings for a Digest AV, or the challenge,
+//     response, cryptkey and integritykey strings for an AKA AV
+//   - if AV_FLAG_BRANCH is set, the branch string.
+//
+// Each string is encoded as a 2-byte big-endian length followed by the
+// string data.  AVs with fields that can't be represented in this format
+// are written as JSON.
+static const char AV_BINARY_VERSION = 0x01;
+
+static const uint8_t AV_FLAG_DIGEST = 0x01;
+static const uint8_t AV_FLAG_AKA = 0x02;
+static const uint8_t AV_FLAG_TOMBSTONE = 0x04;
+static const uint8_t AV_FLAG_NC = 0x08;
+static const uint8_t AV_FLAG_BRANCH = 0x10;
+
+static const char* DIGEST_FIELDS[] = {"realm", "qop", "ha1"};
+static const char* AKA_FIELDS[] = {"challenge", "response", "cryptkey", "integritykey"};
+
+static void encode_uint32(uint32_t value, std::string& data)
+{
+  data.push_back((char)((value >> 24) & 0xff));
+  data.push_back((char)((value >> 16) & 0xff));
+  data.push_back((char)((value >> 8) & 0xff));
+  data.push_back((char)(value & 0xff));
+}
+
+static bool encode_string(const Json::Value& value, std::string& data)
+{
+  if ((!value.isString()) ||
+      (value.asString().length() > 0xffff))
+  {
+    return false;
+  }
+
+  const std::string& str = value.asString();
+  data.push_back((char)((str.length() >> 8) & 0xff));
+  data.push_back((char)(str.length() & 0xff));
+  data.append(str);
+  return true;
+}
+
+static bool decode_uint32(const std::string& data, size_t& offset, uint32_t& value)
+{
+  if (offset + 4 > data.length())
+  {
+    return false;
+  }
+
+  value = ((uint32_t)(uint8_t)data[offset] << 24) |
+          ((uint32_t)(uint8_t)data[offset + 1] << 16) |
+          ((uint32_t)(uint8_t)data[offset + 2] << 8) |
+          (uint32_t)(uint8_t)data[offset + 3];
+  offset += 4;
+  return true;
+}
+
+static bool decode_string(const std::string& data, size_t& offset, Json::Value& value)
+{
+  if (offset + 2 > data.length())
+  {
+    return false;
+  }
+
+  size_t length = ((size_t)(uint8_t)data[offset] << 8) |
+                  (size_t)(uint8_t)data[offset + 1];
+  offset += 2;
+
+  if (offset + length > data.length())
+  {
+    return false;
+  }
+
+  value = data.substr(offset, length);
+  offset += length;
+  return true;
+}
+
+/// Encodes an AV in the binary format.
+/// @returns false if the AV can't be represented in the binary format.
+static bool encode_av(const Json::Value& av, std::string& data)
+{
+  uint8_t flags = 0;
+  const char** fields;
+  size_t num_fields;
+  size_t num_members = 1;
+  Json::Value null_json;
+
+  if (!av.isObject())
+  {
+    return false;
+  }
+
+  if (av.isMember("digest"))
+  {
+    flags |= AV_FLAG_DIGEST;
+    fields = DIGEST_FIELDS;
+    num_fields = sizeof(DIGEST_FIELDS) / sizeof(DIGEST_FIELDS[0]);
+  }
+  else if (av.isMember("aka"))
+  {
+    flags |= AV_FLAG_AKA;
+    fields = AKA_FIELDS;
+    num_fields = sizeof(AKA_FIELDS) / sizeof(AKA_FIELDS[0]);
+  }
+  else
+  {
+    return false;
+  }
+
+  const Json::Value& body = av[(flags & AV_FLAG_DIGEST) ? "digest" : "aka"];
+  if ((!body.isObject()) ||
+      (body.size() != num_fields))
+  {
+    return false;
+  }
+
+  if (av.isMember("tombstone"))
+  {
+    if (av["tombstone"] != Json::Value("true"))
+    {
+      return false;
+    }
+    flags |= AV_FLAG_TOMBSTONE;
+    num_members++;
+  }
+
+  if (av.isMember("nc"))
+  {
+    if ((!av["nc"].isUInt()) ||
+        (!av.get("nonce_expires", null_json).isUInt()))
+    {
+      return false;
+    }
+    flags |= AV_FLAG_NC;
+    num_members += 2;
+  }
+
+  if (av.isMember("branch"))
+  {
+    flags |= AV_FLAG_BRANCH;
+    num_members++;
+  }
+
+  if (av.size() != num_members)
+  {
+    // The AV has members we don't know how to encode.
+    return false;
+  }
+
+  data.clear();
+  data.push_back(AV_BINARY_VERSION);
+  data.push_back((char)flags);
+
+  if (flags & AV_FLAG_NC)
+  {
+    encode_uint32(av["nc"].asUInt(), data);
+    encode_uint32(av["nonce_expires"].asUInt(), data);
+  }
+
+  for (size_t ii = 0; ii < num_fields; ++ii)
+  {
+    if (!encode_string(body.get(fields[ii], null_json), data))
+    {
+      return false;
+    }
+  }
+
+  if ((flags & AV_FLAG_BRANCH) &&
+      (!encode_string(av["branch"], data)))
+  {
+    return false;
+  }
+
+  return true;
+}
+
+/// Decodes an AV in the binary format.
+/// @returns NULL if the data is malformed.
+static Json::Value* decode_av(const std::string& data)
+{
+  if ((data.length() < 2) ||
+      (data[0] != AV_BINARY_VERSION))
+  {
+    return NULL;
+  }
+
+  Json::Value* av = new Json::Value(Json::objectValue);
+  uint8_t flags = (uint8_t)data[1];
+  size_t offset = 2;
+  bool ok = true;
+
+  if (flags & AV_FLAG_TOMBSTONE)
+  {
+    (*av)["tombstone"] = Json::Value("true");
+  }
+
+  if (flags & AV_FLAG_NC)
+  {
+    uint32_t nc = 0;
+    uint32_t nonce_expires = 0;
+    ok = (decode_uint32(data, offset, nc) &&
+          decode_uint32(data, offset, nonce_expires));
+    (*av)["nc"] = Json::UInt(nc);
+    (*av)["nonce_expires"] = Json::UInt(nonce_expires);
+  }
+
+  const char** fields = NULL;
+  size_t num_fields = 0;
+  const char* type = NULL;
+  if (flags & AV_FLAG_DIGEST)
+  {
+    type = "digest";
+    fields = DIGEST_FIELDS;
+    num_fields = sizeof(DIGEST_FIELDS) / sizeof(DIGEST_FIELDS[0]);
+  }
+  else if (flags & AV_FLAG_AKA)
+  {
+    type = "aka";
+    fields = AKA_FIELDS;
+    num_fields = sizeof(AKA_FIELDS) / sizeof(AKA_FIELDS[0]);
+  }
+  else
+  {
+    ok = false;
+  }
+
+  for (size_t ii = 0; (ok) && (ii < num_fields); ++ii)
+  {
+    ok = decode_string(data, offset, (*av)[type][fields[ii]]);
+  }
+
+  if ((ok) && (flags & AV_FLAG_BRANCH))
+  {
+    ok = decode_string(data, offset, (*av)["branch"]);
+  }
+
+  if ((!ok) || (offset != data.length()))
+  {
+    delete av;
+    av = NULL;
+  }
+
+  return av;
+}
+
 AvStore::AvStore(Store* data_store) :
   _data_store(data_store)
 {
@@ -58,13 +311,24 @@ bool AvStore::set_av(const std::string& impi,
                      const std::string& nonce,
                      const Json::Value* av,
                      uint64_t cas,
-                     SAS::TrailId trail)
+                     SAS::TrailId trail,
+                     int expiry)
 {
   std::string key = impi + '\\' + nonce;
-  Json::FastWriter writer;
-  std::string data = writer.write(*av);
-  LOG_DEBUG("Set AV for %s\n%s", key.c_str(), data.c_str());
-  Store::Status status = _data_store->set_data("av", key, data, cas, AV_EXPIRY, trail);
+  std::string data;
+  if (encode_av(*av, data))
+  {
+    LOG_DEBUG("Set AV for %s (%d bytes)", key.c_str(), (int)data.length());
+  }
+  else
+  {
+    // The AV can't be represented in the binary format, so fall back to
+    // writing it as JSON.
+    Json::FastWriter writer;
+    data = writer.write(*av);
+    LOG_DEBUG("Set AV for %s\n%s", key.c_str(), data.c_str());
+  }
+  Store::Status status = _data_store->set_data("av", key, data, cas, expiry, trail);
   std::string operation = "SET";
   if (status != Store::Status::OK)
   {
@@ -102,16 +366,29 @@ Json::Value* AvStore::get_av(const std::string& impi,
 
   if (status == Store::Status::OK)
   {
-    LOG_DEBUG("Retrieved AV for %s\n%s", key.c_str(), data.c_str());
-    av = new Json::Value;
-    Json::Reader reader;
-    bool parsingSuccessful = reader.parse(data, *av);
-    if (!parsingSuccessful)
+    if ((!data.empty()) && (data[0] == AV_BINARY_VERSION))
+    {
+      LOG_DEBUG("Retrieved AV for %s (%d bytes)", key.c_str(), (int)data.length());
+      av = decode_av(data);
+      if (av == NULL)
+      {
+        LOG_DEBUG("Failed to decode AV");
+      }
+    }
+    else
     {
-      LOG_DEBUG("Failed to parse AV\n%s",
-                reader.getFormattedErrorMessages().c_str());
-      delete av;
-      av = NULL;
+      // Legacy record written as JSON.
+      LOG_DEBUG("Retrieved AV for %s\n%s", key.c_str(), data.c_str());
+      av = new Json::Value;
+      Json::Reader reader;
+      bool parsingSuccessful = reader.parse(data, *av);
+      if (!parsingSuccessful)
+      {
+        LOG_DEBUG("Failed to parse AV\n%s",
+                  reader.getFormattedErrorMessages().c_str());
+        delete av;
+        av = NULL;
+      }
     }
 
     SAS::Event event(trail, SASEvent::AVSTORE_SUCCESS, 0);
@@ -131,6 +408,205 @@ Json::Value* AvStore::get_av(const std::string& impi,
   return av;
 }
 
+bool AvStore::tombstone_av(const std::string& impi,
+                           const std::string& nonce,
+                           Json::Value* av,
+                           uint64_t cas,
+                           SAS::TrailId trail,
+                           int reuse_lifetime)
+{
+  (*av)["tombstone"] = Json::Value("true");
+  return set_av(impi, nonce, av, cas, trail,
+                (reuse_lifetime > 0) ? reuse_lifetime : AV_EXPIRY);
+}
+
+void AvStore::add_prefetched_avs(const std::string& impi,
+                                 const std::string& impu,
+                                 const std::vector<Json::Value*>& avs,
+                                 SAS::TrailId trail)
+{
+  if (avs.empty())
+  {
+    return;
+  }
+
+  std::string key = impi + '\\' + impu;
+  Json::Value list(Json::arrayValue);
+  for (std::vector<Json::Value*>::const_iterator i = avs.begin();
+       i != avs.end();
+       ++i)
+  {
+    list.append(**i);
+  }
+
+  // Replace any vectors already held, since a newer batch from the HSS has
+  // higher sequence numbers.  The read is only needed for the CAS.
+  Store::Status status = Store::Status::DATA_CONTENTION;
+  for (int attempt = 0;
+       (attempt < AV_PREFETCH_MAX_ATTEMPTS) &&
+       (status == Store::Status::DATA_CONTENTION);
+       ++attempt)
+  {
+    Json::Value old_list;
+    time_t expires;
+    uint64_t cas = 0;
+    status = get_prefetched_list(key, old_list, expires, cas, trail);
+    if ((status == Store::Status::OK) ||
+        (status == Store::Status::NOT_FOUND))
+    {
+      status = set_prefetched_list(key,
+                                   list,
+                                   time(NULL) + AV_PREFETCH_EXPIRY,
+                                   cas,
+                                   trail);
+    }
+  }
+
+  if (status == Store::Status::OK)
+  {
+    LOG_DEBUG("Holding %d prefetched AVs for %s", (int)list.size(), key.c_str());
+  }
+  else
+  {
+    LOG_ERROR("Failed to store prefetched AVs for %s", key.c_str());
+  }
+}
+
+Json::Value* AvStore::get_prefetched_av(const std::string& impi,
+                                        const std::string& impu,
+                                        SAS::TrailId trail)
+{
+  Json::Value* av = NULL;
+  std::string key = impi + '\\' + impu;
+
+  // Pop the first vector from the shared list, retrying if another node
+  // takes one at the same time, so no vector is ever used twice.
+  Store::Status status = Store::Status::DATA_CONTENTION;
+  for (int attempt = 0;
+       (attempt < AV_PREFETCH_MAX_ATTEMPTS) &&
+       (status == Store::Status::DATA_CONTENTION);
+       ++attempt)
+  {
+    Json::Value list;
+    time_t expires;
+    uint64_t cas = 0;
+    status = get_prefetched_list(key, list, expires, cas, trail);
+    if ((status != Store::Status::OK) || (list.size() == 0))
+    {
+      break;
+    }
+
+    Json::Value remaining(Json::arrayValue);
+    for (Json::ArrayIndex i = 1; i < list.size(); ++i)
+    {
+      remaining.append(list[i]);
+    }
+
+    status = set_prefetched_list(key, remaining, expires, cas, trail);
+    if (status == Store::Status::OK)
+    {
+      av = new Json::Value(list[0]);
+    }
+  }
+
+  if (av != NULL)
+  {
+    LOG_DEBUG("Using prefetched AV for %s", key.c_str());
+  }
+
+  return av;
+}
+
+void AvStore::clear_prefetched_avs(const std::string& impi,
+                                   const std::string& impu,
+                                   SAS::TrailId trail)
+{
+  std::string key = impi + '\\' + impu;
+
+  Store::Status status = Store::Status::DATA_CONTENTION;
+  for (int attempt = 0;
+       (attempt < AV_PREFETCH_MAX_ATTEMPTS) &&
+       (status == Store::Status::DATA_CONTENTION);
+       ++attempt)
+  {
+    Json::Value list;
+    time_t expires;
+    uint64_t cas = 0;
+    status = get_prefetched_list(key, list, expires, cas, trail);
+    if ((status != Store::Status::OK) || (list.size() == 0))
+    {
+      return;
+    }
+
+    status = set_prefetched_list(key,
+                                 Json::Value(Json::arrayValue),
+                                 expires,
+                                 cas,
+                                 trail);
+  }
+
+  if (status != Store::Status::OK)
+  {
+    LOG_ERROR("Failed to discard prefetched AVs for %s", key.c_str());
+  }
+}
+
+Store::Status AvStore::get_prefetched_list(const std::string& key,
+                                           Json::Value& avs,
+                                           time_t& expires,
+                                           uint64_t& cas,
+                                           SAS::TrailId trail)
+{
+  avs = Json::Value(Json::arrayValue);
+  expires = 0;
+
+  std::string data;
+  Store::Status status = _data_store->get_data("av_prefetch", key, data, cas, trail);
+  if (status == Store::Status::OK)
+  {
+    Json::Value record;
+    Json::Reader reader;
+    if ((reader.parse(data, record)) &&
+        (record.isObject()) &&
+        (record["avs"].isArray()) &&
+        (record["expires"].isIntegral()))
+    {
+      expires = (time_t)record["expires"].asInt64();
+      if (expires > time(NULL))
+      {
+        avs = record["avs"];
+      }
+    }
+    else
+    {
+      LOG_DEBUG("Failed to parse prefetched AVs for %s", key.c_str());
+    }
+  }
+
+  return status;
+}
+
+Store::Status AvStore::set_prefetched_list(const std::string& key,
+                                           const Json::Value& avs,
+                                           time_t expires,
+                                           uint64_t cas,
+                                           SAS::TrailId trail)
+{
+  // The record carries its absolute expiry time, so popping a vector
+  // doesn't extend the lifetime of the rest of the batch.
+  int expiry = (int)(expires - time(NULL));
+  if (expiry < 1)
+  {
+    expiry = 1;
+  }
+
+  Json::Value record;
+  record["expires"] = (Json::Int64)expires;
+  record["avs"] = avs;
+  Json::FastWriter writer;
+  return _data_store->set_data("av_prefetch", key, writer.write(record), cas, expiry, trail);
+}
+
 void correlate_branch_from_av(Json::Value* av, SAS::TrailId trail)
 {
   Json::Value null_json;
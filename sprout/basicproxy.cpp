@@ -446,7 +446,6 @@ BasicProxy::UASTsx::~UASTsx()
   pj_assert(_context_count == 0);
 
   cancel_trying_timer();
-  pthread_mutex_destroy(&_trying_timer_lock);
 
   if (_tsx != NULL)
   {
@@ -510,9 +509,10 @@ pj_status_t BasicProxy::UASTsx::init(pjsip_rx_data* rdata)
   _trail = get_trail(rdata);
 
   // initialise deferred trying timer
-  pthread_mutex_init(&_trying_timer_lock, NULL);
-  pj_timer_entry_init(&_trying_timer, 0, (void*)this, &trying_timer_callback);
+  _trying_timer.user_data = (void*)this;
+  _trying_timer.cb = &trying_timer_callback;
   _trying_timer.id = 0;
+  _trying_timer_state = 0;
 
   // Do any start of transaction logging operations.
   on_tsx_start(rdata);
@@ -567,9 +567,9 @@ pj_status_t BasicProxy::UASTsx::init(pjsip_rx_data* rdata)
       // Send the 100 Trying after 3.5 secs if a final response hasn't been
       // sent.
       _trying_timer.id = TRYING_TIMER;
-      pj_time_val delay = {(PJSIP_T2_TIMEOUT - PJSIP_T1_TIMEOUT) / 1000,
-                           (PJSIP_T2_TIMEOUT - PJSIP_T1_TIMEOUT) % 1000 };
-      pjsip_endpt_schedule_timer(stack_data.endpt, &(_trying_timer), &delay);
+      _trying_timer_state = TRYING_TIMER;
+      stack_data.timer_wheel->schedule(&_trying_timer,
+                                       PJSIP_T2_TIMEOUT - PJSIP_T1_TIMEOUT);
     }
   }
   else
@@ -1419,50 +1419,51 @@ void BasicProxy::UASTsx::exit_context()
 /// Cancel the trying timer.
 void BasicProxy::UASTsx::cancel_trying_timer()
 {
-  pthread_mutex_lock(&_trying_timer_lock);
-
-  if (_trying_timer.id == TRYING_TIMER)
+  int state = TRYING_TIMER;
+  if (_trying_timer_state.compare_exchange_strong(state, 0))
   {
-    // The deferred trying timer is running, so cancel it.
-    _trying_timer.id = 0;
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_trying_timer);
+    // The deferred trying timer is running, so cancel it.  If it pops
+    // before it is cancelled, the pop will find it has been cleared and do
+    // nothing.
+    stack_data.timer_wheel->cancel(&_trying_timer);
   }
-
-  pthread_mutex_unlock(&_trying_timer_lock);
 }
 
 
 /// Handle the trying timer expiring on this transaction.
 void BasicProxy::UASTsx::trying_timer_expired()
 {
-  enter_context();
+  // Claim the timer before entering the transaction's context, so a timer
+  // that has been cancelled doesn't contend for the transaction lock.
+  int state = TRYING_TIMER;
+  if (!_trying_timer_state.compare_exchange_strong(state, 0))
+  {
+    LOG_DEBUG("Trying timer for %s already cancelled", name());
+    return;
+  }
 
-  pthread_mutex_lock(&_trying_timer_lock);
+  enter_context();
 
   LOG_DEBUG("Trying timer expired for %s, transaction state = %s",
             name(),
             (_tsx != NULL) ? pjsip_tsx_state_str(_tsx->state) : "Unknown");
 
-  if ((_trying_timer.id == TRYING_TIMER) &&
-      (_tsx != NULL) &&
+  if ((_tsx != NULL) &&
       (_tsx->state == PJSIP_TSX_STATE_TRYING))
   {
     // Transaction is still in Trying state, so send a 100 Trying response
     // now.
     LOG_DEBUG("Send delayed 100 Trying response");
     send_response(100);
-    _trying_timer.id = 0;
   }
 
-  pthread_mutex_unlock(&_trying_timer_lock);
-
   exit_context();
 }
 
 
-/// Static method called by PJSIP when a trying timer expires.  The instance
-/// is stored in the user_data field of the timer entry.
-void BasicProxy::UASTsx::trying_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+/// Static method called by the timer wheel when a trying timer expires.  The
+/// instance is stored in the user_data field of the timer entry.
+void BasicProxy::UASTsx::trying_timer_callback(TimerWheel::Entry* entry)
 {
   if (entry->id == TRYING_TIMER)
   {
@@ -1483,6 +1484,7 @@ BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
   _tdata(NULL),
   _servers(),
   _current_server(0),
+  _send_time(),
   _cancel_tsx(NULL),
   _timer_c(),
   _trail(0),
@@ -1642,6 +1644,7 @@ void BasicProxy::UACTsx::send_request()
     else
     {
       // Send non-ACK request statefully.
+      pj_gettickcount(&_send_time);
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if (status == PJ_SUCCESS)
@@ -1778,6 +1781,15 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
 
     if (!_servers.empty())
     {
+      if ((event->body.tsx_state.type == PJSIP_EVENT_RX_MSG) &&
+          (event->body.tsx_state.prev_state == PJSIP_TSX_STATE_CALLING) &&
+          (_tsx->status_code != PJSIP_SC_SERVICE_UNAVAILABLE))
+      {
+        // This is the first response from the server, so report how long it
+        // took.
+        PJUtils::report_server_latency(_servers[_current_server], _send_time);
+      }
+
       // Check to see if the destination server has failed so we can blacklist
       // it and retry to an alternative if possible.
       if ((_tsx->state == PJSIP_TSX_STATE_TERMINATED) &&
@@ -1799,6 +1811,7 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
         // as it may indicated a transient overload condition, but we can
         // retry to an alternate server if one is available.
         LOG_DEBUG("Server return 503 error");
+        PJUtils::report_server_overload(_servers[_current_server]);
         retrying = retry_request();
       }
     }
@@ -1959,6 +1972,7 @@ bool BasicProxy::UACTsx::retry_request()
       // Copy across the destination information for a retry and try to
       // resend the request.
       PJUtils::set_dest_info(_tdata, _servers[_current_server]);
+      pj_gettickcount(&_send_time);
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if (status == PJ_SUCCESS)
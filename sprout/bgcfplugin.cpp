@@ -93,8 +93,8 @@ std::list<Sproutlet*> BGCFPlugin::load(struct options& opt)
     _bgcf_service = new BgcfService();
 
     // Create the BGCF ACR factory.
-    _acr_factory = (ralf_connection != NULL) ?
-                       (ACRFactory*)new RalfACRFactory(ralf_connection, BGCF) :
+    _acr_factory = (ralf_queue != NULL) ?
+                       (ACRFactory*)new RalfACRFactory(ralf_queue, BGCF) :
                        new ACRFactory();
 
     // Create the Sproutlet.
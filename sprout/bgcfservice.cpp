@@ -39,6 +39,8 @@
 #include <json/reader.h>
 #include <fstream>
 #include <stdlib.h>
+#include <strings.h>
+#include <algorithm>
 
 #include "bgcfservice.h"
 #include "log.h"
@@ -46,14 +48,34 @@
 #include "sproutsasevent.h"
 
 BgcfService::BgcfService(std::string configuration) :
+  _routes(new RouteTable()),
   _configuration(configuration),
   _updater(NULL)
 {
+  pthread_rwlock_init(&_routes_lock, NULL);
+
   // Create an updater to keep the bgcf routes configured appropriately.
   _updater = new Updater<void, BgcfService>(this, std::mem_fun(&BgcfService::update_routes));
 }
 
 void BgcfService::update_routes()
+{
+  RouteTable* routes = read_routes();
+
+  if (routes != NULL)
+  {
+    LOG_STATUS("Loaded %d BGCF routes", (int)routes->size());
+    std::shared_ptr<RouteTable> new_routes(routes);
+
+    // Swap the new routes in.  The old ones are deleted when the last
+    // lookup using them releases its reference, outside the lock.
+    pthread_rwlock_wrlock(&_routes_lock);
+    _routes.swap(new_routes);
+    pthread_rwlock_unlock(&_routes_lock);
+  }
+}
+
+BgcfService::RouteTable* BgcfService::read_routes() const
 {
   Json::Value root;
   Json::Reader reader;
@@ -69,71 +91,71 @@ void BgcfService::update_routes()
   {
     LOG_STATUS("No BGCF configuration (file %s does not exist)",
                _configuration.c_str());
-    return;
+    return NULL;
   }
 
   LOG_STATUS("Loading BGCF configuration from %s", _configuration.c_str());
 
-  std::map<std::string, std::vector<std::string>> new_routes;
-
   file.open(_configuration.c_str());
-  if (file.is_open())
+  if (!file.is_open())
   {
-    if (!reader.parse(file, root))
-    {
-      LOG_WARNING("Failed to read BGCF configuration data, %s",
-                  reader.getFormattedErrorMessages().c_str());
-      return;
-    }
+    //LCOV_EXCL_START
+    LOG_WARNING("Failed to read BGCF configuration data %d", file.rdstate());
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
 
-    file.close();
+  if (!reader.parse(file, root))
+  {
+    LOG_WARNING("Failed to read BGCF configuration data, %s",
+                reader.getFormattedErrorMessages().c_str());
+    return NULL;
+  }
 
-    if (root["routes"].isArray())
+  file.close();
+
+  if (!root["routes"].isArray())
+  {
+    LOG_WARNING("Badly formed BGCF configuration file - missing routes object");
+    return NULL;
+  }
+
+  RouteTable* routes = new RouteTable();
+  Json::Value routes_json = root["routes"];
+
+  for (size_t ii = 0; ii < routes_json.size(); ++ii)
+  {
+    Json::Value route_json = routes_json[(int)ii];
+    if ((route_json["domain"].isString()) &&
+        (route_json["route"].isArray()))
     {
-      Json::Value routes = root["routes"];
+      Route* route = new Route;
+      Json::Value route_vals = route_json["route"];
+      route->domain = route_json["domain"].asString();
 
-      for (size_t ii = 0; ii < routes.size(); ++ii)
+      LOG_DEBUG("Add route for %s", route->domain.c_str());
+
+      for (size_t jj = 0; jj < route_vals.size(); ++jj)
       {
-        Json::Value route = routes[(int)ii];
-        if ((route["domain"].isString()) &&
-            (route["route"].isArray()))
-        {
-          std::vector<std::string> route_vec;
-          Json::Value route_vals = route["route"];
-          std::string domain = route["domain"].asString();
-
-          LOG_DEBUG("Add route for %s", domain.c_str());
-
-          for (size_t jj = 0; jj < route_vals.size(); ++jj)
-          {
-            Json::Value route_val = route_vals[(int)jj];
-            std::string route_uri = route_val.asString();
-            LOG_DEBUG("  %s", route_uri.c_str());
-            route_vec.push_back(route_uri);
-          }
-
-          new_routes.insert(std::make_pair(domain, route_vec));
-          route_vec.clear();
-        }
-        else
-        {
-          LOG_WARNING("Badly formed BGCF route entry %s", route.toStyledString().c_str());
-        }
+        Json::Value route_val = route_vals[(int)jj];
+        std::string route_uri = route_val.asString();
+        LOG_DEBUG("  %s", route_uri.c_str());
+        route->route.push_back(route_uri);
+        route->route_string.append(route_uri).append(";");
       }
 
-      _routes = new_routes;
+      if (!routes->insert(route))
+      {
+        LOG_WARNING("Duplicate BGCF route entry %s", route_json.toStyledString().c_str());
+      }
     }
     else
     {
-      LOG_WARNING("Badly formed BGCF configuration file - missing routes object");
+      LOG_WARNING("Badly formed BGCF route entry %s", route_json.toStyledString().c_str());
     }
   }
-  else
-  {
-    //LCOV_EXCL_START
-    LOG_WARNING("Failed to read BGCF configuration data %d", file.rdstate());
-    //LCOV_EXCL_STOP
-  }
+
+  return routes;
 }
 
 BgcfService::~BgcfService()
@@ -141,6 +163,8 @@ BgcfService::~BgcfService()
   // Destroy the updater (if it was created).
   delete _updater;
   _updater = NULL;
+
+  pthread_rwlock_destroy(&_routes_lock);
 }
 
 std::vector<std::string> BgcfService::get_route(const std::string &domain,
@@ -148,46 +172,39 @@ std::vector<std::string> BgcfService::get_route(const std::string &domain,
 {
   LOG_DEBUG("Getting route for URI domain %s via BGCF lookup", domain.c_str());
 
-  // First try the specified domain.
-  std::map<std::string, std::vector<std::string>>::const_iterator i = _routes.find(domain);
-  if (i != _routes.end())
+  // Hold a reference to the routes until the lookup is complete, in case
+  // they are updated in the meantime.
+  std::shared_ptr<RouteTable> routes;
+  pthread_rwlock_rdlock(&_routes_lock);
+  routes = _routes;
+  pthread_rwlock_unlock(&_routes_lock);
+
+  // First try the specified domain and its parent domains.
+  const Route* route = routes->longest_match(domain);
+  if (route != NULL)
   {
-    LOG_INFO("Found route to domain %s", domain.c_str());
+    LOG_INFO("Found route to domain %s using %s", domain.c_str(), route->domain.c_str());
 
     SAS::Event event(trail, SASEvent::BGCF_FOUND_ROUTE, 0);
     event.add_var_param(domain);
-    std::string route_string;
-
-    for (std::vector<std::string>::const_iterator ii = i->second.begin(); ii != i->second.end(); ++ii)
-    {
-      route_string = route_string + *ii + ";";
-    }
-
-    event.add_var_param(route_string);
+    event.add_var_param(route->route_string);
     SAS::report_event(event);
 
-    return i->second;
+    return route->route;
   }
 
   // Then try the default domain (*).
-  i = _routes.find("*");
-  if (i != _routes.end())
+  route = routes->default_route();
+  if (route != NULL)
   {
     LOG_INFO("Found default route");
 
     SAS::Event event(trail, SASEvent::BGCF_DEFAULT_ROUTE, 0);
     event.add_var_param(domain);
-    std::string route_string;
-
-    for (std::vector<std::string>::const_iterator ii = i->second.begin(); ii != i->second.end(); ++ii)
-    {
-      route_string = route_string + *ii + ";";
-    }
-
-    event.add_var_param(route_string);
+    event.add_var_param(route->route_string);
     SAS::report_event(event);
 
-    return i->second;
+    return route->route;
   }
 
   SAS::Event event(trail, SASEvent::BGCF_NO_ROUTE, 0);
@@ -196,3 +213,153 @@ std::vector<std::string> BgcfService::get_route(const std::string &domain,
 
   return std::vector<std::string>();
 }
+
+BgcfService::RouteTable::RouteTable() :
+  _nodes(1),
+  _routes(),
+  _default_route(NULL)
+{
+}
+
+BgcfService::RouteTable::~RouteTable()
+{
+  for (std::vector<Route*>::iterator it = _routes.begin();
+       it != _routes.end();
+       ++it)
+  {
+    delete *it;
+  }
+}
+
+/// Compares a label in the table with a label in a domain, ignoring case.
+int BgcfService::RouteTable::compare_label(const std::string& label,
+                                           const char* str,
+                                           size_t len)
+{
+  int rc = strncasecmp(label.data(), str, std::min(label.length(), len));
+  if (rc == 0)
+  {
+    rc = (label.length() < len) ? -1 : ((label.length() > len) ? 1 : 0);
+  }
+  return rc;
+}
+
+/// Returns the position of the first child of the node whose label isn't
+/// less than the specified label.
+size_t BgcfService::RouteTable::find_child(const Node& node,
+                                           const char* label,
+                                           size_t len)
+{
+  size_t lo = 0;
+  size_t hi = node.children.size();
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (compare_label(node.children[mid].first, label, len) < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+bool BgcfService::RouteTable::insert(Route* route)
+{
+  if (route->domain == "*")
+  {
+    if (_default_route != NULL)
+    {
+      delete route;
+      return false;
+    }
+    _default_route = route;
+    _routes.push_back(route);
+    return true;
+  }
+
+  // Walk down the trie from the last label of the domain, adding nodes as
+  // required.
+  const std::string& domain = route->domain;
+  uint32_t node = 0;
+  size_t end = domain.length();
+  bool done = false;
+
+  while (!done)
+  {
+    size_t dot = (end > 0) ? domain.rfind('.', end - 1) : std::string::npos;
+    size_t start = (dot == std::string::npos) ? 0 : dot + 1;
+    const char* label = domain.data() + start;
+    size_t len = end - start;
+
+    size_t pos = find_child(_nodes[node], label, len);
+    if ((pos < _nodes[node].children.size()) &&
+        (compare_label(_nodes[node].children[pos].first, label, len) == 0))
+    {
+      node = _nodes[node].children[pos].second;
+    }
+    else
+    {
+      // Note that this may reallocate the vector, so look the node up by
+      // index again rather than keeping a reference to it.
+      uint32_t child = _nodes.size();
+      _nodes.push_back(Node());
+      _nodes[node].children.insert(_nodes[node].children.begin() + pos,
+                                   Child(std::string(label, len), child));
+      node = child;
+    }
+
+    done = (dot == std::string::npos);
+    end = dot;
+  }
+
+  if (_nodes[node].route != NULL)
+  {
+    delete route;
+    return false;
+  }
+
+  _nodes[node].route = route;
+  _routes.push_back(route);
+  return true;
+}
+
+const BgcfService::Route* BgcfService::RouteTable::longest_match(const std::string& domain) const
+{
+  const Route* match = NULL;
+  uint32_t node = 0;
+  size_t end = domain.length();
+
+  while (true)
+  {
+    size_t dot = (end > 0) ? domain.rfind('.', end - 1) : std::string::npos;
+    size_t start = (dot == std::string::npos) ? 0 : dot + 1;
+    const char* label = domain.data() + start;
+    size_t len = end - start;
+
+    const Node& parent = _nodes[node];
+    size_t pos = find_child(parent, label, len);
+    if ((pos == parent.children.size()) ||
+        (compare_label(parent.children[pos].first, label, len) != 0))
+    {
+      break;
+    }
+
+    node = parent.children[pos].second;
+    if (_nodes[node].route != NULL)
+    {
+      match = _nodes[node].route;
+    }
+
+    if (dot == std::string::npos)
+    {
+      break;
+    }
+    end = dot;
+  }
+
+  return match;
+}
@@ -522,7 +522,6 @@ CallServices::Terminating::Terminating(CallServices* callServices,
   }
 
   // Set up the no-reply timer.
-  memset(&_no_reply_timer, 0, sizeof(pj_timer_entry));
   _no_reply_timer.user_data = this;
   _no_reply_timer.cb = no_reply_timer_pop;
 }
@@ -531,7 +530,7 @@ CallServices::Terminating::~Terminating()
 {
   if (_no_reply_timer.id != 0)
   {
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_no_reply_timer);
+    stack_data.timer_wheel->cancel(&_no_reply_timer);
     _no_reply_timer.id = 0;
   }
 
@@ -581,15 +580,8 @@ bool CallServices::Terminating::on_response(pjsip_msg *msg)
         {
           // We found a suitable rule.  Start the no-reply timer.
           _no_reply_timer.id = 1;
-          pj_time_val delay;
-          delay.sec = _user_services->cdiv_no_reply_timer();
-          delay.msec = 0;
-          pj_status_t status = pjsip_endpt_schedule_timer(stack_data.endpt, &_no_reply_timer, &delay);
-          if (status != PJ_SUCCESS)
-          {
-            // Log this failure, but don't fail the call - there's no point.
-            LOG_WARNING("Failed to set no-reply timer - status %d", status);
-          }
+          stack_data.timer_wheel->schedule(&_no_reply_timer,
+                                           _user_services->cdiv_no_reply_timer() * 1000);
           break;
         }
       }
@@ -617,7 +609,7 @@ bool CallServices::Terminating::on_final_response(pjsip_tx_data *tx_data)
   // We've got a final response, so there's no point in running the no-reply timer any longer.
   if (_no_reply_timer.id != 0)
   {
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_no_reply_timer);
+    stack_data.timer_wheel->cancel(&_no_reply_timer);
     _no_reply_timer.id = 0;
   }
 
@@ -837,7 +829,7 @@ void CallServices::Terminating::no_reply_timer_pop()
 // Handles the no-reply timer popping.
 //
 // This is just a wrapper for the member function.
-void CallServices::Terminating::no_reply_timer_pop(pj_timer_heap_t *timer_heap, pj_timer_entry *entry)
+void CallServices::Terminating::no_reply_timer_pop(TimerWheel::Entry* entry)
 {
   ((CallServices::Terminating *)entry->user_data)->no_reply_timer_pop();
 }
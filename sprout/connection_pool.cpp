@@ -40,6 +40,7 @@ extern "C" {
 #include <pjlib.h>
 }
 #include <unistd.h>
+#include <sched.h>
 
 // Common STL includes.
 #include <cassert>
@@ -50,6 +51,7 @@ extern "C" {
 #include "pjutils.h"
 #include "connection_pool.h"
 
+__thread unsigned int ConnectionPool::_seed = 0;
 
 ConnectionPool::ConnectionPool(pjsip_host_port* target,
                                int num_connections,
@@ -68,13 +70,13 @@ ConnectionPool::ConnectionPool(pjsip_host_port* target,
   _recycler(NULL),
   _terminated(false),
   _active_connections(0),
+  _tp_hash(num_connections),
   _statistic("connected_sprouts", lvc)
 {
   LOG_STATUS("Creating connection pool to %.*s:%d", _target.host.slen, _target.host.ptr, _target.port);
   LOG_STATUS("  connections = %d, recycle time = %d +/- %d seconds", _num_connections, _recycle_period, _recycle_margin);
 
   pthread_mutex_init(&_tp_hash_lock, NULL);
-  _tp_hash.resize(_num_connections);
 
   report_sprout_counts();
 }
@@ -125,37 +127,92 @@ pjsip_transport* ConnectionPool::get_connection()
 {
   pjsip_transport* tp = NULL;
 
-  pthread_mutex_lock(&_tp_hash_lock);
-
   if (_active_connections > 0)
   {
-    // Select a transport by starting at a random point in the hash and
-    // stepping through the hash until a connected entry is found.
-    int start_slot = rand() % _num_connections;
-    int ii = start_slot;
-    while (!_tp_hash[ii].connected)
+    // Pick two connections at random and use the one with fewer references
+    // to its transport.  Each transaction in progress on a connection holds
+    // a reference, so this favours the less loaded connection, which
+    // balances the load across the upstream nodes better than picking one
+    // connection at random.
+    tp = acquire_connection(random_slot());
+    pjsip_transport* alt_tp = acquire_connection(random_slot());
+
+    if (tp == NULL)
     {
-      ii = (ii + 1) % _num_connections;
-      if (ii == start_slot)
+      tp = alt_tp;
+    }
+    else if (alt_tp != NULL)
+    {
+      if (pj_atomic_get(alt_tp->ref_cnt) < pj_atomic_get(tp->ref_cnt))
       {
-        break;
+        std::swap(tp, alt_tp);
       }
+      pjsip_transport_dec_ref(alt_tp);
     }
+  }
 
-    tp = _tp_hash[ii].tp;
+  return tp;
+}
 
+
+/// Finds a connected transport by starting at the specified slot and
+/// stepping through the hash until a connected entry is found, and adds a
+/// reference to it.  The reference must be decremented once again when the
+/// transport is set on the message.
+pjsip_transport* ConnectionPool::acquire_connection(int start_slot)
+{
+  int ii = start_slot;
+
+  do
+  {
+    tp_hash_slot& slot = _tp_hash[ii];
+
+    // Register as a reader of the slot so the transport can't be released
+    // between reading it and adding the reference.
+    ++slot.readers;
+    pjsip_transport* tp = slot.connected_tp;
     if (tp != NULL)
     {
-      // Add a reference to the transport to make sure it is not destroyed.
-      // The reference must be decremented once again when the transport is set
-      // on the message.
       pjsip_transport_add_ref(tp);
     }
+    --slot.readers;
+
+    if (tp != NULL)
+    {
+      return tp;
+    }
+
+    ii = (ii + 1) % _num_connections;
   }
+  while (ii != start_slot);
 
-  pthread_mutex_unlock(&_tp_hash_lock);
+  return NULL;
+}
 
-  return tp;
+
+/// Stops get_connection picking the connection in the specified slot, and
+/// waits for any get_connection calls that have already read the slot to
+/// take their references.  Once this returns our reference to the transport
+/// can be released.
+void ConnectionPool::disconnect_slot(int hash_slot)
+{
+  _tp_hash[hash_slot].connected_tp = NULL;
+
+  while (_tp_hash[hash_slot].readers != 0)
+  {
+    sched_yield();
+  }
+}
+
+
+int ConnectionPool::random_slot()
+{
+  if (_seed == 0)
+  {
+    _seed = time(NULL) ^ (unsigned int)pthread_self();
+  }
+
+  return rand_r(&_seed) % _num_connections;
 }
 
 
@@ -258,7 +315,6 @@ pj_status_t ConnectionPool::create_connection(int hash_slot)
   pthread_mutex_lock(&_tp_hash_lock);
   _tp_hash[hash_slot].tp = tp;
   _tp_hash[hash_slot].listener_key = key;
-  _tp_hash[hash_slot].connected = PJ_FALSE;
   _tp_map[tp] = hash_slot;
 
   // Don't increment the connection count here, wait until we get confirmation
@@ -277,11 +333,12 @@ void ConnectionPool::quiesce_connection(int hash_slot)
 
   if (tp != NULL)
   {
-    if (_tp_hash[hash_slot].connected)
+    if (_tp_hash[hash_slot].connected_tp != NULL)
     {
       // Connection was established, so update statistics.
       --_active_connections;
       decrement_connection_count(tp);
+      disconnect_slot(hash_slot);
     }
 
     // Don't listen for any more state changes on this connection.
@@ -292,7 +349,6 @@ void ConnectionPool::quiesce_connection(int hash_slot)
     // Remove the transport from the hash and the map.
     _tp_hash[hash_slot].tp = NULL;
     _tp_hash[hash_slot].listener_key = NULL;
-    _tp_hash[hash_slot].connected = PJ_FALSE;
     _tp_map.erase(tp);
 
     // Release the lock now so we don't have a deadlock if pjsip_transport_shutdown
@@ -333,11 +389,11 @@ void ConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transport
   {
     int hash_slot = i->second;
 
-    if ((state == PJSIP_TP_STATE_CONNECTED) && (!_tp_hash[hash_slot].connected))
+    if ((state == PJSIP_TP_STATE_CONNECTED) &&
+        (_tp_hash[hash_slot].connected_tp == NULL))
     {
       // New connection has connected successfully, so update the statistics.
       LOG_DEBUG("Transport %s in slot %d has connected", tp->obj_name, hash_slot);
-      _tp_hash[hash_slot].connected = PJ_TRUE;
       ++_active_connections;
       increment_connection_count(tp);
 
@@ -354,6 +410,9 @@ void ConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transport
         // Connection recycling is disabled.
         _tp_hash[hash_slot].recycle_time = 0;
       }
+
+      // Make the connection available to get_connection.
+      _tp_hash[hash_slot].connected_tp = tp;
     }
     else if ((state == PJSIP_TP_STATE_DISCONNECTED) ||
              (state == PJSIP_TP_STATE_DESTROYED))
@@ -362,11 +421,12 @@ void ConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transport
       // failed to connect.
       LOG_DEBUG("Transport %s in slot %d has failed", tp->obj_name, hash_slot);
 
-      if (_tp_hash[hash_slot].connected)
+      if (_tp_hash[hash_slot].connected_tp != NULL)
       {
         // A connection has failed, so update the statistics.
         --_active_connections;
         decrement_connection_count(tp);
+        disconnect_slot(hash_slot);
       }
       else
       {
@@ -404,7 +464,6 @@ void ConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transport
       // Remove the transport from the hash and the map.
       _tp_hash[hash_slot].tp = NULL;
       _tp_hash[hash_slot].listener_key = NULL;
-      _tp_hash[hash_slot].connected = PJ_FALSE;
       _tp_map.erase(tp);
 
       // Remove our reference to the transport.
@@ -444,7 +503,7 @@ void ConnectionPool::recycle_connections()
         // This slot is empty, so try to populate it now.
         create_connection(ii);
       }
-      else if ((_tp_hash[ii].connected) &&
+      else if ((_tp_hash[ii].connected_tp != NULL) &&
                (_tp_hash[ii].recycle_time != 0) &&
                (now >= _tp_hash[ii].recycle_time))
       {
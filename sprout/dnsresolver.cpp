@@ -37,6 +37,7 @@
 ///
 
 #include <fstream>
+#include <algorithm>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -54,7 +55,8 @@ DNSResolver::DNSResolver(const struct IP46Address& server) :
                          _trail(0),
                          _domain(""),
                          _status(ARES_SUCCESS),
-                         _naptr_reply(NULL)
+                         _naptr_reply(NULL),
+                         _ttl(0)
 {
   // Set options to ensure we always get a response as quickly as possible -
   // we are on the call path!
@@ -103,18 +105,20 @@ void DNSResolver::destroy(DNSResolver* resolver)
 }
 
 
-int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail)
+int DNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail)
 {
   send_naptr_query(domain, trail);
   wait_for_response();
 
   // Save off the results...
   naptr_reply = _naptr_reply;
+  ttl = _ttl;
   int status = _status;
   // ...and then clear out our state.
   _trail = 0;
   _domain = "";
   _naptr_reply = NULL;
+  _ttl = 0;
   _status = ARES_SUCCESS;
 
   return status;
@@ -244,9 +248,19 @@ void DNSResolver::ares_callback(int status,
     {
       LOG_WARNING("Unparseable DNS ENUM response from host %s: %s", _domain.c_str(), ares_strerror(status));
     }
+    else
+    {
+      _ttl = response_ttl(abuf, alen, false);
+    }
   }
   else
   {
+    if ((status == ARES_ENOTFOUND) && (abuf != NULL))
+    {
+      // NXDOMAIN responses can be cached for the negative TTL.
+      _ttl = response_ttl(abuf, alen, true);
+    }
+
     // Log that we've failed.
     LOG_WARNING("DNS ENUM query failed for host %s: %s", _domain.c_str(), ares_strerror(status));
     SAS::Event event(_trail, SASEvent::RX_ENUM_ERR, 0);
@@ -258,6 +272,80 @@ void DNSResolver::ares_callback(int status,
 }
 
 
+/// Returns the time for which a response may be cached.  For a successful
+/// response this is the lowest TTL of the answer records.  For a negative
+/// response it is the lower of the TTL and minimum TTL of the SOA record in
+/// the authority section (RFC 2308), or 0 if there isn't one.
+int DNSResolver::response_ttl(const unsigned char* abuf, int alen, bool negative)
+{
+  if (alen < NS_HFIXEDSZ)
+  {
+    return 0;
+  }
+
+  int qdcount = (abuf[4] << 8) | abuf[5];
+  int ancount = (abuf[6] << 8) | abuf[7];
+  int nscount = (abuf[8] << 8) | abuf[9];
+  const unsigned char* end = abuf + alen;
+  const unsigned char* p = abuf + NS_HFIXEDSZ;
+  int ttl = -1;
+
+  for (int ii = 0; ii < qdcount + ancount + nscount; ++ii)
+  {
+    // Skip the record name.
+    char* name = NULL;
+    long name_len = 0;
+    if (ares_expand_name(p, abuf, alen, &name, &name_len) != ARES_SUCCESS)
+    {
+      return 0;
+    }
+    ares_free_string(name);
+    p += name_len;
+
+    if (ii < qdcount)
+    {
+      // Questions have just a type and class.
+      p += NS_QFIXEDSZ;
+      continue;
+    }
+
+    if (p + NS_RRFIXEDSZ > end)
+    {
+      return 0;
+    }
+
+    int type = (p[0] << 8) | p[1];
+    int rr_ttl = (int)(((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) |
+                       ((uint32_t)p[6] << 8) | (uint32_t)p[7]);
+    int rdlength = (p[8] << 8) | p[9];
+    p += NS_RRFIXEDSZ;
+
+    if (p + rdlength > end)
+    {
+      return 0;
+    }
+
+    bool answer = (ii < qdcount + ancount);
+    if ((!negative) && (answer) && (type == ns_t_naptr))
+    {
+      ttl = ((ttl == -1) || (rr_ttl < ttl)) ? rr_ttl : ttl;
+    }
+    else if ((negative) && (!answer) && (type == ns_t_soa) && (rdlength >= 4))
+    {
+      // The SOA minimum TTL is the last field of the record.
+      const unsigned char* min = p + rdlength - 4;
+      int min_ttl = (int)(((uint32_t)min[0] << 24) | ((uint32_t)min[1] << 16) |
+                          ((uint32_t)min[2] << 8) | (uint32_t)min[3]);
+      ttl = std::min(rr_ttl, min_ttl);
+    }
+
+    p += rdlength;
+  }
+
+  return std::max(ttl, 0);
+}
+
+
 DNSResolver* DNSResolverFactory::new_resolver(const struct IP46Address& server) const
 {
   return new DNSResolver(server);
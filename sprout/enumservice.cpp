@@ -43,6 +43,7 @@
 #include <arpa/inet.h>
 
 #include "enumservice.h"
+#include "regexcache.h"
 #include "dnsresolver.h"
 #include "utils.h"
 #include "log.h"
@@ -67,16 +68,16 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
   if (match_replace.size() == 2)
   {
     LOG_DEBUG("Split regex into match=%s, replace=%s", match_replace[0].c_str(), match_replace[1].c_str());
-    try
+
+    // Get the compiled expression from the shared cache.  Copying it just
+    // takes a reference to the compiled form.
+    RegexCache::Regex compiled = RegexCache::instance()->get(match_replace[0]);
+    if (compiled != NULL)
     {
-      regex.assign(match_replace[0]);
+      regex = *compiled;
       replace = match_replace[1];
       success = true;
     }
-    catch (...)
-    {
-      success = false;
-    }
   }
   else
   {
@@ -87,7 +88,47 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
 }
 
 
-JSONEnumService::JSONEnumService(std::string configuration)
+JSONEnumService::JSONEnumService(std::string configuration) :
+  _configuration(configuration),
+  _number_prefixes(new PrefixTrie()),
+  _updater(NULL)
+{
+  pthread_rwlock_init(&_number_prefixes_lock, NULL);
+
+  // Create an updater to load the configuration, and reload it on SIGHUP.
+  _updater = new Updater<void, JSONEnumService>(this, std::mem_fun(&JSONEnumService::update_enum));
+}
+
+
+JSONEnumService::~JSONEnumService()
+{
+  // Destroy the updater before the prefixes it updates.
+  delete _updater;
+  _updater = NULL;
+
+  pthread_rwlock_destroy(&_number_prefixes_lock);
+}
+
+
+void JSONEnumService::update_enum()
+{
+  PrefixTrie* prefixes = read_prefixes();
+
+  if (prefixes != NULL)
+  {
+    LOG_STATUS("Loaded %d ENUM number prefixes", (int)prefixes->size());
+    std::shared_ptr<PrefixTrie> new_prefixes(prefixes);
+
+    // Swap the new prefixes in.  The old ones are deleted when the last
+    // lookup using them releases its reference, outside the lock.
+    pthread_rwlock_wrlock(&_number_prefixes_lock);
+    _number_prefixes.swap(new_prefixes);
+    pthread_rwlock_unlock(&_number_prefixes_lock);
+  }
+}
+
+
+JSONEnumService::PrefixTrie* JSONEnumService::read_prefixes() const
 {
   Json::Value root;
   Json::Reader reader;
@@ -97,85 +138,85 @@ JSONEnumService::JSONEnumService(std::string configuration)
 
   // Check whether the file exists.
   struct stat s;
-  if ((stat(configuration.c_str(), &s) != 0) &&
+  if ((stat(_configuration.c_str(), &s) != 0) &&
       (errno == ENOENT))
   {
     LOG_STATUS("No ENUM configuration (file %s does not exist)",
-               configuration.c_str());
-    return;
+               _configuration.c_str());
+    return NULL;
   }
 
-  LOG_STATUS("Loading ENUM configuration from %s", configuration.c_str());
+  LOG_STATUS("Loading ENUM configuration from %s", _configuration.c_str());
 
-  file.open(configuration.c_str());
-  if (file.is_open())
+  file.open(_configuration.c_str());
+  if (!file.is_open())
   {
-    if (!reader.parse(file, root))
-    {
-      LOG_WARNING("Failed to read ENUM configuration data\n%s",
-                  reader.getFormattedErrorMessages().c_str());
-      return;
-    }
-    file.close();
+    //LCOV_EXCL_START
+    LOG_WARNING("Failed to read ENUM configuration data %d", file.rdstate());
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
 
-    if (root["number_blocks"].isArray())
-    {
-      Json::Value number_blocks = root["number_blocks"];
+  if (!reader.parse(file, root))
+  {
+    LOG_WARNING("Failed to read ENUM configuration data\n%s",
+                reader.getFormattedErrorMessages().c_str());
+    return NULL;
+  }
+  file.close();
 
-      for (unsigned int i = 0; i < number_blocks.size(); i++)
+  PrefixTrie* prefixes = new PrefixTrie();
+
+  if (root["number_blocks"].isArray())
+  {
+    Json::Value number_blocks = root["number_blocks"];
+
+    for (unsigned int i = 0; i < number_blocks.size(); i++)
+    {
+      Json::Value nb = number_blocks[i];
+      if ((nb["prefix"].isString()) &&
+          (nb["regex"].isString()))
       {
-        Json::Value nb = number_blocks[i];
-        if ((nb["prefix"].isString()) &&
-            (nb["regex"].isString()))
-        {
-          // Entry is well-formed, so add it.
-          LOG_DEBUG("Found valid number prefix block %s", nb["prefix"].asString().c_str());
-          NumberPrefix *pfix = new NumberPrefix;
-          pfix->prefix = nb["prefix"].asString();
-          std::string regex = nb["regex"].asString();
+        // Entry is well-formed, so add it.
+        LOG_DEBUG("Found valid number prefix block %s", nb["prefix"].asString().c_str());
+        NumberPrefix *pfix = new NumberPrefix;
+        pfix->prefix = nb["prefix"].asString();
+        std::string regex = nb["regex"].asString();
 
-          if (parse_regex_replace(regex, pfix->match, pfix->replace))
+        if (parse_regex_replace(regex, pfix->match, pfix->replace))
+        {
+          std::string prefix = pfix->prefix;
+          if (prefixes->insert(pfix))
           {
-            _number_prefixes.push_back(pfix);
             LOG_STATUS("  Adding number prefix %d, %s, regex=%s",
-                       i, pfix->prefix.c_str(), regex.c_str());
+                       i, prefix.c_str(), regex.c_str());
           }
           else
           {
-            LOG_WARNING("Badly formed regular expression in ENUM number block %s",
+            LOG_WARNING("Invalid or duplicate prefix in ENUM number block %s",
                         nb.toStyledString().c_str());
-            delete pfix;
           }
         }
         else
         {
-          // Badly formed number block.
-          LOG_WARNING("Badly formed ENUM number block %s", nb.toStyledString().c_str());
+          LOG_WARNING("Badly formed regular expression in ENUM number block %s",
+                      nb.toStyledString().c_str());
+          delete pfix;
         }
       }
-    }
-    else
-    {
-      LOG_WARNING("Badly formed ENUM configuration data - missing number_blocks object");
+      else
+      {
+        // Badly formed number block.
+        LOG_WARNING("Badly formed ENUM number block %s", nb.toStyledString().c_str());
+      }
     }
   }
   else
   {
-    //LCOV_EXCL_START
-    LOG_WARNING("Failed to read ENUM configuration data %d", file.rdstate());
-    //LCOV_EXCL_STOP
+    LOG_WARNING("Badly formed ENUM configuration data - missing number_blocks object");
   }
-}
-
 
-JSONEnumService::~JSONEnumService()
-{
-  for (std::list<struct NumberPrefix*>::iterator it = _number_prefixes.begin();
-       it != _number_prefixes.end();
-       it++)
-  {
-    delete *it;
-  }
+  return prefixes;
 }
 
 
@@ -191,8 +232,11 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
     return std::string();
   }
 
+  // Hold a reference to the prefixes until the lookup is complete, in case
+  // they are updated in the meantime.
+  std::shared_ptr<PrefixTrie> prefixes;
   std::string aus = user_to_aus(user);
-  struct NumberPrefix* pfix = prefix_match(aus);
+  const NumberPrefix* pfix = prefix_match(aus, prefixes);
 
   if (pfix == NULL)
   {
@@ -219,30 +263,121 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 }
 
 
-JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(const std::string& number) const
+const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(const std::string& number,
+                                                                   std::shared_ptr<PrefixTrie>& prefixes) const
 {
-  // For simplicity this uses a linear scan since we don't expect too many
-  // entries.  Should shift to a radix tree at some point.
-  for (std::list<struct NumberPrefix*>::const_iterator it = _number_prefixes.begin();
-       it != _number_prefixes.end();
-       it++)
+  pthread_rwlock_rdlock(&_number_prefixes_lock);
+  prefixes = _number_prefixes;
+  pthread_rwlock_unlock(&_number_prefixes_lock);
+
+  const NumberPrefix* pfix = prefixes->longest_match(number);
+
+  if (pfix != NULL)
   {
-    int len = std::min(number.size(), (*it)->prefix.size());
+    LOG_DEBUG("Number %s matches prefix %s", number.c_str(), pfix->prefix.c_str());
+  }
 
-    LOG_DEBUG("Comparing first %d numbers of %s against prefix %s",
-              len, number.c_str(), (*it)->prefix.c_str());
+  return pfix;
+}
 
-    if (number.compare(0, len, (*it)->prefix, 0, len) == 0)
+
+JSONEnumService::PrefixTrie::PrefixTrie() :
+  _nodes(1),
+  _prefixes()
+{
+}
+
+
+JSONEnumService::PrefixTrie::~PrefixTrie()
+{
+  for (std::vector<NumberPrefix*>::iterator it = _prefixes.begin();
+       it != _prefixes.end();
+       ++it)
+  {
+    delete *it;
+  }
+}
+
+
+/// Maps a character in a number to a child index, or -1 if it can't appear
+/// in a number.
+int JSONEnumService::PrefixTrie::symbol(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+  {
+    return c - '0';
+  }
+  else if (c == '+')
+  {
+    return 10;
+  }
+
+  return -1;
+}
+
+
+bool JSONEnumService::PrefixTrie::insert(NumberPrefix* pfix)
+{
+  // Check the prefix before adding any nodes for it.
+  for (size_t ii = 0; ii < pfix->prefix.length(); ++ii)
+  {
+    if (symbol(pfix->prefix[ii]) < 0)
+    {
+      delete pfix;
+      return false;
+    }
+  }
+
+  uint32_t node = 0;
+  for (size_t ii = 0; ii < pfix->prefix.length(); ++ii)
+  {
+    int sym = symbol(pfix->prefix[ii]);
+    uint32_t child = _nodes[node].children[sym];
+    if (child == 0)
     {
-      // Found a match, so return it (at the moment we assume the entries are
-      // ordered with most specific matches first so we can stop as soon as we
-      // have one match).
-      LOG_DEBUG("Match found");
-      return *it;
+      // Note that this may reallocate the vector, so look the node up by
+      // index again rather than keeping a reference to it.
+      child = _nodes.size();
+      _nodes.push_back(Node());
+      _nodes[node].children[sym] = child;
     }
+    node = child;
+  }
+
+  if (_nodes[node].prefix != NULL)
+  {
+    // Keep the first entry for a prefix.
+    delete pfix;
+    return false;
   }
 
-  return NULL;
+  _nodes[node].prefix = pfix;
+  _prefixes.push_back(pfix);
+  return true;
+}
+
+
+const JSONEnumService::NumberPrefix* JSONEnumService::PrefixTrie::longest_match(const std::string& number) const
+{
+  const Node* node = &_nodes[0];
+  const NumberPrefix* match = node->prefix;
+
+  for (size_t ii = 0; ii < number.length(); ++ii)
+  {
+    int sym = symbol(number[ii]);
+    if ((sym < 0) || (node->children[sym] == 0))
+    {
+      break;
+    }
+
+    node = &_nodes[node->children[sym]];
+    if (node->prefix != NULL)
+    {
+      match = node->prefix;
+    }
+  }
+
+  return match;
 }
 
 
@@ -250,7 +385,9 @@ DNSEnumService::DNSEnumService(const std::string& dns_server,
                                const std::string& dns_suffix,
                                const DNSResolverFactory* resolver_factory) :
                                _dns_suffix(dns_suffix),
-                               _resolver_factory(resolver_factory)
+                               _resolver_factory(resolver_factory),
+                               _result_cache(MAX_CACHE_ENTRIES),
+                               _rule_cache(MAX_CACHE_ENTRIES)
 {
   // Initialize the ares library.  This might have already been done by curl
   // but it's safe to do it twice.
@@ -313,71 +450,91 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
   // expressions.
   std::string aus = user_to_aus(user);
   std::string string = aus;
-  // Get the resolver to use.  This comes from thread-local data.
-  DNSResolver* resolver = get_resolver();
-  // Spin round until we've finished (successfully or otherwise) or we've done
-  // the maximum number of queries.
   bool complete = false;
-  bool failed = false;
-  int dns_queries = 0;
-  while ((!complete) &&
-         (!failed) &&
-         (dns_queries < MAX_DNS_QUERIES))
-  {
-    // Translate the key into a domain and issue a query for it.
-    std::string domain = key_to_domain(string);
-    struct ares_naptr_reply* naptr_reply = NULL;
-    int status = resolver->perform_naptr_query(domain, naptr_reply, trail);
-    if (status == ARES_SUCCESS)
+
+  if (_result_cache.get(aus, string))
+  {
+    // We've translated this number recently (an empty result means the
+    // translation failed).
+    LOG_DEBUG("Found cached ENUM result for %s", aus.c_str());
+    complete = !string.empty();
+  }
+  else
+  {
+    // Spin round until we've finished (successfully or otherwise) or we've
+    // done the maximum number of queries.  The result can be cached for as
+    // long as all the records used are valid, unless something went wrong
+    // other than the records not matching.
+    bool failed = false;
+    bool cacheable = true;
+    int result_ttl = -1;
+    int dns_queries = 0;
+    while ((!complete) &&
+           (!failed) &&
+           (dns_queries < MAX_DNS_QUERIES))
     {
-      // Parse the reply into a sorted list of rules.
-      std::vector<Rule> rules;
-      parse_naptr_reply(naptr_reply, rules);
-      // Now spin through the rules, looking for the first match.
-      std::vector<DNSEnumService::Rule>::const_iterator rule;
-      for (rule = rules.begin();
-           rule != rules.end();
-           ++rule)
+      // Translate the key into a domain and get the rules for it.
+      std::string domain = key_to_domain(string);
+      RuleList rules;
+      int ttl = 0;
+      if (get_rules(domain, rules, ttl, trail))
+      {
+        result_ttl = ((result_ttl == -1) || (ttl < result_ttl)) ? ttl : result_ttl;
+      }
+      else
       {
-        if (rule->matches(string))
+        // Our DNS query failed.  Give up.
+        failed = true;
+        cacheable = false;
+      }
+
+      if (rules != NULL)
+      {
+        // Now spin through the rules, looking for the first match.
+        std::vector<DNSEnumService::Rule>::const_iterator rule;
+        for (rule = rules->begin();
+             rule != rules->end();
+             ++rule)
         {
-          // We found a match, so apply the regular expression to the AUS (not
-          // the previous string - this is what ENUM mandates).  If this was a
-          // terminal rule, we now have a SIP URI and we're finished.
-          // Otherwise, the output of the regular expression is used as the
-          // next key.
-          try
+          if (rule->matches(string))
           {
-            string = rule->replace(aus, trail);
-            complete = rule->is_terminal();
+            // We found a match, so apply the regular expression to the AUS
+            // (not the previous string - this is what ENUM mandates).  If this
+            // was a terminal rule, we now have a SIP URI and we're finished.
+            // Otherwise, the output of the regular expression is used as the
+            // next key.
+            try
+            {
+              string = rule->replace(aus, trail);
+              complete = rule->is_terminal();
+            }
+            catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
+            {
+              LOG_ERROR("Failed to translate number with regex");
+              failed = true;
+              cacheable = false;
+              // LCOV_EXCL_STOP
+            }
+            break;
           }
-          catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
-          {
-            LOG_ERROR("Failed to translate number with regex");
-            failed = true;
-            // LCOV_EXCL_STOP
-          }
-          break;
         }
+        // If we didn't find a match (and so hit the end of the list), consider
+        // this a failure.
+        failed = failed || (rule == rules->end());
       }
-      // If we didn't find a match (and so hit the end of the list), consider
-      // this a failure.
-      failed = failed || (rule == rules.end());
-    }
-    else
-    {
-      // Our DNS query failed.  Give up.
-      failed = true;
+      else
+      {
+        // The domain doesn't exist.
+        failed = true;
+      }
+
+      dns_queries++;
     }
 
-    // Free off the NAPTR reply if we have one.
-    if (naptr_reply != NULL)
+    if (cacheable)
     {
-      resolver->free_naptr_reply(naptr_reply);
-      naptr_reply = NULL;
+      _result_cache.put(aus, complete ? string : std::string(""), result_ttl);
     }
-
-    dns_queries++;
   }
 
   // Log that we've finished processing (and whether it was successful or not).
@@ -403,6 +560,52 @@ std::string DNSEnumService::lookup_uri_from_user(const std::string& user, SAS::T
 }
 
 
+bool DNSEnumService::get_rules(const std::string& domain,
+                               RuleList& rules,
+                               int& ttl,
+                               SAS::TrailId trail) const
+{
+  if (_rule_cache.get(domain, rules, ttl))
+  {
+    LOG_DEBUG("Found cached NAPTR records for %s", domain.c_str());
+    return true;
+  }
+
+  // Get the resolver to use.  This comes from thread-local data.
+  DNSResolver* resolver = get_resolver();
+  struct ares_naptr_reply* naptr_reply = NULL;
+  int status = resolver->perform_naptr_query(domain, naptr_reply, ttl, trail);
+  bool success = true;
+
+  if (status == ARES_SUCCESS)
+  {
+    // Parse the reply into a sorted list of rules.
+    std::vector<Rule>* parsed_rules = new std::vector<Rule>();
+    parse_naptr_reply(naptr_reply, *parsed_rules);
+    rules = RuleList(parsed_rules);
+    _rule_cache.put(domain, rules, ttl);
+  }
+  else if (status == ARES_ENOTFOUND)
+  {
+    // The domain doesn't exist, which can be cached for the negative TTL.
+    rules = RuleList();
+    _rule_cache.put(domain, rules, ttl);
+  }
+  else
+  {
+    success = false;
+  }
+
+  // Free off the NAPTR reply if we have one.
+  if (naptr_reply != NULL)
+  {
+    resolver->free_naptr_reply(naptr_reply);
+  }
+
+  return success;
+}
+
+
 std::string DNSEnumService::key_to_domain(const std::string& key) const
 {
   // First strip all non-numeric characters from the key.
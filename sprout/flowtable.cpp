@@ -43,6 +43,7 @@ extern "C" {
 // Common STL includes.
 #include <cassert>
 #include <map>
+#include <unordered_map>
 #include <string>
 
 #include "log.h"
@@ -53,13 +54,24 @@ extern "C" {
 
 
 FlowTable::FlowTable(QuiescingManager* qm, LastValueCache* lvc) :
-  _tp2flow_map(),
-  _tk2flow_map(),
+  _interned(),
+  _flow_count(0),
+  _flow_memory(0),
   _statistic("client_count", lvc),
+  _memory_statistic("client_memory", lvc),
   _quiescing(false),
   _qm(qm)
 {
-  pthread_mutex_init(&_flow_map_lock, NULL);
+  for (int ii = 0; ii < NUM_PARTITIONS; ++ii)
+  {
+    pthread_mutex_init(&_partitions[ii].lock, NULL);
+  }
+  for (int ii = 0; ii < NUM_FLOW_LOCKS; ++ii)
+  {
+    pthread_mutex_init(&_flow_locks[ii], NULL);
+  }
+  pthread_mutex_init(&_intern_lock, NULL);
+  pthread_mutex_init(&_count_lock, NULL);
   report_flow_count();
 }
 
@@ -67,14 +79,30 @@ FlowTable::FlowTable(QuiescingManager* qm, LastValueCache* lvc) :
 FlowTable::~FlowTable()
 {
   // Delete all the existing flows.
-  for (std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.begin();
-       i != _tp2flow_map.end();
-       ++i)
+  for (int ii = 0; ii < NUM_PARTITIONS; ++ii)
   {
-    delete i->second;
+    Partition* p = &_partitions[ii];
+    for (std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i = p->tp2flow_map.begin();
+         i != p->tp2flow_map.end();
+         ++i)
+    {
+      delete i->second;
+    }
+
   }
 
-  pthread_mutex_destroy(&_flow_map_lock);
+  // Only destroy the locks once all the flows have gone, as deleting a flow
+  // may release interned strings.
+  for (int ii = 0; ii < NUM_PARTITIONS; ++ii)
+  {
+    pthread_mutex_destroy(&_partitions[ii].lock);
+  }
+  for (int ii = 0; ii < NUM_FLOW_LOCKS; ++ii)
+  {
+    pthread_mutex_destroy(&_flow_locks[ii]);
+  }
+  pthread_mutex_destroy(&_intern_lock);
+  pthread_mutex_destroy(&_count_lock);
 }
 
 
@@ -84,41 +112,50 @@ Flow* FlowTable::find_create_flow(pjsip_transport* transport, const pj_sockaddr*
 {
   Flow* flow = NULL;
   FlowKey key(transport->key.type, raddr);
+  Partition* p = addr_partition(key);
 
   char buf[100];
   LOG_DEBUG("Find or create flow for transport %s (%d), remote address %s",
             transport->obj_name, transport->key.type,
             pj_sockaddr_print(raddr, buf, sizeof(buf), 3));
 
-  pthread_mutex_lock(&_flow_map_lock);
-
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
-
-  if (i == _tp2flow_map.end())
-  {
-    // No matching flow, so create a new one.
-    flow = new Flow(this, transport, raddr);
+  pthread_mutex_lock(&p->lock);
 
-    // Add the new flow to the maps.
-    _tp2flow_map.insert(std::make_pair(key, flow));
-    _tk2flow_map.insert(std::make_pair(flow->token(), flow));
-
-    LOG_DEBUG("Added flow record %p", flow);
+  std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i = p->tp2flow_map.find(key);
 
-    report_flow_count();
-  }
-  else
+  if ((i != p->tp2flow_map.end()) &&
+      (i->second->inc_ref_if_live()))
   {
     // Found a matching flow, so return this one.
     flow = i->second;
+    pthread_mutex_unlock(&p->lock);
 
     LOG_DEBUG("Found flow record %p", flow);
   }
+  else
+  {
+    // No matching flow (or only one that is being removed), so create a new
+    // one.
+    flow = new Flow(this, transport, raddr);
+    flow->inc_ref();
 
-  // Add a reference to the flow.
-  flow->inc_ref();
+    // Add the new flow to the maps.  Nothing else can know the new token yet,
+    // so it doesn't matter that the flow briefly isn't in the token map.
+    p->tp2flow_map[key] = flow;
+    pthread_mutex_unlock(&p->lock);
 
-  pthread_mutex_unlock(&_flow_map_lock);
+    Partition* tp = token_partition(flow->token());
+    pthread_mutex_lock(&tp->lock);
+    tp->tk2flow_map.insert(std::make_pair(flow->token(), flow));
+    pthread_mutex_unlock(&tp->lock);
+
+    LOG_DEBUG("Added flow record %p", flow);
+
+    pthread_mutex_lock(&_count_lock);
+    ++_flow_count;
+    report_flow_count();
+    pthread_mutex_unlock(&_count_lock);
+  }
 
   return flow;
 }
@@ -130,28 +167,26 @@ Flow* FlowTable::find_flow(pjsip_transport* transport, const pj_sockaddr* raddr)
 {
   Flow* flow = NULL;
   FlowKey key(transport->key.type, raddr);
+  Partition* p = addr_partition(key);
 
   char buf[100];
   LOG_DEBUG("Find flow for transport %s (%d), remote address %s",
             transport->obj_name, transport->key.type,
             pj_sockaddr_print(raddr, buf, sizeof(buf), 3));
 
-  pthread_mutex_lock(&_flow_map_lock);
+  pthread_mutex_lock(&p->lock);
 
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
+  std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i = p->tp2flow_map.find(key);
 
-  if (i != _tp2flow_map.end())
+  // If a matching flow is found, increment the reference count on it.
+  if ((i != p->tp2flow_map.end()) &&
+      (i->second->inc_ref_if_live()))
   {
-    // Found a matching flow, so return this one.
     flow = i->second;
-
-    // Increment the reference count on the flow.
-    flow->inc_ref();
-
     LOG_DEBUG("Found flow record %p", flow);
   }
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  pthread_mutex_unlock(&p->lock);
 
   return flow;
 }
@@ -161,31 +196,31 @@ Flow* FlowTable::find_flow(pjsip_transport* transport, const pj_sockaddr* raddr)
 Flow* FlowTable::find_flow(const std::string& token)
 {
   Flow* flow = NULL;
+  Partition* p = token_partition(token);
 
   LOG_DEBUG("Find flow for flow token %s", token.c_str());
 
-  pthread_mutex_lock(&_flow_map_lock);
+  pthread_mutex_lock(&p->lock);
+
+  std::unordered_map<std::string, Flow*>::iterator i = p->tk2flow_map.find(token);
 
-  std::map<std::string, Flow*>::iterator i = _tk2flow_map.find(token);
-  if (i != _tk2flow_map.end())
+  // If a flow matching the token is found, add a reference to it.
+  if ((i != p->tk2flow_map.end()) &&
+      (i->second->inc_ref_if_live()))
   {
-    // Found a flow matching the token.
     flow = i->second;
-
-    // Add a reference to the flow.
-    flow->inc_ref();
-
     LOG_DEBUG("Found flow record %p", flow);
   }
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  pthread_mutex_unlock(&p->lock);
 
   return flow;
 }
 
+/// Must be called with _count_lock held.
 void FlowTable::check_quiescing_state()
 {
-  if (_tp2flow_map.empty() && is_quiescing() && (_qm != NULL))
+  if ((_flow_count == 0) && is_quiescing() && (_qm != NULL))
   {
     LOG_DEBUG("Flow map is empty and we are quiescing - start transaction-based quiescing");
     _qm->flows_gone();
@@ -193,7 +228,7 @@ void FlowTable::check_quiescing_state()
   else
   {
     LOG_DEBUG("Checked quiescing state: flow_map is %s, is_quiescing() result is %s, _qm (QuiescingManager reference) is %s",
-              _tp2flow_map.empty() ? "empty" : "not empty",
+              (_flow_count == 0) ? "empty" : "not empty",
               is_quiescing()? "true" : "false",
               (_qm == NULL) ? "NULL" : "not NULL");
   }
@@ -201,52 +236,117 @@ void FlowTable::check_quiescing_state()
 
 void FlowTable::remove_flow(Flow* flow)
 {
-  pthread_mutex_lock(&_flow_map_lock);
-
   LOG_DEBUG("Remove flow %p", flow);
 
+  // Remove the flow from both maps.  Either entry may already have been
+  // replaced by a new flow for the same address, so only remove entries
+  // that still refer to this flow.
   FlowKey key(flow->transport()->key.type, flow->remote_addr());
-
-  std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.find(key);
-  if (i != _tp2flow_map.end())
+  Partition* p = addr_partition(key);
+  pthread_mutex_lock(&p->lock);
+  std::unordered_map<FlowKey, Flow*, FlowKey::Hash>::iterator i = p->tp2flow_map.find(key);
+  if ((i != p->tp2flow_map.end()) && (i->second == flow))
   {
-    _tp2flow_map.erase(i);
+    p->tp2flow_map.erase(i);
   }
+  pthread_mutex_unlock(&p->lock);
 
-  std::map<std::string, Flow*>::iterator j = _tk2flow_map.find(flow->token());
-  if (j != _tk2flow_map.end())
+  p = token_partition(flow->token());
+  pthread_mutex_lock(&p->lock);
+  std::unordered_map<std::string, Flow*>::iterator j = p->tk2flow_map.find(flow->token());
+  if ((j != p->tk2flow_map.end()) && (j->second == flow))
   {
-    _tk2flow_map.erase(j);
+    p->tk2flow_map.erase(j);
   }
-
-  report_flow_count();
+  pthread_mutex_unlock(&p->lock);
 
   delete flow;
 
+  pthread_mutex_lock(&_count_lock);
+  --_flow_count;
+  report_flow_count();
   check_quiescing_state();
-
-  pthread_mutex_unlock(&_flow_map_lock);
+  pthread_mutex_unlock(&_count_lock);
 }
 
+/// Must be called with _count_lock held.
 void FlowTable::report_flow_count()
 {
-  LOG_DEBUG("Reporting current flow count: %d", _tp2flow_map.size());
+  LOG_DEBUG("Reporting current flow count: %d", _flow_count);
   std::vector<std::string> message;
-  message.push_back(std::to_string(_tp2flow_map.size()));
+  message.push_back(std::to_string(_flow_count));
   _statistic.report_change(message);
+
+  // Report the total memory used by flows, and the average per flow.
+  long memory = _flow_memory.load();
+  std::vector<std::string> memory_message;
+  memory_message.push_back(std::to_string(memory));
+  memory_message.push_back(std::to_string((_flow_count > 0) ? memory / _flow_count : 0));
+  _memory_statistic.report_change(memory_message);
+}
+
+std::shared_ptr<const std::string> FlowTable::intern(const std::string& str)
+{
+  std::shared_ptr<const std::string> shared;
+
+  pthread_mutex_lock(&_intern_lock);
+
+  std::weak_ptr<const std::string>& entry = _interned[str];
+  shared = entry.lock();
+
+  if (!shared)
+  {
+    shared = std::shared_ptr<const std::string>(
+                   new std::string(str),
+                   [this](const std::string* s) { release_interned(s); });
+    entry = shared;
+  }
+
+  pthread_mutex_unlock(&_intern_lock);
+
+  return shared;
+}
+
+/// Called when the last reference to an interned string is released.
+void FlowTable::release_interned(const std::string* str)
+{
+  pthread_mutex_lock(&_intern_lock);
+
+  // The string may have been interned again since the last reference was
+  // released, in which case the entry now refers to the new copy.
+  std::unordered_map<std::string, std::weak_ptr<const std::string> >::iterator i =
+                                                          _interned.find(*str);
+  if ((i != _interned.end()) && (i->second.expired()))
+  {
+    _interned.erase(i);
+  }
+
+  pthread_mutex_unlock(&_intern_lock);
+
+  delete str;
 }
 
 void FlowTable::quiesce()
 {
   LOG_DEBUG("FlowTable was kicked to quiesce");
   _quiescing = true;
-  pthread_mutex_lock(&_flow_map_lock);
+  pthread_mutex_lock(&_count_lock);
 
   // If we have no flows, quiesce now - otherwise we do this in
   // remove_flow when the last flow disappears
   check_quiescing_state();
 
-  pthread_mutex_unlock(&_flow_map_lock);
+  pthread_mutex_unlock(&_count_lock);
+}
+
+FlowTable::Partition* FlowTable::addr_partition(const FlowKey& key)
+{
+  return &_partitions[key.hash() % NUM_PARTITIONS];
+}
+
+FlowTable::Partition* FlowTable::token_partition(const std::string& token)
+{
+  return &_partitions[std::hash<std::string>()(token) % NUM_PARTITIONS];
 }
 
 void FlowTable::unquiesce()
@@ -274,11 +374,9 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
   _authorized_ids(),
   _default_id(),
   _refs(1),
+  _memory(0),
   _dialogs(0)
 {
-  // Create the lock for protecting the authorized_ids and default_id.
-  pthread_mutex_init(&_flow_lock, NULL);
-
   // Create a random base64 encoded token for the flow.
   Utils::create_random_token(Flow::TOKEN_LENGTH, _token);
 
@@ -297,11 +395,15 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
   }
 
   // Initialize the timer.
-  pj_timer_entry_init(&_timer, PJ_FALSE, (void*)this, &on_timer_expiry);
+  _timer.user_data = (void*)this;
+  _timer.cb = &on_timer_expiry;
   _timer.id = 0;
+  _timer_expires = 0;
 
   // Start the timer as an idle timer.
   restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
+
+  update_memory_usage();
 }
 
 
@@ -322,11 +424,11 @@ Flow::~Flow()
   if (_timer.id)
   {
     // Stop the keepalive timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
+    stack_data.timer_wheel->cancel(&_timer);
     _timer.id = 0;
   }
 
-  pthread_mutex_destroy(&_flow_lock);
+  _flow_table->_flow_memory -= _memory;
 }
 
 
@@ -350,7 +452,7 @@ std::string Flow::asserted_identity(pjsip_uri* preferred_identity)
   std::string aor = PJUtils::public_id_from_uri((pjsip_uri*)pjsip_uri_get_uri(preferred_identity));
   std::string id;
 
-  pthread_mutex_lock(&_flow_lock);
+  pthread_mutex_lock(flow_lock());
 
   auth_id_map::const_iterator i = _authorized_ids.find(aor);
 
@@ -360,7 +462,7 @@ std::string Flow::asserted_identity(pjsip_uri* preferred_identity)
     id = i->second.name_addr;
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  pthread_mutex_unlock(flow_lock());
 
   return id;
 }
@@ -371,11 +473,11 @@ std::string Flow::asserted_identity(pjsip_uri* preferred_identity)
 /// identities are authorized on this flow.
 std::string Flow::default_identity()
 {
-  pthread_mutex_lock(&_flow_lock);
+  pthread_mutex_lock(flow_lock());
 
   std::string id = _default_id;
 
-  pthread_mutex_unlock(&_flow_lock);
+  pthread_mutex_unlock(flow_lock());
 
   return id;
 }
@@ -386,17 +488,17 @@ std::string Flow::service_route(const std::string& identity)
 {
   std::string route;
 
-  pthread_mutex_lock(&_flow_lock);
+  pthread_mutex_lock(flow_lock());
 
   auth_id_map::const_iterator i = _authorized_ids.find(identity);
 
   if (i != _authorized_ids.end())
   {
     // Found the corresponding identity.
-    route = i->second.service_route;
+    route = *i->second.service_route;
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  pthread_mutex_unlock(flow_lock());
 
   return route;
 }
@@ -415,7 +517,7 @@ void Flow::set_identity(const pjsip_uri* uri,
 
   LOG_DEBUG("Setting identity %s on flow %p, expires = %d", aor.c_str(), this, expires);
 
-  pthread_mutex_lock(&_flow_lock);
+  pthread_mutex_lock(flow_lock());
 
   // Convert the expiry time to an absolute time.
   expires += now;
@@ -433,8 +535,12 @@ void Flow::set_identity(const pjsip_uri* uri,
     // Store the name_addr rendered from the received URI.
     aid.name_addr = PJUtils::uri_to_string(PJSIP_URI_IN_FROMTO_HDR, uri);
 
-    // Store the service route for this identity.
-    aid.service_route = service_route;
+    // Store the service route for this identity, sharing the copy with any
+    // other flows using the same route.
+    if ((!aid.service_route) || (*aid.service_route != service_route))
+    {
+      aid.service_route = _flow_table->intern(service_route);
+    }
 
     // Update the expiry time.
     aid.expires = expires;
@@ -452,7 +558,7 @@ void Flow::set_identity(const pjsip_uri* uri,
     // running as an idle timer, or the expires time for these identities is
     // earlier than the timer will next pop.
     if ((_timer.id != EXPIRY_TIMER) ||
-        (_timer._timer_value.sec > expires))
+        (_timer_expires > expires))
     {
       restart_timer(EXPIRY_TIMER, expires - time(NULL));
     }
@@ -490,7 +596,9 @@ void Flow::set_identity(const pjsip_uri* uri,
     // so would be no more efficient.
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  update_memory_usage();
+
+  pthread_mutex_unlock(flow_lock());
 }
 
 
@@ -502,11 +610,11 @@ void Flow::expiry_timer()
   // a single flow to have a large number of identities.  This may not be
   // a valid assumption if a downstream SBC or AGCF muxes a large number of
   // clients over a single flow.
-  pthread_mutex_lock(&_flow_lock);
+  pthread_mutex_lock(flow_lock());
 
   int now = time(NULL);
   int min_expires = 0;
-  for (auth_id_map::const_iterator i = _authorized_ids.begin();
+  for (auth_id_map::iterator i = _authorized_ids.begin();
        i != _authorized_ids.end();
        )
   {
@@ -523,7 +631,10 @@ void Flow::expiry_timer()
         // This was our default ID, so remove it.
         _default_id = "";
       }
-      _authorized_ids.erase(i++);
+
+      // Erasing moves the last entry into this position, so don't advance
+      // the iterator.
+      _authorized_ids.erase(i);
     }
     else
     {
@@ -558,7 +669,9 @@ void Flow::expiry_timer()
     restart_timer(EXPIRY_TIMER, min_expires - now);
   }
 
-  pthread_mutex_unlock(&_flow_lock);
+  update_memory_usage();
+
+  pthread_mutex_unlock(flow_lock());
 }
 
 
@@ -578,28 +691,79 @@ void Flow::select_default_identity()
 }
 
 
-/// Restart the timer using the specified id and timeout.
-void Flow::restart_timer(int id, int timeout)
+/// Returns the approximate memory used by this flow, including its share of
+/// any interned service routes.
+size_t Flow::memory_usage() const
 {
-  if (_timer.id)
+  size_t memory = sizeof(Flow) + _token.capacity() + _default_id.capacity();
+
+  if (_authorized_ids.on_heap())
   {
-    // Stop the existing timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
+    memory += _authorized_ids.capacity() * sizeof(auth_id_map::value_type);
   }
 
-  pj_time_val delay = {timeout, 0};
-  pjsip_endpt_schedule_timer(stack_data.endpt, &_timer, &delay);
+  for (auth_id_map::const_iterator i = _authorized_ids.begin();
+       i != _authorized_ids.end();
+       ++i)
+  {
+    memory += i->first.capacity() + i->second.name_addr.capacity();
+    if (i->second.service_route)
+    {
+      memory += i->second.service_route->capacity() /
+                i->second.service_route.use_count();
+    }
+  }
+
+  return memory;
+}
+
+
+/// Updates the flow's contribution to the FlowTable memory count.  The
+/// statistic is reported next time a flow is added or removed.
+void Flow::update_memory_usage()
+{
+  size_t memory = memory_usage();
+  _flow_table->_flow_memory += (long)memory - (long)_memory;
+  _memory = memory;
+}
+
+
+/// Restart the timer using the specified id and timeout.
+void Flow::restart_timer(int id, int timeout)
+{
+  // Scheduling the timer cancels it first if it is already running.
+  _timer_expires = time(NULL) + timeout;
+  stack_data.timer_wheel->schedule(&_timer, timeout * 1000);
   _timer.id = id;
 }
 
 
-/// Increment the reference count on the flow.  This is always called when
-/// the flowtable lock is held, so no need to lock.
+/// Increment the reference count on a flow that is known to be live.
 void Flow::inc_ref()
 {
-  ++_refs;
-  LOG_DEBUG("Dialog count now %d for flow %s", _refs, _default_id.c_str());
+  int refs = ++_refs;
+  LOG_DEBUG("Dialog count now %d for flow %s", refs, _default_id.c_str());
+}
+
+
+/// Increment the reference count on the flow, unless it has already dropped
+/// to zero and the flow is being removed.  This is called by FlowTable
+/// lookups with the partition lock held, which stops the flow being deleted
+/// until the lock is released.
+bool Flow::inc_ref_if_live()
+{
+  int refs = _refs.load();
+  do
+  {
+    if (refs == 0)
+    {
+      return false;
+    }
+  }
+  while (!_refs.compare_exchange_weak(refs, refs + 1));
+
+  LOG_DEBUG("Dialog count now %d for flow %p", refs + 1, this);
+  return true;
 }
 
 
@@ -607,17 +771,15 @@ void Flow::inc_ref()
 /// to zero.
 void Flow::dec_ref()
 {
-  pthread_mutex_lock(&_flow_table->_flow_map_lock);
+  int refs = --_refs;
 
-  if ((--_refs) == 0)
+  if (refs == 0)
   {
-    pthread_mutex_unlock(&_flow_table->_flow_map_lock);
     _flow_table->remove_flow(this);
   }
   else
   {
-    LOG_DEBUG("Dialog count now %d for flow %s", _refs, _default_id.c_str());
-    pthread_mutex_unlock(&_flow_table->_flow_map_lock);
+    LOG_DEBUG("Dialog count now %d for flow %s", refs, _default_id.c_str());
   }
 }
 
@@ -662,8 +824,8 @@ void Flow::on_transport_state_changed(pjsip_transport *tp,
 }
 
 
-/// Called by PJSIP when the expiry/idle timer expires.
-void Flow::on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e)
+/// Called by the timer wheel when the expiry/idle timer expires.
+void Flow::on_timer_expiry(TimerWheel::Entry* e)
 {
   LOG_DEBUG("%s timer expired for flow %p",
             (e->id == EXPIRY_TIMER) ? "Expiry" : "Idle",
@@ -45,7 +45,6 @@
 #include "log.h"
 #include "sas.h"
 #include "sproutsasevent.h"
-#include "httpconnection.h"
 #include "hssconnection.h"
 #include "accumulator.h"
 
@@ -61,16 +60,27 @@ const std::string HSSConnection::STATE_REGISTERED = "REGISTERED";
 const std::string HSSConnection::STATE_NOT_REGISTERED = "NOT_REGISTERED";
 
 HSSConnection::HSSConnection(const std::string& server,
-                             HttpResolver* resolver,
+                             HttpClientPool* pool,
                              LoadMonitor *load_monitor,
                              LastValueCache *stats_aggregator) :
-  _http(new HttpConnection(server,
-                           false,
-                           resolver,
-                           "connected_homesteads",
-                           load_monitor,
-                           stats_aggregator,
-                           SASEvent::HttpLogLevel::PROTOCOL)),
+  _http(new HttpClient(pool,
+                       server,
+                       "connected_homesteads",
+                       load_monitor,
+                       stats_aggregator)),
+  _latency_stat("hss_latency_us", stats_aggregator),
+  _digest_latency_stat("hss_digest_latency_us", stats_aggregator),
+  _subscription_latency_stat("hss_subscription_latency_us", stats_aggregator),
+  _user_auth_latency_stat("hss_user_auth_latency_us", stats_aggregator),
+  _location_latency_stat("hss_location_latency_us", stats_aggregator)
+{
+}
+
+/// Constructor supplying own client. For UT use. Ownership passes
+/// to this object.
+HSSConnection::HSSConnection(HttpClient* http,
+                             LastValueCache *stats_aggregator) :
+  _http(http),
   _latency_stat("hss_latency_us", stats_aggregator),
   _digest_latency_stat("hss_digest_latency_us", stats_aggregator),
   _subscription_latency_stat("hss_subscription_latency_us", stats_aggregator),
@@ -104,6 +114,92 @@ HTTPCode HSSConnection::get_auth_vector(const std::string& private_user_identity
   event.add_var_param(auth_type);
   SAS::report_event(event);
 
+  std::string path = auth_vector_path(private_user_identity,
+                                      public_user_identity,
+                                      auth_type,
+                                      autn,
+                                      1);
+
+  HTTPCode rc = get_json_object(path, av, trail);
+
+  accumulate_auth_vector_latency(stopWatch, rc);
+
+  if (av == NULL)
+  {
+    LOG_ERROR("Failed to get Authentication Vector for %s",
+              private_user_identity.c_str());
+  }
+
+  return rc;
+}
+
+
+HTTPCode HSSConnection::get_auth_vectors(const std::string& private_user_identity,
+                                         const std::string& public_user_identity,
+                                         const std::string& auth_type,
+                                         const std::string& autn,
+                                         int count,
+                                         std::vector<Json::Value*>& avs,
+                                         SAS::TrailId trail)
+{
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
+
+  SAS::Event event(trail, SASEvent::HTTP_HOMESTEAD_VECTOR, 0);
+  event.add_var_param(private_user_identity);
+  event.add_var_param(public_user_identity);
+  event.add_var_param(auth_type);
+  SAS::report_event(event);
+
+  std::string path = auth_vector_path(private_user_identity,
+                                      public_user_identity,
+                                      auth_type,
+                                      autn,
+                                      count);
+
+  Json::Value* object = NULL;
+  HTTPCode rc = get_json_object(path, object, trail);
+
+  accumulate_auth_vector_latency(stopWatch, rc);
+
+  if (object != NULL)
+  {
+    if ((object->isMember("vectors")) &&
+        ((*object)["vectors"].isArray()))
+    {
+      // Homestead has returned a batch of vectors, in the order they should
+      // be used.
+      Json::Value& vectors = (*object)["vectors"];
+      for (size_t ii = 0; ii < vectors.size(); ++ii)
+      {
+        avs.push_back(new Json::Value(vectors[(int)ii]));
+      }
+      delete object;
+    }
+    else
+    {
+      // Homestead has returned a single vector.
+      avs.push_back(object);
+    }
+  }
+
+  if (avs.empty())
+  {
+    LOG_ERROR("Failed to get Authentication Vectors for %s",
+              private_user_identity.c_str());
+  }
+
+  return rc;
+}
+
+
+/// Builds the Homestead path for retrieving authentication vectors.
+std::string HSSConnection::auth_vector_path(const std::string& private_user_identity,
+                                            const std::string& public_user_identity,
+                                            const std::string& auth_type,
+                                            const std::string& autn,
+                                            int count)
+{
   std::string path = "/impi/" +
                      Utils::url_escape(private_user_identity) +
                      "/av";
@@ -113,19 +209,32 @@ HTTPCode HSSConnection::get_auth_vector(const std::string& private_user_identity
     path += "/" + auth_type;
   }
 
+  std::string separator = "?";
+
   if (!public_user_identity.empty())
   {
-    path += "?impu=" + Utils::url_escape(public_user_identity);
+    path += separator + "impu=" + Utils::url_escape(public_user_identity);
+    separator = "&";
   }
 
   if (!autn.empty())
   {
-    path += public_user_identity.empty() ? "?" : "&";
-    path += "autn=" + Utils::url_escape(autn);
+    path += separator + "autn=" + Utils::url_escape(autn);
+    separator = "&";
   }
 
-  HTTPCode rc = get_json_object(path, av, trail);
+  if (count > 1)
+  {
+    path += separator + "count=" + std::to_string(count);
+  }
 
+  return path;
+}
+
+
+void HSSConnection::accumulate_auth_vector_latency(Utils::StopWatch& stopWatch,
+                                                   HTTPCode rc)
+{
   unsigned long latency_us = 0;
 
   // Only accumulate the latency if we haven't already applied a
@@ -137,14 +246,6 @@ HTTPCode HSSConnection::get_auth_vector(const std::string& private_user_identity
     _latency_stat.accumulate(latency_us);
     _digest_latency_stat.accumulate(latency_us);
   }
-
-  if (av == NULL)
-  {
-    LOG_ERROR("Failed to get Authentication Vector for %s",
-              private_user_identity.c_str());
-  }
-
-  return rc;
 }
 
 
@@ -155,7 +256,7 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
 {
   std::string json_data;
 
-  HTTPCode rc = _http->send_get(path, json_data, "", trail);
+  HTTPCode rc = _http->send_get(path, json_data, trail);
   if (rc == HTTP_OK)
   {
     json_object = new Json::Value;
@@ -203,8 +304,9 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
                                            SAS::TrailId trail)
 {
   std::string raw_data;
+  std::map<std::string, std::string> headers;
 
-  HTTPCode http_code = _http->send_put(path, raw_data, body, trail);
+  HTTPCode http_code = _http->send_put(path, headers, body, raw_data, trail);
 
   if (http_code == HTTP_OK)
   {
@@ -222,7 +324,7 @@ HTTPCode HSSConnection::get_xml_object(const std::string& path,
 {
   std::string raw_data;
 
-  HTTPCode http_code = _http->send_get(path, raw_data, "", trail);
+  HTTPCode http_code = _http->send_get(path, raw_data, trail);
 
   if (http_code == HTTP_OK)
   {
@@ -0,0 +1,781 @@
+/**
+ * @file httpclientpool.cpp  Shared event-driven HTTP client
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <arpa/inet.h>
+#include <time.h>
+#include <event2/buffer.h>
+#include <event2/thread.h>
+#include <event2/keyvalq_struct.h>
+
+#include "log.h"
+#include "sproutsasevent.h"
+#include "httpclientpool.h"
+
+/// State shared between a blocking request and its completion callback.
+struct SyncWaiter
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  HTTPCode rc;
+  std::string response;
+};
+
+HttpClientPool::HttpClientPool(HttpResolver* resolver,
+                               int num_threads,
+                               int connections_per_host,
+                               int timeout_secs) :
+  _resolver(resolver),
+  _connections_per_host(connections_per_host),
+  _timeout_secs(timeout_secs),
+  _threads(),
+  _resolve_queue(),
+  _terminating(false),
+  _resolve_threads()
+{
+  // The I/O threads are woken from other threads, so libevent must be
+  // thread-safe.
+  evthread_use_pthreads();
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    _threads.push_back(new IoThread(this));
+  }
+
+  pthread_mutex_init(&_resolve_lock, NULL);
+  pthread_cond_init(&_resolve_cond, NULL);
+
+  // Resolving a name can block on DNS, so use as many resolver threads as
+  // I/O threads to avoid one slow lookup holding up every other request.
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, resolver_thread, this);
+    if (rc == 0)
+    {
+      _resolve_threads.push_back(thread);
+    }
+    else
+    {
+      LOG_ERROR("Failed to create HTTP client resolver thread, rc = %d", rc);
+    }
+  }
+}
+
+HttpClientPool::~HttpClientPool()
+{
+  // Stop the resolver threads, and fail anything they hadn't got to.
+  pthread_mutex_lock(&_resolve_lock);
+  _terminating = true;
+  pthread_cond_broadcast(&_resolve_cond);
+  pthread_mutex_unlock(&_resolve_lock);
+
+  for (std::vector<pthread_t>::iterator i = _resolve_threads.begin();
+       i != _resolve_threads.end();
+       ++i)
+  {
+    pthread_join(*i, NULL);
+  }
+
+  for (std::deque<Request*>::iterator i = _resolve_queue.begin();
+       i != _resolve_queue.end();
+       ++i)
+  {
+    complete(*i, HTTP_SERVER_UNAVAILABLE, "");
+  }
+  _resolve_queue.clear();
+
+  // Stop all the I/O threads before destroying any of them, as a request
+  // that fails on one thread may be retried on another.
+  for (std::vector<IoThread*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    (*i)->stop();
+  }
+
+  for (std::vector<IoThread*>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    delete *i;
+  }
+  _threads.clear();
+
+  pthread_cond_destroy(&_resolve_cond);
+  pthread_mutex_destroy(&_resolve_lock);
+}
+
+void HttpClientPool::send_request(const std::string& server,
+                                  evhttp_cmd_type method,
+                                  const std::string& path,
+                                  const std::map<std::string, std::string>& headers,
+                                  const std::string& body,
+                                  Callback callback,
+                                  SAS::TrailId trail,
+                                  Listener* listener)
+{
+  Request* req = new Request;
+  req->server = server;
+  req->method = method;
+  req->path = path;
+  req->headers = headers;
+  req->body = body;
+  req->callback = callback;
+  req->trail = trail;
+  req->listener = listener;
+  req->current = 0;
+  req->target_port = 0;
+  req->thread = NULL;
+
+  // Split the server into host and port.
+  req->host = server;
+  req->port = 80;
+  size_t colon = server.find_last_of(':');
+  size_t close_bracket = server.find_last_of(']');
+  if ((colon != std::string::npos) &&
+      ((close_bracket == std::string::npos) || (colon > close_bracket)))
+  {
+    req->host = server.substr(0, colon);
+    req->port = atoi(server.substr(colon + 1).c_str());
+  }
+  if ((req->host.length() > 2) &&
+      (req->host[0] == '[') &&
+      (req->host[req->host.length() - 1] == ']'))
+  {
+    req->host = req->host.substr(1, req->host.length() - 2);
+  }
+
+  // Hand the request to a resolver thread, so the caller never blocks on
+  // DNS.
+  pthread_mutex_lock(&_resolve_lock);
+  _resolve_queue.push_back(req);
+  pthread_cond_signal(&_resolve_cond);
+  pthread_mutex_unlock(&_resolve_lock);
+}
+
+HTTPCode HttpClientPool::send_request(const std::string& server,
+                                      evhttp_cmd_type method,
+                                      const std::string& path,
+                                      const std::map<std::string, std::string>& headers,
+                                      const std::string& body,
+                                      std::string& response,
+                                      SAS::TrailId trail,
+                                      Listener* listener)
+{
+  SyncWaiter waiter;
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_cond_init(&waiter.cond, NULL);
+  waiter.done = false;
+  waiter.rc = HTTP_OK;
+
+  send_request(server,
+               method,
+               path,
+               headers,
+               body,
+               [&waiter](HTTPCode rc, const std::string& rsp)
+               {
+                 pthread_mutex_lock(&waiter.lock);
+                 waiter.rc = rc;
+                 waiter.response = rsp;
+                 waiter.done = true;
+                 pthread_cond_signal(&waiter.cond);
+                 pthread_mutex_unlock(&waiter.lock);
+               },
+               trail,
+               listener);
+
+  pthread_mutex_lock(&waiter.lock);
+  while (!waiter.done)
+  {
+    pthread_cond_wait(&waiter.cond, &waiter.lock);
+  }
+  pthread_mutex_unlock(&waiter.lock);
+
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.lock);
+
+  response = waiter.response;
+  return waiter.rc;
+}
+
+void* HttpClientPool::resolver_thread(void* arg)
+{
+  ((HttpClientPool*)arg)->resolve_requests();
+  return NULL;
+}
+
+void HttpClientPool::resolve_requests()
+{
+  pthread_mutex_lock(&_resolve_lock);
+
+  while (true)
+  {
+    while ((_resolve_queue.empty()) && (!_terminating))
+    {
+      pthread_cond_wait(&_resolve_cond, &_resolve_lock);
+    }
+
+    if (_terminating)
+    {
+      break;
+    }
+
+    Request* req = _resolve_queue.front();
+    _resolve_queue.pop_front();
+    pthread_mutex_unlock(&_resolve_lock);
+
+    _resolver->resolve(req->host, req->port, MAX_TARGETS, req->targets, req->trail);
+
+    if (req->targets.empty())
+    {
+      LOG_WARNING("Failed to resolve HTTP server %s", req->server.c_str());
+      complete(req, HTTP_NOT_FOUND, "");
+    }
+    else
+    {
+      dispatch(req);
+    }
+
+    pthread_mutex_lock(&_resolve_lock);
+  }
+
+  pthread_mutex_unlock(&_resolve_lock);
+}
+
+void HttpClientPool::dispatch(Request* req)
+{
+  // Requests for a target are always sent from the same I/O thread, so they
+  // share its persistent connections.
+  char buf[INET6_ADDRSTRLEN];
+  const AddrInfo& target = req->targets[req->current];
+  if (target.address.af == AF_INET)
+  {
+    inet_ntop(AF_INET, &target.address.addr.ipv4, buf, sizeof(buf));
+  }
+  else
+  {
+    inet_ntop(AF_INET6, &target.address.addr.ipv6, buf, sizeof(buf));
+  }
+
+  req->address = buf;
+  req->target_port = target.port;
+
+  thread_for(req->address, req->target_port)->enqueue(req);
+}
+
+bool HttpClientPool::retry(Request* req)
+{
+  if (req->current + 1 < req->targets.size())
+  {
+    ++req->current;
+    LOG_DEBUG("Retrying HTTP request to %s on %s:%d",
+              req->server.c_str(), req->address.c_str(), req->target_port);
+    dispatch(req);
+    return true;
+  }
+
+  return false;
+}
+
+void HttpClientPool::complete(Request* req, HTTPCode rc, const std::string& body)
+{
+  req->callback(rc, body);
+  delete req;
+}
+
+HttpClientPool::IoThread* HttpClientPool::thread_for(const std::string& address,
+                                                     int port)
+{
+  size_t hash = std::hash<std::string>()(address) + port;
+  return _threads[hash % _threads.size()];
+}
+
+HttpClientPool::IoThread::IoThread(HttpClientPool* pool) :
+  _pool(pool),
+  _base(NULL),
+  _wakeup(NULL),
+  _tick(NULL),
+  _stopped(false),
+  _queue(),
+  _stopping(false),
+  _in_flight(),
+  _hosts()
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  _base = event_base_new();
+
+  // The wakeup event is activated when requests are queued.  The tick is a
+  // persistent timer that keeps the event loop running while it is idle, and
+  // makes sure the loop notices a stop request.
+  _wakeup = event_new(_base, -1, 0, on_wakeup, this);
+  _tick = event_new(_base, -1, EV_PERSIST, on_tick, this);
+  struct timeval tv = {1, 0};
+  event_add(_tick, &tv);
+
+  pthread_create(&_thread, NULL, thread_func, this);
+}
+
+HttpClientPool::IoThread::~IoThread()
+{
+  stop();
+
+  // Fail any requests that were never sent, or are awaiting responses.
+  for (std::deque<Request*>::iterator i = _queue.begin();
+       i != _queue.end();
+       ++i)
+  {
+    complete(*i, HTTP_SERVER_UNAVAILABLE, "");
+  }
+  _queue.clear();
+
+  for (std::set<Request*>::iterator i = _in_flight.begin();
+       i != _in_flight.end();
+       ++i)
+  {
+    complete(*i, HTTP_SERVER_UNAVAILABLE, "");
+  }
+  _in_flight.clear();
+
+  // Freeing the connections frees the outstanding libevent requests without
+  // calling their callbacks.
+  for (std::map<std::string, HostConnections>::iterator i = _hosts.begin();
+       i != _hosts.end();
+       ++i)
+  {
+    for (std::vector<evhttp_connection*>::iterator j = i->second.connections.begin();
+         j != i->second.connections.end();
+         ++j)
+    {
+      evhttp_connection_free(*j);
+    }
+  }
+  _hosts.clear();
+
+  event_free(_tick);
+  event_free(_wakeup);
+  event_base_free(_base);
+  pthread_mutex_destroy(&_lock);
+}
+
+void HttpClientPool::IoThread::enqueue(Request* req)
+{
+  pthread_mutex_lock(&_lock);
+  _queue.push_back(req);
+  pthread_mutex_unlock(&_lock);
+
+  event_active(_wakeup, 0, 0);
+}
+
+void HttpClientPool::IoThread::stop()
+{
+  if (!_stopped)
+  {
+    pthread_mutex_lock(&_lock);
+    _stopping = true;
+    pthread_mutex_unlock(&_lock);
+
+    event_base_loopbreak(_base);
+    pthread_join(_thread, NULL);
+    _stopped = true;
+  }
+}
+
+void* HttpClientPool::IoThread::thread_func(void* arg)
+{
+  IoThread* thread = (IoThread*)arg;
+  event_base_dispatch(thread->_base);
+  return NULL;
+}
+
+void HttpClientPool::IoThread::on_wakeup(evutil_socket_t fd, short events, void* arg)
+{
+  IoThread* thread = (IoThread*)arg;
+
+  // Take all the queued requests in one go, then send them without holding
+  // the lock.
+  std::deque<Request*> queue;
+  pthread_mutex_lock(&thread->_lock);
+  queue.swap(thread->_queue);
+  pthread_mutex_unlock(&thread->_lock);
+
+  for (std::deque<Request*>::iterator i = queue.begin();
+       i != queue.end();
+       ++i)
+  {
+    thread->send(*i);
+  }
+}
+
+void HttpClientPool::IoThread::on_tick(evutil_socket_t fd, short events, void* arg)
+{
+  IoThread* thread = (IoThread*)arg;
+
+  // A loopbreak before the loop started is lost, so check for a stop
+  // request here too.
+  pthread_mutex_lock(&thread->_lock);
+  bool stopping = thread->_stopping;
+  pthread_mutex_unlock(&thread->_lock);
+
+  if (stopping)
+  {
+    event_base_loopbreak(thread->_base);
+  }
+}
+
+void HttpClientPool::IoThread::send(Request* req)
+{
+  evhttp_connection* conn = get_connection(req);
+  evhttp_request* http_req = evhttp_request_new(on_response, req);
+
+  evkeyvalq* output_headers = evhttp_request_get_output_headers(http_req);
+  evhttp_add_header(output_headers, "Host", req->server.c_str());
+  for (std::map<std::string, std::string>::const_iterator i = req->headers.begin();
+       i != req->headers.end();
+       ++i)
+  {
+    evhttp_add_header(output_headers, i->first.c_str(), i->second.c_str());
+  }
+
+  if (!req->body.empty())
+  {
+    if (req->headers.find("Content-Type") == req->headers.end())
+    {
+      evhttp_add_header(output_headers, "Content-Type", "application/json");
+    }
+    evbuffer_add(evhttp_request_get_output_buffer(http_req),
+                 req->body.data(),
+                 req->body.length());
+  }
+
+  LOG_DEBUG("Sending HTTP request to %s:%d%s",
+            req->address.c_str(), req->target_port, req->path.c_str());
+
+  std::string target = req->address + ":" + std::to_string(req->target_port);
+  req->thread = this;
+  clock_gettime(CLOCK_MONOTONIC, &req->send_time);
+
+  if (evhttp_make_request(conn, http_req, req->method, req->path.c_str()) != 0)
+  {
+    // libevent has freed the request.
+    LOG_WARNING("Failed to send HTTP request to %s", target.c_str());
+
+    if (req->listener != NULL)
+    {
+      req->listener->request_failed(target, req->path, req->trail);
+    }
+
+    if (!_pool->retry(req))
+    {
+      complete(req, HTTP_SERVER_UNAVAILABLE, "");
+    }
+    return;
+  }
+
+  _in_flight.insert(req);
+
+  if (req->listener != NULL)
+  {
+    req->listener->request_sent(target, req->method, req->path, req->body, req->trail);
+  }
+}
+
+evhttp_connection* HttpClientPool::IoThread::get_connection(const Request* req)
+{
+  std::string key = req->address + ":" + std::to_string(req->target_port);
+  std::map<std::string, HostConnections>::iterator i = _hosts.find(key);
+  if (i == _hosts.end())
+  {
+    i = _hosts.insert(std::make_pair(key, HostConnections())).first;
+    i->second.next = 0;
+  }
+
+  HostConnections& host = i->second;
+  evhttp_connection* conn;
+
+  if ((int)host.connections.size() < _pool->_connections_per_host)
+  {
+    // Open another persistent connection to this host.
+    conn = evhttp_connection_base_new(_base,
+                                      NULL,
+                                      req->address.c_str(),
+                                      req->target_port);
+    evhttp_connection_set_timeout(conn, _pool->_timeout_secs);
+    host.connections.push_back(conn);
+  }
+  else
+  {
+    // Use the existing connections in turn.  libevent queues requests on a
+    // busy connection until the previous response has been received.
+    conn = host.connections[host.next];
+    host.next = (host.next + 1) % host.connections.size();
+  }
+
+  return conn;
+}
+
+void HttpClientPool::IoThread::on_response(evhttp_request* rsp, void* arg)
+{
+  Request* req = (Request*)arg;
+  IoThread* thread = req->thread;
+  thread->_in_flight.erase(req);
+
+  std::string target = req->address + ":" + std::to_string(req->target_port);
+
+  if ((rsp == NULL) ||
+      (evhttp_request_get_response_code(rsp) == 0))
+  {
+    // The connection failed or the request timed out, so blacklist the
+    // target and try the next one.
+    LOG_WARNING("HTTP request to %s%s failed",
+                target.c_str(), req->path.c_str());
+
+    if (req->listener != NULL)
+    {
+      req->listener->request_failed(target, req->path, req->trail);
+    }
+
+    thread->_pool->_resolver->blacklist(req->targets[req->current],
+                                        BLACKLIST_DURATION);
+
+    if (!thread->_pool->retry(req))
+    {
+      complete(req, HTTP_SERVER_UNAVAILABLE, "");
+    }
+    return;
+  }
+
+  HTTPCode rc = evhttp_request_get_response_code(rsp);
+  evbuffer* buf = evhttp_request_get_input_buffer(rsp);
+  size_t len = evbuffer_get_length(buf);
+  std::string body;
+  body.resize(len);
+  evbuffer_copyout(buf, &body[0], len);
+
+  if (req->listener != NULL)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long latency_us =
+      ((now.tv_sec - req->send_time.tv_sec) * 1000000L) +
+      ((now.tv_nsec - req->send_time.tv_nsec) / 1000L);
+    req->listener->response_received(target, req->path, rc, body, latency_us, req->trail);
+  }
+
+  // A 503 means the target is overloaded, so try another if there is one.
+  if ((rc == HTTP_SERVER_UNAVAILABLE) &&
+      (thread->_pool->retry(req)))
+  {
+    return;
+  }
+
+  complete(req, rc, body);
+}
+
+HttpClient::HttpClient(HttpClientPool* pool,
+                       const std::string& server,
+                       const std::string& stat_name,
+                       LoadMonitor* load_monitor,
+                       LastValueCache* stats_aggregator) :
+  _pool(pool),
+  _server(server),
+  _load_monitor(load_monitor),
+  _connected(),
+  _statistic(stat_name, stats_aggregator)
+{
+  pthread_mutex_init(&_connected_lock, NULL);
+
+  std::vector<std::string> no_targets;
+  _statistic.report_change(no_targets);
+}
+
+HttpClient::~HttpClient()
+{
+  pthread_mutex_destroy(&_connected_lock);
+}
+
+void HttpClient::send_post(const std::string& path,
+                           const std::map<std::string, std::string>& headers,
+                           const std::string& body,
+                           HttpClientPool::Callback callback,
+                           SAS::TrailId trail)
+{
+  _pool->send_request(_server, EVHTTP_REQ_POST, path, headers, body, callback, trail, this);
+}
+
+HTTPCode HttpClient::send_post(const std::string& path,
+                               const std::map<std::string, std::string>& headers,
+                               const std::string& body,
+                               std::string& response,
+                               SAS::TrailId trail)
+{
+  return send_request(EVHTTP_REQ_POST, path, headers, body, response, trail);
+}
+
+HTTPCode HttpClient::send_get(const std::string& path,
+                              std::string& response,
+                              SAS::TrailId trail)
+{
+  std::map<std::string, std::string> headers;
+  return send_request(EVHTTP_REQ_GET, path, headers, "", response, trail);
+}
+
+HTTPCode HttpClient::send_put(const std::string& path,
+                              const std::map<std::string, std::string>& headers,
+                              const std::string& body,
+                              std::string& response,
+                              SAS::TrailId trail)
+{
+  return send_request(EVHTTP_REQ_PUT, path, headers, body, response, trail);
+}
+
+HTTPCode HttpClient::send_request(evhttp_cmd_type method,
+                                  const std::string& path,
+                                  const std::map<std::string, std::string>& headers,
+                                  const std::string& body,
+                                  std::string& response,
+                                  SAS::TrailId trail)
+{
+  HTTPCode rc = send_and_wait(method, path, headers, body, response, trail);
+
+  if (rc != HTTP_OK)
+  {
+    LOG_ERROR("%s http://%s%s failed with HTTP code %ld",
+              method_str(method), _server.c_str(), path.c_str(), rc);
+  }
+
+  return rc;
+}
+
+HTTPCode HttpClient::send_and_wait(evhttp_cmd_type method,
+                                   const std::string& path,
+                                   const std::map<std::string, std::string>& headers,
+                                   const std::string& body,
+                                   std::string& response,
+                                   SAS::TrailId trail)
+{
+  return _pool->send_request(_server, method, path, headers, body, response, trail, this);
+}
+
+void HttpClient::request_sent(const std::string& target,
+                              evhttp_cmd_type method,
+                              const std::string& path,
+                              const std::string& body,
+                              SAS::TrailId trail)
+{
+  SAS::Event event(trail, SASEvent::HTTP_CLIENT_TX_REQ, 0);
+  event.add_var_param(std::string(method_str(method)));
+  event.add_var_param("http://" + target + path);
+  event.add_var_param(body);
+  SAS::report_event(event);
+}
+
+void HttpClient::response_received(const std::string& target,
+                                   const std::string& path,
+                                   HTTPCode rc,
+                                   const std::string& body,
+                                   unsigned long latency_us,
+                                   SAS::TrailId trail)
+{
+  SAS::Event event(trail, SASEvent::HTTP_CLIENT_RX_RSP, 0);
+  event.add_static_param(rc);
+  event.add_var_param("http://" + target + path);
+  event.add_var_param(body);
+  SAS::report_event(event);
+
+  update_connected(target, true);
+
+  if (_load_monitor != NULL)
+  {
+    _load_monitor->request_complete(latency_us);
+
+    if (rc == HTTP_SERVER_UNAVAILABLE)
+    {
+      // The downstream server is overloaded, so back off.
+      _load_monitor->incr_penalties();
+    }
+  }
+}
+
+void HttpClient::request_failed(const std::string& target,
+                                const std::string& path,
+                                SAS::TrailId trail)
+{
+  SAS::Event event(trail, SASEvent::HTTP_CLIENT_REQ_ERROR, 0);
+  event.add_var_param("http://" + target + path);
+  SAS::report_event(event);
+
+  update_connected(target, false);
+
+  if (_load_monitor != NULL)
+  {
+    // Treat a timeout or connection failure as a sign of overload.
+    _load_monitor->incr_penalties();
+  }
+}
+
+void HttpClient::update_connected(const std::string& target, bool connected)
+{
+  pthread_mutex_lock(&_connected_lock);
+
+  bool changed = (connected) ? _connected.insert(target).second :
+                               (_connected.erase(target) > 0);
+
+  if (changed)
+  {
+    std::vector<std::string> targets(_connected.begin(), _connected.end());
+    _statistic.report_change(targets);
+  }
+
+  pthread_mutex_unlock(&_connected_lock);
+}
+
+const char* HttpClient::method_str(evhttp_cmd_type method)
+{
+  switch (method)
+  {
+    case EVHTTP_REQ_GET:
+      return "GET";
+    case EVHTTP_REQ_PUT:
+      return "PUT";
+    case EVHTTP_REQ_POST:
+      return "POST";
+    default:
+      return "UNKNOWN";
+  }
+}
@@ -86,8 +86,8 @@ std::list<Sproutlet*> ICSCFPlugin::load(struct options& opt)
     _scscf_selector = new SCSCFSelector();
 
     // Create the I-CSCF ACR factory.
-    _acr_factory = (ralf_connection != NULL) ?
-                        (ACRFactory*)new RalfACRFactory(ralf_connection, BGCF) :
+    _acr_factory = (ralf_queue != NULL) ?
+                        (ACRFactory*)new RalfACRFactory(ralf_queue, BGCF) :
                         new ACRFactory();
 
     // Create the I-CSCF sproutlet.
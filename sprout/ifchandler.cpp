@@ -49,6 +49,7 @@ extern "C" {
 #include "pjmedia.h"
 
 #include "ifchandler.h"
+#include "regexcache.h"
 
 #include "sas.h"
 #include "sproutsasevent.h"
@@ -230,8 +231,8 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
   {
     xml_node<>* spt_header = node->first_node("Header");
     xml_node<>* spt_content = node->first_node("Content");
-    boost::regex header_regex;
-    boost::regex content_regex;
+    RegexCache::Regex header_regex;
+    RegexCache::Regex content_regex;
     pjsip_hdr* header = NULL;
 
     if (!spt_header)
@@ -240,8 +241,8 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
                   server_name, SASEvent::IFC_INVALID, 0, trail);
     }
 
-    header_regex = boost::regex(get_text_or_cdata(spt_header), boost::regex_constants::no_except);
-    if (header_regex.status())
+    header_regex = RegexCache::instance()->get(get_text_or_cdata(spt_header));
+    if (header_regex == NULL)
     {
       invalid_ifc("Invalid regular expression in Header element for SIPHeader service point trigger",
                   server_name, SASEvent::IFC_INVALID, 0, trail);
@@ -249,7 +250,7 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
 
     for (header = msg->hdr.next; header != &msg->hdr; header = header->next)
     {
-      if (boost::regex_search(PJUtils::pj_str_to_string(&(header->name)), header_regex))
+      if (boost::regex_search(PJUtils::pj_str_to_string(&(header->name)), *header_regex))
       {
         if (!spt_content)
         {
@@ -259,18 +260,18 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
         else
         {
           std::string header_value = PJUtils::get_header_value(header);
-          // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once
-          if (content_regex.status())
+          // Only look the content regex up once, and only if we need it.
+          if (content_regex == NULL)
           {
-            content_regex = boost::regex(get_text_or_cdata(spt_content), boost::regex_constants::no_except);
-            if (content_regex.status())
+            content_regex = RegexCache::instance()->get(get_text_or_cdata(spt_content));
+            if (content_regex == NULL)
             {
               invalid_ifc("Invalid regular expression in Content element for SIPHeader service point trigger",
                           server_name, SASEvent::IFC_INVALID, 0, trail);
             }
           }
 
-          if (boost::regex_search(header_value, content_regex))
+          if (boost::regex_search(header_value, *content_regex))
           {
             // We've found a matching header, and have matching content in one field
             ret = true;
@@ -314,7 +315,7 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
   }
   else if (strcmp("RequestURI", name) == 0)
   {
-    boost::regex req_uri_regex;
+    RegexCache::Regex req_uri_regex;
     std::string test_string;
 
     if (PJSIP_URI_SCHEME_IS_TEL(msg->line.req.uri))
@@ -341,20 +342,20 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
       test_string = hostport;
     }
 
-    req_uri_regex = boost::regex(get_text_or_cdata(node), boost::regex_constants::no_except);
-    if (req_uri_regex.status())
+    req_uri_regex = RegexCache::instance()->get(get_text_or_cdata(node));
+    if (req_uri_regex == NULL)
     {
       invalid_ifc("Invalid regular expression in Request URI service point trigger",
                   server_name, SASEvent::IFC_INVALID, 0, trail);
     }
-    ret = boost::regex_search(test_string, req_uri_regex);
+    ret = boost::regex_search(test_string, *req_uri_regex);
   }
   else if (strcmp("SessionDescription", name) == 0)
   {
     xml_node<>* spt_line = node->first_node("Line");
     xml_node<>* spt_content = node->first_node("Content");
-    boost::regex line_regex;
-    boost::regex content_regex;
+    RegexCache::Regex line_regex;
+    RegexCache::Regex content_regex;
     char newline = '\n';
 
     if (!spt_line)
@@ -363,8 +364,8 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
                   server_name, SASEvent::IFC_INVALID, 0, trail);
     }
 
-    line_regex = boost::regex(get_text_or_cdata(spt_line), boost::regex_constants::no_except);
-    if (line_regex.status())
+    line_regex = RegexCache::instance()->get(get_text_or_cdata(spt_line));
+    if (line_regex == NULL)
     {
       invalid_ifc("Invalid regular expression in Line element for Session Description service point trigger",
                   server_name, SASEvent::IFC_INVALID, 0, trail);
@@ -384,7 +385,7 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
         {
           // Match the line regex on the first character of the SDP line.
           std::string sdp_identifier(1, sdp_line[0]);
-          if (boost::regex_search(sdp_identifier, line_regex))
+          if (boost::regex_search(sdp_identifier, *line_regex))
           {
             if (!spt_content)
             {
@@ -393,11 +394,11 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
             }
             else
             {
-              // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once.
-              if (content_regex.status())
+              // Only look the content regex up once, and only if we need it.
+              if (content_regex == NULL)
               {
-                content_regex = boost::regex(get_text_or_cdata(spt_content), boost::regex_constants::no_except);
-                if (content_regex.status())
+                content_regex = RegexCache::instance()->get(get_text_or_cdata(spt_content));
+                if (content_regex == NULL)
                 {
                   invalid_ifc("Invalid regular expression in Content element for Session Description service point trigger",
                               server_name, SASEvent::IFC_INVALID, 0, trail);
@@ -409,7 +410,7 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
               if (sdp_line.find_first_of("=") == 1)
               {
                 sdp_line.erase(0,2);
-                if (boost::regex_search(sdp_line, content_regex))
+                if (boost::regex_search(sdp_line, *content_regex))
                 {
                   // We've found a matching line.
                   ret = true;
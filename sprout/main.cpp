@@ -84,6 +84,8 @@ extern "C" {
 #include "memcachedstore.h"
 #include "localstore.h"
 #include "scscfselector.h"
+#include "regexcache.h"
+#include "objectpool.h"
 #include "chronosconnection.h"
 #include "handlers.h"
 #include "httpstack.h"
@@ -107,7 +109,15 @@ enum OptionTypes
   OPT_MEMENTO_THREADS,
   OPT_CALL_LIST_TTL,
   OPT_MEMENTO_ENABLED,
-  OPT_GEMINI_ENABLED
+  OPT_GEMINI_ENABLED,
+  OPT_NONCE_REUSE_LIFETIME,
+  OPT_NONCE_COUNT_MAX,
+  OPT_AKA_AV_PREFETCH,
+  OPT_HTTP_CLIENT_THREADS,
+  OPT_RALF_QUEUE_SIZE,
+  OPT_RALF_BATCH_SIZE,
+  OPT_RALF_SPOOL_DIR,
+  OPT_WEBRTC_THREADS
 };
 
 
@@ -158,6 +168,14 @@ enum OptionTypes
     { "call-list-ttl", required_argument, 0, OPT_CALL_LIST_TTL},
     { "memento-enabled", no_argument, 0, OPT_MEMENTO_ENABLED},
     { "gemini-enabled", no_argument, 0, OPT_GEMINI_ENABLED},
+    { "nonce-reuse-lifetime", required_argument, 0, OPT_NONCE_REUSE_LIFETIME},
+    { "nonce-count-max", required_argument, 0, OPT_NONCE_COUNT_MAX},
+    { "aka-av-prefetch", required_argument, 0, OPT_AKA_AV_PREFETCH},
+    { "http-client-threads", required_argument, 0, OPT_HTTP_CLIENT_THREADS},
+    { "ralf-queue-size",   required_argument, 0, OPT_RALF_QUEUE_SIZE},
+    { "ralf-batch-size",   required_argument, 0, OPT_RALF_BATCH_SIZE},
+    { "ralf-spool-dir",    required_argument, 0, OPT_RALF_SPOOL_DIR},
+    { "webrtc-threads",    required_argument, 0, OPT_WEBRTC_THREADS},
     { "log-level",         required_argument, 0, 'L'},
     { "daemon",            no_argument,       0, 'd'},
     { "interactive",       no_argument,       0, 't'},
@@ -181,6 +199,9 @@ const static int MAX_TOKENS = 20;
 const static float INITIAL_TOKEN_RATE = 10.0;
 const static float MIN_TOKEN_RATE = 10.0;
 
+const static int HTTP_CLIENT_CONNECTIONS_PER_HOST = 4;
+const static int HTTP_CLIENT_TIMEOUT = 5;
+
 static void usage(void)
 {
   puts("Options:\n"
@@ -191,6 +212,8 @@ static void usage(void)
        " -s, --scscf <port>         Enable S-CSCF function on the specified port\n"
        " -w, --webrtc-port N        Set local WebRTC listener port to N\n"
        "                            If not specified WebRTC support will be disabled\n"
+       "     --webrtc-threads N     Number of threads handling WebRTC connections\n"
+       "                            (default: 1)\n"
        " -l, --localhost [<hostname>|<private hostname>,<public hostname>]\n"
        "                            Override the local host name with the specified\n"
        "                            hostname(s) or IP address(es).  If one name/address\n"
@@ -266,6 +289,27 @@ static void usage(void)
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -A, --authentication       Enable authentication\n"
+       "     --nonce-reuse-lifetime <secs>\n"
+       "                            Allow clients to reuse a validated Digest nonce with an\n"
+       "                            increasing nonce count for this period, so refresh\n"
+       "                            REGISTERs don't need a fresh challenge (default: 0, disabled)\n"
+       "     --nonce-count-max N    Maximum nonce count accepted on a reused nonce.  If this\n"
+       "                            is 0, then there is no limit (default: 0)\n"
+       "     --aka-av-prefetch N    Number of AKA authentication vectors to request from the\n"
+       "                            HSS at once.  Unused vectors are held for subsequent\n"
+       "                            challenges to the same subscriber (default: 1)\n"
+       "     --http-client-threads N\n"
+       "                            Number of threads sending requests to Ralf and the HSS\n"
+       "                            over the shared keep-alive HTTP client, and of threads\n"
+       "                            resolving their server names (default: 2)\n"
+       "     --ralf-queue-size N    Maximum number of ACRs queued in memory for delivery\n"
+       "                            to Ralf (default: 10000)\n"
+       "     --ralf-batch-size N    Maximum number of ACRs awaiting a response from Ralf\n"
+       "                            at once (default: 32)\n"
+       "     --ralf-spool-dir <directory>\n"
+       "                            Directory in which to spool ACRs when the Ralf\n"
+       "                            delivery queue is full.  If not specified, ACRs\n"
+       "                            are dropped when the queue is full\n"
        "     --allow-emergency-registration\n"
        "                            Allow the P-CSCF to acccept emergency registrations.\n"
        "                            Only valid if -p/pcscf is specified.\n"
@@ -736,6 +780,62 @@ static pj_status_t init_options(int argc, char *argv[], struct options *options)
       LOG_INFO("Gemini AS is enabled");
       break;
 
+    case OPT_NONCE_REUSE_LIFETIME:
+      options->nonce_reuse_lifetime = atoi(pj_optarg);
+      LOG_INFO("Nonce reuse lifetime set to %d seconds",
+               options->nonce_reuse_lifetime);
+      break;
+
+    case OPT_NONCE_COUNT_MAX:
+      options->nonce_count_max = atoi(pj_optarg);
+      LOG_INFO("Maximum nonce count set to %d",
+               options->nonce_count_max);
+      break;
+
+    case OPT_AKA_AV_PREFETCH:
+      options->aka_av_prefetch = atoi(pj_optarg);
+      LOG_INFO("Prefetching %d AKA authentication vectors",
+               options->aka_av_prefetch);
+      break;
+
+    case OPT_HTTP_CLIENT_THREADS:
+      options->http_client_threads = atoi(pj_optarg);
+      LOG_INFO("Using %d HTTP client threads",
+               options->http_client_threads);
+      break;
+
+    case OPT_RALF_QUEUE_SIZE:
+      options->ralf_queue_size = atoi(pj_optarg);
+      LOG_INFO("Ralf delivery queue size set to %d",
+               options->ralf_queue_size);
+      break;
+
+    case OPT_RALF_BATCH_SIZE:
+      options->ralf_batch_size = atoi(pj_optarg);
+      LOG_INFO("Ralf delivery window set to %d ACRs",
+               options->ralf_batch_size);
+      break;
+
+    case OPT_RALF_SPOOL_DIR:
+      options->ralf_spool_dir = std::string(pj_optarg);
+      LOG_INFO("Ralf ACR spool directory set to %s",
+               options->ralf_spool_dir.c_str());
+      break;
+
+    case OPT_WEBRTC_THREADS:
+      options->webrtc_threads = atoi(pj_optarg);
+      if (options->webrtc_threads >= 1)
+      {
+        LOG_INFO("Using %d WebRTC threads",
+                 options->webrtc_threads);
+      }
+      else
+      {
+        LOG_ERROR("Number of WebRTC threads %s is invalid", pj_optarg);
+        return -1;
+      }
+      break;
+
     case 'h':
       usage();
       return -1;
@@ -936,7 +1036,9 @@ LoadMonitor* load_monitor = NULL;
 HSSConnection* hss_connection = NULL;
 RegStore* local_reg_store = NULL;
 RegStore* remote_reg_store = NULL;
-HttpConnection* ralf_connection = NULL;
+HttpClientPool* http_client_pool = NULL;
+HttpClient* ralf_connection = NULL;
+RalfDeliveryQueue* ralf_queue = NULL;
 HttpResolver* http_resolver = NULL;
 ACRFactory* scscf_acr_factory = NULL;
 EnumService* enum_service = NULL;
@@ -994,11 +1096,19 @@ int main(int argc, char *argv[])
   opt.pcscf_untrusted_port = 0;
   opt.upstream_proxy_port = 0;
   opt.webrtc_port = 0;
+  opt.webrtc_threads = 1;
   opt.ibcf = PJ_FALSE;
   opt.scscf_enabled = false;
   opt.scscf_port = 0;
   opt.external_icscf_uri = "";
   opt.auth_enabled = PJ_FALSE;
+  opt.nonce_reuse_lifetime = 0;
+  opt.nonce_count_max = 0;
+  opt.aka_av_prefetch = 1;
+  opt.http_client_threads = 2;
+  opt.ralf_queue_size = 10000;
+  opt.ralf_batch_size = 32;
+  opt.ralf_spool_dir = "";
   opt.enum_suffix = ".e164.arpa";
   opt.enforce_user_phone = false;
   opt.enforce_global_only_lookups = false;
@@ -1226,19 +1336,39 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  // Publish statistics for the shared regular expression cache.
+  RegexCache::instance()->enable_stats(stack_data.stats_aggregator);
+
+  // Publish statistics for the object pools.
+  ObjectPool::enable_stats(stack_data.stats_aggregator);
+
   // Now that we know the address family, create an HttpResolver too.
   http_resolver = new HttpResolver(dns_resolver, stack_data.addr_family);
 
+  if ((opt.ralf_server != "") || (opt.hss_server != ""))
+  {
+    // Create the shared HTTP client pool used for Ralf and the HSS.
+    http_client_pool = new HttpClientPool(http_resolver,
+                                          opt.http_client_threads,
+                                          HTTP_CLIENT_CONNECTIONS_PER_HOST,
+                                          HTTP_CLIENT_TIMEOUT);
+  }
+
   if (opt.ralf_server != "")
   {
-    // Create HttpConnection pool for Ralf Rf billing interface.
-    ralf_connection = new HttpConnection(opt.ralf_server,
-                                         false,
-                                         http_resolver,
-                                         "connected_ralfs",
-                                         load_monitor,
-                                         stack_data.stats_aggregator,
-                                         SASEvent::HttpLogLevel::PROTOCOL);
+    // Create a client on the pool for the Ralf Rf billing interface.
+    ralf_connection = new HttpClient(http_client_pool,
+                                     opt.ralf_server,
+                                     "connected_ralfs",
+                                     load_monitor,
+                                     stack_data.stats_aggregator);
+
+    // ACRs are delivered to Ralf from a background queue.
+    ralf_queue = new RalfDeliveryQueue(ralf_connection,
+                                       opt.ralf_queue_size,
+                                       opt.ralf_batch_size,
+                                       opt.ralf_spool_dir,
+                                       stack_data.stats_aggregator);
   }
 
   // Initialise the OPTIONS handling module.
@@ -1249,7 +1379,7 @@ int main(int argc, char *argv[])
     // Create a connection to the HSS.
     LOG_STATUS("Creating connection to HSS %s", opt.hss_server.c_str());
     hss_connection = new HSSConnection(opt.hss_server,
-                                       http_resolver,
+                                       http_client_pool,
                                        load_monitor,
                                        stack_data.stats_aggregator);
   }
@@ -1291,8 +1421,8 @@ int main(int argc, char *argv[])
   if (opt.pcscf_enabled)
   {
     // Create an ACR factory for the P-CSCF.
-    pcscf_acr_factory = (ralf_connection != NULL) ?
-                (ACRFactory*)new RalfACRFactory(ralf_connection, PCSCF) :
+    pcscf_acr_factory = (ralf_queue != NULL) ?
+                (ACRFactory*)new RalfACRFactory(ralf_queue, PCSCF) :
                 new ACRFactory();
 
     // Launch stateful proxy as P-CSCF.
@@ -1331,7 +1461,8 @@ int main(int argc, char *argv[])
     pj_bool_t websockets_enabled = (opt.webrtc_port != 0);
     if (websockets_enabled)
     {
-      status = init_websockets((unsigned short)opt.webrtc_port);
+      status = init_websockets((unsigned short)opt.webrtc_port,
+                               opt.webrtc_threads);
       if (status != PJ_SUCCESS)
       {
         LOG_ERROR("Error initializing websockets, %s",
@@ -1344,8 +1475,8 @@ int main(int argc, char *argv[])
 
   if (opt.scscf_enabled)
   {
-    scscf_acr_factory = (ralf_connection != NULL) ?
-                      (ACRFactory*)new RalfACRFactory(ralf_connection, SCSCF) :
+    scscf_acr_factory = (ralf_queue != NULL) ?
+                      (ACRFactory*)new RalfACRFactory(ralf_queue, SCSCF) :
                       new ACRFactory();
 
     if (opt.store_servers != "")
@@ -1390,7 +1521,10 @@ int main(int argc, char *argv[])
                                    hss_connection,
                                    chronos_connection,
                                    scscf_acr_factory,
-                                   analytics_logger);
+                                   analytics_logger,
+                                   opt.nonce_reuse_lifetime,
+                                   opt.nonce_count_max,
+                                   opt.aka_av_prefetch);
     }
 
     // Launch the registrar.
@@ -1541,9 +1675,15 @@ int main(int argc, char *argv[])
   }
 
   destroy_options();
+
+  // Stop the Ralf delivery queue before the statistics it reports go away.
+  delete ralf_queue;
+  ralf_queue = NULL;
+  RegexCache::instance()->disable_stats();
+  ObjectPool::disable_stats();
+
   destroy_stack();
 
-  delete hss_connection;
   delete quiescing_mgr;
   delete load_monitor;
   delete local_reg_store;
@@ -1551,7 +1691,12 @@ int main(int argc, char *argv[])
   delete av_store;
   delete local_data_store;
   delete remote_data_store;
+  // The pool completes any outstanding requests as it is destroyed, so it
+  // must go before the clients it reports to.
+  delete http_client_pool;
   delete ralf_connection;
+  delete hss_connection;
+
   delete enum_service;
   delete scscf_acr_factory;
 
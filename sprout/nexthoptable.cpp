@@ -0,0 +1,578 @@
+/**
+ * @file nexthoptable.cpp  Next hop target set table.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "log.h"
+#include "nexthoptable.h"
+
+const double NextHopTable::MIN_HEALTH = 0.01;
+
+NextHopTable::Health::Health() :
+  latency_us(INITIAL_LATENCY_US),
+  error_rate(0),
+  blacklisted_until_ms(0)
+{
+}
+
+NextHopTable::NextHopTable(SIPResolver* resolver, int num_threads) :
+  _resolver(resolver),
+  _sets(),
+  _health(),
+  _jobs(),
+  _terminating(false),
+  _threads()
+{
+  pthread_rwlock_init(&_lock, NULL);
+  pthread_mutex_init(&_jobs_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &rebuild_thread, this);
+    if (rc == 0)
+    {
+      _threads.push_back(thread);
+    }
+    else
+    {
+      LOG_ERROR("Failed to create next hop table thread, rc = %d", rc);
+    }
+  }
+}
+
+NextHopTable::~NextHopTable()
+{
+  pthread_mutex_lock(&_jobs_lock);
+  _terminating = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_jobs_lock);
+
+  for (std::vector<pthread_t>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_jobs_lock);
+  pthread_rwlock_destroy(&_lock);
+}
+
+void NextHopTable::resolve(const std::string& name,
+                           int af,
+                           int port,
+                           int transport,
+                           int retries,
+                           std::vector<AddrInfo>& targets,
+                           SAS::TrailId trail)
+{
+  std::string key = destination_key(name, af, port, transport);
+  uint64_t now = now_ms();
+  TargetSetPtr set;
+  bool held;
+  bool full;
+
+  pthread_rwlock_rdlock(&_lock);
+  std::unordered_map<std::string, TargetSetPtr>::const_iterator it = _sets.find(key);
+  held = (it != _sets.end());
+  if (held)
+  {
+    set = it->second;
+  }
+  full = (_sets.size() >= MAX_DESTINATIONS);
+  pthread_rwlock_unlock(&_lock);
+
+  if ((set != NULL) &&
+      (now >= set->expires_ms + GRACE_MS))
+  {
+    // The target set is too old to use, as it hasn't been rebuilt since the
+    // destination was last used.
+    LOG_DEBUG("Target set for %s is out of date", key.c_str());
+    set.reset();
+  }
+
+  if (set == NULL)
+  {
+    if ((full) && (!held))
+    {
+      // There's no room to hold another target set, so just use the
+      // resolver for this destination.
+      LOG_DEBUG("Next hop table full, so resolve %s directly", key.c_str());
+      _resolver->resolve(name, af, port, transport, retries, targets, trail);
+      return;
+    }
+
+    // This is the first request for the destination (or the first for a
+    // long time), so it has to wait for the target set to be built.
+    LOG_DEBUG("No target set for %s, so build one", key.c_str());
+    set = build(name, af, port, transport, trail);
+
+    if (set == NULL)
+    {
+      // The destination has no targets in DNS right now, so drop any out of
+      // date target set.
+      LOG_DEBUG("No targets for %s", key.c_str());
+      pthread_rwlock_wrlock(&_lock);
+      _sets.erase(key);
+      pthread_rwlock_unlock(&_lock);
+    }
+  }
+  else if ((now >= set->rebuild_ms) &&
+           (!set->rebuilding.exchange(true)))
+  {
+    // The target set's records have expired, and no rebuild is in progress.
+    // Requests carry on using the current set while it is rebuilt.
+    LOG_DEBUG("Queue rebuild of target set for %s", key.c_str());
+    queue_rebuild(key, name, af, port, transport);
+  }
+
+  if (set != NULL)
+  {
+    pick(*set, retries, targets);
+  }
+}
+
+void NextHopTable::report_response(const AddrInfo& target, int latency_ms)
+{
+  std::shared_ptr<Health> health = find_health(target);
+
+  if (health != NULL)
+  {
+    update_average(health->latency_us, latency_ms * 1000);
+    update_average(health->error_rate, 0);
+  }
+}
+
+void NextHopTable::report_failure(const AddrInfo& target,
+                                  bool hard,
+                                  int blacklist_secs)
+{
+  std::shared_ptr<Health> health = find_health(target);
+
+  if (health != NULL)
+  {
+    update_average(health->error_rate, ERROR_SCALE);
+
+    if (hard)
+    {
+      LOG_DEBUG("Blacklist target %s for %d seconds",
+                target_key(target).c_str(), blacklist_secs);
+      health->blacklisted_until_ms = now_ms() + (uint64_t)blacklist_secs * 1000;
+    }
+  }
+}
+
+NextHopTable::TargetSetPtr NextHopTable::build(const std::string& name,
+                                               int af,
+                                               int port,
+                                               int transport,
+                                               SAS::TrailId trail)
+{
+  std::vector<SIPResolver::WeightedTarget> resolved;
+  int ttl;
+  _resolver->resolve_weighted(name, af, port, transport, resolved, ttl, trail);
+
+  // Put the targets in fallback order: by SRV priority, then by weight.  A
+  // target found through more than one record of the same priority gets
+  // their combined weight.
+  std::stable_sort(resolved.begin(),
+                   resolved.end(),
+                   [](const SIPResolver::WeightedTarget& lhs,
+                      const SIPResolver::WeightedTarget& rhs)
+                   {
+                     return ((lhs.priority < rhs.priority) ||
+                             ((lhs.priority == rhs.priority) &&
+                              (lhs.weight > rhs.weight)));
+                   });
+
+  std::vector<SIPResolver::WeightedTarget> found;
+  std::vector<std::string> found_keys;
+  for (size_t ii = 0; ii < resolved.size(); ++ii)
+  {
+    std::string target = target_key(resolved[ii].ai);
+    std::vector<std::string>::iterator jj =
+                          std::find(found_keys.begin(), found_keys.end(), target);
+
+    if (jj != found_keys.end())
+    {
+      SIPResolver::WeightedTarget& existing = found[jj - found_keys.begin()];
+      if (existing.priority == resolved[ii].priority)
+      {
+        existing.weight += resolved[ii].weight;
+      }
+    }
+    else if (found.size() < (size_t)MAX_TARGETS)
+    {
+      found.push_back(resolved[ii]);
+      found_keys.push_back(target);
+    }
+  }
+
+  if (found.empty())
+  {
+    return NULL;
+  }
+
+  // Only the targets with the best priority are picked first, in proportion
+  // to their weights.  If they all have zero weight they are picked equally.
+  double top_weight = 0.0;
+  for (size_t ii = 0;
+       (ii < found.size()) && (found[ii].priority == found[0].priority);
+       ++ii)
+  {
+    top_weight += found[ii].weight;
+  }
+
+  std::string key = destination_key(name, af, port, transport);
+  uint64_t now = now_ms();
+  TargetSetPtr set(new TargetSet());
+  set->expires_ms = now + (uint64_t)std::max(ttl, 0) * 1000;
+  set->rebuild_ms = std::max(set->expires_ms, now + MIN_REBUILD_INTERVAL_MS);
+  set->rebuilding = false;
+
+  pthread_rwlock_wrlock(&_lock);
+
+  if (_health.size() > MAX_DESTINATIONS)
+  {
+    // Forget the health of targets that are no longer in any target set.
+    for (std::unordered_map<std::string, std::shared_ptr<Health> >::iterator it = _health.begin();
+         it != _health.end();
+        )
+    {
+      if (it->second.use_count() == 1)
+      {
+        it = _health.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  for (size_t ii = 0; ii < found.size(); ++ii)
+  {
+    Target target;
+    target.ai = found[ii].ai;
+    if (found[ii].priority != found[0].priority)
+    {
+      target.base_weight = 0.0;
+    }
+    else if (top_weight > 0.0)
+    {
+      target.base_weight = found[ii].weight;
+    }
+    else
+    {
+      target.base_weight = 1.0;
+    }
+
+    std::shared_ptr<Health>& health = _health[target_key(target.ai)];
+    if (health == NULL)
+    {
+      health = std::shared_ptr<Health>(new Health());
+    }
+    target.health = health;
+
+    set->targets.push_back(target);
+  }
+
+  if ((_sets.size() < MAX_DESTINATIONS) || (_sets.find(key) != _sets.end()))
+  {
+    _sets[key] = set;
+  }
+  else
+  {
+    LOG_DEBUG("Next hop table full, so not holding target set for %s",
+              key.c_str());
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return set;
+}
+
+void NextHopTable::queue_rebuild(const std::string& key,
+                                 const std::string& name,
+                                 int af,
+                                 int port,
+                                 int transport)
+{
+  Job job;
+  job.key = key;
+  job.name = name;
+  job.af = af;
+  job.port = port;
+  job.transport = transport;
+
+  pthread_mutex_lock(&_jobs_lock);
+  _jobs.push_back(job);
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_jobs_lock);
+}
+
+void NextHopTable::rebuild_failed(const std::string& key)
+{
+  uint64_t now = now_ms();
+
+  pthread_rwlock_wrlock(&_lock);
+  std::unordered_map<std::string, TargetSetPtr>::iterator it = _sets.find(key);
+  if ((it != _sets.end()) && (it->second != NULL))
+  {
+    TargetSetPtr& set = it->second;
+    if (now >= set->expires_ms + GRACE_MS)
+    {
+      LOG_DEBUG("Failed to rebuild target set for %s, dropping it", key.c_str());
+      _sets.erase(it);
+    }
+    else
+    {
+      LOG_DEBUG("Failed to rebuild target set for %s, retrying shortly",
+                key.c_str());
+      set->rebuild_ms = now + REBUILD_RETRY_MS;
+      set->rebuilding = false;
+    }
+  }
+  pthread_rwlock_unlock(&_lock);
+}
+
+void* NextHopTable::rebuild_thread(void* p)
+{
+  ((NextHopTable*)p)->run_rebuilds();
+  return NULL;
+}
+
+void NextHopTable::run_rebuilds()
+{
+  pthread_mutex_lock(&_jobs_lock);
+
+  while (!_terminating)
+  {
+    if (_jobs.empty())
+    {
+      pthread_cond_wait(&_cond, &_jobs_lock);
+      continue;
+    }
+
+    Job job = _jobs.front();
+    _jobs.pop_front();
+    pthread_mutex_unlock(&_jobs_lock);
+
+    if (build(job.name, job.af, job.port, job.transport, 0) != NULL)
+    {
+      LOG_DEBUG("Rebuilt target set for %s", job.key.c_str());
+    }
+    else
+    {
+      rebuild_failed(job.key);
+    }
+
+    pthread_mutex_lock(&_jobs_lock);
+  }
+
+  pthread_mutex_unlock(&_jobs_lock);
+}
+
+void NextHopTable::pick(const TargetSet& set,
+                        int retries,
+                        std::vector<AddrInfo>& targets)
+{
+  uint64_t now = now_ms();
+  size_t num_targets = set.targets.size();
+  std::vector<double> weights(num_targets);
+  std::vector<bool> picked(num_targets, false);
+  double total_weight = 0.0;
+  double healthy_weight = 0.0;
+
+  for (size_t ii = 0; ii < num_targets; ++ii)
+  {
+    weights[ii] = weight(set.targets[ii], now);
+    total_weight += weights[ii];
+    if (healthy(set.targets[ii]))
+    {
+      healthy_weight += weights[ii];
+    }
+  }
+
+  // Pick the first target in proportion to the weights.  If none of the
+  // targets that would normally come first is healthy, the healthy fallback
+  // targets are used first instead, apart from an occasional probe so we
+  // notice when the other targets recover.
+  if ((total_weight > 0.0) &&
+      (retries > 0) &&
+      ((healthy_weight > 0.0) || (rand() < RAND_MAX * MIN_HEALTH)))
+  {
+    double choice = total_weight * (rand() / (RAND_MAX + 1.0));
+    size_t chosen = 0;
+    for (size_t ii = 0; ii < num_targets; ++ii)
+    {
+      if (weights[ii] > 0.0)
+      {
+        chosen = ii;
+        if (choice < weights[ii])
+        {
+          break;
+        }
+        choice -= weights[ii];
+      }
+    }
+    targets.push_back(set.targets[chosen].ai);
+    picked[chosen] = true;
+  }
+
+  // Add the other targets that aren't blacklisted in fallback order, healthy
+  // targets first.
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    for (size_t ii = 0;
+         (ii < num_targets) && ((int)targets.size() < retries);
+         ++ii)
+    {
+      const Target& target = set.targets[ii];
+
+      if ((!picked[ii]) &&
+          (target.health->blacklisted_until_ms <= now) &&
+          (healthy(target) == (pass == 0)))
+      {
+        targets.push_back(target.ai);
+        picked[ii] = true;
+      }
+    }
+  }
+
+  if (targets.empty())
+  {
+    // Every target is blacklisted, so try them all anyway.
+    for (size_t ii = 0;
+         (ii < num_targets) && ((int)targets.size() < retries);
+         ++ii)
+    {
+      targets.push_back(set.targets[ii].ai);
+    }
+  }
+}
+
+double NextHopTable::weight(const Target& target, uint64_t now)
+{
+  if (target.health->blacklisted_until_ms > now)
+  {
+    return 0.0;
+  }
+
+  double latency_us = target.health->latency_us;
+  double error_rate = (double)target.health->error_rate / ERROR_SCALE;
+  double health = (1.0 - error_rate) *
+                  REFERENCE_LATENCY_US / (REFERENCE_LATENCY_US + latency_us);
+
+  return target.base_weight * std::max(health, MIN_HEALTH);
+}
+
+bool NextHopTable::healthy(const Target& target)
+{
+  return (target.health->error_rate < UNHEALTHY_ERROR_RATE);
+}
+
+std::shared_ptr<NextHopTable::Health> NextHopTable::find_health(const AddrInfo& target)
+{
+  std::shared_ptr<Health> health;
+
+  pthread_rwlock_rdlock(&_lock);
+  std::unordered_map<std::string, std::shared_ptr<Health> >::const_iterator it =
+                                                  _health.find(target_key(target));
+  if (it != _health.end())
+  {
+    health = it->second;
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  return health;
+}
+
+void NextHopTable::update_average(std::atomic_int& average, int sample)
+{
+  int current = average;
+  int updated;
+
+  do
+  {
+    updated = current + (sample - current) / AVERAGE_WEIGHT;
+  }
+  while (!average.compare_exchange_weak(current, updated));
+}
+
+std::string NextHopTable::destination_key(const std::string& name,
+                                          int af,
+                                          int port,
+                                          int transport)
+{
+  std::string key = name;
+  key.append("/").append(std::to_string(af))
+     .append("/").append(std::to_string(port))
+     .append("/").append(std::to_string(transport));
+  return key;
+}
+
+std::string NextHopTable::target_key(const AddrInfo& target)
+{
+  char buf[INET6_ADDRSTRLEN];
+  std::string key;
+
+  if (target.address.af == AF_INET6)
+  {
+    key = inet_ntop(AF_INET6, &target.address.addr.ipv6, buf, sizeof(buf));
+  }
+  else
+  {
+    key = inet_ntop(AF_INET, &target.address.addr.ipv4, buf, sizeof(buf));
+  }
+  key.append(":").append(std::to_string(target.port))
+     .append(";").append(std::to_string(target.transport));
+  return key;
+}
+
+uint64_t NextHopTable::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
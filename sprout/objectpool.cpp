@@ -0,0 +1,228 @@
+/**
+ * @file objectpool.cpp  Per-thread pools of free objects
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <new>
+
+#include "log.h"
+#include "objectpool.h"
+
+__thread ObjectPool::FreeObject* ObjectPool::_free_list[ObjectPool::NUM_SIZES];
+__thread int ObjectPool::_num_free[ObjectPool::NUM_SIZES];
+
+__thread ObjectPool::ThreadStats* ObjectPool::_thread_stats;
+std::atomic<ObjectPool::ThreadStats*> ObjectPool::_all_stats(NULL);
+
+pthread_mutex_t ObjectPool::_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ObjectPool::_stats_cond;
+Statistic* ObjectPool::_statistic = NULL;
+pthread_t ObjectPool::_stats_thread;
+
+void* ObjectPool::alloc(size_t size)
+{
+  ThreadStats& stats = thread_stats();
+  count(stats.allocated);
+
+  if ((size == 0) || (size > MAX_OBJECT_SIZE))
+  {
+    return ::operator new(size);
+  }
+
+  size_t index = (size - 1) / GRANULARITY;
+  FreeObject* obj = _free_list[index];
+
+  if (obj != NULL)
+  {
+    // Reuse an object from this thread's free list.
+    _free_list[index] = obj->next;
+    --_num_free[index];
+    count(stats.reused);
+    return obj;
+  }
+
+  // Allocate the full size for this size class, so the object can be reused
+  // for any size that rounds up to it.
+  return ::operator new((index + 1) * GRANULARITY);
+}
+
+void ObjectPool::free(void* obj, size_t size)
+{
+  if (obj == NULL)
+  {
+    return;
+  }
+
+  if ((size == 0) || (size > MAX_OBJECT_SIZE))
+  {
+    count(thread_stats().released);
+    ::operator delete(obj);
+    return;
+  }
+
+  size_t index = (size - 1) / GRANULARITY;
+
+  if (_num_free[index] >= MAX_FREE_PER_THREAD)
+  {
+    // This thread already has enough free objects of this size.
+    count(thread_stats().released);
+    ::operator delete(obj);
+    return;
+  }
+
+  // Add the object to this thread's free list.  If the object was allocated
+  // on another thread it now belongs to this one.
+  FreeObject* free_obj = (FreeObject*)obj;
+  free_obj->next = _free_list[index];
+  _free_list[index] = free_obj;
+  ++_num_free[index];
+}
+
+ObjectPool::ThreadStats& ObjectPool::thread_stats()
+{
+  if (_thread_stats == NULL)
+  {
+    // First use of the pool on this thread, so add its statistics to the
+    // list.
+    ThreadStats* stats = new ThreadStats;
+    stats->allocated = 0;
+    stats->reused = 0;
+    stats->released = 0;
+    stats->next = _all_stats.load();
+    while (!_all_stats.compare_exchange_weak(stats->next, stats))
+    {
+    }
+    _thread_stats = stats;
+  }
+
+  return *_thread_stats;
+}
+
+void ObjectPool::count(std::atomic_ulong& counter)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+void ObjectPool::get_stats(Stats& stats)
+{
+  stats.allocated = 0;
+  stats.reused = 0;
+  stats.released = 0;
+
+  for (ThreadStats* thread = _all_stats.load();
+       thread != NULL;
+       thread = thread->next)
+  {
+    stats.allocated += thread->allocated.load(std::memory_order_relaxed);
+    stats.reused += thread->reused.load(std::memory_order_relaxed);
+    stats.released += thread->released.load(std::memory_order_relaxed);
+  }
+}
+
+void ObjectPool::enable_stats(LastValueCache* stats_aggregator)
+{
+  pthread_mutex_lock(&_stats_lock);
+
+  if (_statistic == NULL)
+  {
+    _statistic = new Statistic("object_pool", stats_aggregator);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_stats_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    int rc = pthread_create(&_stats_thread, NULL, &stats_thread, NULL);
+    if (rc != 0)
+    {
+      LOG_ERROR("Failed to create object pool statistics thread, rc = %d", rc);
+    }
+  }
+
+  pthread_mutex_unlock(&_stats_lock);
+}
+
+void ObjectPool::disable_stats()
+{
+  pthread_mutex_lock(&_stats_lock);
+  Statistic* statistic = _statistic;
+  _statistic = NULL;
+  pthread_cond_signal(&_stats_cond);
+  pthread_mutex_unlock(&_stats_lock);
+
+  if (statistic != NULL)
+  {
+    pthread_join(_stats_thread, NULL);
+    pthread_cond_destroy(&_stats_cond);
+    delete statistic;
+  }
+}
+
+void* ObjectPool::stats_thread(void* p)
+{
+  pthread_mutex_lock(&_stats_lock);
+
+  // Publish the statistics periodically until they are disabled.
+  while (_statistic != NULL)
+  {
+    report_stats();
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += STATS_INTERVAL_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&_stats_cond, &_stats_lock, &ts);
+  }
+
+  pthread_mutex_unlock(&_stats_lock);
+  return NULL;
+}
+
+/// Reports the number of objects allocated, reused and released.  Must be
+/// called with the statistics lock held.
+void ObjectPool::report_stats()
+{
+  Stats stats;
+  get_stats(stats);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(stats.allocated));
+  values.push_back(std::to_string(stats.reused));
+  values.push_back(std::to_string(stats.released));
+  _statistic->report_change(values);
+}
@@ -689,6 +689,65 @@ pjsip_tx_data* PJUtils::clone_msg(pjsip_endpoint* endpt,
 }
 
 
+/// Clones a request, sharing the headers that are not modified while
+/// routing and the body with the original, rather than copying them.  The
+/// Request-URI and all other headers are copied, so may be modified freely.
+///
+/// The clone refers to memory in the original's pool, so the caller must
+/// keep the original alive for as long as the clone exists, and should use
+/// clone_msg to make an independent copy before the clone is transmitted.
+pjsip_tx_data* PJUtils::shallow_clone_msg(pjsip_endpoint* endpt,
+                                          pjsip_tx_data* tdata)
+{
+  pjsip_tx_data* clone = NULL;
+  pj_status_t status = pjsip_endpt_create_tdata(endpt, &clone);
+  if (status == PJ_SUCCESS)
+  {
+    pjsip_tx_data_add_ref(clone);
+    pjsip_msg* src = tdata->msg;
+    pjsip_msg* msg = pjsip_msg_create(clone->pool, PJSIP_REQUEST_MSG);
+    pjsip_method_copy(clone->pool, &msg->line.req.method, &src->line.req.method);
+    msg->line.req.uri = (pjsip_uri*)pjsip_uri_clone(clone->pool,
+                                                    src->line.req.uri);
+
+    for (pjsip_hdr* hdr = src->hdr.next; hdr != &src->hdr; hdr = hdr->next)
+    {
+      pjsip_hdr* new_hdr;
+
+      switch (hdr->type)
+      {
+        case PJSIP_H_VIA:
+        case PJSIP_H_CALL_ID:
+        case PJSIP_H_CSEQ:
+        case PJSIP_H_RECORD_ROUTE:
+        case PJSIP_H_ALLOW:
+        case PJSIP_H_SUPPORTED:
+        case PJSIP_H_CONTENT_TYPE:
+        case PJSIP_H_CONTENT_LENGTH:
+          // These headers aren't changed by Sproutlets, so share the values
+          // with the original.
+          new_hdr = (pjsip_hdr*)pjsip_hdr_shallow_clone(clone->pool, hdr);
+          break;
+
+        default:
+          new_hdr = (pjsip_hdr*)pjsip_hdr_clone(clone->pool, hdr);
+          break;
+      }
+
+      pjsip_msg_add_hdr(msg, new_hdr);
+    }
+
+    // Share the body.  Sproutlets replace the body rather than modifying it.
+    msg->body = src->body;
+
+    clone->msg = msg;
+    set_trail(clone, get_trail(tdata));
+    LOG_DEBUG("Shallow cloned %s to %s", tdata->obj_name, clone->obj_name);
+  }
+  return clone;
+}
+
+
 pj_status_t PJUtils::create_response(pjsip_endpoint* endpt,
                                      const pjsip_rx_data* rdata,
                                      int st_code,
@@ -919,13 +978,27 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
     retries = DEFAULT_RETRIES;
   }
 
-  stack_data.sipresolver->resolve(name,
+  if (stack_data.next_hops != NULL)
+  {
+    // Pick the servers from the cached target set for the destination.
+    stack_data.next_hops->resolve(name,
                                   stack_data.addr_family,
                                   port,
                                   transport,
                                   retries,
                                   servers,
                                   trail);
+  }
+  else
+  {
+    stack_data.sipresolver->resolve(name,
+                                    stack_data.addr_family,
+                                    port,
+                                    transport,
+                                    retries,
+                                    servers,
+                                    trail);
+  }
 
   LOG_INFO("Resolved destination URI %s to %d servers",
            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
@@ -939,6 +1012,40 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
 void PJUtils::blacklist_server(AddrInfo& server)
 {
   stack_data.sipresolver->blacklist(server, DEFAULT_BLACKLIST_DURATION);
+
+  if (stack_data.next_hops != NULL)
+  {
+    stack_data.next_hops->report_failure(server, true, DEFAULT_BLACKLIST_DURATION);
+  }
+}
+
+
+/// Records that the specified server has responded to a request sent at the
+/// specified time, so its latency is taken into account in subsequent
+/// resolve_next_hop calls.
+void PJUtils::report_server_latency(const AddrInfo& server,
+                                    const pj_time_val& send_time)
+{
+  if (stack_data.next_hops != NULL)
+  {
+    pj_time_val latency;
+    pj_gettickcount(&latency);
+    PJ_TIME_VAL_SUB(latency, send_time);
+    stack_data.next_hops->report_response(server, PJ_TIME_VAL_MSEC(latency));
+  }
+}
+
+
+/// Records that the specified server has rejected a request with a 503
+/// response.  This isn't treated as a failure of the server (so the server
+/// isn't blacklisted), but makes it less likely to be picked in subsequent
+/// resolve_next_hop calls.
+void PJUtils::report_server_overload(const AddrInfo& server)
+{
+  if (stack_data.next_hops != NULL)
+  {
+    stack_data.next_hops->report_failure(server, false, 0);
+  }
 }
 
 
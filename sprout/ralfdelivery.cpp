@@ -0,0 +1,576 @@
+/**
+ * @file ralfdelivery.cpp  Background delivery of ACRs to Ralf
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sstream>
+
+#include "log.h"
+#include "ralfdelivery.h"
+
+RalfDeliveryQueue::RalfDeliveryQueue(HttpClient* ralf,
+                                     int max_queue_size,
+                                     int max_in_flight,
+                                     const std::string& spool_dir,
+                                     LastValueCache* stats_aggregator) :
+  _ralf(ralf),
+  _max_queue_size(max_queue_size),
+  _max_in_flight(max_in_flight),
+  _queue(),
+  _terminating(false),
+  _stopped(false),
+  _drain_deadline_ms(0),
+  _overflow(),
+  _overflow_pending(0),
+  _in_flight(0),
+  _responses(new Responses(this)),
+  _spool(NULL),
+  _spool_offset(0),
+  _spooled(0),
+  _dropped(0),
+  _failed(0),
+  _statistic("ralf_delivery", stats_aggregator)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_mutex_init(&_spool_lock, NULL);
+
+  if (spool_dir != "")
+  {
+    open_spool(spool_dir);
+  }
+
+  report_stats();
+
+  int rc = pthread_create(&_thread, NULL, &delivery_thread, this);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to create Ralf delivery thread, rc = %d", rc);
+  }
+}
+
+
+RalfDeliveryQueue::~RalfDeliveryQueue()
+{
+  stop(DRAIN_TIMEOUT_MS);
+
+  if (_spool != NULL)
+  {
+    fclose(_spool);
+  }
+
+  pthread_mutex_destroy(&_spool_lock);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+RalfDeliveryQueue::Responses::Responses(RalfDeliveryQueue* queue) :
+  queue(queue)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+
+RalfDeliveryQueue::Responses::~Responses()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+
+void RalfDeliveryQueue::stop(int timeout_ms)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_stopped)
+  {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  _stopped = true;
+  _terminating = true;
+  _drain_deadline_ms = now_ms() + timeout_ms;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  pthread_join(_thread, NULL);
+
+  // Stop responses that are still to arrive from touching the queue.
+  pthread_mutex_lock(&_responses->lock);
+  _responses->queue = NULL;
+  pthread_mutex_unlock(&_responses->lock);
+
+  if (_in_flight > 0)
+  {
+    LOG_WARNING("Abandoning %d ACRs still awaiting a response from Ralf",
+                (int)_in_flight);
+    _dropped += _in_flight;
+    _in_flight = 0;
+  }
+
+  // Keep anything that hasn't been sent in the spool if we have one.
+  if (!_queue.empty())
+  {
+    LOG_WARNING("Ralf delivery queue stopped with %d ACRs undelivered",
+                (int)_queue.size());
+  }
+
+  while (!_queue.empty())
+  {
+    if (!spool(_queue.front()))
+    {
+      ++_dropped;
+    }
+    _queue.pop_front();
+  }
+
+  spool_overflow(_overflow);
+  _overflow.clear();
+  _overflow_pending = 0;
+
+  report_stats();
+}
+
+
+void RalfDeliveryQueue::send(const std::string& path,
+                             const std::string& body,
+                             SAS::TrailId trail)
+{
+  QueuedACR acr;
+  acr.path = path;
+  acr.body = body;
+  acr.trail = trail;
+
+  pthread_mutex_lock(&_lock);
+
+  // Once ACRs are overflowing, later ones go behind them until the spool has
+  // drained, so ACRs are delivered in order.  The delivery thread does the
+  // spooling, so this never waits on the disk.
+  if ((_overflow_pending == 0) &&
+      (_spooled == 0) &&
+      (_queue.size() < _max_queue_size))
+  {
+    _queue.push_back(acr);
+    pthread_cond_signal(&_cond);
+  }
+  else if ((_spool != NULL) &&
+           (_overflow.size() < _max_queue_size))
+  {
+    _overflow.push_back(acr);
+    ++_overflow_pending;
+    pthread_cond_signal(&_cond);
+  }
+  else
+  {
+    LOG_WARNING("Ralf delivery queue full, dropping ACR for %s", path.c_str());
+    ++_dropped;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void* RalfDeliveryQueue::delivery_thread(void* p)
+{
+  ((RalfDeliveryQueue*)p)->deliver();
+  return NULL;
+}
+
+
+void RalfDeliveryQueue::deliver()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    if (!_overflow.empty())
+    {
+      // Spool the ACRs that didn't fit on the queue.  They stay counted in
+      // _overflow_pending until they are in the spool, so senders keep
+      // putting new ACRs behind them.
+      std::deque<QueuedACR> overflow;
+      overflow.swap(_overflow);
+      pthread_mutex_unlock(&_lock);
+
+      spool_overflow(overflow);
+
+      pthread_mutex_lock(&_lock);
+      _overflow_pending -= overflow.size();
+      continue;
+    }
+
+    // When terminating, carry on sending what is on the queue and waiting
+    // for responses until the drain time is up.  Anything in the spool stays
+    // there for the next run.
+    if ((_terminating) &&
+        (((_queue.empty()) && (_in_flight == 0)) ||
+         (now_ms() >= _drain_deadline_ms)))
+    {
+      break;
+    }
+
+    // Fill the free slots in the window.  Anything on the queue is older
+    // than anything in the spool, so send that first.
+    size_t space = (_in_flight < _max_in_flight) ?
+                                          (_max_in_flight - _in_flight) : 0;
+    std::vector<QueuedACR> acrs;
+    while ((!_queue.empty()) && (acrs.size() < space))
+    {
+      acrs.push_back(_queue.front());
+      _queue.pop_front();
+    }
+
+    bool read_spool = ((acrs.empty()) &&
+                       (space > 0) &&
+                       (_spooled > 0) &&
+                       (!_terminating));
+
+    if ((acrs.empty()) && (!read_spool))
+    {
+      // Nothing can be sent until an ACR is queued or a response arrives.
+      if (_terminating)
+      {
+        struct timespec ts;
+        ts.tv_sec = _drain_deadline_ms / 1000;
+        ts.tv_nsec = (_drain_deadline_ms % 1000) * 1000000L;
+        pthread_cond_timedwait(&_cond, &_lock, &ts);
+      }
+      else
+      {
+        pthread_cond_wait(&_cond, &_lock);
+      }
+      continue;
+    }
+
+    _in_flight += acrs.size();
+    pthread_mutex_unlock(&_lock);
+
+    if (read_spool)
+    {
+      unspool(space, acrs);
+      pthread_mutex_lock(&_lock);
+      _in_flight += acrs.size();
+      pthread_mutex_unlock(&_lock);
+    }
+
+    send_acrs(acrs);
+    report_stats();
+
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Sends ACRs to Ralf.  They must already be counted in _in_flight, and
+/// each response frees up a slot for the next ACR.
+void RalfDeliveryQueue::send_acrs(const std::vector<QueuedACR>& acrs)
+{
+  LOG_DEBUG("Sending %d ACRs to Ralf", (int)acrs.size());
+
+  std::map<std::string, std::string> headers;
+  std::shared_ptr<Responses> responses = _responses;
+
+  for (std::vector<QueuedACR>::const_iterator i = acrs.begin();
+       i != acrs.end();
+       ++i)
+  {
+    std::string path = i->path;
+    _ralf->send_post(path,
+                     headers,
+                     i->body,
+                     [responses, path](HTTPCode rc, const std::string& rsp)
+                     {
+                       if (rc != HTTP_OK)
+                       {
+                         LOG_WARNING("Failed to send Ralf ACR message for %s, rc = %ld",
+                                     path.c_str(), rc);
+                       }
+
+                       pthread_mutex_lock(&responses->lock);
+                       if (responses->queue != NULL)
+                       {
+                         responses->queue->on_response(rc);
+                       }
+                       pthread_mutex_unlock(&responses->lock);
+                     },
+                     i->trail);
+  }
+}
+
+
+void RalfDeliveryQueue::on_response(HTTPCode rc)
+{
+  if (rc != HTTP_OK)
+  {
+    ++_failed;
+  }
+
+  pthread_mutex_lock(&_lock);
+  --_in_flight;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+/// Writes ACRs that overflowed the queue to the spool, dropping any that
+/// can't be written.
+void RalfDeliveryQueue::spool_overflow(const std::deque<QueuedACR>& overflow)
+{
+  for (std::deque<QueuedACR>::const_iterator i = overflow.begin();
+       i != overflow.end();
+       ++i)
+  {
+    if (!spool(*i))
+    {
+      LOG_WARNING("Failed to spool ACR for %s, dropping it", i->path.c_str());
+      ++_dropped;
+    }
+  }
+}
+
+
+void RalfDeliveryQueue::report_stats()
+{
+  pthread_mutex_lock(&_lock);
+  size_t queue_size = _queue.size();
+  size_t in_flight = _in_flight;
+  pthread_mutex_unlock(&_lock);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(queue_size));
+  values.push_back(std::to_string(_spooled.load()));
+  values.push_back(std::to_string(in_flight));
+  values.push_back(std::to_string(_dropped.load()));
+  values.push_back(std::to_string(_failed.load()));
+  _statistic.report_change(values);
+}
+
+
+uint64_t RalfDeliveryQueue::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+/// Opens the spool file, counting any ACRs left in it by a previous run.
+void RalfDeliveryQueue::open_spool(const std::string& spool_dir)
+{
+  std::string filename = spool_dir + "/ralf_acrs.spool";
+  _spool = fopen(filename.c_str(), "a+");
+
+  if (_spool == NULL)
+  {
+    LOG_ERROR("Failed to open Ralf ACR spool file %s", filename.c_str());
+    return;
+  }
+
+  // Leave any ACRs in the spool to be sent by the delivery thread.
+  QueuedACR acr;
+  fseek(_spool, 0, SEEK_SET);
+  while (next_acr(_spool, acr))
+  {
+    ++_spooled;
+  }
+  _spool_offset = 0;
+
+  if (_spooled > 0)
+  {
+    LOG_INFO("Found %d spooled ACRs in %s", _spooled.load(), filename.c_str());
+  }
+}
+
+
+/// Appends an ACR to the spool file.  Each ACR is written as a header line
+/// holding the path, SAS trail and body length, then the body.
+bool RalfDeliveryQueue::spool(const QueuedACR& acr)
+{
+  bool success = false;
+
+  pthread_mutex_lock(&_spool_lock);
+
+  if (_spool != NULL)
+  {
+    // The file is opened for appending, so this write goes at the end, but a
+    // seek is needed between reading and writing the stream.
+    fseek(_spool, 0, SEEK_END);
+    success = ((fprintf(_spool, "%s %lu %lu\n",
+                        acr.path.c_str(),
+                        (unsigned long)acr.trail,
+                        (unsigned long)acr.body.length()) > 0) &&
+               (fwrite(acr.body.data(), 1, acr.body.length(), _spool) == acr.body.length()) &&
+               (fputc('\n', _spool) != EOF) &&
+               (fflush(_spool) == 0));
+
+    if (success)
+    {
+      ++_spooled;
+    }
+    else
+    {
+      LOG_ERROR("Failed to write ACR to spool file");
+    }
+  }
+
+  pthread_mutex_unlock(&_spool_lock);
+
+  return success;
+}
+
+
+/// Reads the ACR at the current position in the spool file.  If the record
+/// there is corrupt, the file is left positioned just after the line that
+/// should have been its header, so the caller can look for the next record.
+RalfDeliveryQueue::ReadResult RalfDeliveryQueue::read_acr(FILE* file,
+                                                          QueuedACR& acr)
+{
+  char* line = NULL;
+  size_t line_size = 0;
+
+  if (getline(&line, &line_size, file) <= 0)
+  {
+    free(line);
+    return READ_EOF;
+  }
+
+  long body_start = ftell(file);
+  unsigned long trail = 0;
+  size_t length = 0;
+  std::istringstream header(line);
+  header >> acr.path >> trail >> length;
+  free(line);
+  acr.trail = trail;
+
+  // The header must hold exactly the path, trail and length, and the body
+  // must fit in the rest of the file.
+  struct stat st;
+  if ((header.fail()) ||
+      (!(header >> std::ws).eof()) ||
+      (fstat(fileno(file), &st) != 0) ||
+      (body_start < 0) ||
+      (length >= (size_t)(st.st_size - body_start)))
+  {
+    return READ_CORRUPT;
+  }
+
+  acr.body.resize(length);
+
+  if ((fread(&acr.body[0], 1, length, file) != length) ||
+      (fgetc(file) != '\n'))
+  {
+    fseek(file, body_start, SEEK_SET);
+    return READ_CORRUPT;
+  }
+
+  return READ_OK;
+}
+
+
+/// Reads the next ACR from the spool file, skipping over any corrupt
+/// records.  Returns false at the end of the file.
+bool RalfDeliveryQueue::next_acr(FILE* file, QueuedACR& acr)
+{
+  ReadResult result = read_acr(file, acr);
+
+  if (result == READ_CORRUPT)
+  {
+    LOG_ERROR("Ralf ACR spool file is corrupt, skipping to the next valid record");
+
+    do
+    {
+      result = read_acr(file, acr);
+    }
+    while (result == READ_CORRUPT);
+  }
+
+  return (result == READ_OK);
+}
+
+
+/// Reads up to max_acrs ACRs from the spool.  The spool is emptied once
+/// everything in it has been read.
+void RalfDeliveryQueue::unspool(int max_acrs, std::vector<QueuedACR>& acrs)
+{
+  pthread_mutex_lock(&_spool_lock);
+
+  if (_spool != NULL)
+  {
+    fseek(_spool, _spool_offset, SEEK_SET);
+
+    bool eof = false;
+    QueuedACR acr;
+
+    while ((int)acrs.size() < max_acrs)
+    {
+      if (!next_acr(_spool, acr))
+      {
+        eof = true;
+        break;
+      }
+
+      acrs.push_back(acr);
+      --_spooled;
+    }
+
+    if ((eof) || (_spooled == 0))
+    {
+      // Everything has been read, so empty the file.
+      if (ftruncate(fileno(_spool), 0) != 0)
+      {
+        LOG_ERROR("Failed to truncate Ralf ACR spool file");
+      }
+      _spool_offset = 0;
+      _spooled = 0;
+    }
+    else
+    {
+      _spool_offset = ftell(_spool);
+    }
+  }
+
+  pthread_mutex_unlock(&_spool_lock);
+}
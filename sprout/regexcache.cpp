@@ -0,0 +1,143 @@
+/**
+ * @file regexcache.cpp  Process-wide cache of compiled regular expressions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include "log.h"
+#include "regexcache.h"
+
+pthread_once_t RegexCache::_instance_once = PTHREAD_ONCE_INIT;
+RegexCache* RegexCache::_instance = NULL;
+
+RegexCache::RegexCache(size_t max_patterns) :
+  _cache(max_patterns),
+  _hits(0),
+  _misses(0),
+  _statistic(NULL)
+{
+  pthread_mutex_init(&_stats_lock, NULL);
+}
+
+
+RegexCache::~RegexCache()
+{
+  disable_stats();
+  pthread_mutex_destroy(&_stats_lock);
+}
+
+
+void RegexCache::create_instance()
+{
+  _instance = new RegexCache(MAX_PATTERNS);
+}
+
+
+RegexCache* RegexCache::instance()
+{
+  pthread_once(&_instance_once, &create_instance);
+  return _instance;
+}
+
+
+RegexCache::Regex RegexCache::get(const std::string& pattern)
+{
+  Regex regex;
+
+  if (_cache.get(pattern, regex))
+  {
+    if ((++_hits % STATS_HIT_INTERVAL) == 0)
+    {
+      report_stats();
+    }
+    return regex;
+  }
+
+  // Compile the pattern.  Invalid patterns are cached (as NULL) too, so
+  // they aren't recompiled every time they are used.
+  ++_misses;
+  boost::regex* compiled =
+                   new boost::regex(pattern, boost::regex_constants::no_except);
+  if (compiled->status() == 0)
+  {
+    regex = Regex(compiled);
+  }
+  else
+  {
+    LOG_DEBUG("Invalid regular expression %s", pattern.c_str());
+    delete compiled;
+  }
+
+  _cache.put(pattern, regex, NO_EXPIRY);
+  report_stats();
+
+  return regex;
+}
+
+
+void RegexCache::enable_stats(LastValueCache* stats_aggregator)
+{
+  pthread_mutex_lock(&_stats_lock);
+  delete _statistic;
+  _statistic = new Statistic("regex_cache", stats_aggregator);
+  pthread_mutex_unlock(&_stats_lock);
+
+  report_stats();
+}
+
+
+void RegexCache::disable_stats()
+{
+  pthread_mutex_lock(&_stats_lock);
+  delete _statistic;
+  _statistic = NULL;
+  pthread_mutex_unlock(&_stats_lock);
+}
+
+
+/// Reports the number of patterns cached, and the number of hits and
+/// misses.
+void RegexCache::report_stats()
+{
+  pthread_mutex_lock(&_stats_lock);
+  if (_statistic != NULL)
+  {
+    std::vector<std::string> values;
+    values.push_back(std::to_string(_cache.size()));
+    values.push_back(std::to_string(_hits.load()));
+    values.push_back(std::to_string(_misses.load()));
+    _statistic->report_change(values);
+  }
+  pthread_mutex_unlock(&_stats_lock);
+}
@@ -47,13 +47,32 @@
 
 SCSCFSelector::SCSCFSelector(std::string configuration) :
   _configuration(configuration),
+  _config(new Config()),
   _updater(NULL)
 {
+  pthread_rwlock_init(&_config_lock, NULL);
+
   // create an updater
   _updater = new Updater<void, SCSCFSelector>(this, std::mem_fun(&SCSCFSelector::update_scscf));
 }
 
 void SCSCFSelector::update_scscf()
+{
+  Config* config = read_scscfs();
+
+  if (config != NULL)
+  {
+    std::shared_ptr<Config> new_config(config);
+
+    // Swap the new configuration in.  The old one is deleted when the last
+    // selection using it releases its reference.
+    pthread_rwlock_wrlock(&_config_lock);
+    _config.swap(new_config);
+    pthread_rwlock_unlock(&_config_lock);
+  }
+}
+
+SCSCFSelector::Config* SCSCFSelector::read_scscfs() const
 {
   Json::Value root;
   Json::Reader reader;
@@ -61,8 +80,6 @@ void SCSCFSelector::update_scscf()
   std::string jsonData;
   std::ifstream file;
 
-  std::vector<scscf_t> new_scscfs;
-
   // Check whether the file exists.
   struct stat s;
   if ((stat(_configuration.c_str(), &s) != 0) &&
@@ -70,78 +87,101 @@ void SCSCFSelector::update_scscf()
   {
     LOG_STATUS("No S-CSCF configuration data (file %s does not exist)",
                _configuration.c_str());
-    return;
+    return NULL;
   }
 
   // The file exists so try to open it.
   LOG_STATUS("Loading S-CSCF configuration from %s", _configuration.c_str());
 
   file.open(_configuration.c_str());
-  if (file.is_open())
+  if (!file.is_open())
   {
-    if (!reader.parse(file, root))
-    {
-      LOG_WARNING("Failed to read S-CSCF configuration data, %s",
-                  reader.getFormattedErrorMessages().c_str());
-      return;
-    }
+    //LCOV_EXCL_START
+    LOG_WARNING("Failed to read S-CSCF configuration data %d", file.rdstate());
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
+
+  if (!reader.parse(file, root))
+  {
+    LOG_WARNING("Failed to read S-CSCF configuration data, %s",
+                reader.getFormattedErrorMessages().c_str());
+    return NULL;
+  }
+
+  file.close();
+
+  if (!root["s-cscfs"].isArray())
+  {
+    LOG_WARNING("Badly formed S-CSCF configuration file - missing s-cscfs object");
+    return NULL;
+  }
+
+  Config* config = new Config();
+  Json::Value scscfs = root["s-cscfs"];
 
-    file.close();
+  for (size_t ii = 0; ii < scscfs.size(); ++ii)
+  {
+    Json::Value scscf = scscfs[(int)ii];
 
-    if (root["s-cscfs"].isArray())
+    if ((scscf["server"].isString()) &&
+        (scscf["priority"].isInt()) &&
+        (scscf["weight"].isInt()) &&
+        (scscf["capabilities"].isArray()))
     {
-      Json::Value scscfs = root["s-cscfs"];
+      scscf_t new_scscf;
 
-      for (size_t ii = 0; ii < scscfs.size(); ++ii)
+      new_scscf.server = scscf["server"].asString();
+      new_scscf.priority = scscf["priority"].asInt();
+      new_scscf.weight = scscf["weight"].asInt();
+
+      // Give each capability an ID the first time it is seen, and set its
+      // bit for this S-CSCF.
+      Json::Value capabilities_vals = scscf["capabilities"];
+
+      for (size_t jj = 0; jj < capabilities_vals.size(); ++jj)
       {
-        Json::Value scscf = scscfs[(int)ii];
+        int capability = capabilities_vals[(int)jj].asInt();
+        std::unordered_map<int, int>::const_iterator id =
+                                      config->capability_ids.find(capability);
+
+        int cap_id;
 
-        if ((scscf["server"].isString()) &&
-            (scscf["priority"].isInt()) &&
-            (scscf["weight"].isInt()) &&
-            (scscf["capabilities"].isArray()))
+        if (id != config->capability_ids.end())
         {
-          scscf_t new_scscf;
-
-          new_scscf.server = scscf["server"].asString();
-          new_scscf.priority = scscf["priority"].asInt();
-          new_scscf.weight = scscf["weight"].asInt();
-
-          Json::Value capabilities_vals = scscf["capabilities"];
-          std::vector<int> capabilities_vec;
-
-          for (size_t jj = 0; jj < capabilities_vals.size(); ++jj)
-          {
-            Json::Value capability_val = capabilities_vals[(int)jj];
-            capabilities_vec.push_back(capability_val.asInt());
-          }
-
-          // Sort the capabalities and remove duplicates
-          std::sort(capabilities_vec.begin(), capabilities_vec.end());
-          capabilities_vec.erase(unique(capabilities_vec.begin(), capabilities_vec.end() ), capabilities_vec.end() );
-          new_scscf.capabilities = capabilities_vec;
-          new_scscfs.push_back(new_scscf);
-          capabilities_vec.clear();
+          cap_id = id->second;
         }
         else
         {
-          LOG_WARNING("Badly formed S-CSCF entry %s", scscf.toStyledString().c_str());
+          cap_id = config->capability_ids.size();
+          config->capability_ids[capability] = cap_id;
         }
+
+        if ((size_t)cap_id >= new_scscf.capabilities.size())
+        {
+          new_scscf.capabilities.resize(cap_id + 1);
+        }
+        new_scscf.capabilities.set(cap_id);
       }
 
-      _scscfs = new_scscfs;
+      config->scscfs.push_back(new_scscf);
     }
     else
     {
-      LOG_WARNING("Badly formed S-CSCF configuration file - missing s-cscfs object");
+      LOG_WARNING("Badly formed S-CSCF entry %s", scscf.toStyledString().c_str());
     }
   }
-  else
+
+  // Now all the capabilities have IDs, make every S-CSCF's set the same size
+  // so they can be compared with the sets built for each request.
+  for (std::vector<scscf_t>::iterator it = config->scscfs.begin();
+       it != config->scscfs.end();
+       ++it)
   {
-    //LCOV_EXCL_START
-    LOG_WARNING("Failed to read S-CSCF configuration data %d", file.rdstate());
-    //LCOV_EXCL_STOP
+    it->capabilities.resize(config->capability_ids.size());
   }
+
+  return config;
 }
 
 SCSCFSelector::~SCSCFSelector()
@@ -149,6 +189,59 @@ SCSCFSelector::~SCSCFSelector()
   // Destroy the updater
   delete _updater;
   _updater = NULL;
+
+  pthread_rwlock_destroy(&_config_lock);
+}
+
+bool SCSCFSelector::Config::capability_set(const std::vector<int>& capabilities,
+                                           Capabilities& set) const
+{
+  bool known = true;
+  set.resize(capability_ids.size());
+
+  for (std::vector<int>::const_iterator ii = capabilities.begin();
+       ii != capabilities.end();
+       ++ii)
+  {
+    std::unordered_map<int, int>::const_iterator id = capability_ids.find(*ii);
+    if (id != capability_ids.end())
+    {
+      set.set(id->second);
+    }
+    else
+    {
+      known = false;
+    }
+  }
+
+  return known;
+}
+
+/// Returns a capabilities list, sorted and without duplicates, as reported
+/// in SAS events.
+std::string SCSCFSelector::capabilities_str(const std::vector<int>& capabilities)
+{
+  std::vector<int> sorted = capabilities;
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+  std::string str;
+  for (std::vector<int>::const_iterator ii = sorted.begin(); ii != sorted.end(); ++ii)
+  {
+    str.append(std::to_string(*ii)).append(";");
+  }
+  return str;
+}
+
+/// Returns the list of rejected S-CSCFs as reported in SAS events.
+std::string SCSCFSelector::rejects_str(const std::vector<std::string>& rejects)
+{
+  std::string str;
+  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
+  {
+    str.append(*ii).append(";");
+  }
+  return str;
 }
 
 std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
@@ -156,8 +249,14 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
                                      const std::vector<std::string> &rejects,
                                      SAS::TrailId trail)
 {
+  // Hold a reference to the configuration until the selection is complete,
+  // in case it is updated in the meantime.
+  pthread_rwlock_rdlock(&_config_lock);
+  std::shared_ptr<Config> config = _config;
+  pthread_rwlock_unlock(&_config_lock);
+
   // There are no configured S-CSCFs.
-  if (_scscfs.empty())
+  if (config->scscfs.empty())
   {
     SAS::Event event(trail, SASEvent::SCSCF_NONE_CONFIGURED, 0);
     SAS::report_event(event);
@@ -166,73 +265,53 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
     return std::string();
   }
 
-  // There's at least one S-CSCF, so check if any match the capabilities requested
-  std::string reject_str;
-  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
-  {
-    reject_str = reject_str + *ii + ";";
-  }
-
-  // Sort the mandatory capabilities, and remove duplicates.
-  std::vector<int> mandatory_cap = mandatory;
-  std::sort(mandatory_cap.begin(), mandatory_cap.end());
-  mandatory_cap.erase(unique(mandatory_cap.begin(), mandatory_cap.end()), mandatory_cap.end());
-  std::string mandatory_str;
-  for (std::vector<int>::const_iterator ii = mandatory_cap.begin(); ii != mandatory_cap.end(); ++ii)
-  {
-    mandatory_str = mandatory_str + std::to_string(*ii) + ";";
-  }
-
-  // Sort the optional capabilities, and remove duplicates.
-  std::vector<int> optional_cap = optional;
-  std::sort(optional_cap.begin(), optional_cap.end());
-  optional_cap.erase(unique(optional_cap.begin(), optional_cap.end()), optional_cap.end());
-  std::string optional_str;
-  for (std::vector<int>::const_iterator ii = optional_cap.begin(); ii != optional_cap.end(); ++ii)
-  {
-    optional_str = optional_str + std::to_string(*ii) + ";";
-  }
+  // There's at least one S-CSCF, so check if any match the capabilities
+  // requested.  If a mandatory capability isn't one that any S-CSCF has then
+  // none can match.  An unknown optional capability can just be ignored.
+  Capabilities mandatory_cap;
+  Capabilities optional_cap;
+  bool mandatory_known = config->capability_set(mandatory, mandatory_cap);
+  config->capability_set(optional, optional_cap);
 
   // Find all S-CSCFs that have all the mandatory capabilities, the highest possible number
   // of optional capabilities, and the highest priority (closest to 0).
   // Also sum up the weights of the valid S-CSCFs as part of the iteration
-  std::vector<scscf> matches;
-  u_int max_size = 0;
+  std::vector<const scscf_t*> matches;
+  size_t max_size = 0;
   int priority = 0;
   int sum = 0;
 
-  for (std::vector<scscf>::iterator it=_scscfs.begin(); it!=_scscfs.end(); ++it)
+  for (std::vector<scscf_t>::const_iterator it = config->scscfs.begin();
+       (mandatory_known) && (it != config->scscfs.end());
+       ++it)
   {
-    // Only include the S-CSCF if its name isn't in the list of S-CSCFs to reject and it has all of
-    // the mandatory capabilities
-    if ((std::find(rejects.begin(), rejects.end(), it->server) == rejects.end()) &&
-        (std::includes(it->capabilities.begin(), it->capabilities.end(), mandatory_cap.begin(), mandatory_cap.end())))
+    // Only include the S-CSCF if it has all of the mandatory capabilities
+    // and its name isn't in the list of S-CSCFs to reject.
+    if ((mandatory_cap.is_subset_of(it->capabilities)) &&
+        (std::find(rejects.begin(), rejects.end(), it->server) == rejects.end()))
     {
-      std::vector<int> intersection;
-      std::set_intersection(it->capabilities.begin(), it->capabilities.end(),
-                            optional_cap.begin(), optional_cap.end(),
-                            std::back_inserter(intersection));
+      size_t num_optional = (it->capabilities & optional_cap).count();
 
-      if (intersection.size() > max_size ||
+      if (num_optional > max_size ||
           matches.size() == 0)
       {
         matches.clear();
-        matches.push_back(*it);
-        max_size = intersection.size();
+        matches.push_back(&(*it));
+        max_size = num_optional;
         priority = it->priority;
         sum = it->weight;
       }
-      else if (intersection.size() == max_size)
+      else if (num_optional == max_size)
       {
         if (it->priority == priority)
         {
-          matches.push_back(*it);
+          matches.push_back(&(*it));
           sum += it->weight;
         }
         else if (it->priority < priority)
         {
           matches.clear();
-          matches.push_back(*it);
+          matches.push_back(&(*it));
           priority = it->priority;
           sum = it->weight;
         }
@@ -242,12 +321,15 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
 
   // If there are no matches, return an empty string (there will only be no matches
   // if no S-CSCFs had all the requested mandatory capabilities).
-  // If there's only one match, then return its name.
   if (matches.empty())
   {
+    std::string mandatory_str = capabilities_str(mandatory);
     LOG_WARNING("There are no configured S-CSCFs that have the requested mandatory capabilities (%s)",
                 mandatory_str.c_str());
 
+    std::string optional_str = capabilities_str(optional);
+    std::string reject_str = rejects_str(rejects);
+
     SAS::Event event(trail, SASEvent::SCSCF_NONE_VALID, 0);
     event.add_var_param(mandatory_str);
     event.add_var_param(optional_str);
@@ -256,51 +338,45 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
 
     return std::string();
   }
-  else if (matches.size() == 1)
-  {
-    LOG_DEBUG("Selected S-CSCF is %s",  matches[0].server.c_str());
-
-    SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-    event.add_var_param(matches[0].server);
-    event.add_var_param(mandatory_str);
-    event.add_var_param(optional_str);
-    std::string priority_str = std::to_string(matches[0].priority);
-    std::string weight_str = std::to_string(matches[0].weight);
-    event.add_var_param(priority_str);
-    event.add_var_param(weight_str);
-    event.add_var_param(reject_str);
-    SAS::report_event(event);
 
-    return matches[0].server.c_str();
-  }
+  // If there's only one match, then select it.  Otherwise there are multiple
+  // S-CSCFs that match on all mandatory capabilities, the highest number of
+  // optional capabilities, and the highest priority, so select one using a
+  // weighted random choice.
+  size_t index = 0;
 
-  // There are multiple S-CSCFs that match on all mandatory capabilities, the highest number of optional
-  // capabilities, and the highest priority. Select one using a weighted random choice.
-  srand(time(NULL));
-  int random;
-  random = rand() % sum;
+  if (matches.size() > 1)
+  {
+    srand(time(NULL));
+    int random;
+    random = rand() % sum;
 
-  int index = 0;
-  int accumulator = matches[index].weight;
+    int accumulator = matches[index]->weight;
 
-  while (accumulator <= random)
-  {
-    index++;
-    accumulator +=  matches[index].weight;
+    while (accumulator <= random)
+    {
+      index++;
+      accumulator += matches[index]->weight;
+    }
   }
 
-  LOG_DEBUG("Selected S-CSCF is %s",  matches[index].server.c_str());
+  const scscf_t* selected = matches[index];
+  LOG_DEBUG("Selected S-CSCF is %s", selected->server.c_str());
+
+  std::string mandatory_str = capabilities_str(mandatory);
+  std::string optional_str = capabilities_str(optional);
+  std::string priority_str = std::to_string(selected->priority);
+  std::string weight_str = std::to_string(selected->weight);
+  std::string reject_str = rejects_str(rejects);
 
   SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-  event.add_var_param(matches[index].server);
+  event.add_var_param(selected->server);
   event.add_var_param(mandatory_str);
   event.add_var_param(optional_str);
-  std::string priority_str = std::to_string(matches[index].priority);
-  std::string weight_str = std::to_string(matches[index].weight);
   event.add_var_param(priority_str);
   event.add_var_param(weight_str);
   event.add_var_param(reject_str);
   SAS::report_event(event);
 
-  return matches[index].server;
+  return selected->server;
 }
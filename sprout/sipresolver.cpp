@@ -34,13 +34,23 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <limits.h>
+#include <time.h>
+#include <algorithm>
+
 #include "log.h"
 #include "sipresolver.h"
 #include "sas.h"
 #include "sproutsasevent.h"
 
-SIPResolver::SIPResolver(DnsCachedResolver* dns_client) :
-  BaseResolver(dns_client)
+SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
+                         int num_threads,
+                         int grace_secs) :
+  BaseResolver(dns_client),
+  _grace_ms((uint64_t)grace_secs * 1000),
+  _jobs(),
+  _terminating(false),
+  _threads()
 {
   LOG_DEBUG("Creating SIP resolver");
 
@@ -56,11 +66,66 @@ SIPResolver::SIPResolver(DnsCachedResolver* dns_client) :
   // Create the blacklist.
   create_blacklist();
 
+  // Create the threads that run refreshes.
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+  pthread_mutex_init(&_jobs_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_refresh_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, &resolver_thread, this);
+    if (rc == 0)
+    {
+      _threads.push_back(thread);
+    }
+    else
+    {
+      LOG_ERROR("Failed to create SIP resolver thread, rc = %d", rc);
+    }
+  }
+
+  int rc = pthread_create(&_refresh_thread, NULL, &refresh_thread, this);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to create SIP resolver refresh thread, rc = %d", rc);
+  }
+
   LOG_STATUS("Created SIP resolver");
 }
 
 SIPResolver::~SIPResolver()
 {
+  pthread_mutex_lock(&_jobs_lock);
+  _terminating = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_cond_signal(&_refresh_cond);
+  pthread_mutex_unlock(&_jobs_lock);
+
+  for (std::vector<pthread_t>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+  pthread_join(_refresh_thread, NULL);
+
+  pthread_cond_destroy(&_refresh_cond);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_jobs_lock);
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+
   destroy_blacklist();
   destroy_srv_cache();
   destroy_naptr_cache();
@@ -74,7 +139,348 @@ void SIPResolver::resolve(const std::string& name,
                           std::vector<AddrInfo>& targets,
                           SAS::TrailId trail)
 {
-  int dummy_ttl = 0;
+  std::string key = resolution_key(name, af, port, transport);
+
+  if (!resolve_without_waiting(key, name, af, port, transport, retries, targets, trail))
+  {
+    // Resolve the full list of targets to hold, and return as many as were
+    // asked for.
+    int ttl;
+    do_resolve(name,
+               af,
+               port,
+               transport,
+               std::max(retries, (int)MAX_HELD_TARGETS),
+               targets,
+               ttl,
+               trail);
+    hold_resolution(key, name, af, port, transport, targets, ttl);
+
+    if (targets.size() > (size_t)retries)
+    {
+      targets.resize(retries);
+    }
+  }
+}
+
+void SIPResolver::blacklist(const AddrInfo& ai, int ttl)
+{
+  BaseResolver::blacklist(ai, ttl);
+
+  // Make sure a held resolution never returns the blacklisted target.  If
+  // that leaves a resolution with no targets, drop it.
+  for (int ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    Shard& shard = _shards[ii];
+    pthread_mutex_lock(&shard.lock);
+    std::unordered_map<std::string, Resolution>::iterator it = shard.resolutions.begin();
+    while (it != shard.resolutions.end())
+    {
+      std::vector<AddrInfo>& targets = it->second.targets;
+      for (size_t jj = 0; jj < targets.size(); )
+      {
+        if (same_target(targets[jj], ai))
+        {
+          targets.erase(targets.begin() + jj);
+        }
+        else
+        {
+          ++jj;
+        }
+      }
+
+      if (targets.empty())
+      {
+        it = shard.resolutions.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+}
+
+std::string SIPResolver::resolution_key(const std::string& name,
+                                        int af,
+                                        int port,
+                                        int transport)
+{
+  std::string key = name;
+  key.append("/").append(std::to_string(af))
+     .append("/").append(std::to_string(port))
+     .append("/").append(std::to_string(transport));
+  return key;
+}
+
+SIPResolver::Shard& SIPResolver::shard_for(const std::string& key)
+{
+  return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+}
+
+uint64_t SIPResolver::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool SIPResolver::same_target(const AddrInfo& lhs, const AddrInfo& rhs)
+{
+  return ((lhs.address.compare(rhs.address) == 0) &&
+          (lhs.port == rhs.port) &&
+          (lhs.transport == rhs.transport));
+}
+
+bool SIPResolver::resolve_without_waiting(const std::string& key,
+                                          const std::string& name,
+                                          int af,
+                                          int port,
+                                          int transport,
+                                          int retries,
+                                          std::vector<AddrInfo>& targets,
+                                          SAS::TrailId trail)
+{
+  uint64_t now = now_ms();
+  bool resolved = false;
+  bool fresh = false;
+  IP46Address address;
+
+  if (parse_ip_target(name, address))
+  {
+    // IP addresses don't need DNS.
+    int ttl;
+    do_resolve(name, af, port, transport, retries, targets, ttl, trail);
+    return true;
+  }
+
+  Shard& shard = shard_for(key);
+  pthread_mutex_lock(&shard.lock);
+  std::unordered_map<std::string, Resolution>::iterator it = shard.resolutions.find(key);
+
+  if (it != shard.resolutions.end())
+  {
+    Resolution& resolution = it->second;
+    resolution.used = true;
+
+    if (now + REFRESH_AHEAD_MS < resolution.expires_ms)
+    {
+      // The DNS records are still cached, so resolve the name afresh.
+      fresh = true;
+    }
+    else if (now < resolution.expires_ms + _grace_ms)
+    {
+      // The DNS records are about to expire or have expired, so use the held
+      // resolution and make sure it is being refreshed.
+      LOG_DEBUG("Using held resolution of %s", name.c_str());
+      size_t num_targets = std::min(resolution.targets.size(), (size_t)retries);
+      targets.assign(resolution.targets.begin(),
+                     resolution.targets.begin() + num_targets);
+      queue_refresh(key, resolution, now);
+      resolved = true;
+    }
+    else
+    {
+      // The resolution is too old to use.
+      shard.resolutions.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  if (fresh)
+  {
+    int ttl;
+    do_resolve(name, af, port, transport, retries, targets, ttl, trail);
+    resolved = true;
+  }
+
+  return resolved;
+}
+
+void SIPResolver::hold_resolution(const std::string& key,
+                                  const std::string& name,
+                                  int af,
+                                  int port,
+                                  int transport,
+                                  const std::vector<AddrInfo>& targets,
+                                  int ttl)
+{
+  if ((ttl < MIN_HOLD_TTL_SECS) || (targets.empty()))
+  {
+    // Don't hold resolutions that failed or that expire almost immediately.
+    return;
+  }
+
+  Shard& shard = shard_for(key);
+  pthread_mutex_lock(&shard.lock);
+  if ((shard.resolutions.size() < MAX_RESOLUTIONS_PER_SHARD) ||
+      (shard.resolutions.find(key) != shard.resolutions.end()))
+  {
+    Resolution& resolution = shard.resolutions[key];
+    resolution.name = name;
+    resolution.af = af;
+    resolution.port = port;
+    resolution.transport = transport;
+    resolution.targets = targets;
+    resolution.expires_ms = now_ms() + (uint64_t)ttl * 1000;
+    resolution.next_refresh_ms = resolution.expires_ms;
+    resolution.used = false;
+    resolution.refreshing = false;
+  }
+  pthread_mutex_unlock(&shard.lock);
+}
+
+void SIPResolver::queue_refresh(const std::string& key,
+                                Resolution& resolution,
+                                uint64_t now)
+{
+  // The refresh has to wait until the records have expired from the DNS
+  // caches, otherwise it just gets the cached records again.
+  if ((!resolution.refreshing) &&
+      (now >= resolution.next_refresh_ms))
+  {
+    resolution.refreshing = true;
+
+    Job job;
+    job.key = key;
+    job.name = resolution.name;
+    job.af = resolution.af;
+    job.port = resolution.port;
+    job.transport = resolution.transport;
+
+    pthread_mutex_lock(&_jobs_lock);
+    _jobs.push_back(job);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_jobs_lock);
+  }
+}
+
+void* SIPResolver::resolver_thread(void* p)
+{
+  ((SIPResolver*)p)->run_jobs();
+  return NULL;
+}
+
+void SIPResolver::run_jobs()
+{
+  pthread_mutex_lock(&_jobs_lock);
+
+  while (!_terminating)
+  {
+    if (_jobs.empty())
+    {
+      pthread_cond_wait(&_cond, &_jobs_lock);
+      continue;
+    }
+
+    Job job = _jobs.front();
+    _jobs.pop_front();
+    pthread_mutex_unlock(&_jobs_lock);
+
+    std::vector<AddrInfo> targets;
+    int ttl;
+    do_resolve(job.name, job.af, job.port, job.transport, MAX_HELD_TARGETS, targets, ttl, 0);
+
+    if ((ttl >= MIN_HOLD_TTL_SECS) && (!targets.empty()))
+    {
+      LOG_DEBUG("Refreshed resolution of %s", job.name.c_str());
+      hold_resolution(job.key, job.name, job.af, job.port, job.transport, targets, ttl);
+    }
+    else
+    {
+      // The refresh failed, so keep using the current resolution (until its
+      // grace period runs out) and try again shortly.
+      LOG_DEBUG("Failed to refresh resolution of %s", job.name.c_str());
+      Shard& shard = shard_for(job.key);
+      pthread_mutex_lock(&shard.lock);
+      std::unordered_map<std::string, Resolution>::iterator it = shard.resolutions.find(job.key);
+      if (it != shard.resolutions.end())
+      {
+        it->second.refreshing = false;
+        it->second.next_refresh_ms = now_ms() + REFRESH_RETRY_MS;
+      }
+      pthread_mutex_unlock(&shard.lock);
+    }
+
+    pthread_mutex_lock(&_jobs_lock);
+  }
+
+  pthread_mutex_unlock(&_jobs_lock);
+}
+
+void* SIPResolver::refresh_thread(void* p)
+{
+  ((SIPResolver*)p)->run_refreshes();
+  return NULL;
+}
+
+/// Periodically refreshes the held resolutions that are in use as they
+/// expire, so they are ready before they are next needed, and drops the
+/// ones that are out of date.
+void SIPResolver::run_refreshes()
+{
+  pthread_mutex_lock(&_jobs_lock);
+
+  while (!_terminating)
+  {
+    pthread_mutex_unlock(&_jobs_lock);
+
+    // Check one shard at a time, so resolutions in the other shards can be
+    // used in the meantime.
+    uint64_t now = now_ms();
+    for (int ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      Shard& shard = _shards[ii];
+      pthread_mutex_lock(&shard.lock);
+      std::unordered_map<std::string, Resolution>::iterator it = shard.resolutions.begin();
+      while (it != shard.resolutions.end())
+      {
+        Resolution& resolution = it->second;
+
+        if (now >= resolution.expires_ms + _grace_ms)
+        {
+          it = shard.resolutions.erase(it);
+          continue;
+        }
+
+        if (resolution.used)
+        {
+          queue_refresh(it->first, resolution, now);
+        }
+        ++it;
+      }
+      pthread_mutex_unlock(&shard.lock);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += REFRESH_INTERVAL_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&_jobs_lock);
+    if (!_terminating)
+    {
+      pthread_cond_timedwait(&_refresh_cond, &_jobs_lock, &ts);
+    }
+  }
+
+  pthread_mutex_unlock(&_jobs_lock);
+}
+
+void SIPResolver::do_resolve(const std::string& name,
+                             int af,
+                             int port,
+                             int transport,
+                             int retries,
+                             std::vector<AddrInfo>& targets,
+                             int& ttl,
+                             SAS::TrailId trail)
+{
+  // The TTL of the result is the lowest TTL of all the records used.
+  int record_ttl = 0;
+  ttl = INT_MAX;
   targets.clear();
 
   // First determine the transport following the process in RFC3263 section
@@ -104,6 +510,9 @@ void SIPResolver::resolve(const std::string& name,
     ai.port = (port != 0) ? port : 5060;
     targets.push_back(ai);
 
+    // There's nothing to hold.
+    ttl = 0;
+
     if (trail != 0)
     {
       SAS::Event event(trail, SASEvent::SIPRESOLVE_IP_ADDRESS, 0);
@@ -118,196 +527,328 @@ void SIPResolver::resolve(const std::string& name,
   else
   {
     std::string srv_name;
-    std::string a_name = name;
+    std::string a_name;
+    select_lookup(name, port, transport, srv_name, a_name, ttl, trail);
 
-    if (port != 0)
+    if (srv_name != "")
     {
-      // Port is specified, so don't do NAPTR or SRV look-ups.  Default transport
-      // if required and move straight to A record look-up.
-      LOG_DEBUG("Port is specified");
-      transport = (transport != -1) ? transport : IPPROTO_UDP;
+      LOG_DEBUG("Do SRV lookup for %s", srv_name.c_str());
 
       if (trail != 0)
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_PORT_A_LOOKUP, 0);
-        event.add_var_param(name);
-        std::string port_str = std::to_string(port);
+        SAS::Event event(trail, SASEvent::SIPRESOLVE_SRV_LOOKUP, 0);
+        event.add_var_param(srv_name);
         std::string transport_str = get_transport_str(transport);
         event.add_var_param(transport_str);
-        event.add_var_param(port_str);
         SAS::report_event(event);
       }
+
+      srv_resolve(srv_name, af, transport, retries, targets, record_ttl, trail);
+      ttl = std::min(ttl, record_ttl);
     }
-    else if (transport == -1)
+    else
     {
-      // Transport protocol isn't specified, so do a NAPTR lookup for the target.
-      LOG_DEBUG("Do NAPTR look-up for %s", name.c_str());
+      LOG_DEBUG("Perform A/AAAA record lookup only, name = %s", a_name.c_str());
+      port = (port != 0) ? port : 5060;
 
       if (trail != 0)
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_LOOKUP, 0);
-        event.add_var_param(name);
+        SAS::Event event(trail, SASEvent::SIPRESOLVE_A_LOOKUP, 0);
+        event.add_var_param(a_name);
+        std::string transport_str = get_transport_str(transport);
+        std::string port_str = std::to_string(port);
+        event.add_var_param(transport_str);
+        event.add_var_param(port_str);
         SAS::report_event(event);
       }
 
-      NAPTRReplacement* naptr = _naptr_cache->get(name, dummy_ttl);
+      a_resolve(a_name, af, port, transport, retries, targets, record_ttl, trail);
+      ttl = std::min(ttl, record_ttl);
+    }
+  }
+}
 
-      if (naptr != NULL)
+void SIPResolver::select_lookup(const std::string& name,
+                                int port,
+                                int& transport,
+                                std::string& srv_name,
+                                std::string& a_name,
+                                int& ttl,
+                                SAS::TrailId trail)
+{
+  int record_ttl = 0;
+  a_name = name;
+
+  if (port != 0)
+  {
+    // Port is specified, so don't do NAPTR or SRV look-ups.  Default transport
+    // if required and move straight to A record look-up.
+    LOG_DEBUG("Port is specified");
+    transport = (transport != -1) ? transport : IPPROTO_UDP;
+
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_PORT_A_LOOKUP, 0);
+      event.add_var_param(name);
+      std::string port_str = std::to_string(port);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      event.add_var_param(port_str);
+      SAS::report_event(event);
+    }
+  }
+  else if (transport == -1)
+  {
+    // Transport protocol isn't specified, so do a NAPTR lookup for the target.
+    LOG_DEBUG("Do NAPTR look-up for %s", name.c_str());
+
+    if (trail != 0)
+    {
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_LOOKUP, 0);
+      event.add_var_param(name);
+      SAS::report_event(event);
+    }
+
+    NAPTRReplacement* naptr = _naptr_cache->get(name, record_ttl);
+    ttl = std::min(ttl, record_ttl);
+
+    if (naptr != NULL)
+    {
+      // NAPTR resolved to a supported service
+      LOG_DEBUG("NAPTR resolved to transport %d", naptr->transport);
+      transport = naptr->transport;
+      if (strcasecmp(naptr->flags.c_str(), "S") == 0)
       {
-        // NAPTR resolved to a supported service
-        LOG_DEBUG("NAPTR resolved to transport %d", naptr->transport);
-        transport = naptr->transport;
-        if (strcasecmp(naptr->flags.c_str(), "S") == 0)
-        {
-          // Do an SRV lookup with the replacement domain from the NAPTR lookup.
-          srv_name = naptr->replacement;
-
-          if (trail != 0)
-          {
-            SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_SRV, 0);
-            event.add_var_param(name);
-            event.add_var_param(srv_name);
-            std::string transport_str = get_transport_str(naptr->transport);
-            event.add_var_param(transport_str);
-            SAS::report_event(event);
-          }
-        }
-        else
+        // Do an SRV lookup with the replacement domain from the NAPTR lookup.
+        srv_name = naptr->replacement;
+
+        if (trail != 0)
         {
-          // Move straight to A/AAAA lookup of the domain returned by NAPTR.
-          a_name = naptr->replacement;
-
-          if (trail != 0)
-          {
-            SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_A, 0);
-            event.add_var_param(name);
-            event.add_var_param(a_name);
-            SAS::report_event(event);
-          }
+          SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_SRV, 0);
+          event.add_var_param(name);
+          event.add_var_param(srv_name);
+          std::string transport_str = get_transport_str(naptr->transport);
+          event.add_var_param(transport_str);
+          SAS::report_event(event);
         }
       }
       else
       {
-        // NAPTR resolution failed, so do SRV lookups for both UDP and TCP to
-        // see which transports are supported.
-        LOG_DEBUG("NAPTR lookup failed, so do SRV lookups for UDP and TCP");
+        // Move straight to A/AAAA lookup of the domain returned by NAPTR.
+        a_name = naptr->replacement;
 
         if (trail != 0)
         {
-          SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_FAILURE, 0);
+          SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_SUCCESS_A, 0);
           event.add_var_param(name);
+          event.add_var_param(a_name);
           SAS::report_event(event);
         }
-
-        std::vector<std::string> domains;
-        domains.push_back("_sip._udp." + name);
-        domains.push_back("_sip._tcp." + name);
-        std::vector<DnsResult> results;
-        _dns_client->dns_query(domains, ns_t_srv, results);
-        DnsResult& udp_result = results[0];
-        LOG_DEBUG("UDP SRV record %s returned %d records",
-                  udp_result.domain().c_str(), udp_result.records().size());
-        DnsResult& tcp_result = results[1];
-        LOG_DEBUG("TCP SRV record %s returned %d records",
-                  tcp_result.domain().c_str(), tcp_result.records().size());
-
-        if (!udp_result.records().empty())
-        {
-          // UDP SRV lookup returned some records, so use UDP transport.
-          LOG_DEBUG("UDP SRV lookup successful, select UDP transport");
-          transport = IPPROTO_UDP;
-          srv_name = udp_result.domain();
-        }
-        else if (!tcp_result.records().empty())
-        {
-          // TCP SRV lookup returned some records, so use TCP transport.
-          LOG_DEBUG("TCP SRV lookup successful, select TCP transport");
-          transport = IPPROTO_TCP;
-          srv_name = tcp_result.domain();
-        }
-        else
-        {
-          // Neither UDP nor TCP SRV lookup returned any results, so default to
-          // UDP transport and move straight to A/AAAA record lookups.
-          LOG_DEBUG("UDP and TCP SRV queries unsuccessful, default to UDP");
-          transport = IPPROTO_UDP;
-        }
       }
-
-      _naptr_cache->dec_ref(name);
     }
-    else if (transport == IPPROTO_UDP)
+    else
     {
-      // Use specified transport and try an SRV lookup.
+      // NAPTR resolution failed, so do SRV lookups for both UDP and TCP to
+      // see which transports are supported.
+      LOG_DEBUG("NAPTR lookup failed, so do SRV lookups for UDP and TCP");
+
       if (trail != 0)
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
+        SAS::Event event(trail, SASEvent::SIPRESOLVE_NAPTR_FAILURE, 0);
         event.add_var_param(name);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
         SAS::report_event(event);
       }
 
-      DnsResult result = _dns_client->dns_query("_sip._udp." + name, ns_t_srv);
-
-      if (!result.records().empty())
+      std::vector<std::string> domains;
+      domains.push_back("_sip._udp." + name);
+      domains.push_back("_sip._tcp." + name);
+      std::vector<DnsResult> results;
+      _dns_client->dns_query(domains, ns_t_srv, results);
+      DnsResult& udp_result = results[0];
+      LOG_DEBUG("UDP SRV record %s returned %d records",
+                udp_result.domain().c_str(), udp_result.records().size());
+      DnsResult& tcp_result = results[1];
+      LOG_DEBUG("TCP SRV record %s returned %d records",
+                tcp_result.domain().c_str(), tcp_result.records().size());
+      ttl = std::min(ttl, std::min(udp_result.ttl(), tcp_result.ttl()));
+
+      if (!udp_result.records().empty())
       {
-        srv_name = result.domain();
+        // UDP SRV lookup returned some records, so use UDP transport.
+        LOG_DEBUG("UDP SRV lookup successful, select UDP transport");
+        transport = IPPROTO_UDP;
+        srv_name = udp_result.domain();
       }
-    }
-    else if (transport == IPPROTO_TCP)
-    {
-      // Use specified transport and try an SRV lookup.
-      if (trail != 0)
+      else if (!tcp_result.records().empty())
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
-        event.add_var_param(name);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
-        SAS::report_event(event);
+        // TCP SRV lookup returned some records, so use TCP transport.
+        LOG_DEBUG("TCP SRV lookup successful, select TCP transport");
+        transport = IPPROTO_TCP;
+        srv_name = tcp_result.domain();
       }
-
-      DnsResult result = _dns_client->dns_query("_sip._tcp." + name, ns_t_srv);
-
-      if (!result.records().empty())
+      else
       {
-        srv_name = result.domain();
+        // Neither UDP nor TCP SRV lookup returned any results, so default to
+        // UDP transport and move straight to A/AAAA record lookups.
+        LOG_DEBUG("UDP and TCP SRV queries unsuccessful, default to UDP");
+        transport = IPPROTO_UDP;
       }
     }
 
-    if (srv_name != "")
+    _naptr_cache->dec_ref(name);
+  }
+  else if (transport == IPPROTO_UDP)
+  {
+    // Use specified transport and try an SRV lookup.
+    if (trail != 0)
     {
-      LOG_DEBUG("Do SRV lookup for %s", srv_name.c_str());
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
+      event.add_var_param(name);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      SAS::report_event(event);
+    }
 
-      if (trail != 0)
-      {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_SRV_LOOKUP, 0);
-        event.add_var_param(srv_name);
-        std::string transport_str = get_transport_str(transport);
-        event.add_var_param(transport_str);
-        SAS::report_event(event);
-      }
+    DnsResult result = _dns_client->dns_query("_sip._udp." + name, ns_t_srv);
+    ttl = std::min(ttl, result.ttl());
 
-      srv_resolve(srv_name, af, transport, retries, targets, dummy_ttl, trail);
+    if (!result.records().empty())
+    {
+      srv_name = result.domain();
     }
-    else
+  }
+  else if (transport == IPPROTO_TCP)
+  {
+    // Use specified transport and try an SRV lookup.
+    if (trail != 0)
     {
-      LOG_DEBUG("Perform A/AAAA record lookup only, name = %s", a_name.c_str());
-      port = (port != 0) ? port : 5060;
+      SAS::Event event(trail, SASEvent::SIPRESOLVE_TRANSPORT_SRV_LOOKUP, 0);
+      event.add_var_param(name);
+      std::string transport_str = get_transport_str(transport);
+      event.add_var_param(transport_str);
+      SAS::report_event(event);
+    }
 
-      if (trail != 0)
+    DnsResult result = _dns_client->dns_query("_sip._tcp." + name, ns_t_srv);
+    ttl = std::min(ttl, result.ttl());
+
+    if (!result.records().empty())
+    {
+      srv_name = result.domain();
+    }
+  }
+}
+
+void SIPResolver::resolve_weighted(const std::string& name,
+                                   int af,
+                                   int port,
+                                   int transport,
+                                   std::vector<WeightedTarget>& targets,
+                                   int& ttl,
+                                   SAS::TrailId trail)
+{
+  targets.clear();
+  ttl = INT_MAX;
+
+  LOG_DEBUG("SIPResolver::resolve_weighted for name %s, port %d, transport %d, family %d",
+            name.c_str(), port, transport, af);
+
+  IP46Address address;
+  if (parse_ip_target(name, address))
+  {
+    WeightedTarget target;
+    target.ai.address = address;
+    target.ai.transport = (transport != -1) ? transport : IPPROTO_UDP;
+    target.ai.port = (port != 0) ? port : 5060;
+    target.priority = 0;
+    target.weight = 1.0;
+    targets.push_back(target);
+    return;
+  }
+
+  std::string srv_name;
+  std::string a_name;
+  select_lookup(name, port, transport, srv_name, a_name, ttl, trail);
+
+  if (srv_name != "")
+  {
+    // Find the targets of every SRV record, keeping their priorities and
+    // weights rather than picking an order from them.
+    DnsResult result = _dns_client->dns_query(srv_name, ns_t_srv);
+    ttl = std::min(ttl, result.ttl());
+    std::vector<DnsRRecord*>& records = result.records();
+
+    for (size_t ii = 0; ii < records.size(); ++ii)
+    {
+      if (records[ii]->rrtype() == ns_t_srv)
       {
-        SAS::Event event(trail, SASEvent::SIPRESOLVE_A_LOOKUP, 0);
-        event.add_var_param(a_name);
-        std::string transport_str = get_transport_str(transport);
-        std::string port_str = std::to_string(port);
-        event.add_var_param(transport_str);
-        event.add_var_param(port_str);
-        SAS::report_event(event);
+        DnsSrvRecord* srv = (DnsSrvRecord*)records[ii];
+        add_weighted_targets(srv->target(),
+                             af,
+                             srv->port(),
+                             transport,
+                             srv->priority(),
+                             srv->weight(),
+                             targets,
+                             ttl);
       }
+    }
+  }
+  else
+  {
+    add_weighted_targets(a_name,
+                         af,
+                         (port != 0) ? port : 5060,
+                         transport,
+                         0,
+                         1.0,
+                         targets,
+                         ttl);
+  }
+
+  LOG_DEBUG("Resolved %s to %d weighted targets", name.c_str(), (int)targets.size());
+}
+
+void SIPResolver::add_weighted_targets(const std::string& a_name,
+                                       int af,
+                                       int port,
+                                       int transport,
+                                       int priority,
+                                       double weight,
+                                       std::vector<WeightedTarget>& targets,
+                                       int& ttl)
+{
+  int rrtype = (af == AF_INET6) ? ns_t_aaaa : ns_t_a;
+  DnsResult result = _dns_client->dns_query(a_name, rrtype);
+  ttl = std::min(ttl, result.ttl());
+  std::vector<DnsRRecord*> records;
+
+  for (size_t ii = 0; ii < result.records().size(); ++ii)
+  {
+    if (result.records()[ii]->rrtype() == rrtype)
+    {
+      records.push_back(result.records()[ii]);
+    }
+  }
 
-      a_resolve(a_name, af, port, transport, retries, targets, dummy_ttl, trail);
+  // The addresses of a name share the weight of the record that led to it.
+  for (size_t ii = 0; ii < records.size(); ++ii)
+  {
+    WeightedTarget target;
+    target.ai.address.af = af;
+    if (af == AF_INET6)
+    {
+      target.ai.address.addr.ipv6 = ((DnsAAAARecord*)records[ii])->address();
+    }
+    else
+    {
+      target.ai.address.addr.ipv4 = ((DnsARecord*)records[ii])->address();
     }
+    target.ai.port = port;
+    target.ai.transport = transport;
+    target.priority = priority;
+    target.weight = weight / records.size();
+    targets.push_back(target);
   }
 }
 
@@ -24,6 +24,7 @@ TARGET_SOURCES := logger.cpp \
                   connection_pool.cpp \
                   flowtable.cpp \
                   httpconnection.cpp \
+                  httpclientpool.cpp \
                   httpresolver.cpp \
                   hssconnection.cpp \
                   websockets.cpp \
@@ -31,6 +32,12 @@ TARGET_SOURCES := logger.cpp \
                   memcachedstore.cpp \
                   memcachedstoreview.cpp \
                   avstore.cpp \
+                  objectpool.cpp \
+                  sproutletstats.cpp \
+                  timerwheel.cpp \
+                  ralfdelivery.cpp \
+                  regexcache.cpp \
+                  nexthoptable.cpp \
                   regstore.cpp \
                   xdmconnection.cpp \
                   simservs.cpp \
@@ -29,6 +29,7 @@ TARGET_SOURCES := logger.cpp \
                   connection_pool.cpp \
                   flowtable.cpp \
                   httpconnection.cpp \
+                  httpclientpool.cpp \
                   httpresolver.cpp \
                   hssconnection.cpp \
                   websockets.cpp \
@@ -36,6 +37,12 @@ TARGET_SOURCES := logger.cpp \
                   memcachedstore.cpp \
                   memcachedstoreview.cpp \
                   avstore.cpp \
+                  objectpool.cpp \
+                  sproutletstats.cpp \
+                  timerwheel.cpp \
+                  ralfdelivery.cpp \
+                  regexcache.cpp \
+                  nexthoptable.cpp \
                   regstore.cpp \
                   xdmconnection.cpp \
                   simservs.cpp \
@@ -134,6 +141,14 @@ TARGET_SOURCES_TEST := test_main.cpp \
                        appserver_test.cpp \
                        scscf_test.cpp \
                        sproutletproxy_test.cpp \
+                       smallmap_test.cpp \
+                       objectpool_test.cpp \
+                       sproutletstats_test.cpp \
+                       timerwheel_test.cpp \
+                       ralfdelivery_test.cpp \
+                       httpclientpool_test.cpp \
+                       regexcache_test.cpp \
+                       nexthoptable_test.cpp \
                        gruu_test.cpp \
                        mobiletwinned_test.cpp
 
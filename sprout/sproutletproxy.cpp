@@ -48,6 +48,7 @@ extern "C" {
 }
 
 #include <sstream>
+#include <algorithm>
 
 #include "log.h"
 #include "pjutils.h"
@@ -68,29 +69,54 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
   BasicProxy(endpt, "mod-sproutlet-controller", priority, false),
   _root_uri(NULL),
   _host_aliases(host_aliases),
-  _sproutlets(sproutlets)
+  _sproutlets(sproutlets),
+  _services(),
+  _ports(),
+  _local_hosts(),
+  _stats(NULL)
 {
   /// Store the URI of this SproutletProxy - this is used for Record-Routing.
   LOG_DEBUG("Root Record-Route URI = %s", root_uri.c_str());
   _root_uri = (pjsip_sip_uri*)PJUtils::uri_from_string(root_uri, stack_data.pool, false);
+
+  build_dispatch_tables();
+
+  if (stack_data.stats_aggregator != NULL)
+  {
+    // Preallocate the statistics for each Sproutlet, including the default
+    // no-op Sproutlet.
+    std::vector<std::string> services;
+    services.push_back("noop");
+    for (std::list<Sproutlet*>::const_iterator i = sproutlets.begin();
+         i != sproutlets.end();
+         ++i)
+    {
+      services.push_back((*i)->service_name());
+    }
+    _stats = new SproutletStats(stack_data.stats_aggregator, services);
+  }
 }
 
 
 /// Destructor.
 SproutletProxy::~SproutletProxy()
 {
+  delete _stats;
 }
 
 
-void SproutletProxy::on_timer_pop(pj_timer_heap_t* th,
-                                  pj_timer_entry* tentry)
+void SproutletProxy::on_timer_pop(TimerWheel::Entry* tentry)
 {
   SproutletTimerCallbackData* tdata = (SproutletTimerCallbackData*)tentry->user_data;
   LOG_DEBUG("Sproutlet timer popped, id = %ld", (TimerID)tdata);
   tdata->proxy->on_timer_pop(tdata->uas_tsx,
+                             (TimerID)tdata,
                              tdata->sproutlet_wrapper,
                              tdata->context);
-  delete tentry;
+
+  // The timer has been removed from the wheel, so a concurrent cancel can't
+  // have freed the callback data, and the transaction no longer refers to
+  // it.
   delete tdata;
 }
 
@@ -102,6 +128,55 @@ BasicProxy::UASTsx* SproutletProxy::create_uas_tsx()
 }
 
 
+/// Builds the tables used to dispatch requests to Sproutlets.  The set of
+/// Sproutlets is fixed once the plugins have loaded, so this is only done
+/// when the proxy is created.
+void SproutletProxy::build_dispatch_tables()
+{
+  _services.clear();
+  _ports.clear();
+  _local_hosts.clear();
+
+  for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
+       it != _sproutlets.end();
+       ++it)
+  {
+    // insert does not overwrite existing entries, so the first Sproutlet
+    // with a given name or port takes precedence.
+    _services.insert(std::make_pair((*it)->service_name(), *it));
+    std::list<std::string> aliases = (*it)->aliases();
+    for (std::list<std::string>::const_iterator jt = aliases.begin();
+         jt != aliases.end();
+         ++jt)
+    {
+      _services.insert(std::make_pair(*jt, *it));
+    }
+
+    if ((*it)->port() != 0)
+    {
+      _ports.insert(std::make_pair((*it)->port(), *it));
+    }
+  }
+
+  // Host names are compared case-insensitively, so store them lower-cased.
+  std::string host = PJUtils::pj_str_to_string(&_root_uri->host);
+  std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+  _local_hosts.insert(host);
+
+  for (std::unordered_set<std::string>::const_iterator it = _host_aliases.begin();
+       it != _host_aliases.end();
+       ++it)
+  {
+    host = *it;
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    _local_hosts.insert(host);
+  }
+
+  LOG_DEBUG("Built Sproutlet dispatch tables, %d services, %d ports, %d local hosts",
+            (int)_services.size(), (int)_ports.size(), (int)_local_hosts.size());
+}
+
+
 /// Utility method to find the appropriate Sproutlet to handle a request.
 Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
                                             int port,
@@ -143,13 +218,19 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
               PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
                                      (pjsip_uri*)uri).c_str());
 
-    for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
-         it != _sproutlets.end();
+    std::list<std::string> names;
+    possible_service_names(uri, names);
+
+    for (std::list<std::string>::iterator it = names.begin();
+         it != names.end();
          ++it)
     {
-      if (does_uri_match_sproutlet((pjsip_uri*)uri, *it, alias))
+      std::unordered_map<std::string, Sproutlet*>::const_iterator i =
+                                                          _services.find(*it);
+      if (i != _services.end())
       {
-        sproutlet = *it;
+        sproutlet = i->second;
+        alias = *it;
         break;
       }
     }
@@ -177,16 +258,11 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
          (is_host_local(&((pjsip_sip_uri*)route->name_addr.uri)->host))))
     {
       LOG_DEBUG("Find default service for port %d", port);
-      for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
-           it != _sproutlets.end();
-           ++it)
+      std::unordered_map<int, Sproutlet*>::const_iterator i = _ports.find(port);
+      if (i != _ports.end())
       {
-        if ((*it)->port() == port)
-        {
-          sproutlet = *it;
-          alias = (*it)->service_name();
-          break;
-        }
+        sproutlet = i->second;
+        alias = sproutlet->service_name();
       }
     }
   }
@@ -207,10 +283,45 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
     // LCOV_EXCL_STOP
   }
 
-  // Now we know we have a SIP URI, cast to one.
-  pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)uri;
   bool match = false;
+  std::list<std::string> names;
+  possible_service_names((pjsip_sip_uri*)uri, names);
 
+  // Check if any of the possible service names from the URI match any of the
+  // aliases for the sproutlet.
+  for (std::list<std::string>::iterator it = names.begin();
+       (it != names.end()) && (match != true);
+       ++it)
+  {
+    if (*it == sproutlet->service_name())
+    {
+      alias = *it;
+      match = true;
+    }
+    else
+    {
+      std::list<std::string> aliases = sproutlet->aliases();
+      for (std::list<std::string>::const_iterator jt = aliases.begin();
+           jt != aliases.end();
+           ++jt)
+      {
+        if (*it == *jt)
+        {
+          alias = *it;
+          match = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return match;
+}
+
+
+void SproutletProxy::possible_service_names(const pjsip_sip_uri* sip_uri,
+                                            std::list<std::string>& names)
+{
   // Extract the service name, this can appear in one of three places:
   //
   //  - Username
@@ -220,8 +331,6 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
   // In each case, the domain name (minus the prefix in the third case) also
   // has to be one of the registered local domains.
   std::string service_name;
-  std::list<std::string> possible_service_names;
-  std::string domain;
 
   // Check services parameter.
   pjsip_param* services_param = pjsip_param_find(&sip_uri->other_param,
@@ -249,7 +358,7 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
 
     if (is_host_local(&sip_uri->host))
     {
-      possible_service_names.push_back(service_name);
+      names.push_back(service_name);
     }
   }
   else
@@ -261,7 +370,7 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
       service_name = PJUtils::pj_str_to_string(&sip_uri->user);
       if (is_host_local(&sip_uri->host))
       {
-        possible_service_names.push_back(service_name);
+        names.push_back(service_name);
       }
     }
 
@@ -281,40 +390,10 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
 
       if (is_host_local(&hostname))
       {
-        possible_service_names.push_back(service_name);
-      }
-    }
-  }
-
-  // Check if any of the possible service names from the URI match any of the
-  // aliases for the sproutlet.
-  for (std::list<std::string>::iterator it = possible_service_names.begin();
-       (it != possible_service_names.end()) && (match != true);
-       ++it)
-  {
-    if (*it == sproutlet->service_name())
-    {
-      alias = *it;
-      match = true;
-    }
-    else
-    {
-      std::list<std::string> aliases = sproutlet->aliases();
-      for (std::list<std::string>::const_iterator jt = aliases.begin();
-           jt != aliases.end();
-           ++jt)
-      {
-        if (*it == *jt)
-        {
-          alias = *it;
-          match = true;
-          break;
-        }
+        names.push_back(service_name);
       }
     }
   }
-
-  return match;
 }
 
 
@@ -364,24 +443,9 @@ bool SproutletProxy::is_uri_local(const pjsip_uri* uri)
 
 bool SproutletProxy::is_host_local(const pj_str_t* host)
 {
-  bool rc = false;
-
-  if (!pj_stricmp(host, &_root_uri->host))
-  {
-    rc = true;
-  }
-
-  for (std::unordered_set<std::string>::iterator it = _host_aliases.begin();
-       (rc != true) && (it != _host_aliases.end());
-       ++it)
-  {
-    if (!pj_stricmp2(host, it->c_str()))
-    {
-      rc = true;
-    }
-  }
-
-  return rc;
+  std::string hostname = PJUtils::pj_str_to_string(host);
+  std::transform(hostname.begin(), hostname.end(), hostname.begin(), ::tolower);
+  return (_local_hosts.find(hostname) != _local_hosts.end());
 }
 
 bool SproutletProxy::schedule_timer(SproutletProxy::UASTsx* uas_tsx,
@@ -390,54 +454,55 @@ bool SproutletProxy::schedule_timer(SproutletProxy::UASTsx* uas_tsx,
                                     TimerID& id,
                                     int duration)
 {
-  pj_timer_entry* tentry = new pj_timer_entry();
-  memset(tentry, 0, sizeof(*tentry));
-
   SproutletTimerCallbackData* tdata = new SproutletTimerCallbackData;
+  tdata->proxy = this;
   tdata->uas_tsx = uas_tsx;
   tdata->sproutlet_wrapper = sproutlet_wrapper;
   tdata->context = context;
-  tentry->user_data = tdata;
+  tdata->entry.user_data = tdata;
+  tdata->entry.cb = SproutletProxy::on_timer_pop;
 
-  tentry->cb = SproutletProxy::on_timer_pop;
+  id = (TimerID)tdata;
 
-  id = (TimerID)tentry;
-
-  pj_time_val tval;
-  tval.sec = duration / 1000;
-  tval.msec = duration % 1000;
-
-  pj_status_t rc = pjsip_endpt_schedule_timer(_endpt, tentry, &tval);
+  stack_data.timer_wheel->schedule(&tdata->entry, duration);
 
   LOG_DEBUG("Started Sproutlet timer, id = %ld, duration = %d.%.3d",
-            id, tval.sec, tval.msec);
-  return (rc == 0);
+            id, duration / 1000, duration % 1000);
+  return true;
 }
 
 
-void SproutletProxy::cancel_timer(TimerID id)
+bool SproutletProxy::cancel_timer(TimerID id)
 {
-  pj_timer_entry* tentry = (pj_timer_entry*)id;
-  pjsip_endpt_cancel_timer(_endpt, tentry);
-  SproutletTimerCallbackData* tdata = (SproutletTimerCallbackData*)tentry->user_data;
-  delete tdata;
-  delete tentry;
-  LOG_DEBUG("Cancelled Sproutlet timer, id = %ld", id);
+  SproutletTimerCallbackData* tdata = (SproutletTimerCallbackData*)id;
+  if (stack_data.timer_wheel->cancel(&tdata->entry))
+  {
+    delete tdata;
+    LOG_DEBUG("Cancelled Sproutlet timer, id = %ld", id);
+    return true;
+  }
+
+  // The timer is popping on another thread, which owns the callback data
+  // and will free it.
+  LOG_DEBUG("Sproutlet timer %ld is popping, leave it to the pop", id);
+  return false;
 }
 
 
 bool SproutletProxy::timer_running(TimerID id)
 {
-  pj_timer_entry* tentry = (pj_timer_entry*)id;
-  return pj_timer_entry_running(tentry);
+  SproutletTimerCallbackData* tdata = (SproutletTimerCallbackData*)id;
+  return stack_data.timer_wheel->running(&tdata->entry);
 }
 
 
 void SproutletProxy::on_timer_pop(SproutletProxy::UASTsx* uas_tsx,
+                                  TimerID id,
                                   SproutletWrapper* sproutlet_wrapper,
                                   void* context)
 {
-  uas_tsx->process_timer_pop(sproutlet_wrapper,
+  uas_tsx->process_timer_pop(id,
+                             sproutlet_wrapper,
                              context);
 }
 
@@ -448,6 +513,10 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   _dmap_uac(),
   _umap(),
   _pending_req_q(),
+  _pinned_reqs(),
+  _timers(),
+  _popping_timers(),
+  _complete(false),
   _sproutlet_proxy(proxy)
 {
   LOG_VERBOSE("Sproutlet Proxy transaction (%p) created", this);
@@ -457,6 +526,21 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
 SproutletProxy::UASTsx::~UASTsx()
 {
   LOG_VERBOSE("Sproutlet Proxy transaction (%p) destroyed", this);
+
+  // All the Sproutlets have completed, so nothing can refer to the pinned
+  // requests any more.
+  for (std::list<pjsip_tx_data*>::iterator i = _pinned_reqs.begin();
+       i != _pinned_reqs.end();
+       ++i)
+  {
+    pjsip_tx_data_dec_ref(*i);
+  }
+  _pinned_reqs.clear();
+
+  // Any timers were cancelled, and any pops in flight handled, before the
+  // transaction was marked for destruction.
+  pj_assert(_timers.empty());
+  pj_assert(_popping_timers.empty());
 }
 
 
@@ -531,7 +615,7 @@ void SproutletProxy::UASTsx::process_tsx_request(pjsip_rx_data* rdata)
     LOG_DEBUG("ACK transaction is complete");
     _root = NULL;
     on_tsx_complete();
-    _pending_destroy = true;
+    destroy_when_timers_done();
   }
 }
 
@@ -554,12 +638,31 @@ void SproutletProxy::UASTsx::process_cancel_request(pjsip_rx_data* rdata)
 
 
 /// Handle a timer expiring.
-void SproutletProxy::UASTsx::process_timer_pop(SproutletWrapper* sproutlet_wrapper,
+void SproutletProxy::UASTsx::process_timer_pop(TimerID id,
+                                               SproutletWrapper* sproutlet_wrapper,
                                                void* context)
 {
   enter_context();
-  sproutlet_wrapper->on_timer_pop(context);
-  schedule_requests();
+
+  // The Sproutlet may have cancelled the timer while this thread was waiting
+  // for the transaction context, in which case it mustn't see the pop.
+  if (_timers.erase(id) > 0)
+  {
+    sproutlet_wrapper->on_timer_pop(context);
+    schedule_requests();
+  }
+  else if (_popping_timers.erase(id) > 0)
+  {
+    LOG_DEBUG("Sproutlet timer %ld was cancelled as it popped", id);
+
+    // The transaction may have been waiting for this pop before it could be
+    // destroyed.
+    if ((_complete) && (_popping_timers.empty()))
+    {
+      _pending_destroy = true;
+    }
+  }
+
   exit_context();
 }
 
@@ -761,6 +864,20 @@ void SproutletProxy::UASTsx::schedule_requests()
     {
       // No local Sproutlet, proxy the request.
       LOG_DEBUG("No local sproutlet matches request");
+
+      if (req.req->mod_data[_sproutlet_proxy->_mod_tu.id()] != NULL)
+      {
+        // The request shares data with requests held by this transaction,
+        // but the UAC transaction may outlive it, so send an independent
+        // copy instead.
+        pjsip_tx_data* clone = PJUtils::clone_msg(stack_data.endpt, req.req);
+        if (clone != NULL)
+        {
+          pjsip_tx_data_dec_ref(req.req);
+          req.req = clone;
+        }
+      }
+
       size_t index;
       PJUtils::add_top_via(req.req);
 
@@ -790,22 +907,36 @@ bool SproutletProxy::UASTsx::schedule_timer(SproutletWrapper* tsx,
                                             TimerID& id,
                                             int duration)
 {
-  return _sproutlet_proxy->schedule_timer(this,
-                                          tsx,
-                                          context,
-                                          id,
-                                          duration);
+  bool rc = _sproutlet_proxy->schedule_timer(this,
+                                             tsx,
+                                             context,
+                                             id,
+                                             duration);
+  if (rc)
+  {
+    _timers.insert(id);
+  }
+  return rc;
 }
 
 void SproutletProxy::UASTsx::cancel_timer(TimerID id)
 {
-  _sproutlet_proxy->cancel_timer(id);
+  // Only timers that are still outstanding can be cancelled - once a timer
+  // has popped its callback data has been freed.
+  if ((_timers.erase(id) > 0) &&
+      (!_sproutlet_proxy->cancel_timer(id)))
+  {
+    // The timer is already popping, so the pop will still call
+    // process_timer_pop on this transaction.
+    _popping_timers.insert(id);
+  }
 }
 
 
 bool SproutletProxy::UASTsx::timer_running(TimerID id)
 {
-  return _sproutlet_proxy->timer_running(id);
+  return ((_timers.find(id) != _timers.end()) &&
+          (_sproutlet_proxy->timer_running(id)));
 }
 
 
@@ -919,8 +1050,44 @@ void SproutletProxy::UASTsx::check_destroy()
       (_tsx == NULL))
   {
     // UAS transaction has been destroyed and all Sproutlets are complete.
+    destroy_when_timers_done();
+  }
+}
+
+
+void SproutletProxy::UASTsx::destroy_when_timers_done()
+{
+  // Cancel any timers the Sproutlets left running.  A timer that can't be
+  // cancelled is already popping on another thread and will enter this
+  // transaction's context, so the transaction must outlive the pop.
+  for (std::unordered_set<TimerID>::iterator i = _timers.begin();
+       i != _timers.end();
+       ++i)
+  {
+    if (!_sproutlet_proxy->cancel_timer(*i))
+    {
+      _popping_timers.insert(*i);
+    }
+  }
+  _timers.clear();
+
+  _complete = true;
+  if (_popping_timers.empty())
+  {
     _pending_destroy = true;
   }
+  else
+  {
+    LOG_DEBUG("Transaction (%p) waiting for %d timer pops before destruction",
+              this, (int)_popping_timers.size());
+  }
+}
+
+
+void SproutletProxy::UASTsx::pin_request(pjsip_tx_data* req)
+{
+  pjsip_tx_data_add_ref(req);
+  _pinned_reqs.push_back(req);
 }
 
 
@@ -939,6 +1106,7 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _sproutlet(sproutlet),
   _sproutlet_tsx(NULL),
   _service_name(""),
+  _stats_counters(NULL),
   _id(""),
   _packets(),
   _send_requests(),
@@ -969,6 +1137,13 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
     _sproutlet_tsx = new SproutletTsx(this);
   }
 
+  if (_proxy->_stats != NULL)
+  {
+    _stats_counters = _proxy->_stats->get_counters(
+                        _service_name,
+                        PJUtils::pj_str_to_string(&req->msg->line.req.method.name));
+  }
+
   // Construct a unique identifier for this Sproutlet.
   std::ostringstream id;
   id << _service_name << "-" << (const void*)_sproutlet_tsx;
@@ -988,6 +1163,11 @@ SproutletWrapper::~SproutletWrapper()
 
   if (_req != NULL)
   {
+    if (_stats_counters != NULL)
+    {
+      SproutletStats::record_forks(_stats_counters, _forks.size());
+    }
+
     LOG_DEBUG("Free original request %s (%s)",
               pjsip_tx_data_get_info(_req), _req->obj_name);
     pjsip_tx_data_dec_ref(_req);
@@ -1014,10 +1194,13 @@ const std::string& SproutletWrapper::service_name() const
 //
 
 /// Returns a mutable clone of the original request suitable for forwarding
-/// or as the basis for constructing a response.
+/// or as the basis for constructing a response.  This is a copy-on-write
+/// clone that shares unmodified headers and the body with the original, so
+/// passing a request between Sproutlets in this process doesn't copy the
+/// whole message at every hop.
 pjsip_msg* SproutletWrapper::original_request()
 {
-  pjsip_tx_data* clone = PJUtils::clone_msg(stack_data.endpt, _req);
+  pjsip_tx_data* clone = PJUtils::shallow_clone_msg(stack_data.endpt, _req);
 
   if (clone == NULL)
   {
@@ -1039,6 +1222,10 @@ pjsip_msg* SproutletWrapper::original_request()
     pj_list_erase(hr);
   }
 
+  // Mark the clone as sharing data with the original request, so it is
+  // copied before being sent outside this transaction.
+  clone->mod_data[_proxy->_mod_tu.id()] = _req;
+
   register_tdata(clone);
 
   return clone->msg;
@@ -1285,6 +1472,10 @@ pj_pool_t* SproutletWrapper::get_pool(const pjsip_msg* msg)
 
 bool SproutletWrapper::schedule_timer(void* context, TimerID& id, int duration)
 {
+  if (_stats_counters != NULL)
+  {
+    SproutletStats::record_timer(_stats_counters);
+  }
   return _proxy_tsx->schedule_timer(this, context, id, duration);
 }
 
@@ -1321,8 +1512,11 @@ pjsip_sip_uri* SproutletWrapper::get_reflexive_uri(pj_pool_t* pool) const
 
 void SproutletWrapper::rx_request(pjsip_tx_data* req)
 {
-  // Keep an immutable reference to the request.
+  // Keep an immutable reference to the request.  The clones passed to the
+  // Sproutlet share data with it, so it must be kept until the whole
+  // transaction completes.
   _req = req;
+  _proxy_tsx->pin_request(_req);
 
   // Clone the request to get a mutable copy to pass to the Sproutlet.
   pjsip_msg* clone = original_request();
@@ -1331,6 +1525,9 @@ void SproutletWrapper::rx_request(pjsip_tx_data* req)
     // @TODO
   }
 
+  unsigned long start_cpu_us = (_stats_counters != NULL) ?
+                                 SproutletStats::thread_cpu_us() : 0;
+
   if (PJSIP_MSG_TO_HDR(clone)->tag.slen == 0)
   {
     LOG_VERBOSE("%s pass initial request %s to Sproutlet",
@@ -1344,6 +1541,12 @@ void SproutletWrapper::rx_request(pjsip_tx_data* req)
     _sproutlet_tsx->on_rx_in_dialog_request(clone);
   }
 
+  if (_stats_counters != NULL)
+  {
+    SproutletStats::record_request(_stats_counters,
+                                   SproutletStats::thread_cpu_us() - start_cpu_us);
+  }
+
   // We consider an ACK transaction to be complete immediately after the
   // sproutlet's actions have been processed, regardless of whether the
   // sproutlet forwarded the ACK (some sproutlets are unable to in certain
@@ -1377,10 +1580,25 @@ void SproutletWrapper::rx_response(pjsip_tx_data* rsp, int fork_id)
                 fork_id, pjsip_tsx_state_str(_forks[fork_id].state.tsx_state));
     --_pending_responses;
   }
-  _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+  pass_response(rsp, fork_id);
   process_actions(false);
 }
 
+/// Passes a response to the Sproutlet, recording the CPU time it uses.
+void SproutletWrapper::pass_response(pjsip_tx_data* rsp, int fork_id)
+{
+  unsigned long start_cpu_us = (_stats_counters != NULL) ?
+                                 SproutletStats::thread_cpu_us() : 0;
+
+  _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+
+  if (_stats_counters != NULL)
+  {
+    SproutletStats::record_response(_stats_counters,
+                                    SproutletStats::thread_cpu_us() - start_cpu_us);
+  }
+}
+
 void SproutletWrapper::rx_cancel(pjsip_tx_data* cancel)
 {
   LOG_VERBOSE("%s received CANCEL request", _id.c_str());
@@ -1444,7 +1662,7 @@ void SproutletWrapper::rx_fork_error(pjsip_event_id_e event, int fork_id)
     {
       // Pass the response to the application.
       register_tdata(rsp);
-      _sproutlet_tsx->on_rx_response(rsp->msg, fork_id);
+      pass_response(rsp, fork_id);
       process_actions(false);
     }
   }
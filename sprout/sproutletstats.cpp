@@ -0,0 +1,227 @@
+/**
+ * @file sproutletstats.cpp  Per-Sproutlet statistics
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "log.h"
+#include "sproutletstats.h"
+
+const char* const SproutletStats::METHODS[] =
+{
+  "INVITE", "ACK", "BYE", "CANCEL", "OPTIONS", "REGISTER", "SUBSCRIBE",
+  "NOTIFY", "PUBLISH", "MESSAGE", "INFO", "PRACK", "UPDATE", "REFER", "OTHER"
+};
+const int SproutletStats::NUM_METHODS = sizeof(METHODS) / sizeof(METHODS[0]);
+
+SproutletStats::SproutletStats(LastValueCache* lvc,
+                               const std::vector<std::string>& services,
+                               uint_fast64_t period_us) :
+  _stats(),
+  _period_us(period_us),
+  _statistic("sproutlet_stats", lvc),
+  _terminating(false)
+{
+  for (std::vector<std::string>::const_iterator i = services.begin();
+       i != services.end();
+       ++i)
+  {
+    _stats[*i].reset(new Counters[NUM_METHODS]());
+  }
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  int rc = pthread_create(&_thread, NULL, &refresh_thread, this);
+  if (rc != 0)
+  {
+    LOG_ERROR("Failed to create Sproutlet statistics thread, rc = %d", rc);
+  }
+}
+
+SproutletStats::~SproutletStats()
+{
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  pthread_join(_thread, NULL);
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+SproutletStats::Counters* SproutletStats::get_counters(const std::string& service,
+                                                       const std::string& method)
+{
+  StatsMap::iterator i = _stats.find(service);
+  if (i == _stats.end())
+  {
+    return NULL;
+  }
+
+  int index = 0;
+  while ((index < NUM_METHODS - 1) && (method != METHODS[index]))
+  {
+    ++index;
+  }
+
+  return &i->second[index];
+}
+
+void SproutletStats::record_request(Counters* counters, unsigned long cpu_us)
+{
+  counters->requests.fetch_add(1, std::memory_order_relaxed);
+  record_cpu(counters, cpu_us);
+}
+
+void SproutletStats::record_response(Counters* counters, unsigned long cpu_us)
+{
+  counters->responses.fetch_add(1, std::memory_order_relaxed);
+  record_cpu(counters, cpu_us);
+}
+
+void SproutletStats::record_forks(Counters* counters, int forks)
+{
+  counters->forks.fetch_add(forks, std::memory_order_relaxed);
+  update_max(counters->max_forks, forks);
+  counters->used = true;
+}
+
+void SproutletStats::record_timer(Counters* counters)
+{
+  counters->timers.fetch_add(1, std::memory_order_relaxed);
+  counters->used = true;
+}
+
+unsigned long SproutletStats::thread_cpu_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (ts.tv_sec * 1000000UL) + (ts.tv_nsec / 1000);
+}
+
+void SproutletStats::record_cpu(Counters* counters, unsigned long cpu_us)
+{
+  counters->cpu_us.fetch_add(cpu_us, std::memory_order_relaxed);
+  update_max(counters->max_cpu_us, cpu_us);
+  counters->used = true;
+}
+
+void SproutletStats::update_max(std::atomic_ulong& max, unsigned long value)
+{
+  unsigned long current = max.load(std::memory_order_relaxed);
+  while ((value > current) &&
+         (!max.compare_exchange_weak(current, value, std::memory_order_relaxed)))
+  {
+  }
+}
+
+void* SproutletStats::refresh_thread(void* p)
+{
+  SproutletStats* stats = (SproutletStats*)p;
+
+  pthread_mutex_lock(&stats->_lock);
+
+  while (!stats->_terminating)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += stats->_period_us / 1000000;
+    ts.tv_nsec += (stats->_period_us % 1000000) * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+
+    if ((pthread_cond_timedwait(&stats->_cond, &stats->_lock, &ts) == ETIMEDOUT) &&
+        (!stats->_terminating))
+    {
+      stats->refresh();
+    }
+  }
+
+  pthread_mutex_unlock(&stats->_lock);
+  return NULL;
+}
+
+void SproutletStats::refresh()
+{
+  // The Sproutlets and methods seen are kept so that idle ones are reported
+  // with zero counts.
+  std::vector<std::string> values;
+  build_report(values, true);
+  _statistic.report_change(values);
+}
+
+void SproutletStats::build_report(std::vector<std::string>& values, bool reset)
+{
+  for (StatsMap::const_iterator i = _stats.begin(); i != _stats.end(); ++i)
+  {
+    for (int method = 0; method < NUM_METHODS; ++method)
+    {
+      Counters& counters = i->second[method];
+
+      if (!counters.used)
+      {
+        continue;
+      }
+
+      unsigned long requests = (reset) ? counters.requests.exchange(0) : counters.requests.load();
+      unsigned long responses = (reset) ? counters.responses.exchange(0) : counters.responses.load();
+      unsigned long cpu_us = (reset) ? counters.cpu_us.exchange(0) : counters.cpu_us.load();
+      unsigned long max_cpu_us = (reset) ? counters.max_cpu_us.exchange(0) : counters.max_cpu_us.load();
+      unsigned long forks = (reset) ? counters.forks.exchange(0) : counters.forks.load();
+      unsigned long max_forks = (reset) ? counters.max_forks.exchange(0) : counters.max_forks.load();
+      unsigned long timers = (reset) ? counters.timers.exchange(0) : counters.timers.load();
+      unsigned long invocations = requests + responses;
+      unsigned long mean_cpu_us = (invocations > 0) ? (cpu_us / invocations) : 0;
+
+      values.push_back(i->first);
+      values.push_back(METHODS[method]);
+      values.push_back(std::to_string(requests));
+      values.push_back(std::to_string(responses));
+      values.push_back(std::to_string(mean_cpu_us));
+      values.push_back(std::to_string(max_cpu_us));
+      values.push_back(std::to_string(forks));
+      values.push_back(std::to_string(max_forks));
+      values.push_back(std::to_string(timers));
+    }
+  }
+}
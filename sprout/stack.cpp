@@ -145,6 +145,11 @@ const static std::string _known_statnames[] = {
   "hss_user_auth_latency_us",
   "hss_location_latency_us",
   "connected_ralfs",
+  "sproutlet_stats",
+  "client_memory",
+  "ralf_delivery",
+  "regex_cache",
+  "object_pool",
 };
 
 const static std::string SPROUT_ZMQ_PORT = "6666";
@@ -154,7 +159,7 @@ const std::string* known_statnames = _known_statnames;
 const int num_known_stats = sizeof(_known_statnames) / sizeof(std::string);
 
 /// PJSIP threads are donated to PJSIP to handle receiving at transport level
-/// and timers.
+/// and timers.  They also drive the timer wheel.
 static int pjsip_thread(void *p)
 {
   pj_time_val delay = {0, 10};
@@ -166,6 +171,7 @@ static int pjsip_thread(void *p)
   while (!quit_flag)
   {
     pjsip_endpt_handle_events(stack_data.endpt, &delay);
+    stack_data.timer_wheel->poll();
   }
 
   LOG_DEBUG("PJSIP thread ended");
@@ -804,6 +810,9 @@ pj_status_t init_pjsip()
   status = pjsip_tsx_layer_init_module(stack_data.endpt);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
+  // Create the timer wheel used for flow, transaction and Sproutlet timers.
+  stack_data.timer_wheel = new TimerWheel();
+
   // Create pool for the application
   stack_data.pool = pj_pool_create(&stack_data.cp.factory,
                                    "sprout-bono",
@@ -881,6 +890,7 @@ pj_status_t init_stack(const std::string& system_name,
   stack_data.icscf_port = icscf_port;
 
   stack_data.sipresolver = sipresolver;
+  stack_data.next_hops = new NextHopTable(sipresolver);
 
   // Copy other functional options to stack data.
   stack_data.default_session_expires = default_session_expires;
@@ -1218,6 +1228,8 @@ void unregister_stack_modules(void)
 void term_pjsip()
 {
   pjsip_endpt_destroy(stack_data.endpt);
+  delete stack_data.timer_wheel;
+  stack_data.timer_wheel = NULL;
   pj_pool_release(stack_data.pool);
   pj_caching_pool_destroy(&stack_data.cp);
   pj_shutdown();
@@ -1244,6 +1256,9 @@ void destroy_stack(void)
   delete connection_tracker;
   connection_tracker = NULL;
 
+  delete stack_data.next_hops;
+  stack_data.next_hops = NULL;
+
   pjsip_threads.clear();
   worker_threads.clear();
 
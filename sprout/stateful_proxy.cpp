@@ -726,9 +726,9 @@ void process_tsx_request(pjsip_rx_data* rdata)
     {
       // schedule trying timer
       uas_data->_trying_timer.id = uas_data->TRYING_TIMER;
-      pj_time_val delay = {(PJSIP_T2_TIMEOUT - PJSIP_T1_TIMEOUT) / 1000,
-                           (PJSIP_T2_TIMEOUT - PJSIP_T1_TIMEOUT) % 1000 };
-      pjsip_endpt_schedule_timer(stack_data.endpt, &(uas_data->_trying_timer), &delay);
+      uas_data->_trying_timer_state = uas_data->TRYING_TIMER;
+      stack_data.timer_wheel->schedule(&(uas_data->_trying_timer),
+                                       PJSIP_T2_TIMEOUT - PJSIP_T1_TIMEOUT);
     }
   }
 
@@ -1706,16 +1706,14 @@ static pj_status_t proxy_process_routing(pjsip_tx_data *tdata)
 
 void UASTransaction::cancel_trying_timer()
 {
-  pthread_mutex_lock(&_trying_timer_lock);
-
-  if (_trying_timer.id == TRYING_TIMER)
+  int state = TRYING_TIMER;
+  if (_trying_timer_state.compare_exchange_strong(state, 0))
   {
-    // The deferred trying timer is running, so cancel it.
-    _trying_timer.id = 0;
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_trying_timer);
+    // The deferred trying timer is running, so cancel it.  If it pops
+    // before it is cancelled, the pop will find it has been cleared and do
+    // nothing.
+    stack_data.timer_wheel->cancel(&_trying_timer);
   }
-
-  pthread_mutex_unlock(&_trying_timer_lock);
 }
 
 // Gets the subscriber's associated URIs and iFCs for each URI from
@@ -2222,9 +2220,10 @@ UASTransaction::UASTransaction(pjsip_transaction* tsx,
   _tsx->mod_data[mod_tu.id] = this;
 
   // initialise deferred trying timer
-  pthread_mutex_init(&_trying_timer_lock, NULL);
-  pj_timer_entry_init(&_trying_timer, 0, (void*)this, &trying_timer_callback);
+  _trying_timer.user_data = (void*)this;
+  _trying_timer.cb = &trying_timer_callback;
   _trying_timer.id = 0;
+  _trying_timer_state = 0;
 
   // Record whether or not this is an in-dialog request.  This is needed
   // to determine whether or not to send interim ACRs on provisional
@@ -2254,7 +2253,6 @@ UASTransaction::~UASTransaction()
   }
 
   cancel_trying_timer();
-  pthread_mutex_destroy(&_trying_timer_lock);
 
   // Disconnect all UAC transactions from the UAS transaction.
   LOG_DEBUG("Disconnect UAC transactions from UAS transaction");
@@ -4030,6 +4028,7 @@ UACTransaction::UACTransaction(UASTransaction* uas_data,
   _binding_id(),
   _servers(),
   _current_server(0),
+  _send_time(),
   _pending_destroy(false),
   _context_count(0)
 {
@@ -4044,6 +4043,7 @@ UACTransaction::UACTransaction(UASTransaction* uas_data,
 
   // Initialise the liveness timer.
   pj_timer_entry_init(&_liveness_timer, 0, (void*)this, &liveness_timer_callback);
+  _liveness_timer_state = 0;
 }
 
 /// UACTransaction destructor.  On entry, the group lock must be held.  On
@@ -4068,12 +4068,7 @@ UACTransaction::~UACTransaction()
     _tdata = NULL;
   }
 
-  if (_liveness_timer.id == LIVENESS_TIMER)
-  {
-    // The liveness timer is running, so cancel it.
-    _liveness_timer.id = 0;
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_liveness_timer);
-  }
+  cancel_liveness_timer();
 
   if ((_tsx != NULL) &&
       (_tsx->state != PJSIP_TSX_STATE_TERMINATED) &&
@@ -4242,6 +4237,7 @@ void UACTransaction::send_request()
   {
     LOG_DEBUG("Sending request for %s", PJUtils::uri_to_string(PJSIP_URI_IN_REQ_URI, _tdata->msg->line.req.uri).c_str());
     _uas_data->_downstream_acr->tx_request(_tdata->msg);
+    pj_gettickcount(&_send_time);
     status = pjsip_tsx_send_msg(_tsx, _tdata);
   }
 
@@ -4268,6 +4264,7 @@ void UACTransaction::send_request()
     if (_liveness_timeout != 0)
     {
       _liveness_timer.id = LIVENESS_TIMER;
+      _liveness_timer_state = LIVENESS_TIMER;
       pj_time_val delay = {_liveness_timeout, 0};
       pjsip_endpt_schedule_timer(stack_data.endpt, &_liveness_timer, &delay);
     }
@@ -4358,6 +4355,15 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
 
     if (!_servers.empty())
     {
+      if ((event->body.tsx_state.type == PJSIP_EVENT_RX_MSG) &&
+          (event->body.tsx_state.prev_state == PJSIP_TSX_STATE_CALLING) &&
+          (_tsx->status_code != PJSIP_SC_SERVICE_UNAVAILABLE))
+      {
+        // This is the first response from the server, so report how long it
+        // took.
+        PJUtils::report_server_latency(_servers[_current_server], _send_time);
+      }
+
       // Check to see if the destination server has failed so we can blacklist
       // it and retry to an alternative if possible.
       if ((event->body.tsx_state.tsx->state == PJSIP_TSX_STATE_TERMINATED) &&
@@ -4378,6 +4384,7 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
         // The server returned a 503 error.  We don't blacklist in this case
         // as it may indicated a transient overload condition, but we can
         // retry to an alternate server if one is available.
+        PJUtils::report_server_overload(_servers[_current_server]);
         retrying = retry_request();
       }
     }
@@ -4387,12 +4394,7 @@ void UACTransaction::on_tsx_state(pjsip_event* event)
       if (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG)
       {
         LOG_DEBUG("%s - RX_MSG on active UAC transaction", name());
-        if (_liveness_timer.id == LIVENESS_TIMER)
-        {
-          // The liveness timer is running on this transaction, so cancel it.
-          _liveness_timer.id = 0;
-          pjsip_endpt_cancel_timer(stack_data.endpt, &_liveness_timer);
-        }
+        cancel_liveness_timer();
 
         if (_uas_data != NULL) {
           pjsip_rx_data* rdata = event->body.tsx_state.src.rdata;
@@ -4486,6 +4488,7 @@ bool UACTransaction::retry_request()
       // Copy across the destination information for a retry and try to
       // resend the request.
       PJUtils::set_dest_info(_tdata, _servers[_current_server]);
+      pj_gettickcount(&_send_time);
       status = pjsip_tsx_send_msg(_tsx, _tdata);
 
       if (status == PJ_SUCCESS)
@@ -4510,9 +4513,29 @@ bool UACTransaction::retry_request()
 }
 
 
+/// Cancels the liveness timer if it is running.
+void UACTransaction::cancel_liveness_timer()
+{
+  int state = LIVENESS_TIMER;
+  if (_liveness_timer_state.compare_exchange_strong(state, 0))
+  {
+    // The liveness timer is running on this transaction, so cancel it.
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_liveness_timer);
+  }
+}
+
+
 /// Handle the liveness timer expiring on this transaction.
 void UACTransaction::liveness_timer_expired()
 {
+  // Claim the timer before entering the transaction's context, so a timer
+  // that has been cancelled doesn't contend for the group lock.
+  int state = LIVENESS_TIMER;
+  if (!_liveness_timer_state.compare_exchange_strong(state, 0))
+  {
+    return;
+  }
+
   enter_context();
 
   if ((_tsx->state == PJSIP_TSX_STATE_NULL) ||
@@ -4541,25 +4564,29 @@ void UACTransaction::liveness_timer_callback(pj_timer_heap_t *timer_heap, struct
 /// Handle the trying timer expiring on this transaction.
 void UASTransaction::trying_timer_expired()
 {
+  // Claim the timer before entering the transaction's context, so a timer
+  // that has been cancelled doesn't contend for the group lock.
+  int state = TRYING_TIMER;
+  if (!_trying_timer_state.compare_exchange_strong(state, 0))
+  {
+    return;
+  }
+
   enter_context();
-  pthread_mutex_lock(&_trying_timer_lock);
 
-  if ((_trying_timer.id == TRYING_TIMER) &&
-      (_tsx->state == PJSIP_TSX_STATE_TRYING))
+  if (_tsx->state == PJSIP_TSX_STATE_TRYING)
   {
     // Transaction is still in Trying state, so send a 100 Trying response
     // now.
     send_response(100);
-    _trying_timer.id = 0;
   }
 
-  pthread_mutex_unlock(&_trying_timer_lock);
   exit_context();
 }
 
-/// Static method called by PJSIP when a trying timer expires.  The instance
-/// is stored in the user_data field of the timer entry.
-void UASTransaction::trying_timer_callback(pj_timer_heap_t *timer_heap, struct pj_timer_entry *entry)
+/// Static method called by the timer wheel when a trying timer expires.  The
+/// instance is stored in the user_data field of the timer entry.
+void UASTransaction::trying_timer_callback(TimerWheel::Entry* entry)
 {
   if (entry->id == TRYING_TIMER)
   {
@@ -0,0 +1,306 @@
+/**
+ * @file timerwheel.cpp  Hierarchical timer wheel
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <time.h>
+
+#include "timerwheel.h"
+
+TimerWheel::TimerWheel(int num_shards) :
+  _num_shards(num_shards)
+{
+  uint64_t now = current_tick();
+
+  _shards = new Shard[_num_shards];
+
+  for (int ii = 0; ii < _num_shards; ++ii)
+  {
+    Shard* shard = &_shards[ii];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->polling = false;
+    shard->tick = now;
+
+    for (int slot = 0; slot < ROOT_SLOTS; ++slot)
+    {
+      list_init(&shard->root[slot]);
+    }
+
+    for (int level = 0; level < NUM_LEVELS; ++level)
+    {
+      for (int slot = 0; slot < LEVEL_SLOTS; ++slot)
+      {
+        list_init(&shard->levels[level][slot]);
+      }
+    }
+  }
+}
+
+
+TimerWheel::~TimerWheel()
+{
+  for (int ii = 0; ii < _num_shards; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+
+  delete[] _shards;
+}
+
+
+void TimerWheel::schedule(Entry* entry, int delay_ms)
+{
+  if (delay_ms < 0)
+  {
+    delay_ms = 0;
+  }
+
+  Shard* shard = shard_for(entry);
+  pthread_mutex_lock(&shard->lock);
+
+  if (entry->_next != NULL)
+  {
+    list_remove(entry);
+  }
+
+  entry->_pop_tick = current_tick() + (delay_ms + TICK_MS - 1) / TICK_MS;
+  add(shard, entry);
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+
+bool TimerWheel::cancel(Entry* entry)
+{
+  bool cancelled = false;
+
+  Shard* shard = shard_for(entry);
+  pthread_mutex_lock(&shard->lock);
+
+  if (entry->_next != NULL)
+  {
+    list_remove(entry);
+    cancelled = true;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return cancelled;
+}
+
+
+bool TimerWheel::running(Entry* entry)
+{
+  Shard* shard = shard_for(entry);
+  pthread_mutex_lock(&shard->lock);
+  bool running = (entry->_next != NULL);
+  pthread_mutex_unlock(&shard->lock);
+
+  return running;
+}
+
+
+int TimerWheel::poll()
+{
+  uint64_t now = current_tick();
+  int popped = 0;
+
+  for (int ii = 0; ii < _num_shards; ++ii)
+  {
+    Shard* shard = &_shards[ii];
+    bool polling = false;
+
+    if (shard->polling.compare_exchange_strong(polling, true))
+    {
+      popped += poll_shard(shard, now);
+      shard->polling = false;
+    }
+  }
+
+  return popped;
+}
+
+
+/// Processes all the ticks up to and including now on the shard, then calls
+/// the callbacks for the timers that popped once the shard is unlocked.
+int TimerWheel::poll_shard(Shard* shard, uint64_t now)
+{
+  pthread_mutex_lock(&shard->lock);
+
+  while (shard->tick <= now)
+  {
+    int index = shard->tick & (ROOT_SLOTS - 1);
+
+    if (index == 0)
+    {
+      // The root level has completed a revolution, so move the timers in
+      // the next slot of the level above down into the root level.  If that
+      // level has also completed a revolution, do the same for the level
+      // above it, and so on.
+      for (int level = 0; level < NUM_LEVELS; ++level)
+      {
+        if (cascade(shard, level, (shard->tick >> (ROOT_BITS + level * LEVEL_BITS)) &
+                                  (LEVEL_SLOTS - 1)) != 0)
+        {
+          break;
+        }
+      }
+    }
+
+    Entry* head = &shard->root[index];
+    while (head->_next != head)
+    {
+      Entry* entry = head->_next;
+      list_remove(entry);
+      shard->popped.push_back(std::make_pair(entry, entry->cb));
+    }
+
+    shard->tick++;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  int popped = shard->popped.size();
+
+  for (std::vector<std::pair<Entry*, Callback> >::iterator i = shard->popped.begin();
+       i != shard->popped.end();
+       ++i)
+  {
+    if (i->second != NULL)
+    {
+      i->second(i->first);
+    }
+  }
+  shard->popped.clear();
+
+  return popped;
+}
+
+
+/// Moves the timers in the specified slot of a level down the wheel, and
+/// returns the index of the slot.
+int TimerWheel::cascade(Shard* shard, int level, int index)
+{
+  Entry* head = &shard->levels[level][index];
+
+  while (head->_next != head)
+  {
+    Entry* entry = head->_next;
+    list_remove(entry);
+    add(shard, entry);
+  }
+
+  return index;
+}
+
+
+/// Adds a timer to the right slot for its pop time.  Must be called with the
+/// shard lock held.
+void TimerWheel::add(Shard* shard, Entry* entry)
+{
+  if (entry->_pop_tick < shard->tick)
+  {
+    // The timer is already due, so put it in the next slot to be processed.
+    list_add(&shard->root[shard->tick & (ROOT_SLOTS - 1)], entry);
+    return;
+  }
+
+  uint64_t delta = entry->_pop_tick - shard->tick;
+
+  if (delta >= MAX_TICKS)
+  {
+    entry->_pop_tick = shard->tick + MAX_TICKS - 1;
+    delta = MAX_TICKS - 1;
+  }
+
+  if (delta < (uint64_t)ROOT_SLOTS)
+  {
+    list_add(&shard->root[entry->_pop_tick & (ROOT_SLOTS - 1)], entry);
+    return;
+  }
+
+  for (int level = 0; level < NUM_LEVELS; ++level)
+  {
+    int shift = ROOT_BITS + level * LEVEL_BITS;
+
+    if ((delta >> (shift + LEVEL_BITS)) == 0)
+    {
+      list_add(&shard->levels[level][(entry->_pop_tick >> shift) & (LEVEL_SLOTS - 1)],
+               entry);
+      return;
+    }
+  }
+}
+
+
+TimerWheel::Shard* TimerWheel::shard_for(Entry* entry)
+{
+  // Timer entries are always at least pointer-aligned, so ignore the low
+  // order bits.
+  return &_shards[((uintptr_t)entry >> 4) % _num_shards];
+}
+
+
+uint64_t TimerWheel::current_tick()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+
+void TimerWheel::list_init(Entry* head)
+{
+  head->_prev = head;
+  head->_next = head;
+}
+
+
+void TimerWheel::list_add(Entry* head, Entry* entry)
+{
+  entry->_prev = head->_prev;
+  entry->_next = head;
+  head->_prev->_next = entry;
+  head->_prev = entry;
+}
+
+
+void TimerWheel::list_remove(Entry* entry)
+{
+  entry->_prev->_next = entry->_next;
+  entry->_next->_prev = entry->_prev;
+  entry->_prev = NULL;
+  entry->_next = NULL;
+}
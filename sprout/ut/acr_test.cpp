@@ -61,6 +61,459 @@ using testing::MatchesRegex;
 using testing::HasSubstr;
 using testing::Not;
 
+/// Tree encoding of the SDP-Media-Component AVPs for an offer or answer.
+static void tree_encode_media_components(Json::Value& v,
+                                         const std::vector<std::string>& sdp,
+                                         RalfACR::SDPType sdp_type,
+                                         Initiator initiator_flag,
+                                         const std::string& initiator_party)
+{
+  for (size_t ii = 0; ii < sdp.size(); )
+  {
+    if (sdp[ii][0] == 'm')
+    {
+      // Generate an SDP-Media-Component AVP.
+      Json::Value& mc = v["SDP-Media-Component"].append(Json::Value());
+
+      // Add the SDP-Media-Name AVP.
+      mc["SDP-Media-Name"] = Json::Value(sdp[ii]);
+
+      // Add SDP-Media-Description AVPs.
+      for (ii = ii + 1; (ii < sdp.size()) && (sdp[ii][0] != 'm'); ++ii)
+      {
+        mc["SDP-Media-Description"].append(Json::Value(sdp[ii]));
+      }
+
+      // Add the Local-GW-Inserted-Indication AVP (alway 0 - Local GW not
+      // inserted).
+      mc["Local-GW-Inserted-Indication"] = Json::Value(0);
+
+      // Add the IP-Realm-Default-Indication AVP (always 1 - Default IP
+      // realm used).
+      mc["IP-Realm-Default-Indication"] = Json::Value(1);
+
+      // Add the Transcoder-Inserted-Indication AVP (always 0 - Transcode not
+      // inserted).
+      mc["Transcoder-Inserted-Indication"] = Json::Value(0);
+
+      // Add the Media-Initiator-Flag AVP.
+      mc["Media-Initiator-Flag"] = Json::Value(initiator_flag);
+
+      // Add the Media-Initiator-Party AVP.
+      mc["Media-Initiator-Party"] = Json::Value(initiator_party);
+
+      // Add the SDP-Type AVP.
+      mc["SDP-Type"] = Json::Value(sdp_type);
+    }
+    else
+    {
+      // Not an m= line, so move to the next one.
+      ++ii;
+    }
+  }
+}
+
+/// Tree encoding of the SDP AVPs for a media description.
+static void tree_encode_sdp_description(RalfACR* acr,
+                                        Json::Value& v,
+                                        const RalfACR::MediaDescription& media)
+{
+  // Split the offer and answer in to lines.
+  std::vector<std::string> offer;
+  acr->split_sdp(media.offer.sdp, offer);
+  std::vector<std::string> answer;
+  acr->split_sdp(media.answer.sdp, answer);
+
+  // First add the SDP-Session-Description AVPs.  We take these from the
+  // answer if there is one, and from the offer otherwise (rather than
+  // repeating them).
+  std::vector<std::string>& session_sdp = (answer.empty()) ? offer : answer;
+  for (size_t ii = 0; ii < session_sdp.size(); ++ii)
+  {
+    if (session_sdp[ii][0] == 'm')
+    {
+      break;
+    }
+    v["SDP-Session-Description"].append(Json::Value(session_sdp[ii]));
+  }
+
+  // Now parse and encode the offer and answer media components.
+  tree_encode_media_components(v,
+                               offer,
+                               RalfACR::SDP_OFFER,
+                               media.offer.initiator_flag,
+                               media.offer.initiator_party);
+  tree_encode_media_components(v,
+                               answer,
+                               RalfACR::SDP_ANSWER,
+                               media.answer.initiator_flag,
+                               media.answer.initiator_party);
+}
+
+/// Reference encoder that builds a Json::Value tree for the ACR and renders
+/// it, as RalfACR::get_message did before it streamed the ACR with
+/// rapidjson.  Used to check that the streaming encoder produces the same
+/// document, and that it is cheaper.
+static std::string tree_encode_acr(RalfACR* acr, pj_time_val timestamp)
+{
+  if (timestamp.sec == -1)
+  {
+    // Timestamp is unspecified, so get the current time.
+    pj_gettimeofday(&timestamp);
+  }
+
+  Json::Value v;
+
+  // Add the peers section with charging function addresses if this is a
+  // start or event message.
+  if ((acr->_record_type == RalfACR::START_RECORD) ||
+      (acr->_record_type == RalfACR::EVENT_RECORD))
+  {
+    Json::Value& p = v["peers"];
+    for (std::list<std::string>::const_iterator i = acr->_ccfs.begin();
+         i != acr->_ccfs.end();
+         ++i)
+    {
+      p["ccf"].append(Json::Value(*i));
+    }
+    for (std::list<std::string>::const_iterator i = acr->_ecfs.begin();
+         i != acr->_ecfs.end();
+         ++i)
+    {
+      p["ecf"].append(Json::Value(*i));
+    }
+  }
+
+  // Build the event data.
+  Json::Value& e = v["event"];
+
+  // Add top-level fields.
+  e["Accounting-Record-Type"] = Json::Value(acr->_record_type);
+  if (!acr->_username.empty())
+  {
+    e["User-Name"] = Json::Value(acr->_username);
+  }
+  if (acr->_interim_interval != 0)
+  {
+    e["Acct-Interim-Interval"] = Json::Value(acr->_interim_interval);
+  }
+  e["Event-Timestamp"] = Json::Value((Json::UInt)timestamp.sec);
+
+  // Add Service-Information AVP group.
+  Json::Value& si = e["Service-Information"];
+
+  if ((acr->_node_functionality == PCSCF) ||
+      (acr->_node_functionality == SCSCF) ||
+      (acr->_node_functionality == IBCF))
+  {
+    // Add Subscription-Id AVPs on P-CSCF/S-CSCF/IBCF ACRs (should be omitted
+    // on I-CSCF and BGCF).
+    for (std::list<RalfACR::SubscriptionId>::const_iterator i = acr->_subscription_ids.begin();
+         i != acr->_subscription_ids.end();
+         ++i)
+    {
+      Json::Value& sub = si["Subscription-Id"].append(Json::Value());
+      sub["Subscription-Id-Type"] = Json::Value(i->type);
+      sub["Subscription-Id-Data"] = Json::Value(i->id);
+    }
+  }
+
+  // Add IMS-Information AVP group.
+  Json::Value& ii = si["IMS-Information"];
+
+  // Add Event-Type AVP group.
+  Json::Value& event_type = ii["Event-Type"];
+  event_type["SIP-Method"] = Json::Value(acr->_method);
+  if (!acr->_event.empty())
+  {
+    event_type["Event"] = Json::Value(acr->_event);
+  }
+  if (acr->_expires != -1)
+  {
+    event_type["Expires"] = Json::Value(acr->_expires);
+  }
+
+  ii["Role-Of-Node"] = Json::Value(acr->_node_role);
+  ii["Node-Functionality"] = Json::Value(acr->_node_functionality);
+  ii["User-Session-Id"] = Json::Value(acr->_user_session_id);
+
+  // Add the Calling-Party-Address AVPs.
+  for (std::list<std::string>::const_iterator i = acr->_calling_party_addresses.begin();
+       i != acr->_calling_party_addresses.end();
+       ++i)
+  {
+    ii["Calling-Party-Address"].append(Json::Value(*i));
+  }
+
+  // Add the Called-Party-Address AVP.
+  if (!acr->_called_party_address.empty())
+  {
+    ii["Called-Party-Address"] = Json::Value(acr->_called_party_address);
+  }
+
+  if (acr->_node_functionality == SCSCF)
+  {
+    // Add the Requested-Party-Address AVP.  This is only present if different
+    // from the called party address.
+    if (acr->_requested_party_address != acr->_called_party_address)
+    {
+      ii["Requested-Party-Address"] = Json::Value(acr->_requested_party_address);
+    }
+  }
+
+  if ((acr->_node_functionality == PCSCF) ||
+      (acr->_node_functionality == SCSCF))
+  {
+    // Add the Called-Asserted-Identity AVPs.
+    for (std::list<std::string>::const_iterator i = acr->_called_asserted_ids.begin();
+         i != acr->_called_asserted_ids.end();
+         ++i)
+    {
+      ii["Called-Asserted-Identity"].append(Json::Value(*i));
+    }
+  }
+
+  if (acr->_node_functionality != BGCF)
+  {
+    // Add the Associated-URI AVPs.
+    for (std::list<std::string>::const_iterator i = acr->_associated_uris.begin();
+         i != acr->_associated_uris.end();
+         ++i)
+    {
+      ii["Associated-URI"].append(Json::Value(*i));
+    }
+  }
+
+  // Add the Time-Stamps AVP group.
+  Json::Value& timestamps = ii["Time-Stamps"];
+  if (acr->_req_timestamp.sec != 0)
+  {
+    timestamps["SIP-Request-Timestamp"] = Json::Value((Json::UInt)acr->_req_timestamp.sec);
+    timestamps["SIP-Request-Timestamp-Fraction"] = Json::Value((Json::UInt)acr->_req_timestamp.msec);
+  }
+  if (acr->_rsp_timestamp.sec != 0)
+  {
+    timestamps["SIP-Response-Timestamp"] = Json::Value((Json::UInt)acr->_rsp_timestamp.sec);
+    timestamps["SIP-Response-Timestamp-Fraction"] = Json::Value((Json::UInt)acr->_rsp_timestamp.msec);
+  }
+
+  if (acr->_node_functionality == SCSCF)
+  {
+    // Add the Application-Server-Information AVPs.
+    for (std::list<RalfACR::ASInformation>::const_iterator i = acr->_as_information.begin();
+         i != acr->_as_information.end();
+         ++i)
+    {
+      Json::Value& as = ii["Application-Server-Information"].append(Json::Value());
+      as["Application-Server"] = Json::Value(i->uri);
+      if (!i->redirect_uri.empty())
+      {
+        as["Application-Provided-Called-Party-Address"].append(Json::Value(i->redirect_uri));
+      }
+      if (i->status_code != RalfACR::STATUS_CODE_NONE)
+      {
+        as["Status-Code"] = Json::Value(i->status_code);
+      }
+    }
+  }
+
+  // Add a single Inter-Operator-Identifier AVP group.  (According to 7.2.77 of
+  // TS 32.299 there could be multiple of these, but only one
+  // IMS-Charging-Identifier - but since they both come from the same SIP
+  // header this seems inconsistent, so we only add a single IOI AVP group.
+  if ((!acr->_orig_ioi.empty()) || (!acr->_term_ioi.empty()))
+  {
+    Json::Value& ioi = ii["Inter-Operator-Identifier"].append(Json::Value());
+    if (!acr->_orig_ioi.empty())
+    {
+      ioi["Originating-IOI"] = Json::Value(acr->_orig_ioi);
+    }
+    if (!acr->_term_ioi.empty())
+    {
+      ioi["Terminating-IOI"] = Json::Value(acr->_term_ioi);
+    }
+  }
+
+  // Add Transit-IOI-List AVPs.
+  for (std::list<std::string>::const_iterator i = acr->_transit_iois.begin();
+       i != acr->_transit_iois.end();
+       ++i)
+  {
+    ii["Transit-IOI-List"].append(Json::Value(*i));
+  }
+
+  ii["IMS-Charging-Identifier"] = Json::Value(acr->_icid);
+
+  // Add the Server-Capabilities AVP if I-CSCF.
+  if (acr->_node_functionality == ICSCF)
+  {
+    Json::Value& server_caps = ii["Server-Capabilities"];
+    for (std::vector<int>::const_iterator i = acr->_server_caps.mandatory_caps.begin();
+         i != acr->_server_caps.mandatory_caps.end();
+         ++i)
+    {
+      server_caps["Mandatory-Capability"].append(Json::Value(*i));
+    }
+    for (std::vector<int>::const_iterator i = acr->_server_caps.optional_caps.begin();
+         i != acr->_server_caps.optional_caps.end();
+         ++i)
+    {
+      server_caps["Optional-Capability"].append(Json::Value(*i));
+    }
+    if (!acr->_server_caps.scscf.empty())
+    {
+      // Note that the Server-Name in Server-Capabilities is an array AVP
+      // according to 6.3.4/TS 29.229.
+      server_caps["Server-Name"].append(Json::Value(acr->_server_caps.scscf));
+    }
+  }
+
+  // Add media and message body related AVPs on P-CSCF/S-CSCF/IBCF ACRs.  Note
+  // that according to TS 32.260, a BGCF should include early media AVPs if
+  // it has the information, but since a BGCF does not have to record route
+  // itself, it may not have the information.  We therefore choose not to
+  // include early media on BGCF ACRs.
+  if ((acr->_node_functionality == SCSCF) ||
+      (acr->_node_functionality == PCSCF) ||
+      (acr->_node_functionality == IBCF))
+  {
+    // Add Early-Media-Description AVPs to Start and Event ACRs.
+    if ((acr->_record_type == RalfACR::START_RECORD) ||
+        (acr->_record_type == RalfACR::EVENT_RECORD))
+    {
+      for (std::list<RalfACR::EarlyMediaDescription>::const_iterator i = acr->_early_media.begin();
+           i != acr->_early_media.end();
+           ++i)
+      {
+        Json::Value& em = ii["Early-Media-Description"].append(Json::Value());
+        em["SDP-Timestamps"]["SDP-Offer-Timestamp"] =
+                                 Json::Value((Json::UInt)i->offer_timestamp.sec);
+        em["SDP-Timestamps"]["SDP-Answer-Timestamp"] =
+                                Json::Value((Json::UInt)i->answer_timestamp.sec);
+        tree_encode_sdp_description(acr, em, i->media);
+      }
+    }
+
+    if ((acr->_record_type == RalfACR::START_RECORD) ||
+        (acr->_record_type == RalfACR::INTERIM_RECORD))
+    {
+      // Add SDP related AVPs to Start and Interim ACRs.
+      tree_encode_sdp_description(acr, ii, acr->_media);
+    }
+
+    // Add Message-Body AVPs.
+    for (std::list<RalfACR::MessageBody>::const_iterator i = acr->_msg_bodies.begin();
+         i != acr->_msg_bodies.end();
+         ++i)
+    {
+      Json::Value& body = ii["Message-Body"].append(Json::Value());
+      body["Content-Type"] = Json::Value(i->type);
+      body["Content-Length"] = Json::Value(i->length);
+      if (!i->disposition.empty())
+      {
+        body["Content-Disposition"] = Json::Value(i->disposition);
+      }
+      body["Originator"] = Json::Value(i->originator);
+    }
+  }
+
+  // Add Cause-Code AVP if STOP or EVENT message.
+  if (acr->_record_type == RalfACR::STOP_RECORD)
+  {
+    // Cause code is always zero for STOP requests.
+    ii["Cause-Code"] = Json::Value(0);
+  }
+  else if ((acr->_record_type == RalfACR::EVENT_RECORD) &&
+           (acr->_status_code != 0))
+  {
+    // Calculate the cause code to include on the request (see 7.2.35/TS 32.299
+    // for all the gory details).
+    int cause_code = 0;
+    if (acr->_status_code == PJSIP_SC_OK)
+    {
+      if ((acr->_method == "SUBSCRIBE") &&
+          (acr->_expires == 0))
+      {
+        // End of SUBSCRIBE dialog.
+        cause_code = -2;
+      }
+      else if ((acr->_method == "REGISTER") &&
+               (acr->_expires == 0))
+      {
+        // End of REGISTER dialog (nonsense I know, but it's what the spec
+        // says).
+        cause_code = -3;
+      }
+      else
+      {
+        // Successful transaction.
+        cause_code = -1;
+      }
+    }
+    else if ((acr->_status_code > PJSIP_SC_OK) &&
+             (acr->_status_code < PJSIP_SC_BAD_REQUEST))
+    {
+      // 2xx or 3xx response.
+      cause_code = -acr->_status_code;
+    }
+    else
+    {
+      // 4xx, 5xx or 6xx response.
+      cause_code = acr->_status_code;
+    }
+    // We don't currently support the Unspecified error (1), Unsuccessful
+    // session setup (2) or Internal error (3) cause codes - in all of these
+    // cases we have to send a SIP response with a valid 4xx/5xx/6xx status
+    // code, so we use that status code.
+    ii["Cause-Code"] = Json::Value(cause_code);
+  }
+
+  // Add Reason-Header AVPs.
+  for (std::list<std::string>::const_iterator i = acr->_reasons.begin();
+       i != acr->_reasons.end();
+       ++i)
+  {
+    ii["Reason-Header"].append(Json::Value(*i));
+  }
+
+  // Add Access-Network-Information AVPs
+  for (std::list<std::string>::const_iterator i = acr->_access_network_info.begin();
+       i != acr->_access_network_info.end();
+       ++i)
+  {
+    ii["Access-Network-Information"].append(Json::Value(*i));
+  }
+
+  // Add From-Address AVP.
+  ii["From-Address"] = Json::Value(acr->_from_address);
+
+  // Add IMS-Visited-Network-Identifier AVP if set.
+  if (!acr->_visited_network_id.empty())
+  {
+    ii["IMS-Visited-Network-Identifier"] = Json::Value(acr->_visited_network_id);
+  }
+
+  // Add Route-Header-Received and Route-Header-Transmitted AVPs if set.
+  if (!acr->_route_hdr_received.empty())
+  {
+    ii["Route-Header-Received"] = Json::Value(acr->_route_hdr_received);
+  }
+  if (!acr->_route_hdr_transmitted.empty())
+  {
+    ii["Route-Header-Transmitted"] = Json::Value(acr->_route_hdr_transmitted);
+  }
+
+  // Add the Instance-Id AVP if set.
+  if (!acr->_instance_id.empty())
+  {
+    ii["Instance-Id"] = Json::Value(acr->_instance_id);
+  }
+
+  // Render the message to a string and return it.
+  Json::FastWriter writer;
+  return writer.write(v);
+}
+
 /// Fixture for ACRTest.
 class ACRTest : public SipTest
 {
@@ -121,6 +574,20 @@ protected:
 
     return rc;
   }
+
+  // Checks that the streaming encoder in RalfACR::get_message produces the
+  // same document as the reference tree encoder for this ACR.
+  void compare_encoders(ACR* acr, pj_time_val ts)
+  {
+    RalfACR* ralf_acr = (RalfACR*)acr;
+    Json::Reader reader;
+    Json::Value json_streamed;
+    Json::Value json_tree;
+
+    ASSERT_TRUE(reader.parse(ralf_acr->get_message(ts), json_streamed));
+    ASSERT_TRUE(reader.parse(tree_encode_acr(ralf_acr, ts), json_tree));
+    EXPECT_EQ(json_tree.toStyledString(), json_streamed.toStyledString());
+  }
 };
 
 class SIPRequest
@@ -1019,3 +1486,113 @@ TEST_F(ACRTest, ICSCFRegister)
   EXPECT_TRUE(compare_acr(acr_message, "acr_icscfregister_final.json"));
   delete acr;
 }
+
+TEST_F(ACRTest, StreamingEncoderMatchesTreeEncoder)
+{
+  // Tests that the streaming encoder produces the same ACRs as the tree
+  // encoder it replaced, for event, start and stop records with media,
+  // application server and server capabilities AVPs.
+  pj_time_val ts;
+  ACR* acr;
+
+  RalfACRFactory scscf_factory(NULL, SCSCF);
+  RalfACRFactory icscf_factory(NULL, ICSCF);
+
+  // ACR[EVENT] for a REGISTER at the S-CSCF.
+  acr = scscf_factory.get_acr(0, CALLING_PARTY, NODE_ROLE_ORIGINATING);
+  SIPRequest reg("REGISTER");
+  reg._requri = "sip:homedomain";
+  reg._from = "\"6505550000\" <sip:6505550000@homedomain>";
+  reg._to = "\"6505550000\" <sip:6505550000@homedomain>";
+  reg._extra_hdrs = "Expires: 300\r\n";
+  reg._extra_hdrs += "P-Charging-Vector: icid-value=1234bc9876e;icid-generated-at=10.83.18.28;orig-ioi=homedomain\r\n";
+  reg._extra_hdrs += "P-Charging-Function-Addresses: ccf=192.1.1.1;ecf=192.1.1.3\r\n";
+  ts.sec = 1;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(reg.get()), ts);
+  SIPResponse reg200ok(200, "REGISTER");
+  reg200ok._extra_hdrs = "P-Associated-URI: <sip:6505550000@homedomain>, <tel:6505550000>\r\n";
+  ts.msec = 25;
+  acr->tx_response(parse_msg(reg200ok.get()), ts);
+  compare_encoders(acr, ts);
+  delete acr;
+
+  // ACR[START] for an originating INVITE with an offer and answer, routed
+  // through an AS, at the S-CSCF.
+  acr = scscf_factory.get_acr(0, CALLING_PARTY, NODE_ROLE_ORIGINATING);
+  SIPRequest invite("INVITE");
+  invite._to = "\"6505550001\" <sip:6505550001@homedomain>";
+  invite._extra_hdrs = "Session-Expires: 600\r\n";
+  invite._extra_hdrs += "P-Asserted-Identity: <tel:6505550000>\r\n";
+  invite._extra_hdrs += "P-Charging-Vector: icid-value=1234bc9876e;icid-generated-at=10.83.18.28;orig-ioi=homedomain\r\n";
+  invite._extra_hdrs += "P-Charging-Function-Addresses: ccf=192.1.1.1;ecf=192.1.1.3\r\n";
+  invite._extra_hdrs += "Content-Type: application/sdp\r\n";
+  invite._body =
+"v=0\r\n"
+"o=- 2728502836004741600 2 IN IP4 127.0.0.1\r\n"
+"s=-\r\n"
+"t=0 0\r\n"
+"m=audio 1988 RTP/AVP 0 8\r\n"
+"c=IN IP4 10.83.18.38\r\n"
+"a=rtpmap:0 PCMU/8000\r\n"
+"m=video 1990 RTP/AVP 100\r\n"
+"c=IN IP4 10.83.18.38\r\n"
+"a=rtpmap:100 VP8/90000\r\n";
+  ts.sec = 2;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(invite.get()), ts);
+  ts.msec = 10;
+  acr->tx_request(parse_msg(invite.get()), ts);
+  SIPResponse invite200ok(200, "INVITE");
+  invite200ok._extra_hdrs = "P-Asserted-Identity: <tel:6505550001>\r\n";
+  invite200ok._extra_hdrs += "P-Charging-Vector: icid-value=1234bc9876e;icid-generated-at=10.83.18.28;orig-ioi=homedomain;term-ioi=homedomain\r\n";
+  invite200ok._extra_hdrs += "Content-Type: application/sdp\r\n";
+  invite200ok._body =
+"v=0\r\n"
+"o=- 2728502836004741601 2 IN IP4 127.0.0.1\r\n"
+"s=-\r\n"
+"t=0 0\r\n"
+"m=audio 2000 RTP/AVP 0\r\n"
+"c=IN IP4 10.83.18.50\r\n"
+"a=rtpmap:0 PCMU/8000\r\n";
+  ts.msec = 40;
+  acr->rx_response(parse_msg(invite200ok.get()), ts);
+  acr->as_info("sip:as1.homedomain:5060;transport=TCP",
+               "sip:6505559999@homedomain",
+               200,
+               false);
+  ts.msec = 50;
+  acr->tx_response(parse_msg(invite200ok.get()), ts);
+  compare_encoders(acr, ts);
+  delete acr;
+
+  // ACR[STOP] for the BYE ending the call.
+  acr = scscf_factory.get_acr(0, CALLING_PARTY, NODE_ROLE_ORIGINATING);
+  SIPRequest bye("BYE");
+  bye._to = "\"6505550001\" <sip:6505550001@homedomain>;tag=1234";
+  bye._extra_hdrs = "Reason: SIP;cause=200;text=\"Call completed\"\r\n";
+  ts.sec = 3;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(bye.get()), ts);
+  acr->tx_request(parse_msg(bye.get()), ts);
+  SIPResponse bye200ok(200, "BYE");
+  ts.msec = 20;
+  acr->rx_response(parse_msg(bye200ok.get()), ts);
+  acr->tx_response(parse_msg(bye200ok.get()), ts);
+  compare_encoders(acr, ts);
+  delete acr;
+
+  // ACR[EVENT] for a REGISTER at the I-CSCF, with server capabilities.
+  acr = icscf_factory.get_acr(0, CALLING_PARTY, NODE_ROLE_ORIGINATING);
+  ts.sec = 4;
+  ts.msec = 0;
+  acr->rx_request(parse_msg(reg.get()), ts);
+  ServerCapabilities caps;
+  caps.scscf = "sip:scscf1.homedomain";
+  caps.mandatory_caps.push_back(10);
+  caps.optional_caps.push_back(30);
+  acr->server_capabilities(caps);
+  ts.msec = 10;
+  compare_encoders(acr, ts);
+  delete acr;
+}
@@ -82,7 +82,10 @@ public:
                                           _hss_connection,
                                           _chronos_connection,
                                           _acr_factory,
-                                          _analytics);
+                                          _analytics,
+                                          0,
+                                          0,
+                                          1);
     ASSERT_EQ(PJ_SUCCESS, ret);
   }
 
@@ -1066,3 +1069,177 @@ TEST_F(AuthenticationTest, AuthCorruptAV)
 }
 
 
+
+
+TEST_F(AuthenticationTest, DigestAuthNonceReuse)
+{
+  // Test that a validated SIP Digest nonce can be reused with an increasing
+  // nonce count when nonce reuse is enabled.
+  pjsip_tx_data* tdata;
+
+  destroy_authentication();
+  init_authentication("homedomain",
+                      _av_store,
+                      _hss_connection,
+                      _chronos_connection,
+                      _acr_factory,
+                      _analytics,
+                      300,
+                      0,
+                      1);
+
+  // Set up the HSS response for the AV query using a default private user identity.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain",
+                              "{\"digest\":{\"realm\":\"homedomain\",\"qop\":\"auth\",\"ha1\":\"12345678123456781234567812345678\"}}");
+
+  // Send in a REGISTER request with no authentication header.  This triggers
+  // Digest authentication.
+  AuthenticationMessage msg1("REGISTER");
+  msg1._auth_hdr = false;
+  inject_msg(msg1.get());
+
+  // Expect a 401 Not Authorized response.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  free_txdata();
+
+  // Respond to the challenge.
+  AuthenticationMessage msg2("REGISTER");
+  msg2._algorithm = "MD5";
+  msg2._key = "12345678123456781234567812345678";
+  msg2._nonce = auth_params["nonce"];
+  msg2._opaque = auth_params["opaque"];
+  msg2._nc = "00000001";
+  msg2._cnonce = "8765432187654321";
+  msg2._qop = "auth";
+  inject_msg(msg2.get());
+
+  // Expect no response, as the authentication module has let the request through.
+  ASSERT_EQ(0, txdata_count());
+
+  // Send a refresh REGISTER reusing the nonce with a higher nonce count.
+  // This is let through without a further challenge.
+  AuthenticationMessage msg3("REGISTER");
+  msg3._algorithm = "MD5";
+  msg3._key = "12345678123456781234567812345678";
+  msg3._nonce = auth_params["nonce"];
+  msg3._opaque = auth_params["opaque"];
+  msg3._nc = "00000002";
+  msg3._cnonce = "1234567812345678";
+  msg3._qop = "auth";
+  inject_msg(msg3.get());
+  ASSERT_EQ(0, txdata_count());
+
+  // Replay the same request.  The nonce count hasn't increased, so the nonce
+  // is treated as stale and the request is challenged.
+  inject_msg(msg3.get());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  auth = get_headers(tdata->msg, "WWW-Authenticate");
+  auth_params.clear();
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_EQ("true", auth_params["stale"]);
+  free_txdata();
+
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av?impu=sip%3A6505550001%40homedomain");
+
+  destroy_authentication();
+  init_authentication("homedomain",
+                      _av_store,
+                      _hss_connection,
+                      _chronos_connection,
+                      _acr_factory,
+                      _analytics,
+                      0,
+                      0,
+                      1);
+}
+
+
+TEST_F(AuthenticationTest, AKAAuthPrefetch)
+{
+  // Test that AKA vectors are fetched from the HSS in batches when
+  // prefetching is enabled, and the extra vectors are used for subsequent
+  // challenges.
+  pjsip_tx_data* tdata;
+
+  destroy_authentication();
+  init_authentication("homedomain",
+                      _av_store,
+                      _hss_connection,
+                      _chronos_connection,
+                      _acr_factory,
+                      _analytics,
+                      0,
+                      0,
+                      2);
+
+  // Set up the HSS response for the batched AV query using a default private
+  // user identity.
+  _hss_connection->set_result("/impi/6505550001%40homedomain/av/aka?impu=sip%3A6505550001%40homedomain&count=2",
+                              "{\"vectors\":["
+                                "{\"aka\":{\"challenge\":\"11111111111111111111111111111111\","
+                                          "\"response\":\"12345678123456781234567812345678\","
+                                          "\"cryptkey\":\"0123456789abcdef\","
+                                          "\"integritykey\":\"fedcba9876543210\"}},"
+                                "{\"aka\":{\"challenge\":\"22222222222222222222222222222222\","
+                                          "\"response\":\"12345678123456781234567812345678\","
+                                          "\"cryptkey\":\"0123456789abcdef\","
+                                          "\"integritykey\":\"fedcba9876543210\"}}]}");
+
+  // Send in a REGISTER request with an authentication header with
+  // integrity-protected=no.  This triggers aka authentication using the
+  // first vector in the batch.
+  AuthenticationMessage msg1("REGISTER");
+  msg1._integ_prot = "no";
+  inject_msg(msg1.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  std::string auth = get_headers(tdata->msg, "WWW-Authenticate");
+  std::map<std::string, std::string> auth_params;
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_EQ("11111111111111111111111111111111", auth_params["nonce"]);
+  free_txdata();
+
+  // Remove the HSS response, and send in another REGISTER.  This is
+  // challenged using the prefetched vector.
+  _hss_connection->delete_result("/impi/6505550001%40homedomain/av/aka?impu=sip%3A6505550001%40homedomain&count=2");
+  inject_msg(msg1.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(401).matches(tdata->msg);
+  auth = get_headers(tdata->msg, "WWW-Authenticate");
+  auth_params.clear();
+  parse_www_authenticate(auth, auth_params);
+  EXPECT_EQ("22222222222222222222222222222222", auth_params["nonce"]);
+  free_txdata();
+
+  // The prefetched vectors have all been used, so a further REGISTER needs
+  // the HSS, which fails.
+  inject_msg(msg1.get());
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(403).matches(tdata->msg);
+  free_txdata();
+
+  destroy_authentication();
+  init_authentication("homedomain",
+                      _av_store,
+                      _hss_connection,
+                      _chronos_connection,
+                      _acr_factory,
+                      _analytics,
+                      0,
+                      0,
+                      1);
+}
@@ -163,3 +163,160 @@ TEST_F(AvStoreTest, ReadCorrupt)
 }
 
 
+
+TEST_F(AvStoreTest, Tombstone)
+{
+  LocalStore* local_data_store = new LocalStore();
+  AvStore* av_store = new AvStore(local_data_store);
+
+  // Write an AV to the store.
+  std::string impi = "6505551234@cw-ngv.com";
+  std::string nonce = "9876543210";
+  std::string av = "{\"digest\":{\"realm\": \"cw-ngv.com\",\"qop\": \"auth\",\"ha1\": \"12345678\"}}";
+
+  Json::Reader reader;
+  Json::Value* av_json_write = new Json::Value;
+  reader.parse(av, *av_json_write);
+
+  av_store->set_av(impi, nonce, av_json_write, 0, 0);
+
+  // Read the AV and tombstone it using the CAS from the read.
+  uint64_t cas;
+  Json::Value* av_json_read = av_store->get_av(impi, nonce, cas, 0);
+  ASSERT_THAT(av_json_read, ::testing::NotNull());
+  EXPECT_TRUE(av_store->tombstone_av(impi, nonce, av_json_read, cas, 0));
+
+  // Tombstoning again with the same CAS fails, as the record has changed.
+  EXPECT_FALSE(av_store->tombstone_av(impi, nonce, av_json_read, cas, 0));
+  delete av_json_read;
+
+  av_json_read = av_store->get_av(impi, nonce, cas, 0);
+  ASSERT_THAT(av_json_read, ::testing::NotNull());
+  EXPECT_TRUE(av_json_read->isMember("tombstone"));
+  delete av_json_read;
+
+  delete av_json_write;
+
+  delete av_store;
+  delete local_data_store;
+}
+
+
+TEST_F(AvStoreTest, BinaryFormat)
+{
+  LocalStore* local_data_store = new LocalStore();
+  AvStore* av_store = new AvStore(local_data_store);
+
+  // Write an AKA AV to the store.
+  std::string impi = "6505551234@cw-ngv.com";
+  std::string nonce = "9876543210";
+  std::string av = "{\"aka\":{\"challenge\": \"87654321876543218765432187654321\",\"response\": \"12345678123456781234567812345678\",\"cryptkey\": \"0123456789abcdef\",\"integritykey\": \"fedcba9876543210\"},\"branch\": \"z9hG4bK1234\",\"tombstone\": \"true\"}";
+
+  Json::Reader reader;
+  Json::Value* av_json_write = new Json::Value;
+  reader.parse(av, *av_json_write);
+
+  av_store->set_av(impi, nonce, av_json_write, 0, 0);
+
+  // Check the record is written in the binary format, not as JSON.
+  std::string data;
+  uint64_t cas;
+  local_data_store->get_data("av", impi + "\\" + nonce, data, cas, 0);
+  ASSERT_FALSE(data.empty());
+  EXPECT_EQ(0x01, data[0]);
+
+  // Retrieve the AV from the store.
+  Json::Value* av_json_read = av_store->get_av(impi, nonce, cas, 0);
+
+  EXPECT_THAT(av_json_read, ::testing::NotNull());
+  ASSERT_EQ(0, av_json_read->compare(*av_json_write));
+
+  delete av_json_write;
+  delete av_json_read;
+
+  // Truncate the record and check it is rejected.
+  local_data_store->set_data("av", impi + "\\" + nonce, data.substr(0, data.length() - 1), cas, 30);
+  av_json_read = av_store->get_av(impi, nonce, cas, 0);
+  ASSERT_EQ(NULL, av_json_read);
+
+  delete av_store;
+  delete local_data_store;
+}
+
+
+TEST_F(AvStoreTest, ReadLegacyJson)
+{
+  LocalStore* local_data_store = new LocalStore();
+  AvStore* av_store = new AvStore(local_data_store);
+
+  // Write a JSON AV directly to the local data store.
+  std::string impi = "6505551234@cw-ngv.com";
+  std::string nonce = "9876543210";
+  std::string av = "{\"digest\":{\"realm\": \"cw-ngv.com\",\"qop\": \"auth\",\"ha1\": \"12345678\"}}";
+
+  local_data_store->set_data("av", impi + "\\" + nonce, av, 0, 30);
+
+  Json::Reader reader;
+  Json::Value av_json;
+  reader.parse(av, av_json);
+
+  // Retrieve the AV from the store.
+  uint64_t cas;
+  Json::Value* av_json_read = av_store->get_av(impi, nonce, cas, 0);
+
+  EXPECT_THAT(av_json_read, ::testing::NotNull());
+  ASSERT_EQ(0, av_json_read->compare(av_json));
+  delete av_json_read;
+
+  delete av_store;
+  delete local_data_store;
+}
+
+
+TEST_F(AvStoreTest, PrefetchedSharedAcrossNodes)
+{
+  LocalStore* local_data_store = new LocalStore();
+  AvStore* av_store = new AvStore(local_data_store);
+  AvStore* other_av_store = new AvStore(local_data_store);
+
+  std::string impi = "6505551234@cw-ngv.com";
+  std::string impu = "sip:6505551234@cw-ngv.com";
+
+  std::vector<Json::Value*> avs;
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    Json::Value* av = new Json::Value;
+    (*av)["aka"]["challenge"] = "challenge" + std::to_string(ii);
+    avs.push_back(av);
+  }
+
+  // Prefetched AVs held by one node are taken in order by either node, and
+  // each is only used once.
+  av_store->add_prefetched_avs(impi, impu, avs, 0);
+
+  Json::Value* av = other_av_store->get_prefetched_av(impi, impu, 0);
+  ASSERT_THAT(av, ::testing::NotNull());
+  EXPECT_EQ("challenge0", (*av)["aka"]["challenge"].asString());
+  delete av;
+
+  av = av_store->get_prefetched_av(impi, impu, 0);
+  ASSERT_THAT(av, ::testing::NotNull());
+  EXPECT_EQ("challenge1", (*av)["aka"]["challenge"].asString());
+  delete av;
+
+  // A resync on one node discards the remaining AVs for both.
+  other_av_store->clear_prefetched_avs(impi, impu, 0);
+  EXPECT_EQ(NULL, av_store->get_prefetched_av(impi, impu, 0));
+  EXPECT_EQ(NULL, other_av_store->get_prefetched_av(impi, impu, 0));
+
+  for (std::vector<Json::Value*>::iterator i = avs.begin();
+       i != avs.end();
+       ++i)
+  {
+    delete *i;
+  }
+
+  delete other_av_store;
+  delete av_store;
+  delete local_data_store;
+}
@@ -511,6 +511,17 @@ public:
   }
 
 protected:
+  /// Returns the health the next hop table holds for a TCP server on port
+  /// 5060, or NULL if the server isn't in the table.
+  static std::shared_ptr<NextHopTable::Health> server_health(const std::string& address)
+  {
+    AddrInfo ai;
+    ai.address.af = AF_INET;
+    inet_pton(AF_INET, address.c_str(), &ai.address.addr.ipv4);
+    ai.port = 5060;
+    ai.transport = IPPROTO_TCP;
+    return stack_data.next_hops->find_health(ai);
+  }
 };
 
 
@@ -2806,6 +2817,181 @@ TEST_F(BasicProxyTest, RetryOn5xx)
 }
 
 
+TEST_F(BasicProxyTest, NextHopHealthOn5xx)
+{
+  // Tests that a 503 response fails over to the other server and lowers the
+  // health of the server that sent it, without blacklisting it.
+
+  pjsip_tx_data* tdata;
+
+  // Add a host mapping for proxy-y.awaydomain to two IP addresses.
+  add_host_mapping("proxy-y.awaydomain", "10.10.10.110,10.10.10.111");
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with a Route header not referencing this node or the
+  // home domain.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "alice";
+  msg1._to = "bob";
+  msg1._todomain = "awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:proxy-y.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Check the 100 Trying.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Request is forwarded to one of the servers.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  string server1 = str_pj(tdata->tp_info.transport->remote_name.host);
+
+  // Send a 503 response to the request and catch the ACK.
+  inject_msg(respond_to_current_txdata(503));
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+
+  // Check that the request has been retried to the other server.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  string server2 = str_pj(tdata->tp_info.transport->remote_name.host);
+  EXPECT_NE(server1, server2) << "Request retried to same server";
+
+  // Send a 200 OK response and check it is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // The server that sent the 503 has a raised error rate but isn't
+  // blacklisted, and the server that accepted the request is unaffected.
+  std::shared_ptr<NextHopTable::Health> health1 = server_health(server1);
+  std::shared_ptr<NextHopTable::Health> health2 = server_health(server2);
+  ASSERT_TRUE(health1 != NULL);
+  ASSERT_TRUE(health2 != NULL);
+  EXPECT_LT(0, health1->error_rate.load());
+  EXPECT_EQ(0u, health1->blacklisted_until_ms.load());
+  EXPECT_EQ(0, health2->error_rate.load());
+  EXPECT_EQ(0u, health2->blacklisted_until_ms.load());
+
+  delete tp;
+}
+
+
+TEST_F(BasicProxyTest, NextHopBlacklistOnTransportError)
+{
+  // Tests that a server that fails at the transport level is blacklisted, so
+  // subsequent requests go straight to the other server.
+
+  pjsip_tx_data* tdata;
+
+  // Add a host mapping for proxy-z.awaydomain to two IP addresses.
+  add_host_mapping("proxy-z.awaydomain", "10.10.10.120,10.10.10.121");
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "alice";
+  msg1._to = "bob";
+  msg1._todomain = "awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:proxy-z.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Check the 100 Trying.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Request is forwarded to one of the servers.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  string server1 = str_pj(tdata->tp_info.transport->remote_name.host);
+
+  // Kill the transport the request was sent on.
+  fake_tcp_init_shutdown((fake_tcp_transport*)tdata->tp_info.transport, PJ_EEOF);
+  free_txdata();
+  poll();
+
+  // Check that the request has been retried to the other server.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("INVITE").matches(tdata->msg);
+  string server2 = str_pj(tdata->tp_info.transport->remote_name.host);
+  EXPECT_NE(server1, server2) << "Request retried to same server";
+
+  // Send a 200 OK response and check it is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // The failed server is blacklisted in the next hop table.
+  std::shared_ptr<NextHopTable::Health> health1 = server_health(server1);
+  ASSERT_TRUE(health1 != NULL);
+  EXPECT_LT(0u, health1->blacklisted_until_ms.load());
+
+  // Send more requests, and check that they all go to the other server first.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    Message msg2;
+    msg2._method = "INVITE";
+    msg2._requri = "sip:bob@awaydomain";
+    msg2._from = "alice";
+    msg2._to = "bob";
+    msg2._todomain = "awaydomain";
+    msg2._via = tp->to_string(false);
+    msg2._route = "Route: <sip:proxy-z.awaydomain;transport=TCP;lr>";
+    inject_msg(msg2.get_request(), tp);
+
+    ASSERT_EQ(2, txdata_count());
+    tdata = current_txdata();
+    RespMatcher(100).matches(tdata->msg);
+    free_txdata();
+
+    ASSERT_EQ(1, txdata_count());
+    tdata = current_txdata();
+    ReqMatcher("INVITE").matches(tdata->msg);
+    EXPECT_EQ(server2, str_pj(tdata->tp_info.transport->remote_name.host))
+      << "Request sent to blacklisted server";
+
+    inject_msg(respond_to_current_txdata(200));
+    ASSERT_EQ(1, txdata_count());
+    tdata = current_txdata();
+    RespMatcher(200).matches(tdata->msg);
+    free_txdata();
+  }
+
+  delete tp;
+}
+
+
 TEST_F(BasicProxyTest, RetryFailed)
 {
   // Tests retrying to an alternate server on a 5xx response, which also responds
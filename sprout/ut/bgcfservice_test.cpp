@@ -39,6 +39,8 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
+#include <fstream>
+#include <unistd.h>
 
 #include "utils.h"
 #include "sas.h"
@@ -153,3 +155,77 @@ TEST_F(BgcfServiceTest, MissingFile)
   EXPECT_TRUE(log.contains("No BGCF configuration"));
   ET("+15108580271", "").test(bgcf_);
 }
+
+TEST_F(BgcfServiceTest, SuffixMatch)
+{
+  CapturingTestLogger log;
+  BgcfService bgcf_(string(UT_DIR).append("/test_bgcf_suffix.json"));
+  EXPECT_TRUE(log.contains("Duplicate BGCF route entry"));
+
+  // The longest configured suffix (on a label boundary) wins, ignoring case.
+  ET("example.com",                "sip.example.com"        ).test(bgcf_);
+  ET("pbx.example.com",            "sip.example.com"        ).test(bgcf_);
+  ET("a.b.c.example.com",          "sip.example.com"        ).test(bgcf_);
+  ET("west.example.com",           "sip-west.example.com"   ).test(bgcf_);
+  ET("pbx.WEST.Example.com",       "sip-west.example.com"   ).test(bgcf_);
+  ET("east.example.com",           "sip.example.com"        ).test(bgcf_);
+  ET("carrier.example.net",        "sip.carrier.example.net").test(bgcf_);
+  ET("pbx.carrier.example.net",    "sip.carrier.example.net").test(bgcf_);
+  ET("example.net",                ""                       ).test(bgcf_);
+  ET("badexample.com",             ""                       ).test(bgcf_);
+  ET("com",                        ""                       ).test(bgcf_);
+  ET("example.com.",               ""                       ).test(bgcf_);
+  ET("",                           ""                       ).test(bgcf_);
+}
+
+TEST_F(BgcfServiceTest, Reload)
+{
+  std::string file = "/tmp/bgcf_reload_test.json";
+  std::ofstream(file.c_str()) <<
+    "{\"routes\":[{\"domain\":\"example.com\",\"route\":[\"sip1.example.com\"]}]}";
+  BgcfService bgcf_(file);
+  ET("pbx.example.com", "sip1.example.com").test(bgcf_);
+
+  // Lookups see the new routes once they are reloaded.
+  std::ofstream(file.c_str()) <<
+    "{\"routes\":[{\"domain\":\"example.com\",\"route\":[\"sip2.example.com\"]},"
+    "{\"domain\":\"*\",\"route\":[\"default.example.com\"]}]}";
+  bgcf_.update_routes();
+  ET("pbx.example.com", "sip2.example.com").test(bgcf_);
+  ET("example.net", "default.example.com").test(bgcf_);
+
+  // If the file can't be parsed the current routes are kept.
+  std::ofstream(file.c_str()) << "{\"routes\":";
+  bgcf_.update_routes();
+  ET("pbx.example.com", "sip2.example.com").test(bgcf_);
+
+  unlink(file.c_str());
+}
+
+TEST_F(BgcfServiceTest, ManyDomains)
+{
+  // Build a peering table with thousands of carrier domains and check
+  // lookups in it.
+  const int DOMAINS = 10000;
+  std::string file = "/tmp/bgcf_many_domains_test.json";
+  {
+    std::ofstream out(file.c_str());
+    out << "{\"routes\":[";
+    for (int ii = 0; ii < DOMAINS; ++ii)
+    {
+      out << ((ii > 0) ? "," : "")
+          << "{\"domain\":\"carrier" << ii << ".example.com\","
+          << "\"route\":[\"sip.carrier" << ii << ".example.com\"]}";
+    }
+    out << "]}";
+  }
+  BgcfService bgcf_(file);
+  unlink(file.c_str());
+
+  for (int ii = 0; ii < DOMAINS; ii += 97)
+  {
+    ET("pbx.carrier" + std::to_string(ii) + ".example.com",
+       "sip.carrier" + std::to_string(ii) + ".example.com").test(bgcf_);
+  }
+  ET("carrier" + std::to_string(DOMAINS) + ".example.com", "").test(bgcf_);
+}
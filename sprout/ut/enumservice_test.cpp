@@ -35,6 +35,10 @@
  */
 
 #include <string>
+#include <vector>
+#include <list>
+#include <fstream>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
@@ -45,6 +49,7 @@
 #include "fakednsresolver.hpp"
 #include "fakelogger.h"
 #include "test_utils.hpp"
+#include "test_interposer.hpp"
 
 using namespace std;
 
@@ -171,6 +176,144 @@ TEST_F(JSONEnumServiceTest, BadRegex)
   ET("+15108580275", "").test(enum_);
 }
 
+/// Writes an ENUM configuration file with a number block for each prefix,
+/// translating numbers to sip:<number>@<domain>.
+static void write_enum_file(const std::string& filename,
+                            const std::vector<std::pair<std::string, std::string> >& blocks)
+{
+  std::ofstream file(filename.c_str());
+  file << "{ \"number_blocks\" : [\n";
+  for (size_t ii = 0; ii < blocks.size(); ++ii)
+  {
+    file << "  { \"prefix\" : \"" << blocks[ii].first << "\", "
+         << "\"regex\" : \"!(^.*$)!sip:\\\\1@" << blocks[ii].second << "!\" }"
+         << ((ii + 1 < blocks.size()) ? ",\n" : "\n");
+  }
+  file << "] }\n";
+}
+
+TEST_F(JSONEnumServiceTest, LongestPrefixMatch)
+{
+  // The most specific prefix wins, whatever order the blocks are in.
+  std::string filename = "/tmp/enumservice_test_lpm.json";
+  std::vector<std::pair<std::string, std::string> > blocks;
+  blocks.push_back(std::make_pair("", "default.com"));
+  blocks.push_back(std::make_pair("+1", "nanp.com"));
+  blocks.push_back(std::make_pair("+1510", "oakland.com"));
+  blocks.push_back(std::make_pair("+15108580271", "one.com"));
+  blocks.push_back(std::make_pair("+1510", "duplicate.com"));
+  blocks.push_back(std::make_pair("+1-510", "invalid.com"));
+  write_enum_file(filename, blocks);
+
+  CapturingTestLogger log;
+  JSONEnumService enum_(filename);
+  EXPECT_TRUE(log.contains("Invalid or duplicate prefix in ENUM number block"));
+
+  ET("+15108580271",  "sip:+15108580271@one.com"    ).test(enum_);
+  ET("+15108580272",  "sip:+15108580272@oakland.com").test(enum_);
+  ET("+1510",         "sip:+1510@oakland.com"       ).test(enum_);
+  ET("+151",          "sip:+151@nanp.com"           ).test(enum_);
+  ET("+16505551234",  "sip:+16505551234@nanp.com"   ).test(enum_);
+  ET("+446505551234", "sip:+446505551234@default.com").test(enum_);
+
+  unlink(filename.c_str());
+}
+
+TEST_F(JSONEnumServiceTest, Reload)
+{
+  std::string filename = "/tmp/enumservice_test_reload.json";
+  std::vector<std::pair<std::string, std::string> > blocks;
+  blocks.push_back(std::make_pair("+1510", "old.com"));
+  write_enum_file(filename, blocks);
+
+  JSONEnumService enum_(filename);
+  ET("+15108580271", "sip:+15108580271@old.com").test(enum_);
+  ET("+16505551234", "").test(enum_);
+
+  // Change the configuration and reload it.
+  blocks.clear();
+  blocks.push_back(std::make_pair("+1510", "new.com"));
+  blocks.push_back(std::make_pair("+1650", "new.com"));
+  write_enum_file(filename, blocks);
+  enum_.update_enum();
+
+  ET("+15108580271", "sip:+15108580271@new.com").test(enum_);
+  ET("+16505551234", "sip:+16505551234@new.com").test(enum_);
+
+  // If the file can't be parsed the current configuration is kept.
+  {
+    std::ofstream file(filename.c_str());
+    file << "{ \"number_blocks\" : [";
+  }
+  enum_.update_enum();
+  ET("+16505551234", "sip:+16505551234@new.com").test(enum_);
+
+  unlink(filename.c_str());
+}
+
+TEST_F(JSONEnumServiceTest, PrefixTrieMatchesLinearScan)
+{
+  // Checks the trie against a linear scan for the longest matching prefix
+  // (the original implementation), with prefixes of different lengths that
+  // are often prefixes of each other.
+  const int NUM_PREFIXES = 10000;
+  const int LOOKUPS = 1000;
+
+  JSONEnumService::PrefixTrie trie;
+  std::list<std::string> prefix_list;
+
+  for (int ii = 0; ii < NUM_PREFIXES; ++ii)
+  {
+    // Spread the prefixes over a range of area codes and exchanges, with
+    // between 2 and 8 digits after the country code.
+    std::string digits = std::to_string(2000000 + (long long)ii * 7919 % 8000000);
+    std::string prefix = "+1" + digits.substr(0, 2 + ii % 7);
+    JSONEnumService::NumberPrefix* pfix = new JSONEnumService::NumberPrefix;
+    pfix->prefix = prefix;
+    if (trie.insert(pfix))
+    {
+      prefix_list.push_back(prefix);
+    }
+  }
+
+  // Duplicates are rejected, so the trie holds each prefix once.
+  EXPECT_EQ(prefix_list.size(), trie.size());
+  EXPECT_GT(prefix_list.size(), (size_t)NUM_PREFIXES / 2);
+
+  int matches = 0;
+  for (int ii = 0; ii < LOOKUPS; ++ii)
+  {
+    std::string number = "+1" + std::to_string(2000000000LL + (long long)ii * 104729 % 8000000000LL);
+
+    std::string longest;
+    for (std::list<std::string>::const_iterator it = prefix_list.begin();
+         it != prefix_list.end();
+         ++it)
+    {
+      if ((it->size() > longest.size()) &&
+          (number.compare(0, it->size(), *it) == 0))
+      {
+        longest = *it;
+      }
+    }
+
+    const JSONEnumService::NumberPrefix* pfix = trie.longest_match(number);
+    if (longest.empty())
+    {
+      EXPECT_EQ(NULL, pfix) << number;
+    }
+    else
+    {
+      ASSERT_TRUE(pfix != NULL) << number;
+      EXPECT_EQ(longest, pfix->prefix) << number;
+      matches++;
+    }
+  }
+
+  // Most numbers match one of the prefixes.
+  EXPECT_GT(matches, LOOKUPS / 2);
+}
+
 struct ares_naptr_reply basic_naptr_reply[] = {
   {NULL, (unsigned char*)"u", (unsigned char*)"e2u+sip", (unsigned char*)"!(^.*$)!sip:\\1@ut.cw-ngv.com!", ".", 1, 1}
 };
@@ -334,3 +477,94 @@ TEST_F(DNSEnumServiceTest, DifferentSuffixTest)
   DNSEnumService enum_("127.0.0.1", ".e164.arpa.cw-ngv.com", new FakeDNSResolverFactory());
   ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
 }
+
+TEST_F(DNSEnumServiceTest, CachedResultTest)
+{
+  cwtest_completely_control_time();
+  FakeDNSResolver::_ttl = 60;
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  DNSEnumService enum_("127.0.0.1", ".e164.arpa", new FakeDNSResolverFactory());
+
+  // Repeated lookups (however the number is punctuated) are answered from
+  // the cache until the TTL expires.
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  ET("1-234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 1);
+
+  cwtest_advance_time_ms(61000);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+
+  cwtest_reset_time();
+}
+
+TEST_F(DNSEnumServiceTest, CachedRulesTest)
+{
+  cwtest_completely_control_time();
+  FakeDNSResolver::_ttl = 60;
+  struct ares_naptr_reply naptr_reply[] = {
+    {&naptr_reply[1], (unsigned char*)"u", (unsigned char*)"e2u+sip", (unsigned char*)"!(1234)!sip:\\1@ut.cw-ngv.com!", ".", 1, 1},
+    {NULL, (unsigned char*)"u", (unsigned char*)"e2u+sip", (unsigned char*)"!(5678)!sip:\\1@ut2.cw-ngv.com!", ".", 1, 1}
+  };
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("1.e164.arpa"), (struct ares_naptr_reply*)naptr_reply));
+  DNSEnumService enum_("127.0.0.1", ".e164.arpa", new FakeDNSResolverFactory());
+
+  // A non-terminal rule that maps several numbers to the same domain only
+  // queries that domain once.
+  struct ares_naptr_reply redirect_reply[] = {{NULL, (unsigned char*)"", (unsigned char*)"e2u+sip", (unsigned char*)"!^.*$!1!", ".", 1, 1}};
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("2.e164.arpa"), (struct ares_naptr_reply*)redirect_reply));
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("3.e164.arpa"), (struct ares_naptr_reply*)redirect_reply));
+  ET("2", "").test(enum_);
+  ET("3", "").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 3);
+
+  cwtest_reset_time();
+}
+
+TEST_F(DNSEnumServiceTest, NegativeCacheTest)
+{
+  cwtest_completely_control_time();
+  FakeDNSResolver::_ttl = 30;
+  DNSEnumService enum_("127.0.0.1", ".e164.arpa", new FakeDNSResolverFactory());
+
+  // NXDOMAIN is cached for the negative TTL.
+  ET("1234", "").test(enum_);
+  ET("1234", "").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 1);
+
+  // Once it expires, the number is looked up again.
+  FakeDNSResolver::_database.insert(std::make_pair(std::string("4.3.2.1.e164.arpa"), (struct ares_naptr_reply*)basic_naptr_reply));
+  cwtest_advance_time_ms(31000);
+  ET("1234", "sip:1234@ut.cw-ngv.com").test(enum_);
+  EXPECT_EQ(FakeDNSResolver::_num_calls, 2);
+
+  cwtest_reset_time();
+}
+
+TEST_F(DNSEnumServiceTest, ResponseTTLTest)
+{
+  // NAPTR response for 1.e164.arpa with two answers, TTLs 300 and 200.
+  unsigned char naptr_rsp[] = {
+    0x00, 0x01, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x01, '1', 0x04, 'e', '1', '6', '4', 0x04, 'a', 'r', 'p', 'a', 0x00,
+    0x00, 0x23, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x23, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x02, 0xaa, 0xbb,
+    0xc0, 0x0c, 0x00, 0x23, 0x00, 0x01, 0x00, 0x00, 0x00, 0xc8, 0x00, 0x02, 0xaa, 0xbb};
+  EXPECT_EQ(200, DNSResolver::response_ttl(naptr_rsp, sizeof(naptr_rsp), false));
+
+  // NXDOMAIN response with an SOA record with TTL 120 and minimum 60.
+  unsigned char nxdomain_rsp[] = {
+    0x00, 0x01, 0x81, 0x83, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+    0x01, '1', 0x04, 'e', '1', '6', '4', 0x04, 'a', 'r', 'p', 'a', 0x00,
+    0x00, 0x23, 0x00, 0x01,
+    0xc0, 0x0e, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x00, 0x78, 0x00, 0x16,
+    0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x00, 0x03, 0x84,
+    0x00, 0x09, 0x3a, 0x80, 0x00, 0x00, 0x00, 0x3c};
+  EXPECT_EQ(60, DNSResolver::response_ttl(nxdomain_rsp, sizeof(nxdomain_rsp), true));
+
+  // Truncated responses can't be cached.
+  EXPECT_EQ(0, DNSResolver::response_ttl(naptr_rsp, sizeof(naptr_rsp) - 1, false));
+  EXPECT_EQ(0, DNSResolver::response_ttl(nxdomain_rsp, 8, true));
+}
@@ -46,14 +46,16 @@
 
 
 int FakeDNSResolver::_num_calls = 0;
+int FakeDNSResolver::_ttl = 0;
 std::map<std::string,struct ares_naptr_reply*> FakeDNSResolver::_database = std::map<std::string,struct ares_naptr_reply*>();
 // By default, expect requests for 127.0.0.1.
 struct IP46Address FakeDNSResolverFactory::_expected_server = {AF_INET, {{htonl(0x7f000001)}}};
 
 
-int FakeDNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail)
+int FakeDNSResolver::perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail)
 {
   ++_num_calls;
+  ttl = _ttl;
   // Look up the query domain and return the reply if found.
   std::map<std::string,struct ares_naptr_reply*>::iterator i = _database.find(domain);
   if (i != _database.end())
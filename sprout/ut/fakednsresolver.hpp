@@ -46,15 +46,17 @@ class FakeDNSResolver : public DNSResolver
 {
 public:
   inline FakeDNSResolver(const struct IP46Address& server) : DNSResolver(server) {};
-  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, SAS::TrailId trail);
+  virtual int perform_naptr_query(const std::string& domain, struct ares_naptr_reply*& naptr_reply, int& ttl, SAS::TrailId trail);
   virtual void free_naptr_reply(struct ares_naptr_reply* naptr_reply) const;
   // Reset the static data.
-  static inline void reset() { _num_calls = 0; _database.clear(); };
+  static inline void reset() { _num_calls = 0; _database.clear(); _ttl = 0; };
 
   // Number of calls that have been made so far.
   static int _num_calls;
   // Database mapping domain names to NAPTR responses.
   static std::map<std::string,struct ares_naptr_reply*> _database;
+  // TTL returned with all responses (including NXDOMAIN responses).
+  static int _ttl;
 
 };
 
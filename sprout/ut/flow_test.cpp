@@ -36,6 +36,8 @@
 ///----------------------------------------------------------------------------
 
 #include <string>
+#include <vector>
+#include <pthread.h>
 #include "gtest/gtest.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/lexical_cast.hpp>
@@ -152,3 +154,163 @@ TEST_F(FlowTest, FlowUnQuiesceMidDialog)
   EXPECT_FALSE(flow->should_quiesce());
 }
 
+
+
+TEST_F(FlowTest, FindFlowByAddressAndToken)
+{
+  pj_sockaddr raddr;
+  pj_str_t host = pj_str((char*)"10.1.2.3");
+  pj_sockaddr_init(PJ_AF_INET, &raddr, &host, 5060);
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+
+  Flow* flow2 = ft->find_create_flow(tp, &raddr);
+  EXPECT_NE(flow, flow2);
+  EXPECT_EQ(flow2, ft->find_create_flow(tp, &raddr));
+  EXPECT_EQ(flow2, ft->find_flow(tp, &raddr));
+  EXPECT_EQ(flow2, ft->find_flow(flow2->token()));
+  EXPECT_EQ(flow, ft->find_flow(flow->token()));
+
+  // A flow whose last reference has gone is no longer found, even though it
+  // is still in the table, and a new one is created in its place.
+  int refs = flow2->_refs;
+  flow2->_refs = 0;
+  EXPECT_EQ(NULL, ft->find_flow(tp, &raddr));
+  EXPECT_EQ(NULL, ft->find_flow(flow2->token()));
+  Flow* flow3 = ft->find_create_flow(tp, &raddr);
+  EXPECT_NE(flow2, flow3);
+  EXPECT_EQ(flow3, ft->find_flow(tp, &raddr));
+
+  // Removing the old flow leaves the new one in place.
+  flow2->_refs = refs;
+  ft->remove_flow(flow2);
+  EXPECT_EQ(flow3, ft->find_flow(tp, &raddr));
+  EXPECT_EQ(flow3, ft->find_flow(flow3->token()));
+  ft->remove_flow(flow3);
+  EXPECT_EQ(NULL, ft->find_flow(tp, &raddr));
+
+  flow->dec_ref();
+}
+
+/// State for a thread running concurrent flow lookups.
+struct LookupThread
+{
+  pthread_t thread;
+  FlowTable* ft;
+  pjsip_transport* tp;
+  std::vector<pj_sockaddr>* addrs;
+  int lookups;
+  int found;
+};
+
+static void* run_lookups(void* p)
+{
+  LookupThread* t = (LookupThread*)p;
+
+  for (int ii = 0; ii < t->lookups; ++ii)
+  {
+    Flow* flow = t->ft->find_flow(t->tp, &(*t->addrs)[ii % t->addrs->size()]);
+    if (flow != NULL)
+    {
+      t->found++;
+      flow->dec_ref();
+    }
+  }
+
+  return NULL;
+}
+
+TEST_F(FlowTest, ConcurrentLookups)
+{
+  const int FLOWS = 10000;
+  const int LOOKUPS = 40000;
+  const int NUM_THREADS = 8;
+
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+  std::vector<pj_sockaddr> addrs(FLOWS);
+  std::vector<Flow*> flows(FLOWS);
+
+  for (int ii = 0; ii < FLOWS; ++ii)
+  {
+    std::string ip = "10.2." + std::to_string(ii / 250) + "." + std::to_string(ii % 250 + 1);
+    pj_str_t host = pj_str((char*)ip.c_str());
+    pj_sockaddr_init(PJ_AF_INET, &addrs[ii], &host, 5060);
+    flows[ii] = ft->find_create_flow(tp, &addrs[ii]);
+  }
+
+  // The flows are spread across all the partitions, in both the address
+  // and token maps, so lookups on different flows rarely share a lock.
+  size_t addr_flows = 0;
+  size_t token_flows = 0;
+  for (int ii = 0; ii < FlowTable::NUM_PARTITIONS; ++ii)
+  {
+    FlowTable::Partition& partition = ft->_partitions[ii];
+    EXPECT_LT(0u, partition.tp2flow_map.size());
+    EXPECT_GT(3u * FLOWS / FlowTable::NUM_PARTITIONS, partition.tp2flow_map.size());
+    EXPECT_LT(0u, partition.tk2flow_map.size());
+    EXPECT_GT(3u * FLOWS / FlowTable::NUM_PARTITIONS, partition.tk2flow_map.size());
+    addr_flows += partition.tp2flow_map.size();
+    token_flows += partition.tk2flow_map.size();
+  }
+  EXPECT_EQ((size_t)FLOWS, addr_flows);
+  EXPECT_EQ((size_t)FLOWS, token_flows);
+
+  // Every lookup from every thread finds its flow.
+  std::vector<LookupThread> threads(NUM_THREADS);
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads[ii].ft = ft;
+    threads[ii].tp = tp;
+    threads[ii].addrs = &addrs;
+    threads[ii].lookups = LOOKUPS;
+    threads[ii].found = 0;
+    pthread_create(&threads[ii].thread, NULL, &run_lookups, &threads[ii]);
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii].thread, NULL);
+    EXPECT_EQ(LOOKUPS, threads[ii].found);
+  }
+
+  for (int ii = 0; ii < FLOWS; ++ii)
+  {
+    ft->remove_flow(flows[ii]);
+  }
+}
+
+TEST_F(FlowTest, IdentitiesShareServiceRoute)
+{
+  pj_sockaddr raddr;
+  pj_str_t host = pj_str((char*)"10.1.2.4");
+  pj_sockaddr_init(PJ_AF_INET, &raddr, &host, 5060);
+  Flow* flow2 = ft->find_create_flow(TransportFlow::udp_transport(stack_data.pcscf_untrusted_port),
+                                     &raddr);
+  long base_memory = ft->_flow_memory;
+
+  std::string route = "<sip:scscf.homedomain:5058;transport=TCP;lr;orig>";
+  pjsip_uri* alice = PJUtils::uri_from_string("sip:alice@homedomain", stack_data.pool);
+  pjsip_uri* bob = PJUtils::uri_from_string("sip:bob@homedomain", stack_data.pool);
+  flow->set_identity(alice, route, true, 300);
+  flow2->set_identity(bob, route, true, 300);
+
+  EXPECT_EQ("sip:alice@homedomain", flow->default_identity());
+  EXPECT_EQ(route, flow->service_route("sip:alice@homedomain"));
+  EXPECT_EQ(route, flow2->service_route("sip:bob@homedomain"));
+  EXPECT_EQ("", flow->service_route("sip:bob@homedomain"));
+
+  // Both flows share a single copy of the service route.
+  EXPECT_EQ(flow->_authorized_ids.begin()->second.service_route.get(),
+            flow2->_authorized_ids.begin()->second.service_route.get());
+  EXPECT_EQ(1u, ft->_interned.size());
+
+  // The flows' memory is accounted, and is released with the identities.
+  long set_memory = ft->_flow_memory;
+  EXPECT_LT(base_memory, set_memory);
+  flow->set_identity(alice, route, true, 0);
+  flow2->set_identity(bob, route, true, 0);
+  EXPECT_EQ("", flow->default_identity());
+  EXPECT_EQ(0u, ft->_interned.size());
+  EXPECT_GT(set_memory, ft->_flow_memory);
+
+  ft->remove_flow(flow2);
+}
@@ -43,25 +43,66 @@
 
 #include "utils.h"
 #include "sas.h"
-#include "fakehttpresolver.hpp"
+#include "httpclientpool.h"
 #include "hssconnection.h"
 #include "basetest.hpp"
-#include "fakecurl.hpp"
 
 using namespace std;
 
+/// HttpClient that returns canned responses, keyed by path and request body,
+/// rather than sending requests to Homestead.
+class FakeHttpClient : public HttpClient
+{
+public:
+  /// A canned response: either a body returned with 200 OK, or an error.
+  struct Response
+  {
+    Response() : _rc(HTTP_NOT_FOUND), _body() {}
+    Response(const char* body) : _rc(HTTP_OK), _body(body) {}
+    Response(HTTPCode rc) : _rc(rc), _body() {}
+
+    HTTPCode _rc;
+    std::string _body;
+  };
+
+  FakeHttpClient() :
+    HttpClient(NULL, "narcissus", "connected_homesteads", NULL, NULL)
+  {
+  }
+
+  std::map<std::pair<std::string, std::string>, Response> _responses;
+
+protected:
+  HTTPCode send_and_wait(evhttp_cmd_type method,
+                         const std::string& path,
+                         const std::map<std::string, std::string>& headers,
+                         const std::string& body,
+                         std::string& response,
+                         SAS::TrailId trail)
+  {
+    std::map<std::pair<std::string, std::string>, Response>::const_iterator it =
+                                   _responses.find(std::make_pair(path, body));
+    if (it == _responses.end())
+    {
+      return HTTP_NOT_FOUND;
+    }
+
+    response = it->second._body;
+    return it->second._rc;
+  }
+};
+
 /// Fixture for HssConnectionTest.
 class HssConnectionTest : public BaseTest
 {
-  FakeHttpResolver _resolver;
+  FakeHttpClient* _http;
   HSSConnection _hss;
 
   HssConnectionTest() :
-    _resolver("10.42.42.42"),
-    _hss("narcissus", &_resolver, NULL, NULL)
+    _http(new FakeHttpClient()),
+    _hss(_http, NULL)
   {
-    fakecurl_responses.clear();
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid42/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>REGISTERED</RegistrationState>"
@@ -97,18 +138,18 @@ class HssConnectionTest : public BaseTest
           "<ECF priority=\"1\">ecf1</ECF>"
         "</ChargingAddresses>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid43/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid43/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>NOT_REGISTERED</RegistrationState>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "")] = fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42/reg-data", "{\"reqtype\": \"reg\"}")];
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid43/reg-data", "")] = fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid43/reg-data", "{\"reqtype\": \"reg\"}")];
+    _http->_responses[std::make_pair("/impu/pubid42/reg-data", "")] = _http->_responses[std::make_pair("/impu/pubid42/reg-data", "{\"reqtype\": \"reg\"}")];
+    _http->_responses[std::make_pair("/impu/pubid43/reg-data", "")] = _http->_responses[std::make_pair("/impu/pubid43/reg-data", "{\"reqtype\": \"reg\"}")];
 
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid42_malformed/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid42_malformed/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
               "<Grou";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid43_malformed/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid43_malformed/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>REGISTERED</RegistrationState>"
@@ -138,47 +179,47 @@ class HssConnectionTest : public BaseTest
           "</ServiceProfile>"
         "</NonsenseWord>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid44/reg-data", "{\"reqtype\": \"reg\"}")] = CURLE_REMOTE_FILE_NOT_FOUND;
-    fakecurl_responses["http://10.42.42.42:80/impi/privid69/registration-status?impu=pubid44"] = "{\"result-code\": 2001, \"scscf\": \"server-name\"}";
-    fakecurl_responses["http://10.42.42.42:80/impi/privid69/registration-status?impu=pubid44&visited-network=domain&auth-type=REG"] = "{\"result-code\": 2001, \"mandatory-capabilities\": [1, 2, 3], \"optional-capabilities\": []}";
-    fakecurl_responses["http://10.42.42.42:80/impi/privid_corrupt/registration-status?impu=pubid44"] = "{\"result-code\": 2001, \"scscf\"; \"server-name\"}";
-    fakecurl_responses["http://10.42.42.42:80/impu/pubid44/location"] = "{\"result-code\": 2001, \"scscf\": \"server-name\"}";
-    fakecurl_responses["http://10.42.42.42:80/impu/pubid44/location?auth-type=DEREG"] = "{\"result-code\": 2001, \"mandatory-capabilities\": [], \"optional-capabilities\": []}";
-    fakecurl_responses["http://10.42.42.42:80/impu/pubid44/location?originating=true&auth-type=CAPAB"] = "{\"result-code\": 2001, \"mandatory-capabilities\": [1, 2, 3], \"optional-capabilities\": []}";
-    fakecurl_responses["http://10.42.42.42:80/impu/pubid45/location"] = CURLE_REMOTE_FILE_NOT_FOUND;
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid50/reg-data", "{\"reqtype\": \"call\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid44/reg-data", "{\"reqtype\": \"reg\"}")] = HTTP_NOT_FOUND;
+    _http->_responses[std::make_pair("/impi/privid69/registration-status?impu=pubid44", "")] = "{\"result-code\": 2001, \"scscf\": \"server-name\"}";
+    _http->_responses[std::make_pair("/impi/privid69/registration-status?impu=pubid44&visited-network=domain&auth-type=REG", "")] = "{\"result-code\": 2001, \"mandatory-capabilities\": [1, 2, 3], \"optional-capabilities\": []}";
+    _http->_responses[std::make_pair("/impi/privid_corrupt/registration-status?impu=pubid44", "")] = "{\"result-code\": 2001, \"scscf\"; \"server-name\"}";
+    _http->_responses[std::make_pair("/impu/pubid44/location", "")] = "{\"result-code\": 2001, \"scscf\": \"server-name\"}";
+    _http->_responses[std::make_pair("/impu/pubid44/location?auth-type=DEREG", "")] = "{\"result-code\": 2001, \"mandatory-capabilities\": [], \"optional-capabilities\": []}";
+    _http->_responses[std::make_pair("/impu/pubid44/location?originating=true&auth-type=CAPAB", "")] = "{\"result-code\": 2001, \"mandatory-capabilities\": [1, 2, 3], \"optional-capabilities\": []}";
+    _http->_responses[std::make_pair("/impu/pubid45/location", "")] = HTTP_NOT_FOUND;
+    _http->_responses[std::make_pair("/impu/pubid50/reg-data", "{\"reqtype\": \"call\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>UNREGISTERED</RegistrationState>"
         "<IMSSubscription>"
         "</IMSSubscription>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid50/reg-data", "{\"reqtype\": \"dereg-admin\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid50/reg-data", "{\"reqtype\": \"dereg-admin\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>NOT_REGISTERED</RegistrationState>"
         "<IMSSubscription>"
         "</IMSSubscription>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/missingelement1/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/missingelement1/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<IMSSubscription>"
         "</IMSSubscription>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/missingelement2/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/missingelement2/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>NOT_REGISTERED</RegistrationState>"
       "</ClearwaterRegData>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/missingelement3/reg-data", "{\"reqtype\": \"reg\"}")] =
+    _http->_responses[std::make_pair("/impu/missingelement3/reg-data", "{\"reqtype\": \"reg\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<C>"
         "<RegistrationState>NOT_REGISTERED</RegistrationState>"
         "<IMSSubscription>"
         "</IMSSubscription>"
       "</C>";
-    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid46/reg-data", "{\"reqtype\": \"call\"}")] =
+    _http->_responses[std::make_pair("/impu/pubid46/reg-data", "{\"reqtype\": \"call\"}")] =
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
       "<ClearwaterRegData>"
         "<RegistrationState>REGISTERED</RegistrationState>"
@@ -0,0 +1,314 @@
+/**
+ * @file httpclientpool_test.cpp UT for the shared HTTP client pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "httpclientpool.h"
+
+/// HttpResolver that resolves every server to a fixed list of loopback
+/// targets.
+class FixedHttpResolver : public HttpResolver
+{
+public:
+  FixedHttpResolver() : HttpResolver(NULL, AF_INET) {}
+
+  virtual void resolve(const std::string& host,
+                       int port,
+                       int max_targets,
+                       std::vector<AddrInfo>& targets,
+                       SAS::TrailId trail)
+  {
+    targets.clear();
+    for (size_t ii = 0;
+         (ii < _targets.size()) && ((int)ii < max_targets);
+         ++ii)
+    {
+      targets.push_back(_targets[ii]);
+    }
+  }
+
+  void add_target(int port)
+  {
+    AddrInfo ai;
+    ai.address.af = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &ai.address.addr.ipv4);
+    ai.port = port;
+    ai.transport = IPPROTO_TCP;
+    _targets.push_back(ai);
+  }
+
+  std::vector<AddrInfo> _targets;
+};
+
+/// HTTP server on the loopback address, run on its own thread.  It responds
+/// to every request with the configured status code, or holds requests
+/// without responding.
+class TestHttpServer
+{
+public:
+  TestHttpServer(int rc) :
+    _rc(rc),
+    _hold(false),
+    _received(0),
+    _stop(false)
+  {
+    _base = event_base_new();
+    _http = evhttp_new(_base);
+    evhttp_set_gencb(_http, on_request, this);
+    evhttp_bound_socket* sock = evhttp_bind_socket_with_handle(_http, "127.0.0.1", 0);
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(evhttp_bound_socket_get_fd(sock), (struct sockaddr*)&addr, &len);
+    _port = ntohs(addr.sin_port);
+
+    // Poll for the stop flag, as a loopbreak before the loop starts is lost.
+    _tick = event_new(_base, -1, EV_PERSIST, on_tick, this);
+    struct timeval tv = {0, 10000};
+    event_add(_tick, &tv);
+
+    pthread_create(&_thread, NULL, thread_func, this);
+  }
+
+  ~TestHttpServer()
+  {
+    _stop = true;
+    pthread_join(_thread, NULL);
+    evhttp_free(_http);
+    event_free(_tick);
+    event_base_free(_base);
+  }
+
+  /// Waits (for up to a second) for the given number of requests.
+  bool wait_for(int count)
+  {
+    for (int ii = 0; (ii < 1000) && (_received < count); ++ii)
+    {
+      usleep(1000);
+    }
+    return (_received >= count);
+  }
+
+  int _port;
+  int _rc;
+  std::atomic_bool _hold;
+  std::atomic_int _received;
+
+private:
+  static void* thread_func(void* arg)
+  {
+    event_base_dispatch(((TestHttpServer*)arg)->_base);
+    return NULL;
+  }
+
+  static void on_tick(evutil_socket_t fd, short events, void* arg)
+  {
+    TestHttpServer* server = (TestHttpServer*)arg;
+    if (server->_stop)
+    {
+      event_base_loopbreak(server->_base);
+    }
+  }
+
+  static void on_request(evhttp_request* req, void* arg)
+  {
+    TestHttpServer* server = (TestHttpServer*)arg;
+    ++server->_received;
+
+    if (!server->_hold)
+    {
+      evbuffer* body = evbuffer_new();
+      evbuffer_add_printf(body, "Response %d", server->_rc);
+      evhttp_send_reply(req, server->_rc, "", body);
+      evbuffer_free(body);
+    }
+  }
+
+  event_base* _base;
+  evhttp* _http;
+  event* _tick;
+  pthread_t _thread;
+  std::atomic_bool _stop;
+};
+
+/// Fixture for HttpClientPoolTest.
+class HttpClientPoolTest : public BaseTest
+{
+public:
+  HttpClientPoolTest() :
+    _lm(100000, 20, 10, 10),
+    _pool(new HttpClientPool(&_resolver, 2, 2, 1)),
+    _client(_pool, "ralf.example.com", "connected_ralfs", &_lm, stack_data.stats_aggregator)
+  {
+  }
+
+  virtual ~HttpClientPoolTest()
+  {
+    delete _pool;
+  }
+
+  /// Returns a loopback port with nothing listening on it.
+  static int closed_port()
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+  }
+
+  static std::string target(int port)
+  {
+    return "127.0.0.1:" + std::to_string(port);
+  }
+
+  LoadMonitor _lm;
+  FixedHttpResolver _resolver;
+  HttpClientPool* _pool;
+  HttpClient _client;
+};
+
+TEST_F(HttpClientPoolTest, SendPost)
+{
+  TestHttpServer server(HTTP_OK);
+  _resolver.add_target(server._port);
+
+  std::map<std::string, std::string> headers;
+  std::string response;
+  EXPECT_EQ(HTTP_OK, _client.send_post("/call-id/1", headers, "ACR", response, 0));
+  EXPECT_EQ("Response 200", response);
+  EXPECT_EQ(1, server._received.load());
+
+  // The target that responded is reported as connected.
+  EXPECT_EQ(1u, _client._connected.size());
+  EXPECT_EQ(1u, _client._connected.count(target(server._port)));
+}
+
+TEST_F(HttpClientPoolTest, ResolveFailure)
+{
+  std::string response;
+  EXPECT_EQ(HTTP_NOT_FOUND, _client.send_get("/", response, 0));
+}
+
+TEST_F(HttpClientPoolTest, FailoverOnConnectionFailure)
+{
+  TestHttpServer server(HTTP_OK);
+  int dead_port = closed_port();
+  _resolver.add_target(dead_port);
+  _resolver.add_target(server._port);
+
+  std::string response;
+  EXPECT_EQ(HTTP_OK, _client.send_get("/", response, 0));
+  EXPECT_EQ(1, server._received.load());
+
+  // Only the target that responded is reported as connected.
+  EXPECT_EQ(0u, _client._connected.count(target(dead_port)));
+  EXPECT_EQ(1u, _client._connected.count(target(server._port)));
+}
+
+TEST_F(HttpClientPoolTest, FailoverOn503)
+{
+  TestHttpServer busy_server(HTTP_SERVER_UNAVAILABLE);
+  TestHttpServer server(HTTP_OK);
+  _resolver.add_target(busy_server._port);
+  _resolver.add_target(server._port);
+
+  std::string response;
+  EXPECT_EQ(HTTP_OK, _client.send_get("/", response, 0));
+  EXPECT_EQ(1, busy_server._received.load());
+  EXPECT_EQ(1, server._received.load());
+}
+
+TEST_F(HttpClientPoolTest, AllTargetsFail)
+{
+  TestHttpServer busy_server(HTTP_SERVER_UNAVAILABLE);
+  _resolver.add_target(closed_port());
+  _resolver.add_target(busy_server._port);
+
+  // The last target's response is returned.
+  std::string response;
+  EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, _client.send_get("/", response, 0));
+  EXPECT_EQ(1, busy_server._received.load());
+}
+
+TEST_F(HttpClientPoolTest, DestroyFailsOutstandingRequests)
+{
+  TestHttpServer server(HTTP_OK);
+  server._hold = true;
+  _resolver.add_target(server._port);
+
+  std::atomic_int completed(0);
+  std::atomic_long result(0);
+  std::map<std::string, std::string> headers;
+  _client.send_post("/call-id/1",
+                    headers,
+                    "ACR",
+                    [&completed, &result](HTTPCode rc, const std::string& rsp)
+                    {
+                      result = rc;
+                      ++completed;
+                    },
+                    0);
+  ASSERT_TRUE(server.wait_for(1));
+  EXPECT_EQ(0, completed.load());
+
+  // Destroying the pool completes the request with an error.
+  delete _pool;
+  _pool = NULL;
+  EXPECT_EQ(1, completed.load());
+  EXPECT_EQ(HTTP_SERVER_UNAVAILABLE, result.load());
+}
@@ -0,0 +1,381 @@
+/**
+ * @file nexthoptable_test.cpp UT for the next hop target set table.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <string>
+#include <algorithm>
+#include <tuple>
+#include <unistd.h>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "utils.h"
+#include "dnscachedresolver.h"
+#include "sipresolver.h"
+#include "nexthoptable.h"
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+using namespace std;
+
+/// Fixture for NextHopTableTest.
+class NextHopTableTest : public ::testing::Test
+{
+  DnsCachedResolver _dnsresolver;
+  SIPResolver _sipresolver;
+  NextHopTable _next_hops;
+
+  // DNS Resolver is created with server address 0.0.0.0 to disable server
+  // queries.
+  NextHopTableTest() :
+    _dnsresolver("0.0.0.0"),
+    _sipresolver(&_dnsresolver),
+    _next_hops(&_sipresolver)
+  {
+    cwtest_completely_control_time();
+  }
+
+  virtual ~NextHopTableTest()
+  {
+    cwtest_reset_time();
+  }
+
+  void add_a_records(const std::string& name,
+                     const std::vector<std::string>& addresses,
+                     int ttl = 3600)
+  {
+    std::vector<DnsRRecord*> records;
+    for (size_t ii = 0; ii < addresses.size(); ++ii)
+    {
+      struct in_addr addr;
+      inet_pton(AF_INET, addresses[ii].c_str(), &addr);
+      records.push_back((DnsRRecord*)new DnsARecord(name, ttl, addr));
+    }
+    _dnsresolver.add_to_cache(name, ns_t_a, records);
+  }
+
+  /// Adds SRV records, each given as priority, weight and target name.
+  void add_srv_records(const std::string& name,
+                       const std::vector<std::tuple<int, int, std::string> >& srvs)
+  {
+    std::vector<DnsRRecord*> records;
+    for (size_t ii = 0; ii < srvs.size(); ++ii)
+    {
+      records.push_back((DnsRRecord*)new DnsSrvRecord(name,
+                                                      3600,
+                                                      std::get<0>(srvs[ii]),
+                                                      std::get<1>(srvs[ii]),
+                                                      5060,
+                                                      std::get<2>(srvs[ii])));
+    }
+    _dnsresolver.add_to_cache(name, ns_t_srv, records);
+  }
+
+  /// Resolves a name, returning the addresses of the targets separated by
+  /// commas.
+  std::string resolve(const std::string& name, int retries = 5)
+  {
+    std::vector<AddrInfo> targets;
+    _next_hops.resolve(name, AF_INET, 0, -1, retries, targets, 0);
+
+    std::string output;
+    for (size_t ii = 0; ii < targets.size(); ++ii)
+    {
+      char buf[100];
+      output += (ii == 0) ? "" : ",";
+      output += inet_ntop(AF_INET, &targets[ii].address.addr.ipv4, buf, sizeof(buf));
+    }
+    return output;
+  }
+
+  /// Waits (for up to a second) for any target set rebuilds to finish.
+  bool wait_for_rebuilds()
+  {
+    for (int ii = 0; ii < 1000; ++ii)
+    {
+      bool rebuilding = false;
+      pthread_rwlock_rdlock(&_next_hops._lock);
+      for (auto it = _next_hops._sets.begin(); it != _next_hops._sets.end(); ++it)
+      {
+        rebuilding = rebuilding || ((it->second != NULL) && (it->second->rebuilding));
+      }
+      pthread_rwlock_unlock(&_next_hops._lock);
+
+      if (!rebuilding)
+      {
+        return true;
+      }
+      usleep(1000);
+    }
+    return false;
+  }
+
+  static size_t count_targets(const std::string& targets)
+  {
+    return targets.empty() ? 0 : std::count(targets.begin(), targets.end(), ',') + 1;
+  }
+
+  AddrInfo target(const std::string& address)
+  {
+    AddrInfo ai;
+    ai.address.af = AF_INET;
+    inet_pton(AF_INET, address.c_str(), &ai.address.addr.ipv4);
+    ai.port = 5060;
+    ai.transport = IPPROTO_UDP;
+    return ai;
+  }
+};
+
+TEST_F(NextHopTableTest, IPAddress)
+{
+  EXPECT_EQ("3.0.0.1", resolve("3.0.0.1"));
+}
+
+TEST_F(NextHopTableTest, UnknownName)
+{
+  EXPECT_EQ("", resolve("sprout.cw-ngv.com"));
+  EXPECT_EQ(0u, _next_hops._sets.size());
+}
+
+TEST_F(NextHopTableTest, RetriesLimitTargets)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1", "3.0.0.2", "3.0.0.3"});
+  EXPECT_EQ(3u, count_targets(resolve("sprout.cw-ngv.com")));
+  EXPECT_EQ(2u, count_targets(resolve("sprout.cw-ngv.com", 2)));
+}
+
+TEST_F(NextHopTableTest, RebuiltWhenRecordsExpire)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1"}, 10);
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+
+  // Changes to DNS aren't seen until the records the target set was built
+  // from have expired.
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.2"});
+  cwtest_advance_time_ms(9000);
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+  EXPECT_TRUE(wait_for_rebuilds());
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+
+  // The target set is then rebuilt in the background, and the request that
+  // triggered the rebuild uses the current set.
+  cwtest_advance_time_ms(1001);
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+  EXPECT_TRUE(wait_for_rebuilds());
+  EXPECT_EQ("3.0.0.2", resolve("sprout.cw-ngv.com"));
+}
+
+TEST_F(NextHopTableTest, FailedRebuildKeepsTargets)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1"}, 10);
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+
+  // The records expire and the name can't be resolved again, so the current
+  // target set is used until its grace period runs out.
+  cwtest_advance_time_ms(10001);
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+  EXPECT_TRUE(wait_for_rebuilds());
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+  EXPECT_EQ(1u, _next_hops._sets.size());
+
+  cwtest_advance_time_ms(NextHopTable::GRACE_MS);
+  EXPECT_EQ("", resolve("sprout.cw-ngv.com"));
+  EXPECT_EQ(0u, _next_hops._sets.size());
+}
+
+TEST_F(NextHopTableTest, Latency)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1"});
+  resolve("sprout.cw-ngv.com");
+
+  // The latency is a moving average, starting from the initial latency.
+  std::shared_ptr<NextHopTable::Health> health =
+                                   _next_hops.find_health(target("3.0.0.1"));
+  ASSERT_TRUE(health != NULL);
+  int initial = NextHopTable::INITIAL_LATENCY_US;
+  EXPECT_EQ(initial, health->latency_us);
+
+  _next_hops.report_response(target("3.0.0.1"), 50);
+  EXPECT_EQ(initial + (50000 - initial) / NextHopTable::AVERAGE_WEIGHT,
+            health->latency_us);
+
+  // Reports for targets that aren't in any target set are ignored.
+  _next_hops.report_response(target("3.0.0.9"), 50);
+  EXPECT_TRUE(_next_hops.find_health(target("3.0.0.9")) == NULL);
+}
+
+TEST_F(NextHopTableTest, HardFailure)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1", "3.0.0.2"});
+  resolve("sprout.cw-ngv.com");
+
+  // A target that has failed isn't used until its blacklist period passes.
+  _next_hops.report_failure(target("3.0.0.1"), true, 30);
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    EXPECT_EQ("3.0.0.2", resolve("sprout.cw-ngv.com"));
+  }
+
+  // If every target has failed they are all used.
+  _next_hops.report_failure(target("3.0.0.2"), true, 30);
+  EXPECT_EQ(2u, count_targets(resolve("sprout.cw-ngv.com")));
+
+  cwtest_advance_time_ms(30001);
+  EXPECT_EQ(2u, count_targets(resolve("sprout.cw-ngv.com")));
+  _next_hops.report_failure(target("3.0.0.2"), true, 30);
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+}
+
+TEST_F(NextHopTableTest, SoftFailure)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1", "3.0.0.2"});
+  resolve("sprout.cw-ngv.com");
+
+  // A target that keeps rejecting requests is only occasionally picked
+  // first, but is still used as a fallback.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    _next_hops.report_failure(target("3.0.0.1"), false, 0);
+  }
+
+  int first = 0;
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    std::string targets = resolve("sprout.cw-ngv.com");
+    EXPECT_EQ(2u, count_targets(targets));
+    if (targets.find("3.0.0.1") == 0)
+    {
+      first++;
+    }
+  }
+  EXPECT_GT(100, first);
+
+  // Once the target responds successfully it is used normally again.
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    _next_hops.report_response(target("3.0.0.1"), 10);
+  }
+  EXPECT_TRUE(NextHopTable::healthy(_next_hops._sets.begin()->second->targets[0]) &&
+              NextHopTable::healthy(_next_hops._sets.begin()->second->targets[1]));
+}
+
+TEST_F(NextHopTableTest, SlowTarget)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1"});
+  resolve("sprout.cw-ngv.com");
+
+  // A slow target's weight falls with its latency, but never below the
+  // minimum.
+  const NextHopTable::Target& t = _next_hops._sets.begin()->second->targets[0];
+  double initial_weight = NextHopTable::weight(t, 0);
+
+  for (int ii = 0; ii < 50; ++ii)
+  {
+    _next_hops.report_response(target("3.0.0.1"), 1000);
+  }
+  EXPECT_GT(initial_weight / 5, NextHopTable::weight(t, 0));
+  EXPECT_LE(t.base_weight * NextHopTable::MIN_HEALTH, NextHopTable::weight(t, 0));
+}
+
+TEST_F(NextHopTableTest, SRVPrioritiesAndWeights)
+{
+  add_srv_records("_sip._udp.sprout.cw-ngv.com",
+                  {std::make_tuple(1, 300, "sprout1.cw-ngv.com"),
+                   std::make_tuple(1, 100, "sprout2.cw-ngv.com"),
+                   std::make_tuple(2, 100, "sprout3.cw-ngv.com")});
+  add_a_records("sprout1.cw-ngv.com", {"3.0.0.1", "3.0.0.2"});
+  add_a_records("sprout2.cw-ngv.com", {"3.0.0.3"});
+  add_a_records("sprout3.cw-ngv.com", {"3.0.0.4"});
+  resolve("sprout.cw-ngv.com");
+
+  // The base weights come straight from the SRV records, shared between the
+  // addresses of each SRV target, and lower priority targets are only
+  // fallbacks.
+  const NextHopTable::TargetSet& set = *_next_hops._sets.begin()->second;
+  ASSERT_EQ(4u, set.targets.size());
+  EXPECT_EQ(150.0, set.targets[0].base_weight);
+  EXPECT_EQ(150.0, set.targets[1].base_weight);
+  EXPECT_EQ(100.0, set.targets[2].base_weight);
+  EXPECT_EQ(0.0, set.targets[3].base_weight);
+
+  // Requests are spread across the highest priority targets in proportion
+  // to their weights, with the lower priority target always last.
+  int firsts[3] = {0, 0, 0};
+  for (int ii = 0; ii < 4000; ++ii)
+  {
+    std::string targets = resolve("sprout.cw-ngv.com");
+    ASSERT_EQ(4u, count_targets(targets));
+    EXPECT_EQ("3.0.0.4", targets.substr(targets.rfind(',') + 1));
+    firsts[targets[6] - '1']++;
+  }
+  EXPECT_NEAR(1500, firsts[0], 200);
+  EXPECT_NEAR(1500, firsts[1], 200);
+  EXPECT_NEAR(1000, firsts[2], 200);
+}
+
+TEST_F(NextHopTableTest, EqualWeights)
+{
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1", "3.0.0.2"});
+
+  // Targets with equal weights are picked first equally often, including
+  // when the target set is rebuilt.
+  int first = 0;
+  for (int ii = 0; ii < 2000; ++ii)
+  {
+    if (ii % 100 == 0)
+    {
+      _next_hops.build("sprout.cw-ngv.com", AF_INET, 0, -1, 0);
+    }
+    if (resolve("sprout.cw-ngv.com").find("3.0.0.1") == 0)
+    {
+      first++;
+    }
+  }
+  EXPECT_NEAR(1000, first, 150);
+}
+
+TEST_F(NextHopTableTest, TableFull)
+{
+  // Once the table is full, further destinations are resolved directly.
+  size_t max_destinations = NextHopTable::MAX_DESTINATIONS;
+  add_a_records("sprout.cw-ngv.com", {"3.0.0.1"});
+  for (size_t ii = 0; ii < max_destinations; ++ii)
+  {
+    _next_hops._sets[std::to_string(ii)] = NULL;
+  }
+  EXPECT_EQ("3.0.0.1", resolve("sprout.cw-ngv.com"));
+  EXPECT_EQ(max_destinations, _next_hops._sets.size());
+}
@@ -0,0 +1,171 @@
+/**
+ * @file objectpool_test.cpp UT for ObjectPool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "objectpool.h"
+
+/// Class allocated from the object pools.
+class PooledObject
+{
+public:
+  PooledObject() : _value(0) {}
+  virtual ~PooledObject() {}
+
+  static void* operator new(size_t size) { return ObjectPool::alloc(size); }
+  static void operator delete(void* obj, size_t size) { ObjectPool::free(obj, size); }
+
+  int _value;
+};
+
+/// Larger derived class, which is pooled separately.
+class BigPooledObject : public PooledObject
+{
+public:
+  char _data[200];
+};
+
+TEST(ObjectPoolTest, ReuseFreedObject)
+{
+  ObjectPool::Stats before;
+  ObjectPool::get_stats(before);
+
+  PooledObject* obj1 = new PooledObject;
+  delete obj1;
+
+  // The next allocation of the same size reuses the freed object.
+  PooledObject* obj2 = new PooledObject;
+  EXPECT_EQ(obj1, obj2);
+  EXPECT_EQ(0, obj2->_value);
+  delete obj2;
+
+  ObjectPool::Stats after;
+  ObjectPool::get_stats(after);
+  EXPECT_EQ(before.allocated + 2, after.allocated);
+  EXPECT_EQ(before.reused + 1, after.reused);
+}
+
+TEST(ObjectPoolTest, DerivedClassesPooledBySize)
+{
+  PooledObject* small = new PooledObject;
+  PooledObject* big = new BigPooledObject;
+  delete small;
+  delete big;
+
+  // Each size is reused from its own free list.
+  PooledObject* big2 = new BigPooledObject;
+  PooledObject* small2 = new PooledObject;
+  EXPECT_EQ(big, big2);
+  EXPECT_EQ(small, small2);
+  delete big2;
+  delete small2;
+}
+
+TEST(ObjectPoolTest, FreeListLimit)
+{
+  const int NUM_OBJECTS = ObjectPool::MAX_FREE_PER_THREAD + 10;
+  PooledObject* objs[NUM_OBJECTS];
+
+  for (int ii = 0; ii < NUM_OBJECTS; ++ii)
+  {
+    objs[ii] = new PooledObject;
+  }
+
+  ObjectPool::Stats before;
+  ObjectPool::get_stats(before);
+
+  for (int ii = 0; ii < NUM_OBJECTS; ++ii)
+  {
+    delete objs[ii];
+  }
+
+  // Objects beyond the per-thread limit go back to the global allocator.
+  ObjectPool::Stats after;
+  ObjectPool::get_stats(after);
+  EXPECT_EQ(before.released + 10, after.released);
+}
+
+TEST(ObjectPoolTest, LargeObjectsNotPooled)
+{
+  ObjectPool::Stats before;
+  ObjectPool::get_stats(before);
+
+  void* obj = ObjectPool::alloc(ObjectPool::MAX_OBJECT_SIZE + 1);
+  ObjectPool::free(obj, ObjectPool::MAX_OBJECT_SIZE + 1);
+
+  ObjectPool::Stats after;
+  ObjectPool::get_stats(after);
+  EXPECT_EQ(before.released + 1, after.released);
+}
+
+void* alloc_on_thread(void* p)
+{
+  PooledObject* obj = new PooledObject;
+  delete obj;
+  return NULL;
+}
+
+TEST(ObjectPoolTest, StatsIncludeOtherThreads)
+{
+  ObjectPool::Stats before;
+  ObjectPool::get_stats(before);
+
+  // Each thread keeps its own counts, which are totalled even after the
+  // thread has exited.
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, &alloc_on_thread, NULL));
+  pthread_join(thread, NULL);
+
+  PooledObject* obj = new PooledObject;
+  delete obj;
+
+  ObjectPool::Stats after;
+  ObjectPool::get_stats(after);
+  EXPECT_EQ(before.allocated + 2, after.allocated);
+}
+
+TEST(ObjectPoolTest, EnableDisableStats)
+{
+  // Statistics are published from a background thread, which stops when
+  // they are disabled.
+  ObjectPool::enable_stats(stack_data.stats_aggregator);
+  ObjectPool::enable_stats(stack_data.stats_aggregator);
+  ObjectPool::disable_stats();
+  ObjectPool::disable_stats();
+}
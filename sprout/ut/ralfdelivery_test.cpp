@@ -0,0 +1,383 @@
+/**
+ * @file ralfdelivery_test.cpp UT for the Ralf ACR delivery queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "ralfdelivery.h"
+
+/// HttpClient which records the requests it is asked to send, and either
+/// responds immediately or holds the responses until released.
+class FakeRalfClient : public HttpClient
+{
+public:
+  using HttpClient::send_post;
+
+  FakeRalfClient() :
+    HttpClient(NULL, "ralf", "connected_ralfs", NULL, stack_data.stats_aggregator),
+    _rc(HTTP_OK),
+    _hold(false)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  virtual ~FakeRalfClient()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  virtual void send_post(const std::string& path,
+                         const std::map<std::string, std::string>& headers,
+                         const std::string& body,
+                         HttpClientPool::Callback callback,
+                         SAS::TrailId trail)
+  {
+    pthread_mutex_lock(&_lock);
+    _bodies.push_back(body);
+    bool hold = _hold;
+    if (hold)
+    {
+      _held.push_back(callback);
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (!hold)
+    {
+      callback(_rc, "");
+    }
+  }
+
+  /// Stops responding to requests until release() is called.
+  void hold()
+  {
+    pthread_mutex_lock(&_lock);
+    _hold = true;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  /// Responds to all held requests, and any later ones immediately.
+  void release()
+  {
+    pthread_mutex_lock(&_lock);
+    _hold = false;
+    std::vector<HttpClientPool::Callback> held;
+    held.swap(_held);
+    pthread_mutex_unlock(&_lock);
+
+    for (size_t ii = 0; ii < held.size(); ++ii)
+    {
+      held[ii](_rc, "");
+    }
+  }
+
+  /// Responds to the oldest held request.
+  void release_one()
+  {
+    pthread_mutex_lock(&_lock);
+    HttpClientPool::Callback callback = _held.front();
+    _held.erase(_held.begin());
+    pthread_mutex_unlock(&_lock);
+
+    callback(_rc, "");
+  }
+
+  size_t sent()
+  {
+    pthread_mutex_lock(&_lock);
+    size_t count = _bodies.size();
+    pthread_mutex_unlock(&_lock);
+    return count;
+  }
+
+  /// Waits (for up to a second) for the given number of requests.
+  bool wait_for(size_t count)
+  {
+    for (int ii = 0; (ii < 1000) && (sent() < count); ++ii)
+    {
+      usleep(1000);
+    }
+    return (sent() >= count);
+  }
+
+  std::vector<std::string> bodies()
+  {
+    pthread_mutex_lock(&_lock);
+    std::vector<std::string> bodies = _bodies;
+    pthread_mutex_unlock(&_lock);
+    return bodies;
+  }
+
+  HTTPCode _rc;
+
+private:
+  pthread_mutex_t _lock;
+  bool _hold;
+  std::vector<std::string> _bodies;
+  std::vector<HttpClientPool::Callback> _held;
+};
+
+/// Fixture for RalfDeliveryTest.
+class RalfDeliveryTest : public BaseTest
+{
+public:
+  RalfDeliveryTest()
+  {
+    char dir[] = "/tmp/ralfdelivery_test.XXXXXX";
+    _spool_dir = mkdtemp(dir);
+  }
+
+  virtual ~RalfDeliveryTest()
+  {
+    unlink((_spool_dir + "/ralf_acrs.spool").c_str());
+    rmdir(_spool_dir.c_str());
+  }
+
+  FakeRalfClient _ralf;
+  std::string _spool_dir;
+};
+
+TEST_F(RalfDeliveryTest, Deliver)
+{
+  RalfDeliveryQueue queue(&_ralf, 10, 4, "", stack_data.stats_aggregator);
+
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    queue.send("/call-id/1", "ACR " + std::to_string(ii), 0);
+  }
+
+  ASSERT_TRUE(_ralf.wait_for(6));
+
+  std::vector<std::string> bodies = _ralf.bodies();
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    EXPECT_EQ("ACR " + std::to_string(ii), bodies[ii]);
+  }
+  EXPECT_EQ(0u, queue._dropped.load());
+}
+
+TEST_F(RalfDeliveryTest, WindowRefillsOnEachResponse)
+{
+  _ralf.hold();
+
+  RalfDeliveryQueue queue(&_ralf, 10, 2, "", stack_data.stats_aggregator);
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    queue.send("/call-id/1", "ACR " + std::to_string(ii), 0);
+  }
+
+  // Only two ACRs are awaiting a response at once.
+  ASSERT_TRUE(_ralf.wait_for(2));
+  usleep(10000);
+  EXPECT_EQ(2u, _ralf.sent());
+
+  // Each response lets the next ACR go, without waiting for the other
+  // outstanding request.
+  _ralf.release_one();
+  ASSERT_TRUE(_ralf.wait_for(3));
+  usleep(10000);
+  EXPECT_EQ(3u, _ralf.sent());
+
+  _ralf.release_one();
+  ASSERT_TRUE(_ralf.wait_for(4));
+
+  _ralf.release();
+}
+
+TEST_F(RalfDeliveryTest, Failure)
+{
+  _ralf._rc = HTTP_SERVER_UNAVAILABLE;
+  RalfDeliveryQueue queue(&_ralf, 10, 4, "", stack_data.stats_aggregator);
+
+  queue.send("/call-id/1", "ACR", 0);
+
+  ASSERT_TRUE(_ralf.wait_for(1));
+  for (int ii = 0; (ii < 1000) && (queue._failed.load() == 0); ++ii)
+  {
+    usleep(1000);
+  }
+  EXPECT_EQ(1u, queue._failed.load());
+}
+
+TEST_F(RalfDeliveryTest, DropWhenFull)
+{
+  _ralf.hold();
+
+  {
+    RalfDeliveryQueue queue(&_ralf, 2, 1, "", stack_data.stats_aggregator);
+
+    // The first ACR is taken off the queue and sent, and the next two fill
+    // the queue, so the last is dropped.
+    queue.send("/call-id/1", "ACR 0", 0);
+    ASSERT_TRUE(_ralf.wait_for(1));
+    queue.send("/call-id/1", "ACR 1", 0);
+    queue.send("/call-id/1", "ACR 2", 0);
+    queue.send("/call-id/1", "ACR 3", 0);
+
+    EXPECT_EQ(1u, queue._dropped.load());
+    EXPECT_EQ(0, queue._spooled.load());
+
+    _ralf.release();
+    ASSERT_TRUE(_ralf.wait_for(3));
+  }
+
+  EXPECT_EQ(3u, _ralf.sent());
+}
+
+TEST_F(RalfDeliveryTest, SpoolWhenFull)
+{
+  _ralf.hold();
+
+  RalfDeliveryQueue queue(&_ralf, 2, 1, _spool_dir, stack_data.stats_aggregator);
+
+  queue.send("/call-id/1", "ACR 0", 0);
+  ASSERT_TRUE(_ralf.wait_for(1));
+
+  // The queue fills up, and later ACRs are handed to the delivery thread to
+  // spool, including bodies that span lines.
+  queue.send("/call-id/1", "ACR 1", 0);
+  queue.send("/call-id/1", "ACR 2", 0);
+  queue.send("/call-id/1", "ACR\n3", 0);
+  queue.send("/call-id/1", "ACR 4", 0);
+
+  for (int ii = 0; (ii < 1000) && (queue._spooled.load() < 2); ++ii)
+  {
+    usleep(1000);
+  }
+  EXPECT_EQ(0u, queue._dropped.load());
+  EXPECT_EQ(2, queue._spooled.load());
+
+  // Once Ralf responds, everything is delivered in order and the spool is
+  // emptied.
+  _ralf.release();
+  ASSERT_TRUE(_ralf.wait_for(5));
+
+  std::vector<std::string> bodies = _ralf.bodies();
+  EXPECT_EQ("ACR 1", bodies[1]);
+  EXPECT_EQ("ACR 2", bodies[2]);
+  EXPECT_EQ("ACR\n3", bodies[3]);
+  EXPECT_EQ("ACR 4", bodies[4]);
+  EXPECT_EQ(0, queue._spooled.load());
+}
+
+TEST_F(RalfDeliveryTest, SpoolSurvivesRestart)
+{
+  // Write a spool file as left by a previous run.
+  FILE* spool = fopen((_spool_dir + "/ralf_acrs.spool").c_str(), "w");
+  ASSERT_TRUE(spool != NULL);
+  fprintf(spool, "/call-id/1 0 5\nACR 0\n/call-id/2 0 5\nACR 1\n");
+  fclose(spool);
+
+  RalfDeliveryQueue queue(&_ralf, 10, 4, _spool_dir, stack_data.stats_aggregator);
+  ASSERT_TRUE(_ralf.wait_for(2));
+
+  std::vector<std::string> bodies = _ralf.bodies();
+  EXPECT_EQ("ACR 0", bodies[0]);
+  EXPECT_EQ("ACR 1", bodies[1]);
+}
+
+TEST_F(RalfDeliveryTest, StopAbandonsAfterTimeout)
+{
+  _ralf.hold();
+
+  RalfDeliveryQueue queue(&_ralf, 10, 3, "", stack_data.stats_aggregator);
+
+  // The first three ACRs fill the window, and Ralf never answers them, so
+  // the next two wait on the queue.
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    queue.send("/call-id/1", "ACR " + std::to_string(ii), 0);
+  }
+  ASSERT_TRUE(_ralf.wait_for(3));
+  queue.send("/call-id/1", "ACR 3", 0);
+  queue.send("/call-id/1", "ACR 4", 0);
+
+  // Stopping the queue gives up waiting for responses once the drain time
+  // is up, and everything undelivered is counted as dropped.
+  queue.stop(100);
+  EXPECT_EQ(3u, _ralf.sent());
+  EXPECT_EQ(5u, queue._dropped.load());
+
+  // Late responses to the abandoned requests are harmless.
+  _ralf.release();
+  EXPECT_EQ(0u, queue._failed.load());
+}
+
+TEST_F(RalfDeliveryTest, StopDrainsQueue)
+{
+  RalfDeliveryQueue queue(&_ralf, 10, 2, "", stack_data.stats_aggregator);
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    queue.send("/call-id/1", "ACR " + std::to_string(ii), 0);
+  }
+
+  // Everything on the queue is delivered before the queue stops.
+  queue.stop(1000);
+  EXPECT_EQ(5u, _ralf.sent());
+  EXPECT_EQ(0u, queue._dropped.load());
+}
+
+TEST_F(RalfDeliveryTest, SpoolSkipsCorruptRecords)
+{
+  // Write a spool file with a stray line, a record whose length runs past
+  // the end of the file, and a record with a bad header between good ones.
+  FILE* spool = fopen((_spool_dir + "/ralf_acrs.spool").c_str(), "w");
+  ASSERT_TRUE(spool != NULL);
+  fprintf(spool, "/call-id/1 0 5\nACR 0\n"
+                 "garbage\n"
+                 "/call-id/2 0 5 extra\nACR 1\n"
+                 "/call-id/3 0 5\nACR 2\n"
+                 "/call-id/4 0 99\nACR 3\n"
+                 "/call-id/5 0 5\nACR 4\n");
+  fclose(spool);
+
+  RalfDeliveryQueue queue(&_ralf, 10, 4, _spool_dir, stack_data.stats_aggregator);
+  ASSERT_TRUE(_ralf.wait_for(3));
+  usleep(10000);
+
+  std::vector<std::string> bodies = _ralf.bodies();
+  ASSERT_EQ(3u, bodies.size());
+  EXPECT_EQ("ACR 0", bodies[0]);
+  EXPECT_EQ("ACR 2", bodies[1]);
+  EXPECT_EQ("ACR 4", bodies[2]);
+}
@@ -0,0 +1,177 @@
+/**
+ * @file regexcache_test.cpp UT for the shared regular expression cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <string>
+#include <pthread.h>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "regexcache.h"
+
+using namespace std;
+
+class RegexCacheTest : public BaseTest
+{
+};
+
+TEST_F(RegexCacheTest, CompileOnce)
+{
+  RegexCache cache(100);
+
+  RegexCache::Regex r1 = cache.get("^\\+1650([0-9]+)$");
+  ASSERT_TRUE(r1 != NULL);
+  EXPECT_EQ(0u, cache.hits());
+  EXPECT_EQ(1u, cache.misses());
+
+  // The second lookup returns the same compiled expression.
+  RegexCache::Regex r2 = cache.get("^\\+1650([0-9]+)$");
+  EXPECT_EQ(r1.get(), r2.get());
+  EXPECT_EQ(1u, cache.hits());
+  EXPECT_EQ(1u, cache.misses());
+
+  EXPECT_TRUE(boost::regex_match("+16505551234", *r2));
+  EXPECT_FALSE(boost::regex_match("+16515551234", *r2));
+
+  // Copies share the compiled form, and still work once the cache has gone.
+  boost::regex copy = *r1;
+  r1.reset();
+  r2.reset();
+  EXPECT_TRUE(boost::regex_match("+16505551234", copy));
+}
+
+TEST_F(RegexCacheTest, InvalidPattern)
+{
+  RegexCache cache(100);
+
+  EXPECT_TRUE(cache.get("(unbalanced") == NULL);
+  EXPECT_EQ(1u, cache.misses());
+
+  // Invalid patterns are remembered too.
+  EXPECT_TRUE(cache.get("(unbalanced") == NULL);
+  EXPECT_EQ(1u, cache.hits());
+  EXPECT_EQ(1u, cache.misses());
+}
+
+TEST_F(RegexCacheTest, Bounded)
+{
+  RegexCache cache(16);
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    EXPECT_TRUE(cache.get("^pattern" + to_string(ii) + "$") != NULL);
+  }
+  EXPECT_LE(cache._cache.size(), 16u);
+  EXPECT_EQ(100u, cache.misses());
+
+  // Evicted patterns are simply compiled again.
+  RegexCache::Regex r = cache.get("^pattern0$");
+  ASSERT_TRUE(r != NULL);
+  EXPECT_TRUE(boost::regex_match("pattern0", *r));
+}
+
+TEST_F(RegexCacheTest, Stats)
+{
+  RegexCache cache(100);
+  cache.enable_stats(stack_data.stats_aggregator);
+  cache.get("a+");
+  cache.get("a+");
+  cache.get("b+");
+  EXPECT_EQ(1u, cache.hits());
+  EXPECT_EQ(2u, cache.misses());
+  cache.disable_stats();
+}
+
+/// State for a thread looking up a pattern in the cache.
+struct LookupThread
+{
+  pthread_t thread;
+  RegexCache* cache;
+  std::string pattern;
+  const boost::regex* expected;
+  int lookups;
+  int matches;
+};
+
+static void* run_lookups(void* p)
+{
+  LookupThread* t = (LookupThread*)p;
+
+  for (int ii = 0; ii < t->lookups; ii++)
+  {
+    RegexCache::Regex r = t->cache->get(t->pattern);
+    if ((r.get() == t->expected) &&
+        (boost::regex_match("+16505551234", *r)))
+    {
+      t->matches++;
+    }
+  }
+
+  return NULL;
+}
+
+TEST_F(RegexCacheTest, ConcurrentLookups)
+{
+  // Threads repeatedly looking up a typical ENUM rule all share the one
+  // compiled expression, and never compile it again.
+  const string pattern = "^(\\+?1?[2-9][0-9]{2}[2-9][0-9]{6})$";
+  const int NUM_THREADS = 8;
+  const int LOOKUPS = 1000;
+  RegexCache cache(100);
+
+  RegexCache::Regex r = cache.get(pattern);
+  ASSERT_TRUE(r != NULL);
+
+  LookupThread threads[NUM_THREADS];
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    threads[ii].cache = &cache;
+    threads[ii].pattern = pattern;
+    threads[ii].expected = r.get();
+    threads[ii].lookups = LOOKUPS;
+    threads[ii].matches = 0;
+    pthread_create(&threads[ii].thread, NULL, &run_lookups, &threads[ii]);
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ii++)
+  {
+    pthread_join(threads[ii].thread, NULL);
+    EXPECT_EQ(LOOKUPS, threads[ii].matches);
+  }
+
+  EXPECT_EQ((unsigned)(NUM_THREADS * LOOKUPS), cache.hits());
+  EXPECT_EQ(1u, cache.misses());
+}
@@ -39,6 +39,8 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <json/reader.h>
+#include <fstream>
+#include <unistd.h>
 
 #include "utils.h"
 #include "sas.h"
@@ -194,3 +196,74 @@ TEST_F(SCSCFSelectorTest, MissingFile)
   // Check that no S-CSCF is returned
   ST({}, {}, {}, "").test(scscf_);
 }
+
+TEST_F(SCSCFSelectorTest, UnknownCapabilities)
+{
+  // Parse a valid file.
+  SCSCFSelector scscf_(string(UT_DIR).append("/test_scscf.json"));
+
+  // An optional capability that no S-CSCF has is ignored, but a mandatory one
+  // means no S-CSCF can be selected.
+  ST({123, 432, 345}, {9999}, {}, "cw-scscf1.cw-ngv.com").test(scscf_);
+  ST({123, 9999}, {432}, {}, "").test(scscf_);
+
+  // Duplicate capabilities are only counted once.
+  ST({123, 123, 432}, {654, 654, 654}, {}, "cw-scscf2.cw-ngv.com").test(scscf_);
+}
+
+TEST_F(SCSCFSelectorTest, SASLogging)
+{
+  // Parse a valid file.
+  SCSCFSelector scscf_(string(UT_DIR).append("/test_scscf.json"));
+
+  // Selections on a trail that is being logged give the same results.
+  EXPECT_EQ("cw-scscf1.cw-ngv.com",
+            scscf_.get_scscf({345, 123, 432}, {}, {"cw-scscf2.cw-ngv.com"}, 1));
+  EXPECT_EQ("", scscf_.get_scscf({9999}, {654}, {}, 1));
+}
+
+TEST_F(SCSCFSelectorTest, Reload)
+{
+  std::string file = "/tmp/scscf_reload_test.json";
+  std::ofstream(file.c_str()) <<
+    "{\"s-cscfs\":[{\"server\":\"scscf1\",\"priority\":0,\"weight\":100,\"capabilities\":[1]}]}";
+  SCSCFSelector scscf_(file);
+  ST({1}, {}, {}, "scscf1").test(scscf_);
+
+  // Selections use the new S-CSCFs once they are reloaded.
+  std::ofstream(file.c_str()) <<
+    "{\"s-cscfs\":[{\"server\":\"scscf2\",\"priority\":0,\"weight\":100,\"capabilities\":[2, 1]}]}";
+  scscf_.update_scscf();
+  ST({1, 2}, {}, {}, "scscf2").test(scscf_);
+
+  // If the file can't be parsed the current S-CSCFs are kept.
+  std::ofstream(file.c_str()) << "{\"s-cscfs\":";
+  scscf_.update_scscf();
+  ST({1, 2}, {}, {}, "scscf2").test(scscf_);
+
+  unlink(file.c_str());
+}
+
+TEST_F(SCSCFSelectorTest, ManyCapabilities)
+{
+  // The capability sets are sized to the configuration, so there's no limit
+  // on the number of distinct capabilities.
+  std::string file = "/tmp/scscf_many_caps_test.json";
+  std::ofstream config(file.c_str());
+  config << "{\"s-cscfs\":[{\"server\":\"scscf1\",\"priority\":0,\"weight\":100,\"capabilities\":[";
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    config << ((ii > 0) ? "," : "") << ii;
+  }
+  config << "]},{\"server\":\"scscf2\",\"priority\":0,\"weight\":100,\"capabilities\":[999, 1000]}]}";
+  config.close();
+
+  SCSCFSelector scscf_(file);
+  ST({0, 999}, {}, {}, "scscf1").test(scscf_);
+  ST({1000}, {}, {}, "scscf2").test(scscf_);
+  ST({999}, {998}, {}, "scscf1").test(scscf_);
+  ST({999}, {1000}, {}, "scscf2").test(scscf_);
+  ST({1001}, {}, {}, "").test(scscf_);
+
+  unlink(file.c_str());
+}
@@ -670,3 +670,92 @@ TEST_F(SIPResolverTest, NoMatchingNAPTR)
   EXPECT_EQ("4.0.0.1:5060;transport=UDP",
             RT(_sipresolver, "sprout.cw-ngv.com").resolve());
 }
+
+TEST_F(SIPResolverTest, HeldResolution)
+{
+  cwtest_completely_control_time();
+
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // Once the A record has expired (and can't be refreshed, as the DNS
+  // resolver has no server) the resolution is still used during the grace
+  // period.
+  cwtest_advance_time_ms(11000);
+  _dnsresolver.expire_cache();
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+  cwtest_advance_time_ms(SIPResolver::DEFAULT_GRACE_SECS * 1000 - 2000);
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // After the grace period the name has to be resolved again.
+  cwtest_advance_time_ms(2000);
+  EXPECT_EQ("", RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  cwtest_reset_time();
+}
+
+TEST_F(SIPResolverTest, RefreshHeldResolution)
+{
+  cwtest_completely_control_time();
+
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // Change the A record once the old one has expired.  The held resolution
+  // is used until the refresh completes.
+  cwtest_advance_time_ms(11000);
+  _dnsresolver.expire_cache();
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+  EXPECT_EQ("3.0.0.1:5060;transport=UDP",
+            RT(_sipresolver, "sprout.cw-ngv.com").resolve());
+
+  // Wait for the background refresh.
+  std::string result;
+  for (int ii = 0; (ii < 1000) && (result != "3.0.0.2:5060;transport=UDP"); ++ii)
+  {
+    usleep(1000);
+    result = RT(_sipresolver, "sprout.cw-ngv.com").resolve();
+  }
+  EXPECT_EQ("3.0.0.2:5060;transport=UDP", result);
+
+  cwtest_reset_time();
+}
+
+TEST_F(SIPResolverTest, HeldResolutionRetries)
+{
+  cwtest_completely_control_time();
+
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.1"));
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.2"));
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.3"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  // Resolve the name asking for a single target.
+  std::vector<AddrInfo> targets;
+  _sipresolver.resolve("sprout.cw-ngv.com", AF_INET, 0, -1, 1, targets, 0);
+  EXPECT_EQ(1u, targets.size());
+
+  // The held resolution isn't limited to the number of targets first asked
+  // for, so a later request for more gets them all.
+  cwtest_advance_time_ms(11000);
+  _dnsresolver.expire_cache();
+  targets.clear();
+  _sipresolver.resolve("sprout.cw-ngv.com", AF_INET, 0, -1, 5, targets, 0);
+  EXPECT_EQ(3u, targets.size());
+
+  targets.clear();
+  _sipresolver.resolve("sprout.cw-ngv.com", AF_INET, 0, -1, 2, targets, 0);
+  EXPECT_EQ(2u, targets.size());
+
+  cwtest_reset_time();
+}
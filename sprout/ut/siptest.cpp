@@ -85,6 +85,11 @@ SipTest::SipTest(pjsip_module* module) :
   EXPECT_TRUE(_current_instance == NULL) << "Can't run two SipTests in parallel";
   _current_instance = this;
   _module = module;
+
+  // Start each test with an empty next hop table, so target sets and server
+  // health from earlier tests don't affect which servers are picked.
+  delete stack_data.next_hops;
+  stack_data.next_hops = new NextHopTable(stack_data.sipresolver);
 }
 
 /// Runs after each test.
@@ -127,6 +132,7 @@ void SipTest::SetUpTestCase(bool clear_host_mapping)
   stack_data.record_route_on_completion_of_terminating = true;
   stack_data.default_session_expires = 60 * 10;
   stack_data.sipresolver = new SIPResolver(&_dnsresolver);
+  stack_data.next_hops = new NextHopTable(stack_data.sipresolver);
   stack_data.addr_family = AF_INET;
 
   // Sort out logging.
@@ -176,6 +182,8 @@ void SipTest::TearDownTestCase()
   // Clear out any UDP transports and TCP factories that have been created.
   TransportFlow::reset();
 
+  delete stack_data.next_hops;
+  stack_data.next_hops = NULL;
   delete stack_data.sipresolver;
 }
 
@@ -690,6 +698,7 @@ void SipTest::poll()
   do
   {
     pj_status_t status = pjsip_endpt_handle_events2(stack_data.endpt, &delay, &count);
+    count += stack_data.timer_wheel->poll();
     LOG_INFO("Poll found %d events, status %d\n", (int)count, (int)status);
   }
   while (count != 0);
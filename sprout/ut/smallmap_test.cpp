@@ -0,0 +1,213 @@
+/**
+ * @file smallmap_test.cpp UT and microbenchmark for SmallMap.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include "gtest/gtest.h"
+
+#include "smallmap.h"
+
+using namespace std;
+
+/// Number of heap allocations made by CountingAllocator.
+static int num_allocations = 0;
+
+/// Allocator that counts allocations, used to measure the cost of the
+/// standard containers.
+template <typename T>
+struct CountingAllocator : public std::allocator<T>
+{
+  template <typename U> struct rebind { typedef CountingAllocator<U> other; };
+
+  CountingAllocator() {}
+  template <typename U> CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t n, const void* hint = 0)
+  {
+    ++num_allocations;
+    return std::allocator<T>::allocate(n);
+  }
+};
+
+typedef std::pair<void*, int> ForkKey;
+typedef std::map<ForkKey,
+                 void*,
+                 std::less<ForkKey>,
+                 CountingAllocator<std::pair<const ForkKey, void*> > > TreeDMap;
+typedef std::map<void*,
+                 ForkKey,
+                 std::less<void*>,
+                 CountingAllocator<std::pair<void* const, ForkKey> > > TreeUMap;
+typedef SmallMap<ForkKey, void*, 4> FlatDMap;
+typedef SmallMap<void*, ForkKey, 4> FlatUMap;
+
+/// Number of SmallMaps that have moved their entries to a heap buffer.
+static int num_heap_maps = 0;
+
+/// Records whether a map has allocated storage for its entries.  The tree
+/// maps are counted by their allocator instead.
+template <typename M>
+static void count_heap_storage(const M& map)
+{
+}
+
+template <typename K, typename V, size_t N>
+static void count_heap_storage(const SmallMap<K, V, N>& map)
+{
+  if (map.on_heap())
+  {
+    ++num_heap_maps;
+  }
+}
+
+/// Runs the fork bookkeeping done by SproutletProxy::UASTsx for a
+/// transaction that forks to the specified number of downstream targets.
+template <typename D, typename U>
+static void fork_transaction(int forks)
+{
+  D dmap;
+  U umap;
+  char upstream;
+  char downstream[8];
+
+  for (int ii = 0; ii < forks; ++ii)
+  {
+    dmap[std::make_pair((void*)&upstream, ii)] = (void*)&downstream[ii];
+    umap[(void*)&downstream[ii]] = std::make_pair((void*)&upstream, ii);
+  }
+
+  count_heap_storage(dmap);
+  count_heap_storage(umap);
+
+  for (int ii = 0; ii < forks; ++ii)
+  {
+    typename U::iterator i = umap.find((void*)&downstream[ii]);
+    ASSERT_TRUE(i != umap.end());
+    dmap.erase(i->second);
+    umap.erase(i);
+  }
+
+  ASSERT_TRUE(dmap.empty());
+  ASSERT_TRUE(umap.empty());
+}
+
+TEST(SmallMapTest, Basic)
+{
+  SmallMap<int, std::string, 4> m;
+  EXPECT_TRUE(m.empty());
+
+  m[1] = "one";
+  m[2] = "two";
+  m[1] = "uno";
+  EXPECT_EQ(2u, m.size());
+  EXPECT_EQ("uno", m.find(1)->second);
+  EXPECT_TRUE(m.find(3) == m.end());
+
+  EXPECT_EQ(1u, m.erase(1));
+  EXPECT_EQ(0u, m.erase(1));
+  EXPECT_EQ(1u, m.size());
+  EXPECT_EQ("two", m.find(2)->second);
+
+  m.clear();
+  EXPECT_TRUE(m.empty());
+}
+
+TEST(SmallMapTest, Grow)
+{
+  SmallMap<int, int, 4> m;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    m[ii] = ii * 10;
+  }
+
+  // The first four entries are held inline.
+  EXPECT_EQ(m._inline, m._data);
+
+  for (int ii = 4; ii < 20; ++ii)
+  {
+    m[ii] = ii * 10;
+  }
+
+  EXPECT_NE(m._inline, m._data);
+  EXPECT_EQ(20u, m.size());
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    ASSERT_TRUE(m.find(ii) != m.end());
+    EXPECT_EQ(ii * 10, m.find(ii)->second);
+  }
+
+  // Erase every other entry.
+  for (int ii = 0; ii < 20; ii += 2)
+  {
+    EXPECT_EQ(1u, m.erase(ii));
+  }
+  EXPECT_EQ(10u, m.size());
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    EXPECT_EQ((ii % 2 == 1), (m.find(ii) != m.end()));
+  }
+}
+
+// Checks the allocations made for the fork bookkeeping of a transaction
+// with std::map and with SmallMap.
+TEST(SmallMapTest, ForkBookkeepingAllocations)
+{
+  const int TRANSACTIONS = 100;
+
+  for (int forks = 1; forks <= 8; ++forks)
+  {
+    num_allocations = 0;
+    for (int ii = 0; ii < TRANSACTIONS; ++ii)
+    {
+      fork_transaction<TreeDMap, TreeUMap>(forks);
+    }
+
+    // The tree maps allocate a node per entry.
+    EXPECT_EQ(2 * forks * TRANSACTIONS, num_allocations);
+
+    num_heap_maps = 0;
+    for (int ii = 0; ii < TRANSACTIONS; ++ii)
+    {
+      fork_transaction<FlatDMap, FlatUMap>(forks);
+    }
+
+    // The flat maps hold up to four forks inline, and only allocate a heap
+    // buffer for more than that.
+    EXPECT_EQ((forks <= 4) ? 0 : 2 * TRANSACTIONS, num_heap_maps);
+  }
+}
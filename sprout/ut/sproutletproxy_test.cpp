@@ -326,6 +326,52 @@ class FakeSproutletTsxBad : public SproutletTsx
   }
 };
 
+/// Sproutlet that checks the request it is passed shares the unmodified
+/// headers and the body with the original request, and records the shared
+/// data so the test can check the forwarded request doesn't share it.
+class FakeSproutletTsxSharer : public SproutletTsx
+{
+public:
+  FakeSproutletTsxSharer(SproutletTsxHelper* helper) :
+    SproutletTsx(helper)
+  {
+  }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    // Take a second clone of the original request.
+    pjsip_msg* orig = original_request();
+
+    // The clones share the body, Call-ID and Via with the original request.
+    ASSERT_TRUE(req->body != NULL);
+    EXPECT_EQ(orig->body, req->body);
+    pjsip_cid_hdr* cid = PJSIP_MSG_CID_HDR(req);
+    EXPECT_EQ(PJSIP_MSG_CID_HDR(orig)->id.ptr, cid->id.ptr);
+    pjsip_via_hdr* via = (pjsip_via_hdr*)pjsip_msg_find_hdr(req, PJSIP_H_VIA, NULL);
+    pjsip_via_hdr* orig_via = (pjsip_via_hdr*)pjsip_msg_find_hdr(orig, PJSIP_H_VIA, NULL);
+    EXPECT_NE(orig_via, via);
+    EXPECT_EQ(orig_via->branch_param.ptr, via->branch_param.ptr);
+
+    // The Request-URI and the headers a Sproutlet may change are copied, so
+    // changing them in one clone doesn't affect the other.
+    EXPECT_NE(orig->line.req.uri, req->line.req.uri);
+    EXPECT_NE(PJSIP_MSG_TO_HDR(orig)->uri, PJSIP_MSG_TO_HDR(req)->uri);
+    ((pjsip_sip_uri*)orig->line.req.uri)->user = pj_str((char*)"carol");
+    EXPECT_EQ("sip:bob@awaydomain", str_uri(req->line.req.uri));
+    free_msg(orig);
+
+    _body = req->body;
+    _call_id = cid->id.ptr;
+    send_request(req);
+  }
+
+  static pjsip_msg_body* _body;
+  static char* _call_id;
+};
+
+pjsip_msg_body* FakeSproutletTsxSharer::_body = NULL;
+char* FakeSproutletTsxSharer::_call_id = NULL;
+
 class SproutletProxyTest : public SipTest
 {
 public:
@@ -353,6 +399,7 @@ public:
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxForker<NUM_FORKS> >("forker", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDelayRedirect<1> >("delayredirect", 0, ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxBad >("bad", 0, ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxSharer>("sharer", 0, ""));
 
     // Create a host alias.
     std::unordered_set<std::string> host_aliases;
@@ -761,6 +808,71 @@ TEST_F(SproutletProxyTest, SimpleSproutletForwarder)
   delete tp;
 }
 
+TEST_F(SproutletProxyTest, SharedRequestCopiedOnEgress)
+{
+  // Tests that the request passed to a Sproutlet shares data with the
+  // original request, and that the proxy sends an independent copy when the
+  // request leaves the process.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with a body and two Route headers - the first
+  // referencing the sharing Sproutlet and the second referencing an
+  // external node.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:sharer.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  msg1._body = "v=0\r\n";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Request is forwarded to the node in the second Route header.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_EQ("sip:bob@awaydomain", str_uri(tdata->msg->line.req.uri));
+
+  // The forwarded request is a full copy, so shares nothing with the
+  // requests held by the Sproutlet transaction.
+  EXPECT_EQ(NULL, tdata->mod_data[_proxy->_mod_tu.id()]);
+  ASSERT_TRUE(tdata->msg->body != NULL);
+  EXPECT_NE(FakeSproutletTsxSharer::_body, tdata->msg->body);
+  EXPECT_EQ("v=0\r\n", std::string((char*)tdata->msg->body->data,
+                                    tdata->msg->body->len));
+  EXPECT_NE(FakeSproutletTsxSharer::_call_id,
+            PJSIP_MSG_CID_HDR(tdata->msg)->id.ptr);
+
+  // Send a 200 OK response.
+  inject_msg(respond_to_current_txdata(200));
+
+  // Check the response is forwarded back to the source.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, SimpleSproutletForwarderRR)
 {
   // Tests standard routing of a request through a Sproutlet that simply
@@ -1393,6 +1505,49 @@ TEST_F(SproutletProxyTest, UnrecognisedSproutlet)
 }
 
 
+TEST_F(SproutletProxyTest, TargetSproutlet)
+{
+  // Tests the Sproutlet dispatch tables directly.
+  std::string alias;
+  Message msg;
+  msg._method = "MESSAGE";
+  msg._requri = "sip:bob@awaydomain";
+  msg._from = "sip:alice@homedomain";
+  msg._to = "sip:bob@awaydomain";
+
+  // Service name in the services parameter.
+  msg._route = "Route: <sip:proxy1.homedomain;services=forker;lr>";
+  Sproutlet* sproutlet = _proxy->target_sproutlet(parse_msg(msg.get_request()), 0, alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("forker", sproutlet->service_name());
+  EXPECT_EQ("forker", alias);
+
+  // Service name in the user part, with a host alias in a different case.
+  msg._route = "Route: <sip:fwdrr@PROXY1.Homedomain-Alias;lr>";
+  sproutlet = _proxy->target_sproutlet(parse_msg(msg.get_request()), 0, alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("fwdrr", sproutlet->service_name());
+
+  // Service name in the first domain label.
+  msg._route = "Route: <sip:delayredirect.proxy1.homedomain;lr>";
+  sproutlet = _proxy->target_sproutlet(parse_msg(msg.get_request()), 0, alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("delayredirect", sproutlet->service_name());
+
+  // An alias shared by several Sproutlets selects the first one.
+  msg._route = "Route: <sip:alias@proxy1.homedomain;lr>";
+  sproutlet = _proxy->target_sproutlet(parse_msg(msg.get_request()), 0, alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("fwd", sproutlet->service_name());
+  EXPECT_EQ("alias", alias);
+
+  // A service name on a non-local host doesn't match.
+  msg._route = "Route: <sip:forker@proxy2.homedomain;lr>";
+  sproutlet = _proxy->target_sproutlet(parse_msg(msg.get_request()), 0, alias);
+  EXPECT_TRUE(sproutlet == NULL);
+}
+
+
 TEST_F(SproutletProxyTest, UASError)
 {
   // Tests handling of errors on the UAS side of a Sproutlet transaction.
@@ -0,0 +1,178 @@
+/**
+ * @file sproutletstats_test.cpp UT for per-Sproutlet statistics.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "sproutletstats.h"
+
+using namespace std;
+
+/// Fixture for SproutletStatsTest.
+class SproutletStatsTest : public BaseTest
+{
+  SproutletStats _stats;
+
+  SproutletStatsTest() :
+    _stats(stack_data.stats_aggregator,
+           {"scscf", "mmtel", "bgcf"},
+           999999999999) // make the period large to avoid intermittent failures due to timing
+  {
+  }
+
+  virtual ~SproutletStatsTest()
+  {
+  }
+
+  SproutletStats::Counters* counters(const string& service, const string& method)
+  {
+    SproutletStats::Counters* counters = _stats.get_counters(service, method);
+    EXPECT_TRUE(counters != NULL);
+    return counters;
+  }
+
+  vector<string> report()
+  {
+    vector<string> values;
+    _stats.build_report(values);
+    return values;
+  }
+};
+
+TEST_F(SproutletStatsTest, NoSamples)
+{
+  EXPECT_TRUE(report().empty());
+}
+
+TEST_F(SproutletStatsTest, RequestsAndResponses)
+{
+  SproutletStats::Counters* scscf_invite = counters("scscf", "INVITE");
+  SproutletStats::Counters* mmtel_invite = counters("mmtel", "INVITE");
+
+  SproutletStats::record_request(scscf_invite, 100);
+  SproutletStats::record_response(scscf_invite, 20);
+  SproutletStats::record_response(scscf_invite, 30);
+  SproutletStats::record_forks(scscf_invite, 1);
+  SproutletStats::record_request(mmtel_invite, 40);
+  SproutletStats::record_forks(mmtel_invite, 3);
+  SproutletStats::record_forks(mmtel_invite, 1);
+  SproutletStats::record_timer(mmtel_invite);
+
+  vector<string> values = report();
+  ASSERT_EQ(18u, values.size());
+
+  // mmtel sorts first.
+  EXPECT_EQ("mmtel", values[0]);
+  EXPECT_EQ("INVITE", values[1]);
+  EXPECT_EQ("1", values[2]);   // Requests
+  EXPECT_EQ("0", values[3]);   // Responses
+  EXPECT_EQ("40", values[4]);  // Mean CPU
+  EXPECT_EQ("40", values[5]);  // Max CPU
+  EXPECT_EQ("4", values[6]);   // Forks
+  EXPECT_EQ("3", values[7]);   // Max forks
+  EXPECT_EQ("1", values[8]);   // Timers
+
+  EXPECT_EQ("scscf", values[9]);
+  EXPECT_EQ("INVITE", values[10]);
+  EXPECT_EQ("1", values[11]);
+  EXPECT_EQ("2", values[12]);
+  EXPECT_EQ("50", values[13]);
+  EXPECT_EQ("100", values[14]);
+  EXPECT_EQ("1", values[15]);
+  EXPECT_EQ("1", values[16]);
+  EXPECT_EQ("0", values[17]);
+}
+
+TEST_F(SproutletStatsTest, Methods)
+{
+  // Common methods have their own counters, and other methods share one.
+  EXPECT_NE(counters("scscf", "INVITE"), counters("scscf", "BYE"));
+  EXPECT_EQ(counters("scscf", "OTHER"), counters("scscf", "FOO"));
+  EXPECT_NE(counters("scscf", "INVITE"), counters("mmtel", "INVITE"));
+
+  SproutletStats::record_request(counters("bgcf", "FOO"), 10);
+
+  vector<string> values = report();
+  ASSERT_EQ(9u, values.size());
+  EXPECT_EQ("bgcf", values[0]);
+  EXPECT_EQ("OTHER", values[1]);
+}
+
+TEST_F(SproutletStatsTest, UnknownSproutlet)
+{
+  EXPECT_TRUE(_stats.get_counters("unknown", "INVITE") == NULL);
+}
+
+TEST_F(SproutletStatsTest, NewPeriod)
+{
+  SproutletStats::record_request(counters("bgcf", "MESSAGE"), 10);
+
+  // Publishing the statistics starts a new period, but still reports the
+  // Sproutlet.
+  _stats.refresh();
+
+  vector<string> values = report();
+  ASSERT_EQ(9u, values.size());
+  EXPECT_EQ("bgcf", values[0]);
+  EXPECT_EQ("MESSAGE", values[1]);
+  EXPECT_EQ("0", values[2]);
+}
+
+TEST(SproutletStatsTimerTest, RefreshedWhenIdle)
+{
+  // The statistics are published at the end of each period even when
+  // nothing is recorded.
+  SproutletStats stats(stack_data.stats_aggregator, {"scscf"}, 10000);
+  SproutletStats::record_request(stats.get_counters("scscf", "INVITE"), 10);
+
+  vector<string> values;
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    usleep(10000);
+    values.clear();
+    stats.build_report(values);
+    if (values[2] == "0")
+    {
+      break;
+    }
+  }
+
+  ASSERT_EQ(9u, values.size());
+  EXPECT_EQ("0", values[2]);
+}
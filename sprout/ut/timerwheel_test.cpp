@@ -0,0 +1,167 @@
+/**
+ * @file timerwheel_test.cpp UT for the hierarchical timer wheel.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2014  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#include <time.h>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "test_interposer.hpp"
+
+#include "timerwheel.h"
+
+/// Fixture for TimerWheelTest.  Time is frozen, so timers only pop when the
+/// test advances it.
+class TimerWheelTest : public ::testing::Test
+{
+public:
+  TimerWheelTest()
+  {
+    cwtest_completely_control_time();
+    _wheel = new TimerWheel(4);
+  }
+
+  virtual ~TimerWheelTest()
+  {
+    delete _wheel;
+    cwtest_reset_time();
+  }
+
+  /// Timer that records the time at which it popped.
+  struct TestTimer
+  {
+    TestTimer() : entry(this, &on_pop), due_ms(0), popped_ms(-1) {}
+
+    TimerWheel::Entry entry;
+    long due_ms;
+    long popped_ms;
+  };
+
+  static long now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  static void on_pop(TimerWheel::Entry* entry)
+  {
+    ((TestTimer*)entry->user_data)->popped_ms = now_ms();
+  }
+
+  TimerWheel* _wheel;
+};
+
+TEST_F(TimerWheelTest, PopsAfterDelay)
+{
+  TestTimer timer;
+  _wheel->schedule(&timer.entry, 100);
+  EXPECT_TRUE(_wheel->running(&timer.entry));
+
+  EXPECT_EQ(0, _wheel->poll());
+  cwtest_advance_time_ms(90);
+  EXPECT_EQ(0, _wheel->poll());
+  EXPECT_EQ(-1, timer.popped_ms);
+
+  cwtest_advance_time_ms(10);
+  EXPECT_EQ(1, _wheel->poll());
+  EXPECT_NE(-1, timer.popped_ms);
+  EXPECT_FALSE(_wheel->running(&timer.entry));
+
+  // The timer only pops once.
+  cwtest_advance_time_ms(1000);
+  EXPECT_EQ(0, _wheel->poll());
+}
+
+TEST_F(TimerWheelTest, Cancel)
+{
+  TestTimer timer;
+  _wheel->schedule(&timer.entry, 100);
+  EXPECT_TRUE(_wheel->cancel(&timer.entry));
+  EXPECT_FALSE(_wheel->running(&timer.entry));
+  EXPECT_FALSE(_wheel->cancel(&timer.entry));
+
+  cwtest_advance_time_ms(200);
+  EXPECT_EQ(0, _wheel->poll());
+  EXPECT_EQ(-1, timer.popped_ms);
+}
+
+TEST_F(TimerWheelTest, Reschedule)
+{
+  TestTimer timer;
+  _wheel->schedule(&timer.entry, 100);
+  cwtest_advance_time_ms(50);
+  _wheel->schedule(&timer.entry, 100);
+
+  cwtest_advance_time_ms(60);
+  EXPECT_EQ(0, _wheel->poll());
+  cwtest_advance_time_ms(40);
+  EXPECT_EQ(1, _wheel->poll());
+}
+
+TEST_F(TimerWheelTest, LongTimersCascade)
+{
+  // Spread timers from zero to several days out, so they are held on every
+  // level of the wheel, and check each pops on time.
+  const int NUM_TIMERS = 1000;
+  std::vector<TestTimer> timers(NUM_TIMERS);
+  long start_ms = now_ms();
+
+  for (int ii = 0; ii < NUM_TIMERS; ++ii)
+  {
+    int delay_ms = ii * ii * 317;
+    timers[ii].entry.user_data = &timers[ii];
+    timers[ii].due_ms = start_ms + delay_ms;
+    _wheel->schedule(&timers[ii].entry, delay_ms);
+  }
+
+  int popped = 0;
+  for (int step = 0; step < 40000; ++step)
+  {
+    // Advance in uneven steps of a few seconds, so some polls cover
+    // several ticks.
+    cwtest_advance_time_ms(7919);
+    popped += _wheel->poll();
+  }
+  EXPECT_EQ(NUM_TIMERS, popped);
+
+  for (int ii = 0; ii < NUM_TIMERS; ++ii)
+  {
+    EXPECT_LE(timers[ii].due_ms, timers[ii].popped_ms) << "Timer " << ii;
+    EXPECT_GT(timers[ii].due_ms + 7919 + TimerWheel::TICK_MS,
+              timers[ii].popped_ms) << "Timer " << ii;
+  }
+}
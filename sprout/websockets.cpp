@@ -43,6 +43,7 @@ extern "C" {
 #include <stdint.h>
 }
 
+#include <pthread.h>
 #include <string>
 #include <cstring>
 
@@ -54,6 +55,55 @@ extern "C" {
 using websocketpp::server;
 
 static unsigned short ws_port;
+static int ws_threads;
+
+/// Per-thread state for the threads running the websocket server.  These
+/// threads are created by websocketpp, so are registered with PJSIP the first
+/// time they handle an event.  Each thread parses received messages into its
+/// own rdata, reusing the pool (which is reset after each message).
+struct ws_thread_data
+{
+  pj_thread_desc desc;
+  pj_thread_t* thread;
+  pjsip_rx_data rdata;
+};
+
+static pthread_key_t ws_thread_key;
+
+static void ws_release_thread_data(void* p)
+{
+  ws_thread_data* data = (ws_thread_data*)p;
+
+  if (data->rdata.tp_info.pool != NULL)
+  {
+    pj_pool_release(data->rdata.tp_info.pool);
+  }
+
+  delete data;
+}
+
+static ws_thread_data* ws_get_thread_data()
+{
+  ws_thread_data* data = (ws_thread_data*)pthread_getspecific(ws_thread_key);
+
+  if (data == NULL)
+  {
+    data = new ws_thread_data();
+
+    if (!pj_thread_is_registered())
+    {
+      pj_thread_register("websockets", data->desc, &data->thread);
+    }
+
+    data->rdata.tp_info.pool = pjsip_endpt_create_pool(stack_data.endpt,
+                                                       "rtd%p",
+                                                       PJSIP_POOL_RDATA_LEN,
+                                                       PJSIP_POOL_RDATA_INC);
+    pthread_setspecific(ws_thread_key, data);
+  }
+
+  return data;
+}
 
 //
 // mod_ws_transport is the module implementing websockets
@@ -82,7 +132,6 @@ struct ws_transport
 {
   pjsip_transport	base;
   server::handler::connection_ptr con;
-  pjsip_rx_data rdata;
   int			is_closing;
   pj_bool_t		is_paused;
 };
@@ -292,45 +341,35 @@ static pj_bool_t on_ws_data(ws_transport *ws,
     return PJ_FALSE;
   }
 
-  /* Initialize rdata */
-  pj_pool_t *pool;
+  /* Use this thread's rdata (whose pool is reset after each message). */
+  pjsip_rx_data *rdata = &ws_get_thread_data()->rdata;
   pj_sockaddr *rem_addr;
 
-  /* Init rdata */
-  pool = pjsip_endpt_create_pool(ws->base.endpt,
-      "rtd%p",
-      PJSIP_POOL_RDATA_LEN,
-      PJSIP_POOL_RDATA_INC);
-  if (!pool) {
+  if (!rdata->tp_info.pool) {
     LOG_ERROR("Unable to create pool");
     return PJ_ENOMEM;
   }
 
-  ws->rdata.tp_info.pool = pool;
-
-  ws->rdata.tp_info.transport = &ws->base;
-  ws->rdata.tp_info.tp_data = ws;
-  ws->rdata.tp_info.op_key.rdata = &ws->rdata;
+  rdata->tp_info.transport = &ws->base;
+  rdata->tp_info.tp_data = ws;
+  rdata->tp_info.op_key.rdata = rdata;
 
-  ws->rdata.pkt_info.src_addr = ws->base.key.rem_addr;
-  ws->rdata.pkt_info.src_addr_len = sizeof(ws->rdata.pkt_info.src_addr);
+  rdata->pkt_info.src_addr = ws->base.key.rem_addr;
+  rdata->pkt_info.src_addr_len = sizeof(rdata->pkt_info.src_addr);
   rem_addr = &ws->base.key.rem_addr;
-  pj_sockaddr_print(rem_addr, ws->rdata.pkt_info.src_name,
-      sizeof(ws->rdata.pkt_info.src_name), 0);
-  ws->rdata.pkt_info.src_port = pj_sockaddr_get_port(rem_addr);
+  pj_sockaddr_print(rem_addr, rdata->pkt_info.src_name,
+      sizeof(rdata->pkt_info.src_name), 0);
+  rdata->pkt_info.src_port = pj_sockaddr_get_port(rem_addr);
 
   const char *msg_str = msg->get_payload().c_str();
   if (strlen(msg_str) <= PJSIP_MAX_PKT_LEN) {
-    ws->rdata.pkt_info.packet = (char*)pj_pool_alloc(ws->rdata.tp_info.pool, strlen(msg_str) + 1);
-    strcpy(ws->rdata.pkt_info.packet, msg_str);
+    rdata->pkt_info.packet = (char*)pj_pool_alloc(rdata->tp_info.pool, strlen(msg_str) + 1);
+    strcpy(rdata->pkt_info.packet, msg_str);
   } else {
     LOG_ERROR("Dropping incoming websocket message as it is larger than PJSIP_MAX_PKT_LEN, %d", strlen(msg_str));
     return PJ_FALSE;
   }
 
-  pjsip_rx_data *rdata;
-  rdata = &ws->rdata;
-
   /* Init pkt_info part. */
   rdata->pkt_info.len = strlen(msg_str);
   rdata->pkt_info.zero = 0;
@@ -369,11 +408,6 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
   LOG_DEBUG("Destroying WS transport...");
   struct ws_transport *ws = (struct ws_transport*)transport;
 
-  if (ws->rdata.tp_info.pool) {
-    pj_pool_release(ws->rdata.tp_info.pool);
-    ws->rdata.tp_info.pool = NULL;
-  }
-
   if (ws->base.lock) {
     pj_lock_destroy(ws->base.lock);
     ws->base.lock = NULL;
@@ -396,9 +430,22 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
 }
 
 /* Setup callbacks for WebSockets events */
+// The server runs on a pool of threads, so the handler may be called for
+// different connections at once, but the events on each connection are
+// handled one at a time.
 class sip_server_handler : public server::handler {
   public:
 
+    sip_server_handler()
+    {
+      pthread_mutex_init(&_lock, NULL);
+    }
+
+    ~sip_server_handler()
+    {
+      pthread_mutex_destroy(&_lock);
+    }
+
     void validate(connection_ptr con)
     {
       // The key validation step we need to do is on the subprotocols the
@@ -428,6 +475,8 @@ class sip_server_handler : public server::handler {
     }
 
     void on_open(connection_ptr con) {
+      ws_get_thread_data();
+
       LOG_DEBUG("New web socket connection, creating PJSIP transport");
       pjsip_transport *transport;
       pj_status_t status = ws_transport_create(stack_data.endpt,
@@ -436,21 +485,26 @@ class sip_server_handler : public server::handler {
           &transport);
       if (status == PJ_SUCCESS){
         LOG_DEBUG("Created WS transport");
+        pthread_mutex_lock(&_lock);
+        connectionMap.insert(
+            std::pair<connection_ptr, struct ws_transport*>(con, (struct ws_transport*)transport));
+        pthread_mutex_unlock(&_lock);
       }
       else{
         LOG_DEBUG("Failed to create WS transport");
       }
-
-      connectionMap.insert(
-          std::pair<connection_ptr, struct ws_transport*>(con, (struct ws_transport*)transport));
     }
 
     void on_message(connection_ptr con, message_ptr msg) {
-      ws_transport *transport;
+      ws_transport *transport = find_transport(con, false);
 
       LOG_DEBUG("Received message from websockets");
 
-      transport = connectionMap.find(con)->second;
+      if (transport == NULL) {
+        LOG_DEBUG("No transport for connection, dropping message");
+        return;
+      }
+
       LOG_DEBUG("Sending message to PJSIP...");
       pj_status_t status = on_ws_data(transport, msg);
       if (status == PJ_TRUE){
@@ -462,11 +516,15 @@ class sip_server_handler : public server::handler {
     }
 
     void on_close(connection_ptr con) {
-      ws_transport *transport;
+      ws_transport *transport = find_transport(con, true);
       pjsip_tp_state_callback state_cb;
 
       LOG_DEBUG("Closing websocket...");
-      transport = connectionMap.find(con)->second;
+
+      if (transport == NULL) {
+        LOG_DEBUG("No transport for connection");
+        return;
+      }
 
       /* Notify application of transport disconnected state */
       state_cb = pjsip_tpmgr_get_state_cb(transport->base.tpmgr);
@@ -487,7 +545,29 @@ class sip_server_handler : public server::handler {
     }
 
   private:
+    // Finds the transport for a connection, registering this thread with
+    // PJSIP if necessary.  If remove is set, the connection is also removed
+    // from the map.
+    ws_transport* find_transport(connection_ptr con, bool remove) {
+      ws_transport *transport = NULL;
+
+      ws_get_thread_data();
+
+      pthread_mutex_lock(&_lock);
+      std::map<connection_ptr, struct ws_transport*>::iterator it = connectionMap.find(con);
+      if (it != connectionMap.end()) {
+        transport = it->second;
+        if (remove) {
+          connectionMap.erase(it);
+        }
+      }
+      pthread_mutex_unlock(&_lock);
+
+      return transport;
+    }
+
     static std::string SUBPROTOCOL;
+    pthread_mutex_t _lock;
     std::map<connection_ptr, struct ws_transport*> connectionMap;
 };
 
@@ -510,9 +590,10 @@ static int websocket_thread(void* p)
     sip_endpoint.elog().set_level(websocketpp::log::elevel::RERROR);
     sip_endpoint.elog().set_level(websocketpp::log::elevel::FATAL);
 
-    LOG_DEBUG("Starting WebSocket SIP server on port %hu", ws_port);
+    LOG_DEBUG("Starting WebSocket SIP server on port %hu with %d threads",
+              ws_port, ws_threads);
     boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v4(), ws_port);
-    sip_endpoint.listen(ep);
+    sip_endpoint.listen(ep, ws_threads);
   } catch (std::exception& e) {
     LOG_ERROR("Exception: %s", e.what());
   }
@@ -537,9 +618,11 @@ static pj_bool_t ws_transport_on_start()
   return PJ_SUCCESS;
 }
 
-pj_status_t init_websockets(unsigned short port)
+pj_status_t init_websockets(unsigned short port, int num_threads)
 {
   ws_port = port;
+  ws_threads = num_threads;
+  pthread_key_create(&ws_thread_key, ws_release_thread_data);
 
   pj_status_t status;
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_ws_transport);
@@ -551,5 +634,6 @@ pj_status_t init_websockets(unsigned short port)
 void destroy_websockets()
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_ws_transport);
+  pthread_key_delete(ws_thread_key);
 }
 